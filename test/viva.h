@@ -2,6 +2,15 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <algorithm>
+#ifdef __cpp_impl_coroutine
+#include <coroutine> // coroutine routines, needs C++20
+#include <future>
+#define VIVA_COROUTINES
+#endif
 
 namespace viva
 {
@@ -33,6 +42,44 @@ namespace viva
             vector& operator += (const vector& a);
             vector& operator -= (const vector& a);
         };
+
+        struct alignas(16) matrix
+        {
+            float f[4][4];
+
+            static matrix identity();
+            static matrix translate(float x, float y);
+            static matrix translate(float x, float y, float z);
+            static matrix scale(float x, float y);
+            static matrix scale(float x, float y, float z);
+            static matrix rotate(float angle);
+            // Same as translate_negy(origin) * scale(scale) * rotate(angle) * translate_negy(position)
+            // but composed directly.
+            static matrix affine2d(const vector& origin, const vector& scale, float angle, const vector& position);
+
+            matrix();
+            matrix transpose();
+            matrix operator * (const matrix& a);
+            vector operator * (const vector& a);
+        };
+
+        // Reference implementations without SSE.
+        namespace scalar
+        {
+            matrix mul(const matrix& a, const matrix& b);
+            matrix transpose(const matrix& m);
+            vector neg(const vector& v);
+            vector mul(const vector& v, float a);
+        }
+
+        // SSE implementations.
+        namespace simd
+        {
+            matrix mul(const matrix& a, const matrix& b);
+            matrix transpose(const matrix& m);
+            vector neg(const vector& v);
+            vector mul(const vector& v, float a);
+        }
     }
 }
 
@@ -51,10 +98,18 @@ namespace viva
     class Creator;
     class DrawManager;
     class Window;
+    class ResourceManager;
     class RoutineManager;
     class Time;
     class Sprite;
     class Text;
+    class Texture;
+    class Font;
+    class Archive;
+    class SpriteBatch;
+    class TransformSystem;
+    class JobSystem;
+    class TextureLoader;
     struct Routine;
 
     namespace input
@@ -67,6 +122,10 @@ namespace viva
     {
         class Server;
         class Client;
+        class UdpSocket;
+        class UdpPeer;
+        class Replicator;
+        class ReplicaReader;
     }
 
     typedef math::vector Vector;
@@ -76,10 +135,14 @@ namespace viva
     extern Creator* creator;
     extern DrawManager* drawManager;
     extern Window* window;
+    extern ResourceManager* resourceManager;
     extern input::Mouse* mouse;
     extern input::Keyboard* keyboard;
     extern RoutineManager* routineManager;
     extern Time* time;
+    extern TransformSystem* transformSystem;
+    extern JobSystem* jobSystem;
+    extern TextureLoader* textureLoader;
 
     /*@// E N U M S      *****************************************************************************************************@*/
     // xyz 
@@ -109,6 +172,15 @@ namespace viva
         Screen
     };
 
+    // What draws the frame.
+    enum class RenderBackendType
+    {
+        // Direct3D 11, default
+        D3D11,
+        // CPU rasterizer, doesn't need GPU
+        Software
+    };
+
     namespace input
     {
         // xyz 
@@ -369,50 +441,397 @@ namespace viva
 
     namespace util
     {
-        // Read file contents to ASCII string.
+        // Read file contents to ASCII string. Line ends are \n like in text mode.
         // filename: path to file
         std::string ReadFileToStringA(const char* filename);
 
-        // Read file to byte vector.
-        // dst: destination vector
+        // Read file to byte vector in one read, size is known up front.
+        // dst: destination vector, file is appended
         void ReadFileToBytes(const char* filename, vector<byte>& dst);
 
-        // Reads image at 'filename' to array of pixels
+        // Reads image at 'filename' to array of pixels. Decoding starts with the first chunk of the file,
+        // next chunks are read on the calling thread as decoder asks for them. Loader threads call this
+        // for many images at once, a reader thread for each would cost more than it saves.
         // It's 3rd party library written in C, that's why raw array is used.
         // fileparth: filename
         // dst: destination. This function creates a pointer to data and has to write it somewhere.
         Size ReadImageToPixels(const char* filename, Color** dst);
+
+        // Decode image file that is already in memory, like ReadImageToPixels().
+        // data: file contents
+        // name: for error message
+        // dst: destination, free() it
+        Size DecodeImageToPixels(const byte* data, size_t size, const char* name, Color** dst);
+
+        // Hand the file to 'fun' chunk by chunk. Next chunk is read ahead on another thread
+        // while 'fun' works on the current one.
+        // chunkSize: bytes per chunk
+        // fun: gets every chunk in order, returns false to stop reading
+        void ReadFileChunks(const char* filename, size_t chunkSize, const std::function<bool(const byte*, size_t)>& fun);
     }
 
     template <typename T>
     class ObjectPool
     {
     private:
-        vector<T> pool;
-        vector<T*> freeObjects;
+        static const uint MaxChunks = 4096;
+        static const uint MaxThreads = 64; // threads past that go straight to the global list
+        static const uint CacheSize = 32;
+        static const uint Empty = 0xffffffff;
+
+        struct Slot
+        {
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage; // must be first
+            std::atomic<uint> next; // next batch on the global list
+            Slot* cacheNext; // next slot in the cache of a thread or in the batch
+            uint batchCount; // slots in the batch, set in the first slot of a batch on the global list
+            uint index;
+            bool live;
+        };
+
+        // written only by its own thread, one cache line each so threads don't share them
+        struct alignas(64) Cache
+        {
+            Slot* head;
+            uint count;
+            std::atomic<int> live; // allocs - frees on this thread, other threads only read it
+        };
+
+        uint chunkSize;
+        std::atomic<Slot*> chunks[MaxChunks];
+        std::atomic<uint> chunkCount;
+        std::mutex growLock;
+        std::atomic<unsigned long long> freeHead; // batches of free slots, low 32 bits slot index, high 32 bits ABA tag
+        Cache caches[MaxThreads];
+        std::atomic<int> overflowLive; // allocs - frees of threads without cache
+        mutable std::atomic<int> highWaterMark;
+
+        // pools of this type and cache indexes of exited threads
+        struct Registry
+        {
+            std::mutex lock;
+            vector<ObjectPool*> pools;
+            vector<uint> freeIndexes;
+            uint threadCount = 0;
+        };
+
+        // Cache index of a thread, flushes caches of all pools and frees the index when thread exits.
+        struct ThreadGuard
+        {
+            uint* index;
+
+            ThreadGuard(uint* index) : index(index)
+            {
+                Registry& registry = _GetRegistry();
+                std::lock_guard<std::mutex> guard(registry.lock);
+
+                if (registry.freeIndexes.size() > 0)
+                {
+                    *index = registry.freeIndexes.back();
+                    registry.freeIndexes.pop_back();
+                }
+                else if (registry.threadCount < MaxThreads)
+                    *index = registry.threadCount++;
+                else
+                    *index = MaxThreads;
+            }
+
+            ~ThreadGuard()
+            {
+                uint self = *this->index;
+                // pool calls from later thread_local destructors go to the global list
+                *this->index = MaxThreads;
+                if (self >= MaxThreads)
+                    return;
+
+                Registry& registry = _GetRegistry();
+                std::lock_guard<std::mutex> guard(registry.lock);
+
+                for (ObjectPool* pool : registry.pools)
+                    pool->_FlushCache(self);
+
+                registry.freeIndexes.push_back(self);
+            }
+        };
+
+        static Registry& _GetRegistry()
+        {
+            static Registry registry;
+            return registry;
+        }
+
+        static uint _ThreadIndex()
+        {
+            // trivial thread_local is read without init check, guard is made once per thread
+            static thread_local uint index = Empty;
+            if (index == Empty)
+            {
+                static thread_local ThreadGuard guard(&index);
+            }
+
+            return index;
+        }
+
+        // Only the owning thread writes, plain load and store instead of locked add.
+        static void _AddLive(std::atomic<int>& live, int n)
+        {
+            live.store(live.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        int _SumLive() const
+        {
+            int live = this->overflowLive.load(std::memory_order_relaxed);
+            for (uint i = 0; i < MaxThreads; i++)
+                live += this->caches[i].live.load(std::memory_order_relaxed);
+
+            return live;
+        }
+
+        void _UpdateHighWaterMark() const
+        {
+            int live = this->_SumLive();
+            int high = this->highWaterMark.load(std::memory_order_relaxed);
+            while (live > high && !this->highWaterMark.compare_exchange_weak(high, live, std::memory_order_relaxed));
+        }
+
+        // Move all slots of a cache to the global list as one batch, called by the thread that owns the cache.
+        void _FlushCache(uint self)
+        {
+            Cache& cache = this->caches[self];
+            if (cache.count == 0)
+                return;
+
+            this->_PushGlobal(cache.head, cache.count);
+            cache.head = nullptr;
+            cache.count = 0;
+        }
+
+        // Fill empty cache with a batch from the global list, grows the pool if that is empty.
+        void _Refill(Cache& cache)
+        {
+            Slot* batch = this->_PopGlobal();
+            if (batch == nullptr)
+                batch = this->_Grow();
+
+            cache.head = batch;
+            cache.count = batch->batchCount;
+            this->_UpdateHighWaterMark();
+        }
+
+        Slot* _GetSlot(uint index) const
+        {
+            return this->chunks[index / this->chunkSize].load(std::memory_order_acquire) + index % this->chunkSize;
+        }
+
+        // Push batch of 'count' slots linked by 'cacheNext' to the global list, one CAS for all of them.
+        void _PushGlobal(Slot* batch, uint count)
+        {
+            batch->batchCount = count;
+            unsigned long long head = this->freeHead.load(std::memory_order_relaxed);
+            unsigned long long newHead;
+
+            do
+            {
+                batch->next.store((uint)head, std::memory_order_relaxed);
+                newHead = ((head >> 32) + 1) << 32 | batch->index;
+            } while (!this->freeHead.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        // Take whole batch, nullptr if the global list is empty.
+        Slot* _PopGlobal()
+        {
+            unsigned long long head = this->freeHead.load(std::memory_order_acquire);
+            unsigned long long newHead;
+
+            do
+            {
+                if ((uint)head == Empty)
+                    return nullptr;
+
+                // batch might be taken by another thread meanwhile, then tag doesn't match and CAS fails
+                uint next = this->_GetSlot((uint)head)->next.load(std::memory_order_relaxed);
+                newHead = ((head >> 32) + 1) << 32 | next;
+            } while (!this->freeHead.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire));
+
+            return this->_GetSlot((uint)head);
+        }
+
+        // Add a chunk and return its first batch, the other batches go to the global list.
+        Slot* _Grow()
+        {
+            std::lock_guard<std::mutex> guard(this->growLock);
+
+            // another thread might have grown the pool while this one was waiting
+            Slot* batch = this->_PopGlobal();
+            if (batch != nullptr)
+                return batch;
+
+            uint chunk = this->chunkCount.load(std::memory_order_relaxed);
+            if (chunk == MaxChunks)
+                throw Error(__FUNCTION__, "Object pool is full");
+
+            Slot* slots = new Slot[this->chunkSize];
+            uint first = chunk * this->chunkSize;
+
+            for (uint i = 0; i < this->chunkSize; i++)
+            {
+                slots[i].index = first + i;
+                slots[i].live = false;
+                slots[i].cacheNext = i + 1 < this->chunkSize ? &slots[i + 1] : nullptr;
+            }
+
+            this->chunks[chunk].store(slots, std::memory_order_release);
+            this->chunkCount.store(chunk + 1, std::memory_order_release);
+
+            // half a cache per batch so a refill doesn't overflow the cache right away
+            uint batchSize = CacheSize / 2;
+            for (uint i = batchSize; i < this->chunkSize; i += batchSize)
+                this->_PushGlobal(&slots[i], std::min(batchSize, this->chunkSize - i));
+
+            slots[0].batchCount = std::min(batchSize, this->chunkSize);
+            return &slots[0];
+        }
     public:
-        ObjectPool(int capacity)
+        // Ctor.
+        // chunkSize: number of objects added every time pool runs out of free objects
+        ObjectPool(uint chunkSize) : chunkSize(chunkSize > 0 ? chunkSize : 1), chunkCount(0), freeHead(Empty),
+            overflowLive(0), highWaterMark(0)
+        {
+            for (uint i = 0; i < MaxChunks; i++)
+                this->chunks[i].store(nullptr, std::memory_order_relaxed);
+
+            for (uint i = 0; i < MaxThreads; i++)
+            {
+                this->caches[i].head = nullptr;
+                this->caches[i].count = 0;
+                this->caches[i].live.store(0, std::memory_order_relaxed);
+            }
+
+            Registry& registry = _GetRegistry();
+            std::lock_guard<std::mutex> guard(registry.lock);
+            registry.pools.push_back(this);
+        }
+
+        ObjectPool(const ObjectPool&) = delete;
+        ObjectPool& operator=(const ObjectPool&) = delete;
+
+        // Destroys objects that were not freed.
+        ~ObjectPool()
         {
-            pool.resize(capacity);
-            freeObjects.reserve(capacity);
+            {
+                Registry& registry = _GetRegistry();
+                std::lock_guard<std::mutex> guard(registry.lock);
+                registry.pools.erase(std::find(registry.pools.begin(), registry.pools.end(), this));
+            }
+
+            uint count = this->chunkCount.load();
 
-            for (int i = 0; i < capacity; i++)
-                freeObjects.push_back(pool.at(i));
+            for (uint c = 0; c < count; c++)
+            {
+                Slot* slots = this->chunks[c].load();
+
+                for (uint i = 0; i < this->chunkSize; i++)
+                    if (slots[i].live)
+                        reinterpret_cast<T*>(&slots[i].storage)->~T();
+
+                delete[] slots;
+            }
         }
 
-        T* Alloc()
+        // Get new object. Never returns nullptr, pool grows when it runs out of objects.
+        // args: passed to T's constructor
+        template <typename... Args>
+        T* Alloc(Args&&... args)
         {
-            if (freeObjects.size() == 0)
-                return nullptr;
+            uint self = _ThreadIndex();
+            Slot* slot;
+
+            if (self < MaxThreads)
+            {
+                Cache& cache = this->caches[self];
+                if (cache.count == 0)
+                    this->_Refill(cache);
+
+                slot = cache.head;
+                cache.head = slot->cacheNext;
+                cache.count--;
+                _AddLive(cache.live, 1);
+            }
+            else
+            {
+                slot = this->_PopGlobal();
+                if (slot == nullptr)
+                    slot = this->_Grow();
+
+                // rest of the batch goes back
+                if (slot->batchCount > 1)
+                    this->_PushGlobal(slot->cacheNext, slot->batchCount - 1);
+
+                this->overflowLive.fetch_add(1, std::memory_order_relaxed);
+                this->_UpdateHighWaterMark();
+            }
 
-            T* retval = freeObjects.back();
-            freeObjects.pop_back();
-            return retval;
+            T* object = new (&slot->storage) T(std::forward<Args>(args)...);
+            slot->live = true;
+
+            return object;
         }
 
+        // Destroy object and return it to the pool.
+        // ptr: object returned by Alloc() of this pool
         void Free(T* ptr)
         {
-            freeObjects.push_back(ptr);
+            Slot* slot = reinterpret_cast<Slot*>(ptr);
+            ptr->~T();
+            slot->live = false;
+
+            uint self = _ThreadIndex();
+
+            if (self >= MaxThreads)
+            {
+                this->overflowLive.fetch_sub(1, std::memory_order_relaxed);
+                this->_PushGlobal(slot, 1);
+                return;
+            }
+
+            Cache& cache = this->caches[self];
+            _AddLive(cache.live, -1);
+            slot->cacheNext = cache.head;
+            cache.head = slot;
+            cache.count++;
+
+            if (cache.count < CacheSize)
+                return;
+
+            // move half of the cache to the global list
+            Slot* first = cache.head;
+            Slot* last = first;
+            for (uint i = 1; i < CacheSize / 2; i++)
+                last = last->cacheNext;
+
+            cache.head = last->cacheNext;
+            cache.count -= CacheSize / 2;
+            this->_PushGlobal(first, CacheSize / 2);
+        }
+
+        // Number of objects allocated and not freed.
+        int GetLiveCount() const
+        {
+            return this->_SumLive();
+        }
+
+        // Highest live count since the pool was created. Sampled whenever a thread cache refills
+        // from the global list and here, so it can miss a peak by a few cached objects per thread.
+        int GetHighWaterMark() const
+        {
+            this->_UpdateHighWaterMark();
+            return this->highWaterMark.load(std::memory_order_relaxed);
+        }
+
+        // Number of objects the pool can hold without growing.
+        uint GetCapacity() const
+        {
+            return this->chunkCount.load() * this->chunkSize;
         }
     };
 
@@ -444,6 +863,13 @@ namespace viva
 
         void GetScreenshot(vector<Color>& dst) const;
 
+        // Which backend draws the frame.
+        RenderBackendType GetRenderBackendType() const;
+
+        // Copy what the last frame drew. Unlike GetScreenshot it doesn't read the screen so window can be covered.
+        // dst: client width * height pixels, rows from the top
+        void ReadBackBuffer(vector<Color>& dst) const;
+
         // Stop engine. Makes Run method return.
         void Exit();
 
@@ -468,6 +894,55 @@ namespace viva
     };
 
     // Transform object responsible for position, rotation, scale etc. of its owner.
+    // Pool of worker threads with one job queue per thread. Threads take jobs from the back of
+    // their own queue and steal from the front of other queues when theirs is empty.
+    class JobSystem
+    {
+    public:
+        // Number of worker threads.
+        uint GetThreadCount() const;
+
+        // Split [0, count) into ranges of 'grain' elements and run fun on each range.
+        // Calling thread runs queued jobs until all ranges of this call are done, so fun can call
+        // ParallelFor() again. First exception thrown by fun is thrown here after all ranges finished.
+        // count: number of elements
+        // grain: elements per job
+        // fun: called with begin and end of a range
+        void ParallelFor(uint count, uint grain, const std::function<void(uint, uint)>& fun);
+    };
+
+    // Owns state of all transforms and integrates all of them in one pass per frame.
+    class TransformSystem
+    {
+    public:
+        // Euler integration of position, rotation, scale and size of all transforms.
+        // dt: time step in seconds
+        void Integrate(float dt);
+
+        // Number of live transforms.
+        uint GetCount() const;
+
+        // How many times a cached matrix was returned without any math.
+        long long GetCacheHits() const;
+
+        // How many times a matrix had to be rebuilt.
+        long long GetCacheMisses() const;
+
+        // Zero hits and misses.
+        void ResetCacheStats();
+
+        // Resolve matrices level by level on jobSystem threads. When off, everything
+        // is resolved on the main thread in the same order every frame.
+        // val: on/off
+        void SetParallel(bool val);
+
+        bool IsParallel() const;
+
+        // Bring world and world view proj matrices of all transforms up to date.
+        // Drawing after that only reads cached matrices.
+        void ResolveAll();
+    };
+
     class Transform
     {
     public:
@@ -478,9 +953,15 @@ namespace viva
         // Get/Set origin
         Vector& Origin();
 
+        // Get origin, doesn't mark world matrix for rebuild.
+        const Vector& GetOrigin() const;
+
         // Get/Set position
         Vector& Pos();
 
+        // Get position, doesn't mark world matrix for rebuild.
+        const Vector& GetPos() const;
+
         // Get/Set velocity
         Vector& Vel();
 
@@ -490,6 +971,9 @@ namespace viva
         // Get/Set rotation
         float& Rot();
 
+        // Get rotation, doesn't mark world matrix for rebuild.
+        float GetRot() const;
+
         // Get/Set angular velocity
         float& RotVel();
 
@@ -499,6 +983,9 @@ namespace viva
         // Get/Set scale
         Vector& Scale();
 
+        // Get scale, doesn't mark world matrix for rebuild.
+        const Vector& GetScale() const;
+
         // Get/Set scale velocity
         Vector& ScaleVel();
 
@@ -557,9 +1044,70 @@ namespace viva
         void SetExtraBufferPSdata(void* data);
     };
 
+    // One sprite in a batch. Layout matches per instance data of sprite batch vertex shader.
+    struct alignas(16) SpriteInstance
+    {
+        float transform[4][4]; // world view proj, not transposed
+        Rect uv; // final uv (flips applied)
+        float color[4]; // normalized rgba
+    };
+
+    // Range of instances that share texture and pixel shader and go out in one draw call.
+    struct SpriteBatchRun
+    {
+        Texture* texture;
+        PixelShader* ps;
+        uint start;
+        uint count;
+    };
+
+    // Collects sprites into instance array and groups them by pixel shader and texture.
+    // Building the batch (Begin, Add, End) doesn't touch d3d and can be used without a window.
+    class SpriteBatch : public Destroyable
+    {
+    public:
+        // Clear instances and runs. Keeps allocated memory.
+        void Begin();
+
+        // Add one sprite.
+        // texture: texture
+        // ps: pixel shader
+        // transform: world view proj matrix, row major
+        // uv: final uv
+        // color: color
+        void Add(Texture* texture, PixelShader* ps, const math::matrix& transform, const Rect& uv, const Color& color);
+
+        // Sort added sprites by pixel shader and texture (stable) and build runs.
+        void End();
+
+        // Number of added sprites.
+        uint GetCount() const;
+
+        // Instances sorted by End().
+        const vector<SpriteInstance>& GetInstances() const;
+
+        // Runs built by End(). Each run is one draw call.
+        const vector<SpriteBatchRun>& GetRuns() const;
+
+        void Destroy() override;
+    };
+
     class Surface
     {
     public:
+        // Enable sprite batching. Sprites are grouped by texture and pixel shader
+        // and drawn with one instanced draw per group. Order of sprites with equal z
+        // is preserved only within a group. Drawables that can't be batched (text, polygons,
+        // sprites with custom pixel shader) break the batch and are drawn in order.
+        // val: on/off
+        void SetBatching(bool val);
+
+        // Is sprite batching enabled.
+        bool IsBatching() const;
+
+        // Batch used by the last frame. Useful to see how many draw calls there were.
+        const SpriteBatch& GetBatch() const;
+
         // Get pixel shader.
         PixelShader* GetPixelShader() const;
 
@@ -620,6 +1168,197 @@ namespace viva
         const Size& GetSize() const;
 
         void Destroy();
+
+        // Placeholder is drawn until async load finishes.
+        bool IsLoaded() const;
+
+        // Why async load failed, nullptr if it didn't. Failed texture stays a placeholder.
+        const char* GetLoadError() const;
+
+        // Atlas page or nullptr if the texture is standalone.
+        Texture* GetPage() const;
+
+        // Part of the page, 0-1 from left top. Whole texture for standalone textures.
+        const Rect& GetRegion() const;
+    };
+
+    // Cache of textures, fonts and pixel shaders loaded from files. Resources are found by path and
+    // by hash of file contents, so the same image under two names is decoded once. Every Get*()
+    // adds a reference and Destroy() of the resource takes it away. Resources nobody references stay
+    // cached and the least recently used ones are freed when resident bytes go over budget.
+    class ResourceManager
+    {
+    public:
+        // Load texture or get cached one.
+        // filename: file path
+        Texture* GetTexture(const char* filename);
+
+        // Load font or get cached one. Font texture is cached too.
+        // textureFile: image with glyphs
+        // metricsFile: character metrics
+        Font* GetFont(const char* textureFile, const char* metricsFile);
+
+        // Compile pixel shader from file or get cached one.
+        // filename: file path
+        PixelShader* GetPixelShader(const char* filename);
+
+        // Cache resource that was not loaded from file under a name. Caller's pointer counts as reference.
+        // name: Get*() with this name returns the resource
+        void Add(const char* name, Texture* texture);
+
+        void Add(const char* name, Font* font);
+
+        void Add(const char* name, PixelShader* ps);
+
+        // Forget the name. Resource is freed when nothing references it and it has no other name.
+        void Remove(const char* name);
+
+        // Unused resources are evicted when resident bytes go over this. Referenced resources are
+        // never evicted. Default is 256MB.
+        void SetBudget(size_t bytes);
+
+        size_t GetBudget() const;
+
+        // Bytes of everything cached, referenced or not.
+        size_t GetResidentBytes() const;
+
+        // Number of cached resources.
+        uint GetCount() const;
+
+        // Hits over all Get*() calls since last ResetStats().
+        double GetHitRate() const;
+
+        // Found by path.
+        long long GetPathHits() const;
+
+        // Found by contents under a different path.
+        long long GetContentHits() const;
+
+        long long GetMisses() const;
+
+        long long GetEvictions() const;
+
+        void ResetStats();
+
+        // Free everything that is not referenced.
+        void Trim();
+    };
+
+    // Loads textures in the background. Files are read and decoded on a pool of threads, main thread
+    // uploads decoded pixels to the render backend at the start of the frame, within upload budget.
+    class TextureLoader
+    {
+    public:
+        // Start loading file. Returns 1x1 transparent placeholder that becomes the texture when it's
+        // uploaded, check Texture::IsLoaded(). Size of the placeholder is not the size of the image.
+        // If the file can't be loaded, Texture::GetLoadError() says why.
+        // filename: file path
+        Texture* Load(const char* filename);
+
+        // Queue all files at once so every decode thread has work.
+        // filenames: file paths
+        vector<Texture*> LoadBatch(const vector<std::string>& filenames);
+
+        // Limit how many textures are uploaded every frame, the rest waits for the next frame.
+        // 0 means no limit which is default.
+        // maxCount: max textures per frame
+        // maxSeconds: max time per frame
+        void SetUploadBudget(uint maxCount, double maxSeconds);
+
+        // Change number of decode threads. Waits for decodes that are running.
+        void SetThreadCount(uint count);
+
+        uint GetThreadCount() const;
+
+        // Textures that are not uploaded yet.
+        uint GetPending() const;
+
+        // Sum of time all threads spent reading and decoding.
+        double GetDecodeSeconds() const;
+
+        void ResetStats();
+
+        // Block until everything queued is decoded and uploaded, ignores upload budget.
+        void Finish();
+    };
+
+    // Image to be packed.
+    struct AtlasImage
+    {
+        std::string name;
+        const Color* pixels; // starting from left top
+        int width;
+        int height;
+    };
+
+    // Where packed image ended up.
+    struct AtlasRegion
+    {
+        std::string name;
+        uint page;
+        int x, y, width, height; // pixels, without padding
+    };
+
+    // Skyline bottom-left packer. Only places rectangles, pixels are copied by Pack().
+    class AtlasPacker
+    {
+    public:
+        // width, height: page size in pixels
+        AtlasPacker(int width, int height);
+
+        // Empty page.
+        void Reset();
+
+        // Place rectangle. Returns false if page has no room for it.
+        // x, y: left top of the rectangle
+        bool Insert(int w, int h, int& x, int& y);
+
+        // Used area / page area.
+        float GetOccupancy() const;
+
+        // Lowest point of the skyline, page can be cut there.
+        int GetUsedHeight() const;
+
+        // Pack images into pages. Images are sorted by height so skyline stays flat. Padding is
+        // filled with edge pixels so linear filtering doesn't pick up neighbours.
+        // pageSize: width and height of page in pixels
+        // padding: pixels around each image
+        // pages: pixels of pages, last page is cut to used height
+        // pageSizes: size of each page
+        // regions: one per image, same order as images
+        // returns occupancy of all pages together
+        static float Pack(const vector<AtlasImage>& images, int pageSize, int padding, vector<vector<Color>>& pages,
+            vector<Size>& pageSizes, vector<AtlasRegion>& regions);
+
+        // Offline atlas. Packs image files and writes pages as 'outPrefix'_N.tga and metadata as
+        // 'outPrefix'.atlas. Doesn't need the engine running. Load it with Creator::CreateAtlasFromFile().
+        // filenames: images, regions are named by them
+        // returns occupancy
+        static float Bake(const vector<std::string>& filenames, const char* outPrefix, int pageSize, int padding);
+    };
+
+    // Pages with many textures on them. Textures of the atlas draw with the SRV of their page so sprites
+    // using them batch together. Sprite::SetUV() and Animation::AddAction() take uv of the texture itself.
+    class Atlas : public Destroyable
+    {
+    public:
+        // Get texture by name, file name if atlas was created from files. Atlas owns it.
+        Texture* Get(const std::string& name) const;
+
+        // Get texture by index, the same order as images were given.
+        Texture* Get(uint index) const;
+
+        uint GetCount() const;
+
+        Texture* GetPage(uint index) const;
+
+        uint GetPageCount() const;
+
+        // Used area / page area.
+        float GetOccupancy() const;
+
+        // Destroys textures and pages.
+        void Destroy();
     };
 
     struct CharacterMetrics
@@ -627,19 +1366,34 @@ namespace viva
         int id;
         Rect uv;
         Size size;
+        Size sizePx;
         Point offset;
+        Point offsetPx;
         float advance;
+        float advancePx;
     };
 
     struct FontMetrics
     {
         float lineHeight;
+        float lineHeightPx;
+    };
+
+    // Glyph as it is in BMFont metrics file, pixels.
+    struct FontGlyph
+    {
+        int id, x, y, width, height, xoffset, yoffset, xadvance;
     };
 
     // Bitmap font. Stores coordinates for where letters are on texture
     class Font : public Destroyable
     {
     public:
+        // Parse BMFont text metrics.
+        // glyphs: parsed glyphs are added here
+        // lineHeightPx: line height from 'common' line, 0 if there is none
+        static void ParseMetrics(const char* fontMetrics, vector<FontGlyph>& glyphs, float& lineHeightPx);
+
         // Create bitmap font from texture. And calc primitive metrics
         // tex: texture to use
         // glyphs: exact uv coordinate for glyphs. It should contain at least ascii 0-126
@@ -648,6 +1402,11 @@ namespace viva
         // Create bitmap font from texture.
         Font(Texture* tex, const char* fontMetricsFile);
 
+        // Create bitmap font from glyphs that are already parsed, see Archive.
+        // glyphs: pixel metrics
+        // lineHeightPx: line height in pixels
+        Font(Texture* tex, const FontGlyph* glyphs, uint count, float lineHeightPx);
+
         // Gets uv coordinate for char 'code'.
         const CharacterMetrics& GetChar(uint code) const;
 
@@ -658,6 +1417,223 @@ namespace viva
         void Destroy();
     };
 
+    // Function that takes event data, like std::function<void(int)>. Callables up to BufferSize bytes
+    // are stored inside, only bigger ones are allocated.
+    class EventHandler
+    {
+    private:
+        static const uint BufferSize = 64;
+        enum class Op { Copy, Move, Destroy };
+
+        mutable std::aligned_storage<BufferSize, 16>::type buffer;
+        void(*invoke)(void* buffer, int data);
+        void(*manage)(Op op, void* dst, void* src);
+
+        // callable lives in the buffer
+        template <typename F>
+        struct Local
+        {
+            static void Invoke(void* buffer, int data)
+            {
+                (*reinterpret_cast<F*>(buffer))(data);
+            }
+
+            static void Manage(Op op, void* dst, void* src)
+            {
+                if (op == Op::Copy)
+                    new (dst) F(*reinterpret_cast<const F*>(src));
+                else if (op == Op::Move)
+                {
+                    new (dst) F(std::move(*reinterpret_cast<F*>(src)));
+                    reinterpret_cast<F*>(src)->~F();
+                }
+                else
+                    reinterpret_cast<F*>(dst)->~F();
+            }
+        };
+
+        // buffer holds pointer to the callable
+        template <typename F>
+        struct Remote
+        {
+            static void Invoke(void* buffer, int data)
+            {
+                (**reinterpret_cast<F**>(buffer))(data);
+            }
+
+            static void Manage(Op op, void* dst, void* src)
+            {
+                if (op == Op::Copy)
+                    *reinterpret_cast<F**>(dst) = new F(**reinterpret_cast<F**>(src));
+                else if (op == Op::Move)
+                    *reinterpret_cast<F**>(dst) = *reinterpret_cast<F**>(src);
+                else
+                    delete *reinterpret_cast<F**>(dst);
+            }
+        };
+
+        template <typename F>
+        void _Init(F&& f, std::true_type)
+        {
+            typedef typename std::decay<F>::type T;
+            new (&this->buffer) T(std::forward<F>(f));
+            this->invoke = &Local<T>::Invoke;
+            this->manage = &Local<T>::Manage;
+        }
+
+        template <typename F>
+        void _Init(F&& f, std::false_type)
+        {
+            typedef typename std::decay<F>::type T;
+            *reinterpret_cast<T**>(&this->buffer) = new T(std::forward<F>(f));
+            this->invoke = &Remote<T>::Invoke;
+            this->manage = &Remote<T>::Manage;
+        }
+    public:
+        EventHandler() : invoke(nullptr), manage(nullptr)
+        {
+        }
+
+        // Ctor.
+        // f: anything that can be called with int
+        template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, EventHandler>::value>::type>
+        EventHandler(F&& f)
+        {
+            typedef typename std::decay<F>::type T;
+            this->_Init(std::forward<F>(f), std::integral_constant<bool, sizeof(T) <= BufferSize && alignof(T) <= 16>());
+        }
+
+        EventHandler(const EventHandler& other) : invoke(other.invoke), manage(other.manage)
+        {
+            if (this->manage != nullptr)
+                this->manage(Op::Copy, &this->buffer, &other.buffer);
+        }
+
+        EventHandler(EventHandler&& other) : invoke(other.invoke), manage(other.manage)
+        {
+            if (this->manage != nullptr)
+                this->manage(Op::Move, &this->buffer, &other.buffer);
+
+            other.invoke = nullptr;
+            other.manage = nullptr;
+        }
+
+        EventHandler& operator=(const EventHandler& other)
+        {
+            if (this != &other)
+            {
+                this->~EventHandler();
+                new (this) EventHandler(other);
+            }
+
+            return *this;
+        }
+
+        EventHandler& operator=(EventHandler&& other)
+        {
+            if (this != &other)
+            {
+                this->~EventHandler();
+                new (this) EventHandler(std::move(other));
+            }
+
+            return *this;
+        }
+
+        ~EventHandler()
+        {
+            if (this->manage != nullptr)
+                this->manage(Op::Destroy, &this->buffer, nullptr);
+        }
+
+        void operator()(int data) const
+        {
+            this->invoke(&this->buffer, data);
+        }
+
+        explicit operator bool() const
+        {
+            return this->invoke != nullptr;
+        }
+    };
+
+#ifdef VIVA_COROUTINES
+    // Return type of coroutines that RoutineManager can run. Coroutine doesn't start until it's
+    // passed to RoutineManager::StartCoroutine. It can co_await WaitSeconds, WaitFrames, WaitEvent
+    // and WaitFuture.
+    class Coroutine
+    {
+    public:
+        struct promise_type
+        {
+            Routine* routine = nullptr;
+
+            Coroutine get_return_object()
+            {
+                return Coroutine(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            // stays suspended so routine can see it's done, routine destroys it
+            std::suspend_always final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void return_void()
+            {
+            }
+
+            // goes out of RoutineManager like exception from any routine
+            void unhandled_exception()
+            {
+                throw;
+            }
+        };
+    private:
+        std::coroutine_handle<promise_type> handle;
+    public:
+        explicit Coroutine(std::coroutine_handle<promise_type> handle) : handle(handle)
+        {
+        }
+
+        Coroutine(Coroutine&& other) noexcept : handle(other.handle)
+        {
+            other.handle = nullptr;
+        }
+
+        Coroutine(const Coroutine&) = delete;
+        Coroutine& operator=(const Coroutine&) = delete;
+
+        // Destroys coroutine that was never started.
+        ~Coroutine()
+        {
+            if (this->handle)
+                this->handle.destroy();
+        }
+
+        // Take the coroutine, this object becomes empty.
+        std::coroutine_handle<promise_type> _Release()
+        {
+            std::coroutine_handle<promise_type> h = this->handle;
+            this->handle = nullptr;
+            return h;
+        }
+    };
+#endif
+
+    // Refers to a routine without keeping a pointer to it. Handle becomes stale when the
+    // routine is removed, even if its memory is reused by a new routine.
+    struct RoutineHandle
+    {
+        uint slot;
+        uint generation; // 0 is never used so default handle is always stale
+    };
+
     class RoutineManager
     {
     public:
@@ -671,29 +1647,188 @@ namespace viva
         //tick: run event once every tick seconds, 0 to run every frame
         Routine* AddRoutine(const std::function<int()>& func, int id, double delay, double lifeTime, double tick);
 
+        // Add a new routine.
+        //parallel: routine can run on worker threads at the same time as other parallel routines.
+        //          All parallel routines that are due run after serial routines and are done before
+        //          input and drawing. They must only touch their own data. Allowed engine calls are
+        //          jobSystem->ParallelFor(), ObjectPool Alloc()/Free() and const getters such as
+        //          Transform::GetPos(). Adding or removing routines, raising events, creating or
+        //          destroying objects (creator, drawManager), setters and Pos()/Rot()/Scale() that mark
+        //          transforms dirty, and network sends are main thread only. If one throws, it's
+        //          removed and the exception is thrown from the frame after the batch finished.
+        Routine* AddRoutine(const std::function<int()>& func, int id, double delay, double lifeTime, double tick, bool parallel);
+
         Routine* AddRoutine(const std::function<int()>& func);
 
-        // Find routine.
-        // Note, this method performs linear search to find by name.
-        // name: name of the routine
+        // Find routine by id, nullptr if there is none or id is 0.
+        // If more routines have the same id, any of them is returned.
         Routine* FindRoutine(int id);
 
+#ifdef VIVA_COROUTINES
+        // Run coroutine as a routine. It starts in the next frame and it's only touched
+        // when what it waits for happens.
+        // coroutine: function that returns Coroutine
+        // id: id for FindRoutine, 0 for none
+        Routine* StartCoroutine(Coroutine&& coroutine, int id);
+
+        Routine* StartCoroutine(Coroutine&& coroutine);
+#endif
+
+        // Used by awaitables of suspended coroutines.
+        void _WaitSeconds(Routine* r, double seconds);
+
+        void _WaitFrames(Routine* r, uint frames);
+
+        void _WaitEvent(Routine* r, int _event, int* data);
+
+        void _WaitFuture(Routine* r, bool(*poll)(void* awaiter), void* awaiter);
+
+        // Call all handlers of the event now.
         void Trigger(int _event, int data);
 
-        void AddHandler(int _event, const std::function<void(int)>& handler);
+        // Queue the event, it's triggered at the start of the next frame.
+        // Events deferred by handlers of deferred events are triggered in the frame after.
+        void TriggerDeferred(int _event, int data);
+
+        // Handler added from inside a handler is not called until that Trigger() returns.
+        // handler: lambda, function pointer or std::function, captures up to 64 bytes don't allocate
+        void AddHandler(int _event, const EventHandler& handler);
 
         // Remove all handlers for that event.
+        // Don't call it from inside a handler.
         void ClearHandlers(int _event);
 
         // Remove all handlers.
+        // Don't call it from inside a handler.
         void ClearHandlers();
 
         // Remove all routines.
         // Don't call it from inside a routine.
         void ClearRoutines();
 
+        // Destroy routine. It's O(1), routine is removed from the wheel right away.
+        // Routine can remove itself from inside its func.
         void RemoveRoutine(Routine* r);
+
+        // Destroy routine if handle is not stale.
+        // Returns false if routine was removed already.
+        bool RemoveRoutine(RoutineHandle h);
+
+        // Get handle that detects if routine was removed.
+        RoutineHandle GetHandle(Routine* r) const;
+
+        // Get routine by handle, nullptr if it was removed.
+        Routine* GetRoutine(RoutineHandle h) const;
+    };
+
+#ifdef VIVA_COROUTINES
+    // co_await WaitSeconds(2) resumes coroutine after 2 seconds of game time.
+    struct WaitSeconds
+    {
+        double seconds;
+
+        WaitSeconds(double seconds) : seconds(seconds)
+        {
+        }
+
+        bool await_ready() const
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<Coroutine::promise_type> h)
+        {
+            routineManager->_WaitSeconds(h.promise().routine, this->seconds);
+        }
+
+        void await_resume()
+        {
+        }
+    };
+
+    // co_await WaitFrames(1) resumes coroutine in the next frame.
+    struct WaitFrames
+    {
+        uint frames;
+
+        WaitFrames(uint frames) : frames(frames)
+        {
+        }
+
+        bool await_ready() const
+        {
+            return this->frames == 0;
+        }
+
+        void await_suspend(std::coroutine_handle<Coroutine::promise_type> h)
+        {
+            routineManager->_WaitFrames(h.promise().routine, this->frames);
+        }
+
+        void await_resume()
+        {
+        }
+    };
+
+    // int data = co_await WaitEvent(id) resumes coroutine in the frame after event is triggered.
+    // Returns data of the event.
+    struct WaitEvent
+    {
+        int _event;
+        int data;
+
+        WaitEvent(int _event) : _event(_event), data(0)
+        {
+        }
+
+        bool await_ready() const
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<Coroutine::promise_type> h)
+        {
+            routineManager->_WaitEvent(h.promise().routine, this->_event, &this->data);
+        }
+
+        int await_resume()
+        {
+            return this->data;
+        }
+    };
+
+    // T value = co_await WaitFuture(future) resumes coroutine when future is ready. Future is polled
+    // once a frame, there is no way to get notified.
+    template <typename T>
+    struct WaitFuture
+    {
+        std::future<T>& future;
+
+        WaitFuture(std::future<T>& future) : future(future)
+        {
+        }
+
+        static bool _Poll(void* awaiter)
+        {
+            return static_cast<WaitFuture*>(awaiter)->await_ready();
+        }
+
+        bool await_ready() const
+        {
+            return this->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        void await_suspend(std::coroutine_handle<Coroutine::promise_type> h)
+        {
+            routineManager->_WaitFuture(h.promise().routine, &WaitFuture::_Poll, this);
+        }
+
+        T await_resume()
+        {
+            return this->future.get();
+        }
     };
+#endif
 
     class PixelShader : public Destroyable
     {
@@ -818,6 +1953,9 @@ namespace viva
 
         void AddAction(double speed, int columns, int rows, int first, int last);
 
+        // Uv table of frames first to last of a grid, frames go left to right, top to bottom.
+        static vector<Rect> GridUVTable(int columns, int rows, int first, int last);
+
         void AddAction(double speed, const vector<Rect>& uvTable);
 
         void AddAction(double speed, const Size& texSizePx, const vector<Rect>& uvTablePx);
@@ -862,11 +2000,110 @@ namespace viva
         TextureFilter GetTextureFilter() const;
     };
 
+    enum class ArchiveEntryType : uint
+    {
+        Pixels, // rgba, width * height
+        Font, // FontGlyph[count], texture is entry 'link', 'value' is line height in pixels
+        UVTable, // Rect[count] for Animation::AddAction(), 'value' is speed
+        PixelShader, // ps_5_0 bytecode
+    };
+
+    // Table of contents entry. Archive is used in place so layout can't change without bumping ArchiveVersion.
+    struct ArchiveEntry
+    {
+        char name[56]; // zero terminated, entries are sorted by name
+        ArchiveEntryType type;
+        uint link; // index of other entry
+        unsigned long long offset; // from the start of the file, 16 byte aligned
+        unsigned long long size;
+        uint width;
+        uint height;
+        uint count;
+        float value;
+    };
+
+    // Assets cooked by AssetCooker, mapped to memory. Resources are created straight from the mapped
+    // bytes, nothing is decoded or parsed. Resources don't depend on the archive once created.
+    class Archive : public Destroyable
+    {
+    public:
+        // Create texture from cooked pixels.
+        Texture* CreateTexture(const char* name);
+
+        // Create font from cooked glyphs and its cooked texture.
+        Font* CreateFontV(const char* name);
+
+        // Create pixel shader from cooked bytecode.
+        PixelShader* CreatePixelShader(const char* name);
+
+        // Cooked uv table, points into the archive so it's valid until Destroy().
+        // count: number of frames
+        const Rect* GetUVTable(const char* name, uint& count) const;
+
+        // Add cooked uv table to animation as an action with cooked speed.
+        void AddAction(Animation* animation, const char* name) const;
+
+        uint GetCount() const;
+
+        const ArchiveEntry& GetEntry(uint index) const;
+
+        void Destroy();
+    };
+
+    // Turns source assets into archive for Archive. Images are decoded, font metrics are parsed and shaders
+    // are compiled here once instead of at every start. Doesn't need the engine running.
+    class AssetCooker
+    {
+    private:
+        struct Item
+        {
+            ArchiveEntry entry;
+            std::string link;
+            vector<byte> data;
+        };
+
+        vector<Item> items;
+
+        Item& _Add(const char* name, ArchiveEntryType type);
+
+        bool _Has(const char* name) const;
+    public:
+        // Decode image to rgba pixels.
+        // name: name in the archive
+        // filename: image file
+        void AddImage(const char* name, const char* filename);
+
+        // Parse BMFont metrics. Texture is added as image named 'textureFile' unless it's already there.
+        void AddFont(const char* name, const char* textureFile, const char* metricsFile);
+
+        // Uv table for Animation::AddAction().
+        void AddUVTable(const char* name, double speed, const vector<Rect>& uvTable);
+
+        // Uv table of grid frames, see Animation::GridUVTable().
+        void AddUVTable(const char* name, double speed, int columns, int rows, int first, int last);
+
+        // Compile pixel shader.
+        void AddPixelShader(const char* name, const char* filename);
+
+        // AddPixelShader() works, it needs d3dcompiler that is only on windows.
+        static bool CanCompileShaders();
+
+        // Write archive, entries are sorted by name.
+        void Write(const char* filename);
+
+        // Cook assets listed in manifest file, one per line:
+        // image <name> <file>
+        // font <name> <texture file> <metrics file>
+        // uv <name> <speed> <columns> <rows> <first> <last>
+        // shader <name> <file>
+        static void CookManifest(const char* manifestFile, const char* archiveFile);
+    };
+
     // Factory for all objects.
     class Creator
     {
     public:
-        // Create pixel shader from file.
+        // Create pixel shader from file. Shaders from the same file are shared through resourceManager.
         // filename: path to file containing pixel shader.
         PixelShader* CreatePixelShaderFromFile(const char* filename);
 
@@ -880,6 +2117,7 @@ namespace viva
 
         // Create texture from file. Supported files BMP, GIF, JPEG, PNG, TIFF, Exif, WMF, EMF.
         // Named (name is given by filename) textures are stored in resource manager automatically. Can be removed by resourceManager::Remove()
+        // Every call adds a reference, Destroy() takes one away.
         // filename: file path
         Texture* CreateTexture(const char* filename);
 
@@ -888,6 +2126,32 @@ namespace viva
         // size: size of the image in pixels
         Texture* CreateTexture(const Color* pixels, const Size& size);
 
+        // Load texture on textureLoader threads. Returns placeholder that becomes the texture
+        // when it's uploaded, see Texture::IsLoaded().
+        // filename: file path
+        Texture* CreateTextureAsync(const char* filename);
+
+        // Load many textures at once on all textureLoader threads.
+        // filenames: file paths
+        vector<Texture*> CreateTexturesAsync(const vector<std::string>& filenames);
+
+        // Pack images into atlas pages. Textures of the atlas are named by image names.
+        // pageSize: width and height of page in pixels
+        // padding: edge pixels repeated around each image so filtering doesn't bleed
+        Atlas* CreateAtlas(const vector<AtlasImage>& images, int pageSize = 2048, int padding = 1);
+
+        // Load image files and pack them into atlas pages. Textures of the atlas are named by file names.
+        // filenames: file paths
+        Atlas* CreateAtlas(const vector<std::string>& filenames, int pageSize = 2048, int padding = 1);
+
+        // Load atlas made offline by AtlasPacker::Bake(), nothing is packed at load time.
+        // metadataFile: the .atlas file
+        Atlas* CreateAtlasFromFile(const char* metadataFile);
+
+        // Map archive cooked by AssetCooker. Resources are created from it without decoding or parsing.
+        // filename: archive file
+        Archive* OpenArchive(const char* filename);
+
         Text* CreateText(const wchar_t* text);
 
         Text* CreateText(const wchar_t* text, Font* font);
@@ -896,6 +2160,9 @@ namespace viva
         // texture: existing texture object
         Sprite* CreateSprite(Texture* texture);
 
+        // Create standalone sprite batch. Surfaces have their own, this one is for building batches by hand.
+        SpriteBatch* CreateSpriteBatch();
+
         // Create polygon from points.
         // points: vector of points where each point is x,y in world coordinates
         Polygon* CreatePolygon(const vector<Point>& points);
@@ -913,6 +2180,15 @@ namespace viva
 
         net::Client* CreateClient(const char* ip, unsigned short port);
 
+        // Udp socket bound to port, 0 picks a free one.
+        net::UdpSocket* CreateUdpSocket(unsigned short port);
+
+        // Replicate registered entities to clients of server.
+        net::Replicator* CreateReplicator(net::Server* server);
+
+        // Receive snapshots of a replicator on the client side.
+        net::ReplicaReader* CreateReplicaReader(net::Client* client);
+
         // Create surface to render objects on.
         Surface* CreateSurface();
 
@@ -921,6 +2197,14 @@ namespace viva
         Animation* CreateAnimation(Texture* texture);
     };
 
+    // One letter of laid out text. Text local space, +y is up.
+    struct GlyphQuad
+    {
+        float x, y; // lower left corner
+        float width, height;
+        Rect uv;
+    };
+
     class Text : public Sprite
     {
     public:
@@ -928,6 +2212,18 @@ namespace viva
         Text* SetText(const wchar_t* str);
 
         const wchar_t* GetText() const;
+
+        // Set font. Text uses font's texture.
+        Text* SetFont(Font* f);
+
+        Font* GetFont() const;
+
+        // Compute glyph quads for a string. Doesn't touch d3d.
+        // str: text
+        // font: font to take metrics from
+        // mode: World uses world metrics, Screen uses pixel metrics
+        // dst: output, cleared first
+        static void Layout(const wchar_t* str, const Font* font, TransformMode mode, vector<GlyphQuad>& dst);
     };
 
     class DrawManager
@@ -1044,6 +2340,7 @@ namespace viva
         const char* title;
         Size size;
         Size unit;
+        RenderBackendType backend; // D3D11 if not set
     };
 
     class Viva
@@ -1067,29 +2364,95 @@ namespace viva
             int code;
         };
 
-        class Client
+        // Wire protocol version, both sides send it in the welcome message.
+        const unsigned short ProtocolVersion = 2;
+
+        // NetworkError codes that are not winsock errors.
+        const int ErrorProtocol = -1; // welcome message or frame is malformed
+        const int ErrorVersion = -2; // other side speaks different protocol version
+        const int ErrorTooBig = -3; // message is bigger than max message size
+
+        // Message that points into the receive buffer of a client.
+        // Valid only inside the callback it was passed to.
+        struct MsgSpan
+        {
+            const byte* data;
+            uint size;
+        };
+
+        class Socket
+        {
+        public:
+            size_t GetId() const;
+
+            void OnError(const std::function<void(const NetworkError& error)>& handler);
+        };
+
+        class Client : public Socket
         {
         public:
             void OnConnect(const std::function<void()>& handler);
 
+            // Message is copied to vector, OnMsgSpan() doesn't copy.
             void OnMsg(const std::function<void(const vector<byte>&)>& handler);
 
+            // Message points straight into the receive buffer and is valid only inside the handler.
+            void OnMsgSpan(const std::function<void(const MsgSpan&)>& handler);
+
+            // All messages received this frame at once, called after per message handlers.
+            // Spans are valid only inside the handler.
+            void OnMsgBatch(const std::function<void(const vector<MsgSpan>&)>& handler);
+
+            // Limit how much time is spent delivering messages every frame, the rest waits for
+            // the next frame. 0 means no limit. By default everything is delivered.
+            // maxCount: max messages per frame
+            // maxSeconds: max time per frame
+            void SetMsgBudget(uint maxCount, double maxSeconds);
+
+            // Set size of the receive buffer. Call it before Connect().
+            // ringSize: receive buffer size, at least 128KB, allocated when first bytes arrive
+            // recvSize: max bytes read from socket at once
+            void SetReceiveBuffer(uint ringSize, uint recvSize);
+
             const char* GetIp() const;
 
-            void Send(vector<byte>& msg);
+            bool IsConnected() const;
+
+            bool Send(vector<byte>& msg);
+
+            // Queue a copy of the message. All messages queued in a frame go out in one
+            // WSASend() at the end of the network step, or once connected. Messages over 64KB are
+            // sent in chunks. Returns false and doesn't queue it while the queue is over the send
+            // limit, send it again later or drop it.
+            bool Send(byte* msg, uint len);
+
+            // Queue the message without copying it. It must stay valid until the end of the frame.
+            // Returns false like Send().
+            bool SendRef(const byte* msg, uint len);
 
-            void Send(byte* msg, unsigned short len);
+            // Biggest message that can be sent or received, bigger received message closes the
+            // connection. Default is 64MB.
+            void SetMaxMessageSize(uint bytes);
+
+            // Queue messages until the end of the frame, on by default. When off every Send()
+            // goes to the socket right away.
+            void SetSendCoalescing(bool val);
+
+            // When this many bytes are queued because kernel buffer is full or the connection isn't
+            // open yet, Send() returns false until there is room. Default is 4MB.
+            void SetSendLimit(uint bytes);
+
+            // Bytes queued and not sent yet.
+            size_t GetSendQueueSize() const;
 
             void Connect(double timeoutSeconds);
 
             void Disonnect();
 
             void Destroy();
-
-            bool GetReturnReceive() const;
         };
 
-        class Server
+        class Server : public Socket
         {
         public:
             void OnConnect(const std::function<void(Client* c)>& handler);
@@ -1098,7 +2461,10 @@ namespace viva
 
             const vector<Client*>& GetClients() const;
 
-            bool GetReturnAccept() const;
+            // Limit how many new clients are handed to OnConnect every frame, the rest waits for
+            // the next frame. 0 means no limit which is default.
+            // maxCount: max clients per frame
+            void SetAcceptBudget(uint maxCount);
 
             void Start(int backlog);
 
@@ -1106,6 +2472,143 @@ namespace viva
 
             void Destroy();
         };
+
+        // Biggest message that fits in one udp packet, big data goes over tcp.
+        const uint UdpMaxMessage = 1024;
+
+        // How a udp message gets to the other side.
+        enum class Delivery : byte
+        {
+            // might be lost, duplicates are dropped
+            Unreliable,
+            // might be lost, never older than what was delivered already
+            Sequenced,
+            // resent until acked, delivered in order
+            Reliable
+        };
+
+        // One remote address of a udp socket.
+        class UdpPeer
+        {
+        public:
+            // Queue message, it goes out with other messages at the end of the frame.
+            // len: at most UdpMaxMessage
+            void Send(const byte* msg, uint len, Delivery delivery);
+
+            // Message points into the receive buffer and is valid only inside the handler.
+            void OnMsg(const std::function<void(const MsgSpan&, Delivery)>& handler);
+
+            // Smoothed round trip time in seconds, 0 before the first ack.
+            double GetRtt() const;
+
+            uint GetPacketsSent() const;
+
+            uint GetPacketsReceived() const;
+
+            // Reliable messages sent again because they were not acked in time.
+            uint GetResent() const;
+        };
+
+        // Udp socket bound to a port, talks to any number of peers.
+        class UdpSocket : public Socket
+        {
+        public:
+            // Start talking to address. There is no handshake, peer is ready right away.
+            UdpPeer* Connect(const char* ip, unsigned short port);
+
+            // Packet came from an address that has no peer yet.
+            void OnPeer(const std::function<void(UdpPeer*)>& handler);
+
+            void RemovePeer(UdpPeer* peer);
+
+            const vector<UdpPeer*>& GetPeers() const;
+
+            // Port the socket is bound to.
+            unsigned short GetPort() const;
+
+            // Datagrams dropped because main thread was behind.
+            uint GetDropped() const;
+
+            // Simulate bad network on received packets, for testing over loopback.
+            // loss: 0 to 1, chance a packet is dropped
+            // latency: seconds added to every packet
+            // jitter: random seconds added on top, reorders packets
+            void SetSimulation(float loss, double latency, double jitter);
+
+            void Destroy();
+        };
+
+        // Replicates transforms and colors of registered entities to all clients of a server.
+        // Every client gets only what changed since the last snapshot it acked. Clients that acked
+        // the same snapshot share one encoded message.
+        class Replicator
+        {
+        public:
+            // Start replicating transform and color of drawable. Returns entity id that
+            // ReplicaReader::Bind() uses on the other side.
+            // drawable: can be null, color is not replicated then
+            uint Register(Transform* transform, Drawable* drawable);
+
+            // Stop replicating, clients see the entity as not alive.
+            void Unregister(uint id);
+
+            // Values are rounded to these steps, reader must use the same ones.
+            // Defaults are 1/256 for position and 1/1024 for scale.
+            void SetQuantization(float positionStep, float scaleStep);
+
+            // Take a snapshot and send deltas to every client of the server.
+            void Replicate();
+
+            // Pass every message from server side clients here. Returns true if it was an ack
+            // and was consumed.
+            bool Acknowledge(Client* client, const MsgSpan& msg);
+
+            // Forget the client, call it from Server::OnDisconnect() so a new client that gets
+            // the same address doesn't inherit its baseline.
+            void RemoveClient(Client* client);
+
+            uint GetTick() const;
+
+            // Bytes sent to all clients by the last Replicate().
+            size_t GetLastBytes() const;
+
+            // Messages encoded by the last Replicate(), one per distinct baseline.
+            uint GetLastGroups() const;
+
+            // Time spent capturing and encoding in the last Replicate().
+            double GetLastEncodeSeconds() const;
+
+            void Destroy();
+        };
+
+        // Receives snapshots of a Replicator, applies them to bound objects and acks them.
+        class ReplicaReader
+        {
+        public:
+            // Apply entity to these objects every snapshot.
+            // drawable: can be null
+            void Bind(uint id, Transform* transform, Drawable* drawable);
+
+            void Unbind(uint id);
+
+            // Same as the replicator.
+            void SetQuantization(float positionStep, float scaleStep);
+
+            // Snapshot with an entity id at or over this is malformed and dropped. Default is 65536.
+            void SetMaxEntities(uint count);
+
+            // Pass every message from the client here. Returns true if it was a snapshot
+            // and was consumed.
+            bool Read(const MsgSpan& msg);
+
+            // Entity is alive in the last snapshot.
+            bool IsAlive(uint id) const;
+
+            // Last applied snapshot, 0 if none.
+            uint GetTick() const;
+
+            void Destroy();
+        };
     }
 
     namespace input
@@ -5,6 +5,9 @@
 
 #define NOTHING
 
+// Define VIVA_MATH_SCALAR to use plain float code instead of SSE in operators.
+// Both paths do the same operations in the same order so results are bit for bit the same.
+
 namespace viva
 {
     namespace math
@@ -43,7 +46,9 @@ namespace viva
             union
             {
                 struct { __m128 r1, r2, r3, r4; };
-                struct { vector v1, v2, v3, v4; };
+#ifdef _MSC_VER
+                struct { vector v1, v2, v3, v4; }; // vector has constructors, only msvc takes it here
+#endif
                 float f[4][4];
             };
 
@@ -58,6 +63,9 @@ namespace viva
             static matrix scale(float x, float y, float z);
             static matrix scale(const vector& v);
             static matrix rotate(float angle);
+            // Same as translate_negy(origin) * scale(scale) * rotate(angle) * translate_negy(position)
+            // but composed directly.
+            static matrix affine2d(const vector& origin, const vector& scale, float angle, const vector& position);
 
             matrix();
             matrix(__m128 a, __m128 b, __m128 c, __m128 d);
@@ -67,6 +75,24 @@ namespace viva
             vector operator * (const vector& a);
         };
 
+        // Reference implementations without SSE.
+        namespace scalar
+        {
+            matrix mul(const matrix& a, const matrix& b);
+            matrix transpose(const matrix& m);
+            vector neg(const vector& v);
+            vector mul(const vector& v, float a);
+        }
+
+        // SSE implementations.
+        namespace simd
+        {
+            matrix mul(const matrix& a, const matrix& b);
+            matrix transpose(const matrix& m);
+            vector neg(const vector& v);
+            vector mul(const vector& v, float a);
+        }
+
         NOTHING vector::vector(float x, float y, float z, float w)
             :x(x),y(y),z(z),w(w)
         {
@@ -138,17 +164,29 @@ namespace viva
 
         NOTHING vector vector::operator - ()
         {
-            return vector(-this->x, -this->y, -this->z, -this->w);
+#ifdef VIVA_MATH_SCALAR
+            return scalar::neg(*this);
+#else
+            return simd::neg(*this);
+#endif
         }
         
         NOTHING vector vector::operator * (float a)
         {
-            return vector(this->x*a, this->y*a, this->z*a, this->w*a);
+#ifdef VIVA_MATH_SCALAR
+            return scalar::mul(*this, a);
+#else
+            return simd::mul(*this, a);
+#endif
         }
 
         NOTHING vector operator * (float a, const vector& v)
         {
-            return vector(v.x*a, v.y*a, v.z*a, v.w*a);
+#ifdef VIVA_MATH_SCALAR
+            return scalar::mul(v, a);
+#else
+            return simd::mul(v, a);
+#endif
         }
         
         NOTHING vector& vector::operator += (const vector& a)
@@ -258,31 +296,38 @@ namespace viva
                 _mm_set_ps(1.f, 0.f, 0.f, 0.f));
         }
 
+        NOTHING matrix matrix::affine2d(const vector& origin, const vector& scale, float angle, const vector& position)
+        {
+            float sine = sinf(angle);
+            float cosine = cosf(angle);
+            // y is negated like in translate_negy
+            float ox = origin.x * scale.x;
+            float oy = -origin.y * scale.y;
+            float oz = origin.z * scale.z;
+
+            return matrix(
+                _mm_set_ps(0.f, 0.f, -(scale.x * sine), scale.x * cosine),
+                _mm_set_ps(0.f, 0.f, scale.y * cosine, scale.y * sine),
+                _mm_set_ps(0.f, scale.z, 0.f, 0.f),
+                _mm_set_ps(1.f, oz + position.z, (-(ox * sine) + oy * cosine) + -position.y, (ox * cosine + oy * sine) + position.x));
+        }
+
         NOTHING matrix matrix::transpose()
-        {            
-            matrix result;
-            result.f[0][0] = this->f[0][0];
-            result.f[0][1] = this->f[1][0];
-            result.f[0][2] = this->f[2][0];
-            result.f[0][3] = this->f[3][0];
-            result.f[1][0] = this->f[0][1];
-            result.f[1][1] = this->f[1][1];
-            result.f[1][2] = this->f[2][1];
-            result.f[1][3] = this->f[3][1];
-            result.f[2][0] = this->f[0][2];
-            result.f[2][1] = this->f[1][2];
-            result.f[2][2] = this->f[2][2];
-            result.f[2][3] = this->f[3][2];
-            result.f[3][0] = this->f[0][3];
-            result.f[3][1] = this->f[1][3];
-            result.f[3][2] = this->f[2][3];
-            result.f[3][3] = this->f[3][3];
-            return result;
+        {
+#ifdef VIVA_MATH_SCALAR
+            return scalar::transpose(*this);
+#else
+            return simd::transpose(*this);
+#endif
         }
         
         NOTHING matrix matrix::operator * (const matrix& a)
         {
-            
+#ifdef VIVA_MATH_SCALAR
+            return scalar::mul(*this, a);
+#else
+            return simd::mul(*this, a);
+#endif
         }
 
         NOTHING vector matrix::operator * (const vector& a)
@@ -297,5 +342,74 @@ namespace viva
             __m128 s3 = _mm_hadd_ps(s1, s2);
             return vector(s3);
         }
+
+        namespace scalar
+        {
+            // row i of result is a.row(i) * b, summed left to right like simd::mul
+            NOTHING matrix mul(const matrix& a, const matrix& b)
+            {
+                matrix result;
+                for (int i = 0; i < 4; i++)
+                    for (int j = 0; j < 4; j++)
+                        result.f[i][j] = ((a.f[i][0] * b.f[0][j] + a.f[i][1] * b.f[1][j]) +
+                            a.f[i][2] * b.f[2][j]) + a.f[i][3] * b.f[3][j];
+                return result;
+            }
+
+            NOTHING matrix transpose(const matrix& m)
+            {
+                matrix result;
+                for (int i = 0; i < 4; i++)
+                    for (int j = 0; j < 4; j++)
+                        result.f[i][j] = m.f[j][i];
+                return result;
+            }
+
+            NOTHING vector neg(const vector& v)
+            {
+                return vector(-v.x, -v.y, -v.z, -v.w);
+            }
+
+            NOTHING vector mul(const vector& v, float a)
+            {
+                return vector(v.x*a, v.y*a, v.z*a, v.w*a);
+            }
+        }
+
+        namespace simd
+        {
+            // broadcast each element of a row of 'a' and accumulate rows of 'b'
+            NOTHING __m128 mul_row(__m128 row, const matrix& b)
+            {
+                __m128 x = _mm_mul_ps(_mm_shuffle_ps(row, row, _MM_SHUFFLE(0, 0, 0, 0)), b.r1);
+                __m128 y = _mm_mul_ps(_mm_shuffle_ps(row, row, _MM_SHUFFLE(1, 1, 1, 1)), b.r2);
+                __m128 z = _mm_mul_ps(_mm_shuffle_ps(row, row, _MM_SHUFFLE(2, 2, 2, 2)), b.r3);
+                __m128 w = _mm_mul_ps(_mm_shuffle_ps(row, row, _MM_SHUFFLE(3, 3, 3, 3)), b.r4);
+                return _mm_add_ps(_mm_add_ps(_mm_add_ps(x, y), z), w);
+            }
+
+            NOTHING matrix mul(const matrix& a, const matrix& b)
+            {
+                return matrix(mul_row(a.r1, b), mul_row(a.r2, b), mul_row(a.r3, b), mul_row(a.r4, b));
+            }
+
+            NOTHING matrix transpose(const matrix& m)
+            {
+                __m128 r1 = m.r1, r2 = m.r2, r3 = m.r3, r4 = m.r4;
+                _MM_TRANSPOSE4_PS(r1, r2, r3, r4);
+                return matrix(r1, r2, r3, r4);
+            }
+
+            NOTHING vector neg(const vector& v)
+            {
+                // flip sign bit, same as unary minus on each float
+                return vector(_mm_xor_ps(v.data, _mm_set1_ps(-0.0f)));
+            }
+
+            NOTHING vector mul(const vector& v, float a)
+            {
+                return vector(_mm_mul_ps(v.data, _mm_set1_ps(a)));
+            }
+        }
     }
 }
\ No newline at end of file
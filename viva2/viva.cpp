@@ -8,6 +8,17 @@
 #include <mutex>
 #include <queue>
 #include <map>
+#include <unordered_map>
+#include <deque>
+#include <list>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#ifdef __cpp_impl_coroutine
+#include <coroutine> // coroutine routines, needs C++20
+#define VIVA_COROUTINES
+#endif
 // headers needed in code
 #include <fstream>
 #include <random>
@@ -18,6 +29,7 @@
 #include "stb_image.h"
 // math library
 #include "math2.h"
+#ifdef _WIN32
 // windows
 #define WIN32_LEAN_AND_MEAN
 #include <Ws2tcpip.h> // winsock
@@ -26,6 +38,99 @@
 #include <d3d11.h> // d3d11
 #include <d3dcompiler.h> // compile shaders
 #include <Xinput.h> // xbox 360/one controller
+#define MSG_NOSIGNAL 0 // winsock doesn't raise SIGPIPE
+#else
+// sockets
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <immintrin.h> // sse, windows.h brings it in on windows
+// d3d handles stay in class layouts, they are always nullptr without d3d
+struct ID3D11BlendState;
+struct IDXGISwapChain;
+struct ID3D11RenderTargetView;
+struct ID3D11Device;
+struct ID3D11DeviceContext;
+struct ID3D11InputLayout;
+struct ID3D11DepthStencilView;
+struct ID3D11Texture2D;
+struct ID3D11RasterizerState;
+struct ID3D11VertexShader;
+struct ID3D11PixelShader;
+struct ID3D11Buffer;
+struct ID3D11SamplerState;
+struct ID3D11ShaderResourceView;
+typedef void* HWND; // there is no native window
+// net code is written against winsock, these are its names for bsd sockets
+typedef int SOCKET;
+typedef unsigned long DWORD;
+typedef unsigned long ULONG;
+typedef unsigned long u_long;
+typedef short SHORT;
+typedef int BOOL;
+typedef pollfd WSAPOLLFD;
+struct WSAData {};
+struct WSABUF { ULONG len; char* buf; };
+#define TRUE 1
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define WSAEINPROGRESS EINPROGRESS
+#define WSAECONNRESET ECONNRESET
+#define WSAECONNREFUSED ECONNREFUSED
+#define WSAEMSGSIZE EMSGSIZE
+#define WSAETIMEDOUT ETIMEDOUT
+#define MAKEWORD(a, b) ((a) | ((b) << 8))
+inline int WSAStartup(int version, WSAData* data) { return 0; }
+inline int WSAGetLastError() { return errno; }
+inline void WSASetLastError(int code) { errno = code; }
+inline int WSAPoll(WSAPOLLFD* fds, ULONG count, int timeoutMs) { return ::poll(fds, (nfds_t)count, timeoutMs); }
+inline int closesocket(SOCKET s) { return ::close(s); }
+inline void SecureZeroMemory(void* dst, size_t size) { memset(dst, 0, size); }
+// only FIONBIO is used
+inline int ioctlsocket(SOCKET s, long cmd, u_long* mode)
+{
+    int flags = ::fcntl(s, F_GETFL, 0);
+    return ::fcntl(s, F_SETFL, *mode ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+// gather send, a closed connection is an error code and not SIGPIPE
+inline int WSASend(SOCKET s, WSABUF* bufs, DWORD count, DWORD* sent, DWORD flags, void* overlapped, void* routine)
+{
+    iovec vecs[1024]; // IOV_MAX
+    count = count < 1024 ? count : 1024;
+    for (DWORD i = 0; i < count; i++)
+    {
+        vecs[i].iov_base = bufs[i].buf;
+        vecs[i].iov_len = bufs[i].len;
+    }
+    msghdr msg = {};
+    msg.msg_iov = vecs;
+    msg.msg_iovlen = count;
+    ssize_t res = ::sendmsg(s, &msg, MSG_NOSIGNAL);
+    if (res < 0)
+        return SOCKET_ERROR;
+    *sent = (DWORD)res;
+    return 0;
+}
+#endif
+#ifdef __linux__
+// epoll network backend
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+// memory mapped files
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+#ifdef _WIN32
 // link libraries
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment (lib, "d3d11.lib")
@@ -33,6 +138,7 @@
 #pragma comment(lib, "Xinput9_1_0.lib")
 // compile as windowed app without changing any settings
 #pragma comment(linker, "/subsystem:windows /ENTRY:mainCRTStartup")
+#endif
 
 namespace viva
 {
@@ -56,6 +162,16 @@ namespace viva
     class Time;
     class Sprite;
     class Text;
+    class Texture;
+    class SpriteBatch;
+    class Transform;
+    class TransformSystem;
+    class JobSystem;
+    class TextureLoader;
+    class Atlas;
+    class Archive;
+    class VertexBuffer;
+    class RenderBackend;
 
     typedef math::vector Vector;
     typedef math::matrix Matrix;
@@ -69,8 +185,13 @@ namespace viva
     namespace net
     {
         class NetworkManager;
+        class Socket;
         class Server;
         class Client;
+        class UdpSocket;
+        class UdpPeer;
+        class Replicator;
+        class ReplicaReader;
     }
 
     namespace ui
@@ -88,6 +209,10 @@ namespace viva
     extern input::Keyboard* keyboard;
     extern RoutineManager* routineManager;
     extern Time* time;
+    extern TransformSystem* transformSystem;
+    extern JobSystem* jobSystem;
+    extern TextureLoader* textureLoader;
+    extern RenderBackend* renderBackend;
     extern net::NetworkManager* networkManager;
     extern ui::UIManager* uiManager;
 
@@ -115,6 +240,12 @@ namespace viva
         ID3D11Buffer* vertexBufferSurface; // shared for surfaces
         ID3D11SamplerState* samplerPoint;
         ID3D11SamplerState* samplerLinear;
+        ID3D11VertexShader* spriteBatchVS; // instanced sprites, world matrix/uv/color come per instance
+        ID3D11InputLayout* layoutSpriteBatch; // per vertex like layout + per instance float4[4] transform, float4 uv, float4 tint
+        PixelShader* spriteBatchPS; // default ps that reads color from instance tint
+        ID3D11Buffer* instanceBuffer; // shared dynamic vb for sprite instances, grows on demand
+        uint instanceBufferCapacity;
+        ID3D11Texture2D* lastFrame; // back buffer copied before Present(), swap chain discards it
     };
 
     extern D3D11 d3d;
@@ -147,6 +278,15 @@ namespace viva
         Screen
     };
 
+    // What draws the frame.
+    enum class RenderBackendType
+    {
+        // Direct3D 11, default
+        D3D11,
+        // CPU rasterizer, doesn't need GPU
+        Software
+    };
+
     namespace input
     {
         // xyz 
@@ -557,26 +697,111 @@ namespace viva
 {
     namespace util
     {
-        // Read file contents to ASCII string.
+        // Read file contents to ASCII string. Line ends are \n like in text mode.
         // filename: path to file
         std::string ReadFileToStringA(const char* filename);
 
-        // Read file to byte vector.
-        // dst: destination vector
+        // Read file to byte vector in one read, size is known up front.
+        // dst: destination vector, file is appended
         void ReadFileToBytes(const char* filename, vector<byte>& dst);
 
-        // Reads image at 'filename' to array of pixels
+        // Reads image at 'filename' to array of pixels. Decoding starts with the first chunk of the file,
+        // next chunks are read on the calling thread as decoder asks for them. Loader threads call this
+        // for many images at once, a reader thread for each would cost more than it saves.
         // It's 3rd party library written in C, that's why raw array is used.
         // fileparth: filename
         // dst: destination. This function creates a pointer to data and has to write it somewhere.
         Size ReadImageToPixels(const char* filename, Color** dst);
 
+        // Decode image file that is already in memory, like ReadImageToPixels().
+        // data: file contents
+        // name: for error message
+        // dst: destination, free() it
+        Size DecodeImageToPixels(const byte* data, size_t size, const char* name, Color** dst);
+
         // Throws exception if hr is erroneous
         // hr: input error code
         // function: name of the function that generated hr
+#ifdef _WIN32
         void Checkhr(HRESULT hr, const char* function);
+#endif
 
+#ifdef _WIN32
         ID3D11Buffer* CreateConstantBuffer(UINT size);
+#endif
+
+        // Read only view of a whole file. Pages are loaded by the OS when they are touched.
+        class MappedFile
+        {
+        private:
+            const byte* data;
+            size_t size;
+#ifdef __linux__
+            int fd;
+#else
+            HANDLE file;
+            HANDLE mapping;
+#endif
+        public:
+            // Throws if file can't be opened.
+            MappedFile(const char* filename);
+
+            MappedFile(const MappedFile&) = delete;
+
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            ~MappedFile();
+
+            // nullptr for empty file
+            const byte* GetData() const;
+
+            size_t GetSize() const;
+        };
+
+        // Reads file from start to end in fixed size chunks. Next chunk is read ahead on another thread
+        // while the caller works on the current one, or by Next() itself without read ahead.
+        class FileStream
+        {
+        private:
+            std::ifstream file;
+            size_t fileSize;
+            size_t chunkSize;
+            bool readAhead;
+            vector<byte> buffers[2];
+            size_t filled[2];
+            bool ready[2]; // filled by reader, not released by the caller yet
+            uint current; // buffer the caller gets next
+            bool handedOut; // caller has 'current'
+            bool finished;
+            bool failed;
+            bool stop;
+            std::mutex lock;
+            std::condition_variable wake;
+            std::thread reader;
+
+            void _ReadLoop();
+        public:
+            // Throws if file can't be opened.
+            // chunkSize: bytes per chunk, last one is shorter
+            // readAhead: read next chunk on another thread, otherwise Next() reads it
+            FileStream(const char* filename, size_t chunkSize, bool readAhead = true);
+
+            FileStream(const FileStream&) = delete;
+
+            FileStream& operator=(const FileStream&) = delete;
+
+            ~FileStream();
+
+            // Get next chunk. Returns its size, 0 at the end of file. Data is valid until the next call.
+            size_t Next(const byte** data);
+
+            size_t GetFileSize() const;
+        };
+
+        // Hand the file to 'fun' chunk by chunk, see FileStream.
+        // chunkSize: bytes per chunk
+        // fun: gets every chunk in order, returns false to stop reading
+        void ReadFileChunks(const char* filename, size_t chunkSize, const std::function<bool(const byte*, size_t)>& fun);
     }
 }
 
@@ -587,37 +812,113 @@ namespace viva
     {
         std::string ReadFileToStringA(const char* filename)
         {
-            std::ifstream file(filename);
+            // binary so size is exact, \r\n is dropped below like text mode does
+            std::ifstream file(filename, std::ios::binary | std::ios::ate);
 
             if (!file)
                 throw viva::Error("ReadFileToString()", "could not open the file");
 
-            return std::string(std::istreambuf_iterator<char>(file),
-                std::istreambuf_iterator<char>());
+            std::string result((size_t)file.tellg(), '\0');
+            file.seekg(0);
+            file.read(&result[0], result.size());
+            result.resize((size_t)file.gcount());
+
+            size_t j = 0;
+            for (size_t i = 0; i < result.size(); i++)
+                if (result[i] != '\r' || i + 1 >= result.size() || result[i + 1] != '\n')
+                    result[j++] = result[i];
+            result.resize(j);
+
+            return result;
         }
 
         void ReadFileToBytes(const char* filename, vector<byte>& dst)
         {
-            std::ifstream file(filename, std::ios::binary);
+            std::ifstream file(filename, std::ios::binary | std::ios::ate);
 
             if (!file)
                 throw viva::Error("ReadFileToString()", "could not open the file");
 
-            byte c;
-            while (!file.eof())
+            size_t start = dst.size();
+            dst.resize(start + (size_t)file.tellg());
+            file.seekg(0);
+            file.read((char*)dst.data() + start, dst.size() - start);
+            dst.resize(start + (size_t)file.gcount());
+        }
+
+        // stb pulls bytes from the stream
+        struct ImageStream
+        {
+            FileStream stream;
+            const byte* data;
+            size_t size;
+            size_t position;
+            bool end;
+
+            static int Read(void* user, char* dst, int count)
             {
-                c = file.get();
-                dst.push_back(c);
+                ImageStream* s = (ImageStream*)user;
+                int total = 0;
+                while (total < count && !s->end)
+                {
+                    if (s->position == s->size)
+                    {
+                        s->size = s->stream.Next(&s->data);
+                        s->position = 0;
+                        s->end = s->size == 0;
+                        continue;
+                    }
+
+                    size_t n = std::min(s->size - s->position, (size_t)(count - total));
+                    memcpy(dst + total, s->data + s->position, n);
+                    s->position += n;
+                    total += (int)n;
+                }
+
+                return total;
             }
-            dst.pop_back();
-        }
+
+            static void Skip(void* user, int count)
+            {
+                ImageStream* s = (ImageStream*)user;
+                while (count > 0 && !s->end)
+                {
+                    if (s->position == s->size)
+                    {
+                        s->size = s->stream.Next(&s->data);
+                        s->position = 0;
+                        s->end = s->size == 0;
+                        continue;
+                    }
+
+                    size_t n = std::min(s->size - s->position, (size_t)count);
+                    s->position += n;
+                    count -= (int)n;
+                }
+            }
+
+            static int Eof(void* user)
+            {
+                ImageStream* s = (ImageStream*)user;
+                if (s->position == s->size && !s->end)
+                {
+                    s->size = s->stream.Next(&s->data);
+                    s->position = 0;
+                    s->end = s->size == 0;
+                }
+
+                return s->end ? 1 : 0;
+            }
+        };
 
         Size ReadImageToPixels(const char* filename, Color** dst)
         {
             int x = -1, y = -1, n = -1;
             const int components = 4; // components means how many elements from 'RGBA'
                                       // you want to return, I want 4 (RGBA) even in not all 4 are present
-            byte* data = stbi_load(filename, &x, &y, &n, components);
+            ImageStream s = { { filename, 64 * 1024, false }, nullptr, 0, 0, false };
+            stbi_io_callbacks callbacks = { ImageStream::Read, ImageStream::Skip, ImageStream::Eof };
+            byte* data = stbi_load_from_callbacks(&callbacks, &s, &x, &y, &n, components);
 
             if (data == nullptr)
             {
@@ -631,6 +932,24 @@ namespace viva
             return{ (float)x,(float)y };
         }
 
+        Size DecodeImageToPixels(const byte* data, size_t size, const char* name, Color** dst)
+        {
+            int x = -1, y = -1, n = -1;
+            byte* pixels = stbi_load_from_memory(data, (int)size, &x, &y, &n, 4);
+
+            if (pixels == nullptr)
+            {
+                std::string msg = "could not load: " + std::string(name) + " reason: ";
+                msg += stbi_failure_reason();
+                throw Error(__FUNCTION__, msg.c_str());
+            }
+
+            *dst = (Color*)pixels;
+
+            return{ (float)x,(float)y };
+        }
+
+#ifdef _WIN32
         void Checkhr(HRESULT hr, const char* function)
         {
             if (hr == 0)
@@ -644,7 +963,237 @@ namespace viva
 
             throw viva::Error(function, message.c_str());
         }
+#endif
+
+#ifdef __linux__
+        MappedFile::MappedFile(const char* filename) : data(nullptr), size(0)
+        {
+            this->fd = open(filename, O_RDONLY);
+            if (this->fd == -1)
+                throw viva::Error(__FUNCTION__, "could not open the file");
+
+            struct stat st;
+            fstat(this->fd, &st);
+            this->size = (size_t)st.st_size;
+
+            if (this->size > 0)
+            {
+                void* view = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+                if (view == MAP_FAILED)
+                {
+                    close(this->fd);
+                    throw viva::Error(__FUNCTION__, "mmap() failed");
+                }
+
+                this->data = (const byte*)view;
+            }
+        }
+
+        MappedFile::~MappedFile()
+        {
+            if (this->data != nullptr)
+                munmap((void*)this->data, this->size);
+
+            close(this->fd);
+        }
+#else
+        MappedFile::MappedFile(const char* filename) : data(nullptr), size(0), mapping(NULL)
+        {
+            this->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL, NULL);
+            if (this->file == INVALID_HANDLE_VALUE)
+                throw viva::Error(__FUNCTION__, "could not open the file");
+
+            LARGE_INTEGER fileSize;
+            GetFileSizeEx(this->file, &fileSize);
+            this->size = (size_t)fileSize.QuadPart;
+
+            // empty file can't be mapped
+            if (this->size > 0)
+            {
+                this->mapping = CreateFileMappingA(this->file, NULL, PAGE_READONLY, 0, 0, NULL);
+                if (this->mapping != NULL)
+                    this->data = (const byte*)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+
+                if (this->data == nullptr)
+                {
+                    if (this->mapping != NULL)
+                        CloseHandle(this->mapping);
+                    CloseHandle(this->file);
+                    throw viva::Error(__FUNCTION__, "could not map the file");
+                }
+            }
+        }
+
+        MappedFile::~MappedFile()
+        {
+            if (this->data != nullptr)
+                UnmapViewOfFile(this->data);
+
+            if (this->mapping != NULL)
+                CloseHandle(this->mapping);
+
+            CloseHandle(this->file);
+        }
+#endif
+
+        const byte* MappedFile::GetData() const
+        {
+            return this->data;
+        }
+
+        size_t MappedFile::GetSize() const
+        {
+            return this->size;
+        }
+
+        FileStream::FileStream(const char* filename, size_t chunkSize, bool readAhead)
+            : file(filename, std::ios::binary | std::ios::ate), chunkSize(chunkSize), readAhead(readAhead), current(0),
+            handedOut(false), finished(false), failed(false), stop(false)
+        {
+            if (!this->file)
+            {
+                std::string msg = "could not open: " + std::string(filename);
+                throw viva::Error(__FUNCTION__, msg.c_str());
+            }
+
+            this->fileSize = (size_t)this->file.tellg();
+            this->file.seekg(0);
+
+            // Next() reads to the first buffer
+            if (!readAhead)
+            {
+                this->buffers[0].resize(chunkSize);
+                return;
+            }
+
+            for (int i = 0; i < 2; i++)
+            {
+                this->buffers[i].resize(chunkSize);
+                this->filled[i] = 0;
+                this->ready[i] = false;
+            }
+
+            // small files are one read, thread would cost more than it saves
+            if (this->fileSize < chunkSize)
+            {
+                this->file.read((char*)this->buffers[0].data(), chunkSize);
+                this->filled[0] = (size_t)this->file.gcount();
+                this->failed = this->file.bad();
+                this->ready[0] = true;
+                this->ready[1] = true;
+                return;
+            }
+
+            this->reader = std::thread(&FileStream::_ReadLoop, this);
+        }
+
+        FileStream::~FileStream()
+        {
+            {
+                std::lock_guard<std::mutex> guard(this->lock);
+                this->stop = true;
+            }
+            this->wake.notify_all();
+
+            if (this->reader.joinable())
+                this->reader.join();
+        }
+
+        void FileStream::_ReadLoop()
+        {
+            uint i = 0;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> guard(this->lock);
+                    this->wake.wait(guard, [this, i] { return this->stop || !this->ready[i]; });
+                    if (this->stop)
+                        return;
+                }
+
+                this->file.read((char*)this->buffers[i].data(), this->chunkSize);
+                size_t n = (size_t)this->file.gcount();
+
+                {
+                    std::lock_guard<std::mutex> guard(this->lock);
+                    this->filled[i] = n;
+                    this->ready[i] = true;
+                    this->failed = this->file.bad();
+                }
+                this->wake.notify_all();
+
+                // empty chunk tells the caller it's the end
+                if (n == 0)
+                    return;
+
+                i ^= 1;
+            }
+        }
+
+        size_t FileStream::Next(const byte** data)
+        {
+            if (!this->readAhead)
+            {
+                if (this->finished)
+                {
+                    *data = nullptr;
+                    return 0;
+                }
+
+                this->file.read((char*)this->buffers[0].data(), this->chunkSize);
+                size_t n = (size_t)this->file.gcount();
+                if (this->file.bad())
+                    throw viva::Error(__FUNCTION__, "could not read the file");
+
+                this->finished = n == 0;
+                *data = this->buffers[0].data();
+                return n;
+            }
+
+            std::unique_lock<std::mutex> guard(this->lock);
+
+            // give the previous chunk back to the reader
+            if (this->handedOut)
+            {
+                this->ready[this->current] = false;
+                this->current ^= 1;
+                this->handedOut = false;
+                this->wake.notify_all();
+            }
+
+            if (this->finished)
+            {
+                *data = nullptr;
+                return 0;
+            }
+
+            this->wake.wait(guard, [this] { return this->ready[this->current]; });
+            if (this->failed)
+                throw viva::Error(__FUNCTION__, "could not read the file");
+
+            this->handedOut = true;
+            this->finished = this->filled[this->current] == 0;
+            *data = this->buffers[this->current].data();
+            return this->filled[this->current];
+        }
 
+        size_t FileStream::GetFileSize() const
+        {
+            return this->fileSize;
+        }
+
+        void ReadFileChunks(const char* filename, size_t chunkSize, const std::function<bool(const byte*, size_t)>& fun)
+        {
+            FileStream stream(filename, chunkSize);
+            const byte* data;
+            size_t size;
+            while ((size = stream.Next(&data)) > 0)
+                if (!fun(data, size))
+                    return;
+        }
+
+#ifdef _WIN32
         ID3D11Buffer* CreateConstantBuffer(UINT size)
         {
             if (size == 0 || size % 16 != 0)
@@ -663,6 +1212,7 @@ namespace viva
 
             return cb;
         }
+#endif
     }
 }
 #pragma endregion
@@ -670,100 +1220,458 @@ namespace viva
 /*@ Object Pool @*/
 namespace viva
 {
+    // Growable pool with stable addresses. Objects live in chunks that are never moved or freed
+    // before the pool is destroyed. Free slots go to a small cache of the calling thread first,
+    // full caches spill half of their slots to a lock-free global free list.
+    // Threads give their caches back to the global list and their cache index to the next thread when they exit.
+    // Alloc() and Free() can be called from any thread.
     template <typename T>
     class ObjectPool
     {
     private:
-        vector<T> pool;
-        vector<T*> freeObjects;
-    public:
-        ObjectPool(int capacity)
+        static const uint MaxChunks = 4096;
+        static const uint MaxThreads = 64; // threads past that go straight to the global list
+        static const uint CacheSize = 32;
+        static const uint Empty = 0xffffffff;
+
+        struct Slot
+        {
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage; // must be first
+            std::atomic<uint> next; // next batch on the global list
+            Slot* cacheNext; // next slot in the cache of a thread or in the batch
+            uint batchCount; // slots in the batch, set in the first slot of a batch on the global list
+            uint index;
+            bool live;
+        };
+
+        // written only by its own thread, one cache line each so threads don't share them
+        struct alignas(64) Cache
+        {
+            Slot* head;
+            uint count;
+            std::atomic<int> live; // allocs - frees on this thread, other threads only read it
+        };
+
+        uint chunkSize;
+        std::atomic<Slot*> chunks[MaxChunks];
+        std::atomic<uint> chunkCount;
+        std::mutex growLock;
+        std::atomic<unsigned long long> freeHead; // batches of free slots, low 32 bits slot index, high 32 bits ABA tag
+        Cache caches[MaxThreads];
+        std::atomic<int> overflowLive; // allocs - frees of threads without cache
+        mutable std::atomic<int> highWaterMark;
+
+        // pools of this type and cache indexes of exited threads
+        struct Registry
+        {
+            std::mutex lock;
+            vector<ObjectPool*> pools;
+            vector<uint> freeIndexes;
+            uint threadCount = 0;
+        };
+
+        // Cache index of a thread, flushes caches of all pools and frees the index when thread exits.
+        struct ThreadGuard
         {
-            pool.resize(capacity);
-            freeObjects.reserve(capacity);
+            uint* index;
+
+            ThreadGuard(uint* index) : index(index)
+            {
+                Registry& registry = _GetRegistry();
+                std::lock_guard<std::mutex> guard(registry.lock);
+
+                if (registry.freeIndexes.size() > 0)
+                {
+                    *index = registry.freeIndexes.back();
+                    registry.freeIndexes.pop_back();
+                }
+                else if (registry.threadCount < MaxThreads)
+                    *index = registry.threadCount++;
+                else
+                    *index = MaxThreads;
+            }
+
+            ~ThreadGuard()
+            {
+                uint self = *this->index;
+                // pool calls from later thread_local destructors go to the global list
+                *this->index = MaxThreads;
+                if (self >= MaxThreads)
+                    return;
+
+                Registry& registry = _GetRegistry();
+                std::lock_guard<std::mutex> guard(registry.lock);
+
+                for (ObjectPool* pool : registry.pools)
+                    pool->_FlushCache(self);
+
+                registry.freeIndexes.push_back(self);
+            }
+        };
 
-            for (int i = 0; i < capacity; i++)
-                freeObjects.push_back(&pool.at(i));
+        static Registry& _GetRegistry()
+        {
+            static Registry registry;
+            return registry;
         }
 
-        T* Alloc()
+        static uint _ThreadIndex()
         {
-            if (freeObjects.size() == 0)
-                return nullptr;
+            // trivial thread_local is read without init check, guard is made once per thread
+            static thread_local uint index = Empty;
+            if (index == Empty)
+            {
+                static thread_local ThreadGuard guard(&index);
+            }
 
-            T* retval = freeObjects.back();
-            freeObjects.pop_back();
-            return retval;
+            return index;
         }
 
-        void Free(T* ptr)
+        // Only the owning thread writes, plain load and store instead of locked add.
+        static void _AddLive(std::atomic<int>& live, int n)
         {
-            freeObjects.push_back(ptr);
+            live.store(live.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
         }
-    };
-}
 
-/*@// Destroyable **********************************************************************************************************@*/
-namespace viva
-{
-    // Tranformable and destroyable.
-    class Destroyable
-    {
-    public:
-        // Remove from all managers and memory.
-        virtual void Destroy() = 0;
-    };
-}
+        int _SumLive() const
+        {
+            int live = this->overflowLive.load(std::memory_order_relaxed);
+            for (uint i = 0; i < MaxThreads; i++)
+                live += this->caches[i].live.load(std::memory_order_relaxed);
 
-#pragma region code
-namespace viva
-{
-}
-#pragma endregion
+            return live;
+        }
 
-/*@// VertexBuffer *************************************************************************************************@*/
-namespace viva
-{
-    class VertexBuffer : public Destroyable
-    {
-    protected:
-        ID3D11Buffer* vertexBuffer;
-        uint vertexCount;
-        bool shared;
-    public:
-        VertexBuffer(ID3D11Buffer* vb, uint vertexCount, bool shared);
+        void _UpdateHighWaterMark() const
+        {
+            int live = this->_SumLive();
+            int high = this->highWaterMark.load(std::memory_order_relaxed);
+            while (live > high && !this->highWaterMark.compare_exchange_weak(high, live, std::memory_order_relaxed));
+        }
 
-        void Destroy();
+        // Move all slots of a cache to the global list as one batch, called by the thread that owns the cache.
+        void _FlushCache(uint self)
+        {
+            Cache& cache = this->caches[self];
+            if (cache.count == 0)
+                return;
 
-        int GetVertexCount() const;
+            this->_PushGlobal(cache.head, cache.count);
+            cache.head = nullptr;
+            cache.count = 0;
+        }
 
-        bool IsShared() const;
+        // Fill empty cache with a batch from the global list, grows the pool if that is empty.
+        void _Refill(Cache& cache)
+        {
+            Slot* batch = this->_PopGlobal();
+            if (batch == nullptr)
+                batch = this->_Grow();
 
-        ID3D11Buffer** GetVB();
-    };
-}
+            cache.head = batch;
+            cache.count = batch->batchCount;
+            this->_UpdateHighWaterMark();
+        }
 
-#pragma region code
-namespace viva
-{
-    VertexBuffer::VertexBuffer(ID3D11Buffer* vb, uint vertexCount, bool shared)
-        : vertexCount(vertexCount), vertexBuffer(vb), shared(shared)
-    {
-    }
+        Slot* _GetSlot(uint index) const
+        {
+            return this->chunks[index / this->chunkSize].load(std::memory_order_acquire) + index % this->chunkSize;
+        }
 
-    int VertexBuffer::GetVertexCount() const
-    {
-        return this->vertexCount;
-    }
+        // Push batch of 'count' slots linked by 'cacheNext' to the global list, one CAS for all of them.
+        void _PushGlobal(Slot* batch, uint count)
+        {
+            batch->batchCount = count;
+            unsigned long long head = this->freeHead.load(std::memory_order_relaxed);
+            unsigned long long newHead;
 
-    bool VertexBuffer::IsShared() const
-    {
-        return this->shared;
-    }
+            do
+            {
+                batch->next.store((uint)head, std::memory_order_relaxed);
+                newHead = ((head >> 32) + 1) << 32 | batch->index;
+            } while (!this->freeHead.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        // Take whole batch, nullptr if the global list is empty.
+        Slot* _PopGlobal()
+        {
+            unsigned long long head = this->freeHead.load(std::memory_order_acquire);
+            unsigned long long newHead;
+
+            do
+            {
+                if ((uint)head == Empty)
+                    return nullptr;
+
+                // batch might be taken by another thread meanwhile, then tag doesn't match and CAS fails
+                uint next = this->_GetSlot((uint)head)->next.load(std::memory_order_relaxed);
+                newHead = ((head >> 32) + 1) << 32 | next;
+            } while (!this->freeHead.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire));
+
+            return this->_GetSlot((uint)head);
+        }
+
+        // Add a chunk and return its first batch, the other batches go to the global list.
+        Slot* _Grow()
+        {
+            std::lock_guard<std::mutex> guard(this->growLock);
+
+            // another thread might have grown the pool while this one was waiting
+            Slot* batch = this->_PopGlobal();
+            if (batch != nullptr)
+                return batch;
+
+            uint chunk = this->chunkCount.load(std::memory_order_relaxed);
+            if (chunk == MaxChunks)
+                throw Error(__FUNCTION__, "Object pool is full");
+
+            Slot* slots = new Slot[this->chunkSize];
+            uint first = chunk * this->chunkSize;
+
+            for (uint i = 0; i < this->chunkSize; i++)
+            {
+                slots[i].index = first + i;
+                slots[i].live = false;
+                slots[i].cacheNext = i + 1 < this->chunkSize ? &slots[i + 1] : nullptr;
+            }
+
+            this->chunks[chunk].store(slots, std::memory_order_release);
+            this->chunkCount.store(chunk + 1, std::memory_order_release);
+
+            // half a cache per batch so a refill doesn't overflow the cache right away
+            uint batchSize = CacheSize / 2;
+            for (uint i = batchSize; i < this->chunkSize; i += batchSize)
+                this->_PushGlobal(&slots[i], std::min(batchSize, this->chunkSize - i));
+
+            slots[0].batchCount = std::min(batchSize, this->chunkSize);
+            return &slots[0];
+        }
+    public:
+        // Ctor.
+        // chunkSize: number of objects added every time pool runs out of free objects
+        ObjectPool(uint chunkSize) : chunkSize(chunkSize > 0 ? chunkSize : 1), chunkCount(0), freeHead(Empty),
+            overflowLive(0), highWaterMark(0)
+        {
+            for (uint i = 0; i < MaxChunks; i++)
+                this->chunks[i].store(nullptr, std::memory_order_relaxed);
+
+            for (uint i = 0; i < MaxThreads; i++)
+            {
+                this->caches[i].head = nullptr;
+                this->caches[i].count = 0;
+                this->caches[i].live.store(0, std::memory_order_relaxed);
+            }
+
+            Registry& registry = _GetRegistry();
+            std::lock_guard<std::mutex> guard(registry.lock);
+            registry.pools.push_back(this);
+        }
+
+        ObjectPool(const ObjectPool&) = delete;
+        ObjectPool& operator=(const ObjectPool&) = delete;
+
+        // Destroys objects that were not freed.
+        ~ObjectPool()
+        {
+            {
+                Registry& registry = _GetRegistry();
+                std::lock_guard<std::mutex> guard(registry.lock);
+                registry.pools.erase(std::find(registry.pools.begin(), registry.pools.end(), this));
+            }
+
+            uint count = this->chunkCount.load();
+
+            for (uint c = 0; c < count; c++)
+            {
+                Slot* slots = this->chunks[c].load();
+
+                for (uint i = 0; i < this->chunkSize; i++)
+                    if (slots[i].live)
+                        reinterpret_cast<T*>(&slots[i].storage)->~T();
+
+                delete[] slots;
+            }
+        }
+
+        // Get new object. Never returns nullptr, pool grows when it runs out of objects.
+        // args: passed to T's constructor
+        template <typename... Args>
+        T* Alloc(Args&&... args)
+        {
+            uint self = _ThreadIndex();
+            Slot* slot;
+
+            if (self < MaxThreads)
+            {
+                Cache& cache = this->caches[self];
+                if (cache.count == 0)
+                    this->_Refill(cache);
+
+                slot = cache.head;
+                cache.head = slot->cacheNext;
+                cache.count--;
+                _AddLive(cache.live, 1);
+            }
+            else
+            {
+                slot = this->_PopGlobal();
+                if (slot == nullptr)
+                    slot = this->_Grow();
+
+                // rest of the batch goes back
+                if (slot->batchCount > 1)
+                    this->_PushGlobal(slot->cacheNext, slot->batchCount - 1);
+
+                this->overflowLive.fetch_add(1, std::memory_order_relaxed);
+                this->_UpdateHighWaterMark();
+            }
+
+            T* object = new (&slot->storage) T(std::forward<Args>(args)...);
+            slot->live = true;
+
+            return object;
+        }
+
+        // Destroy object and return it to the pool.
+        // ptr: object returned by Alloc() of this pool
+        void Free(T* ptr)
+        {
+            Slot* slot = reinterpret_cast<Slot*>(ptr);
+            ptr->~T();
+            slot->live = false;
+
+            uint self = _ThreadIndex();
+
+            if (self >= MaxThreads)
+            {
+                this->overflowLive.fetch_sub(1, std::memory_order_relaxed);
+                this->_PushGlobal(slot, 1);
+                return;
+            }
+
+            Cache& cache = this->caches[self];
+            _AddLive(cache.live, -1);
+            slot->cacheNext = cache.head;
+            cache.head = slot;
+            cache.count++;
+
+            if (cache.count < CacheSize)
+                return;
+
+            // move half of the cache to the global list
+            Slot* first = cache.head;
+            Slot* last = first;
+            for (uint i = 1; i < CacheSize / 2; i++)
+                last = last->cacheNext;
+
+            cache.head = last->cacheNext;
+            cache.count -= CacheSize / 2;
+            this->_PushGlobal(first, CacheSize / 2);
+        }
+
+        // Number of objects allocated and not freed.
+        int GetLiveCount() const
+        {
+            return this->_SumLive();
+        }
+
+        // Highest live count since the pool was created. Sampled whenever a thread cache refills
+        // from the global list and here, so it can miss a peak by a few cached objects per thread.
+        int GetHighWaterMark() const
+        {
+            this->_UpdateHighWaterMark();
+            return this->highWaterMark.load(std::memory_order_relaxed);
+        }
+
+        // Number of objects the pool can hold without growing.
+        uint GetCapacity() const
+        {
+            return this->chunkCount.load() * this->chunkSize;
+        }
+    };
+}
+
+/*@// Destroyable **********************************************************************************************************@*/
+namespace viva
+{
+    // Tranformable and destroyable.
+    class Destroyable
+    {
+    public:
+        // Remove from all managers and memory.
+        virtual void Destroy() = 0;
+    };
+}
+
+#pragma region code
+namespace viva
+{
+}
+#pragma endregion
+
+/*@// VertexBuffer *************************************************************************************************@*/
+namespace viva
+{
+    class VertexBuffer : public Destroyable
+    {
+    protected:
+        ID3D11Buffer* vertexBuffer;
+        vector<Vertex> vertices; // software backend reads vertices from here
+        uint vertexCount;
+        bool shared;
+    public:
+        VertexBuffer(ID3D11Buffer* vb, uint vertexCount, bool shared);
+
+        // Vertex buffer in system memory.
+        VertexBuffer(const vector<Vertex>& vertices, bool shared);
+
+        void Destroy();
+
+        int GetVertexCount() const;
+
+        bool IsShared() const;
+
+        ID3D11Buffer** GetVB();
+
+        const vector<Vertex>& _GetVertices() const;
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    VertexBuffer::VertexBuffer(ID3D11Buffer* vb, uint vertexCount, bool shared)
+        : vertexCount(vertexCount), vertexBuffer(vb), shared(shared)
+    {
+    }
+
+    VertexBuffer::VertexBuffer(const vector<Vertex>& vertices, bool shared)
+        : vertexCount((uint)vertices.size()), vertexBuffer(nullptr), vertices(vertices), shared(shared)
+    {
+    }
+
+    const vector<Vertex>& VertexBuffer::_GetVertices() const
+    {
+        return this->vertices;
+    }
+
+    int VertexBuffer::GetVertexCount() const
+    {
+        return this->vertexCount;
+    }
+
+    bool VertexBuffer::IsShared() const
+    {
+        return this->shared;
+    }
 
     void VertexBuffer::Destroy()
     {
-        this->vertexBuffer->Release();
+#ifdef _WIN32
+        if (this->vertexBuffer != nullptr)
+            this->vertexBuffer->Release();
+#endif
+
         delete this;
     }
 
@@ -774,6 +1682,74 @@ namespace viva
 }
 #pragma endregion
 
+/*@// RenderBackend ************************************************************************************************@*/
+namespace viva
+{
+    // Everything that talks to the GPU (or pretends to). Engine creates one at startup.
+    // Drawables only say what to draw: matrix, uv, color, texture. Backend decides how.
+    class RenderBackend
+    {
+    public:
+        virtual ~RenderBackend() {}
+
+        // Which backend this is.
+        virtual RenderBackendType GetType() const = 0;
+
+        // Copy back buffer of the last frame. Rows go from the top, rgba.
+        // dst: resized to client width * height
+        virtual void ReadBackBuffer(vector<Color>& dst) = 0;
+
+        virtual Texture* _CreateTexture(const Color* pixels, const Size& size) = 0;
+
+        // Surface the size of the client area. Pixel shader is not set.
+        virtual Surface* _CreateSurface() = 0;
+
+        virtual PixelShader* _CreatePixelShader(const char* str) = 0;
+
+        // Pixel shader from compiled ps_5_0 bytecode, see AssetCooker.
+        virtual PixelShader* _CreatePixelShader(const byte* bytecode, size_t size) = 0;
+
+        virtual VertexBuffer* _CreateVertexBuffer(const vector<Vertex>& vertices, bool shared) = 0;
+
+        virtual void _ResizeExtraPSBuffer(uint size) = 0;
+
+        // Start drawing on a surface. Clears it and depth.
+        virtual void _BeginSurface(Surface* surface) = 0;
+
+        // Draw unit quad (0,0)-(1,1), the sprite.
+        // wvp: world view proj
+        // uv: final uv
+        // extraBufferPSdata: data for extra ps buffer, can be nullptr
+        virtual void _DrawQuad(const Matrix& wvp, const Rect& uv, const Color& color, Texture* texture,
+            PixelShader* ps, void* extraBufferPSdata) = 0;
+
+        // Draw triangle list. Texture coordinates are used as they are.
+        virtual void _DrawTriangles(const Matrix& wvp, VertexBuffer* vb, const Color& color, Texture* texture,
+            PixelShader* ps) = 0;
+
+        virtual void _DrawLineStrip(const Matrix& wvp, VertexBuffer* vb, const Color& color, PixelShader* ps) = 0;
+
+        // Draw instances of the batch, after End().
+        virtual void _DrawSpriteBatch(const SpriteBatch* batch) = 0;
+
+        // Done drawing on a surface.
+        virtual void _EndSurface(Surface* surface) = 0;
+
+        // Clear back buffer before surfaces are drawn on it.
+        virtual void _BeginFrame(const Color& background) = 0;
+
+        // Draw surface on the back buffer with its pixel shader.
+        virtual void _DrawSurface(Surface* surface) = 0;
+
+        virtual void _Present() = 0;
+
+        virtual void _Destroy() = 0;
+
+        // Create backend of given type. Defined after the backends.
+        static RenderBackend* _Create(RenderBackendType type, const Size& size);
+    };
+}
+
     /*@// Engine *******************************************************************************************************@*/
 namespace viva
 {
@@ -788,7 +1764,8 @@ namespace viva
         // Ctor.
         // path: used to load some resources
         // size: viewport size
-        Engine(const Size& size);
+        // backend: what draws the frame
+        Engine(const Size& size, RenderBackendType backend);
 
         void _Activity();
         
@@ -803,6 +1780,13 @@ namespace viva
 
         void GetScreenshot(vector<Color>& dst) const;
 
+        // Which backend draws the frame.
+        RenderBackendType GetRenderBackendType() const;
+
+        // Copy what the last frame drew. Unlike GetScreenshot it doesn't read the screen so window can be covered.
+        // dst: client width * height pixels, rows from the top
+        void ReadBackBuffer(vector<Color>& dst) const;
+
         // Get background color. Background color is the color being drawn if there's nothing there.
         const Color& GetBackgroundColor() const;
 
@@ -827,290 +1811,46 @@ namespace viva
 #pragma region code
 namespace viva
 {
-    Engine::Engine(const Size& size)
+    Engine::Engine(const Size& size, RenderBackendType backend)
         : backgroundColor(0, 64, 128, 1), clientSize(size), frame(0)
     {
-        HRESULT hr = 0;
+        renderBackend = RenderBackend::_Create(backend, size);
+    }
 
-        const char* strPixelShader = "cbuffer cbBufferPS {float4 color;};"
-            "Texture2D ObjTexture;"
-            "SamplerState ObjSamplerState;"
-            "struct VS_OUTPUT { float4 Pos:SV_POSITION; float3 Col:COLOR; float2 TexCoord:TEXCOORD; };"
-            "float4 main(VS_OUTPUT input):SV_TARGET{"
-            "if(input.Col.r == 0){"
-            "float4 result = ObjTexture.Sample(ObjSamplerState,input.TexCoord);"
-            "clip(result.a-0.001f);"
-            "return result*color;"
-            "return result;"
-            "}"
-            "else{"
-            "return color;"
-            "}"
-            "}";
+    void Engine::_Activity()
+    {
+        this->frame++;
 
-        const char* strVertexShader = "cbuffer cbBufferVS { float4x4 transformation; };"
-            "cbuffer cbBufferUV { float4 uv; };"
-            "struct VS_OUTPUT { float4 Pos:SV_POSITION; float3 Col:COLOR; float2 TexCoord:TEXCOORD; };"
-            "VS_OUTPUT main(float4 inPos:POSITION, float3 inCol:COLOR, float2 inTexCoord:TEXCOORD){"
-            "VS_OUTPUT output;"
-            "output.Pos = mul(inPos, transformation);"
-            "output.Col = inCol;"
-            "output.TexCoord = inTexCoord;"
-            "if(inTexCoord[0] == 0 && inTexCoord[1] == 0) output.TexCoord = float2(uv[0], 1 - uv[1]);"
-            "if(inTexCoord[0] == 1 && inTexCoord[1] == 0) output.TexCoord = float2(uv[2], 1 - uv[1]);"
-            "if(inTexCoord[0] == 0 && inTexCoord[1] == 1) output.TexCoord = float2(uv[0], 1 - uv[3]);"
-            "if(inTexCoord[0] == 1 && inTexCoord[1] == 1) output.TexCoord = float2(uv[2], 1 - uv[3]);"
-            "return output;}";
+        // time
+        time->_Activity();
 
-        const char* strPostShader = "cbuffer cbBufferPS{};"
-            "Texture2D ObjTexture;"
-            "SamplerState ObjSamplerState;"
-            "struct VS_OUTPUT { float4 Pos:SV_POSITION; float3 Col:COLOR; float2 TexCoord:TEXCOORD; };"
-            "float4 main(VS_OUTPUT input):SV_TARGET{"
-            "float4 result = ObjTexture.Sample(ObjSamplerState, input.TexCoord);"
-            "clip(result.a-0.001f);"
-            "return result;}";
+        // move everything in one pass
+        transformSystem->_Activity();
 
-        //    DEVICE, DEVICE CONTEXT AND SWAP CHAIN    ////
-        DXGI_SWAP_CHAIN_DESC scd;
-        ZeroMemory(&scd, sizeof(DXGI_SWAP_CHAIN_DESC));
-        scd.BufferCount = 1;                                    // one back buffer
-        scd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;     // use 32-bit color
-        scd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;      // how swap chain is to be used
-        scd.OutputWindow = (HWND)window->GetHandle();     // the window to be used
-        scd.SampleDesc.Quality = 0;
-        scd.SampleDesc.Count = 1;                               // no anti aliasing
-        scd.Windowed = TRUE;                                    // windowed/full-screen mode
-                                                                //scd.Flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;   // alternative fullscreen mode
+        // camear
+        camera->_Activity();
 
-        hr = D3D11CreateDeviceAndSwapChain(NULL,
-            D3D_DRIVER_TYPE_HARDWARE, NULL, NULL, NULL, NULL,
-            D3D11_SDK_VERSION, &scd, &d3d.swapChain, &d3d.device, NULL,
-            &d3d.context);
-        util::Checkhr(hr, "D3D11CreateDeviceAndSwapChain()");
+        // textures that finished decoding
+        textureLoader->_Activity();
 
-        ////    BACK BUFFER AS RENDER TARGET, DEPTH STENCIL   ////
-        ID3D11Texture2D* buf;
-        d3d.swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (LPVOID*)&buf);
-        // use the back buffer address to create the render target
-        hr = d3d.device->CreateRenderTargetView(buf, NULL, &d3d.backBuffer);
-        util::Checkhr(hr, "CreateRenderTargetView()");
-        buf->Release();
+        // events
+        routineManager->_Activity();
 
-        D3D11_TEXTURE2D_DESC depthStencilDesc;
-        depthStencilDesc.Width = (UINT)clientSize.width;
-        depthStencilDesc.Height = (UINT)clientSize.height;
-        depthStencilDesc.MipLevels = 1;
-        depthStencilDesc.ArraySize = 1;
-        depthStencilDesc.Format = DXGI_FORMAT_D24_UNORM_S8_UINT;
-        depthStencilDesc.SampleDesc.Count = 1; // ANTIALIASING, increase to 2
-        depthStencilDesc.SampleDesc.Quality = 0;
-        depthStencilDesc.Usage = D3D11_USAGE_DEFAULT;
-        depthStencilDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
-        depthStencilDesc.CPUAccessFlags = 0;
-        depthStencilDesc.MiscFlags = 0;
-
-        hr = d3d.device->CreateTexture2D(&depthStencilDesc, NULL, &d3d.depthStencilBuffer);
-        util::Checkhr(hr, "CreateTexture2D() for depthStencilDesc");
-        hr = d3d.device->CreateDepthStencilView(d3d.depthStencilBuffer, NULL, &d3d.depthStencil);
-        util::Checkhr(hr, "CreateDepthStencilView()");
-
-        ////   VIEWPORT    ////
-        // Set the viewport
-        D3D11_VIEWPORT viewport;
-        ZeroMemory(&viewport, sizeof(D3D11_VIEWPORT));
-        viewport.TopLeftX = 0;
-        viewport.TopLeftY = 0;
-        viewport.Width = (float)clientSize.width;
-        viewport.Height = (float)clientSize.height;
-        viewport.MinDepth = 0.0f;
-        viewport.MaxDepth = 1.0f;
-        d3d.context->RSSetViewports(1, &viewport);
-
-        ////    VS   ////
-        ID3D10Blob *vs; //release vs after CreateInputLayout()
-                        //alternative to loading shader from cso file
-        hr = D3DCompile(strVertexShader, strlen(strVertexShader), 0, 0, 0, "main", "vs_5_0", D3DCOMPILE_DEBUG, 0, &vs, 0);
-        util::Checkhr(hr, "D3DCompile() vs");
-        hr = d3d.device->CreateVertexShader(vs->GetBufferPointer(), vs->GetBufferSize(), 0,
-            &d3d.defaultVS);
-        util::Checkhr(hr, "CreateVertexShader()");
-        d3d.context->VSSetShader(d3d.defaultVS, 0, 0);
-        // TODO: why is this here ?
-        util::Checkhr(hr, "CreateVertexShader()");
-
-        //    INPUT LAYOUT    ////
-        D3D11_INPUT_ELEMENT_DESC ied[] =
-        {
-            { "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT,
-            0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
-            { "COLOR", 0, DXGI_FORMAT_R32G32B32_FLOAT,
-            0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
-            { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,
-            0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
-            //if you need to pass something on your own to PS or VS per vertex
-            //{ "SOME_MORE_DATA", 0, DXGI_FORMAT_R32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 }
-        };
-        hr = d3d.device->CreateInputLayout(ied, 3, vs->GetBufferPointer(), vs->GetBufferSize(),
-            &d3d.layout);
-        util::Checkhr(hr, "CreateInputLayout()");
-        vs->Release();
-        d3d.context->IASetInputLayout(d3d.layout);
-
-        ///    BLEND STATE    ////
-        D3D11_BLEND_DESC blendDesc;
-        ZeroMemory(&blendDesc, sizeof(blendDesc));
-        D3D11_RENDER_TARGET_BLEND_DESC rtbd;
-        ZeroMemory(&rtbd, sizeof(rtbd));
-        rtbd.BlendEnable = true;
-        rtbd.SrcBlend = D3D11_BLEND_SRC_ALPHA;
-        rtbd.DestBlend = D3D11_BLEND_INV_SRC_ALPHA;
-        rtbd.BlendOp = D3D11_BLEND_OP_ADD;
-        rtbd.SrcBlendAlpha = D3D11_BLEND_INV_DEST_ALPHA;// D3D11_BLEND_ONE;
-        rtbd.DestBlendAlpha = D3D11_BLEND_ONE;//D3D11_BLEND_ZERO;
-        rtbd.BlendOpAlpha = D3D11_BLEND_OP_ADD;
-        rtbd.RenderTargetWriteMask = D3D10_COLOR_WRITE_ENABLE_ALL;
-        blendDesc.AlphaToCoverageEnable = false;
-        blendDesc.RenderTarget[0] = rtbd;
-        hr = d3d.device->CreateBlendState(&blendDesc, &d3d.blendState);
-        util::Checkhr(hr, "CreateBlendState()");
-
-        ////    RASTERIZERS     ////
-        D3D11_RASTERIZER_DESC rd;
-        ZeroMemory(&rd, sizeof(rd));
-        rd.FillMode = D3D11_FILL_WIREFRAME;
-        rd.CullMode = D3D11_CULL_NONE;
-        hr = d3d.device->CreateRasterizerState(&rd, &d3d.rsWire);
-        util::Checkhr(hr, "CreateRasterizerState()");
-        rd.FillMode = D3D11_FILL_SOLID;
-        rd.CullMode = D3D11_CULL_FRONT;
-        //rd.AntialiasedLineEnable = true; // ANTIALIASING
-        //rd.MultisampleEnable = true; // ANTIALIASING
-        hr = d3d.device->CreateRasterizerState(&rd, &d3d.rsSolid);
-        util::Checkhr(hr, "CreateRasterizerState()");
-
-        ////    SAMPLERS    //////
-        D3D11_SAMPLER_DESC sampDesc;
-        ZeroMemory(&sampDesc, sizeof(sampDesc));
-        sampDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_POINT;
-        sampDesc.AddressU = D3D11_TEXTURE_ADDRESS_WRAP;
-        sampDesc.AddressV = D3D11_TEXTURE_ADDRESS_WRAP;
-        sampDesc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
-        sampDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
-        sampDesc.MinLOD = 0;
-        sampDesc.MaxLOD = D3D11_FLOAT32_MAX;
-        d3d.device->CreateSamplerState(&sampDesc, &d3d.samplerPoint);
-        sampDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
-        d3d.device->CreateSamplerState(&sampDesc, &d3d.samplerLinear);
-
-        //// SO FAR ONLY INDEX BUFFER ////
-        vector<int> indices({ 0, 1, 2, 0, 2, 3, });
-
-        D3D11_BUFFER_DESC indexBufferDesc;
-        ZeroMemory(&indexBufferDesc, sizeof(indexBufferDesc));
-        indexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
-        indexBufferDesc.ByteWidth = sizeof(int) * (UINT)indices.size();
-        indexBufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-        indexBufferDesc.CPUAccessFlags = 0;
-        indexBufferDesc.MiscFlags = 0;
-
-        D3D11_SUBRESOURCE_DATA srd;
-        srd.pSysMem = indices.data();
-        d3d.device->CreateBuffer(&indexBufferDesc, &srd, &d3d.indexBuffer);
-        d3d.context->IASetIndexBuffer(d3d.indexBuffer, DXGI_FORMAT_R32_UINT, 0);
-        
-        //////   PS    ///////
-        d3d.defaultPS = creator->CreatePixelShader(strPixelShader);
-        d3d.defaultPost = creator->CreatePixelShader(strPostShader);
-
-        /////// CONSTANT BUFFERS ///////
-        d3d.constantBufferVS = util::CreateConstantBuffer(sizeof(Matrix));
-        d3d.context->VSSetConstantBuffers(0, 1, &d3d.constantBufferVS);
-
-        d3d.constantBufferUV = util::CreateConstantBuffer(sizeof(Rect));
-        d3d.context->VSSetConstantBuffers(1, 1, &d3d.constantBufferUV);
-
-        d3d.constantBufferPS = util::CreateConstantBuffer(16);
-        d3d.context->PSSetConstantBuffers(0, 1, &d3d.constantBufferPS);
-
-        // NOTES
-        // there's one extra buffer for the entire project
-        // it meamns it might be updated for every many objects
-        // it's fine because if object had separated buffers, they all would be updated
-        // one optimization might be to have a separate buffer if it has a lot of data that is not updated frequently
-        d3d.constantBufferPSExtra = util::CreateConstantBuffer(16);
-        d3d.context->PSSetConstantBuffers(1, 1, &d3d.constantBufferPSExtra);
-
-        /////// SQUARE VERTEX BUFFER //////
-        vector<Vertex> verticesSprite({
-            Vertex(0, 0, 0, 0, 0, 0, 0, 1),
-            Vertex(1, 0, 0, 0, 0, 0, 1, 1),
-            Vertex(1, 1, 0, 0, 0, 0, 1, 0),
-            Vertex(0, 1, 0, 0, 0, 0, 0, 0) });
-
-        vector<Vertex> verticesSurface({
-            Vertex(-1, -1, 0, 0, 0, 0, 0, 1),
-            Vertex(1, -1, 0, 0, 0, 0, 1, 1),
-            Vertex(1, 1, 0, 0, 0, 0, 1, 0),
-            Vertex(-1, 1, 0, 0, 0, 0, 0, 0) });
-
-        D3D11_BUFFER_DESC vertexBufferDesc;
-        ZeroMemory(&vertexBufferDesc, sizeof(vertexBufferDesc));
-        vertexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
-        vertexBufferDesc.ByteWidth = sizeof(Vertex) * 4;
-        vertexBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-        vertexBufferDesc.CPUAccessFlags = 0;
-        vertexBufferDesc.MiscFlags = 0;
-
-        D3D11_SUBRESOURCE_DATA vertexBufferData;
-        ZeroMemory(&vertexBufferData, sizeof(vertexBufferData));
-        vertexBufferData.pSysMem = verticesSprite.data();
-        d3d.device->CreateBuffer(&vertexBufferDesc, &vertexBufferData, &d3d.vertexBuffer);
-
-        vertexBufferData.pSysMem = verticesSurface.data();
-        d3d.device->CreateBuffer(&vertexBufferDesc, &vertexBufferData, &d3d.vertexBufferSurface);
-    }
-
-    void Engine::_Activity()
-    {
-        this->frame++;
-
-        // camear
-        camera->_Activity();
-
-        // time
-        time->_Activity();
-
-        // events
-        routineManager->_Activity();
+        // network
+        networkManager->_Activity();
 
         // input
         mouse->_Activity();
         keyboard->_Activity();
 
+        // matrices for everything that changed, drawing only reads them
+        transformSystem->ResolveAll();
+
         // render
         drawManager->_DrawNodes();
-
-        // this snippet is here because
-        // also this is common for all render targets, I need to set this up only once
-        float col[4] = { this->backgroundColor.r / 255.0f,this->backgroundColor.g / 255.0f,this->backgroundColor.b / 255.0f,this->backgroundColor.a / 255.0f };
-        d3d.context->ClearRenderTargetView(d3d.backBuffer, col);
-        d3d.context->ClearDepthStencilView(d3d.depthStencil, D3D11_CLEAR_DEPTH | D3D11_CLEAR_STENCIL, 1.0f, 0);
-        d3d.context->OMSetRenderTargets(1, &d3d.backBuffer, d3d.depthStencil);
-        d3d.context->RSSetState(d3d.rsSolid);
-        d3d.context->PSSetSamplers(0, 1, &d3d.samplerPoint);
-        UINT stride = sizeof(Vertex);
-        UINT offset = 0;
-        d3d.context->IASetVertexBuffers(0, 1, &d3d.vertexBufferSurface, &stride, &offset);
-        d3d.context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-        float identityMatrix[] = { 1,0,0,0,0,1,0,0,0,0,1,0,0,0,0,1 };
-        Rect surfaceuv(0, 0, 1, 1);
-        d3d.context->UpdateSubresource(d3d.constantBufferUV, 0, 0, &surfaceuv, 0, 0);
-        d3d.context->UpdateSubresource(d3d.constantBufferVS, 0, NULL, identityMatrix, 0, 0);
-        
+        renderBackend->_BeginFrame(this->backgroundColor);
         drawManager->_DrawSurfaces();
-
-        d3d.swapChain->Present(0, 0);
+        renderBackend->_Present();
     }
 
     long long Engine::GetFrame() const
@@ -1118,6 +1858,16 @@ namespace viva
         return this->frame;
     }
 
+    RenderBackendType Engine::GetRenderBackendType() const
+    {
+        return renderBackend->GetType();
+    }
+
+    void Engine::ReadBackBuffer(vector<Color>& dst) const
+    {
+        renderBackend->ReadBackBuffer(dst);
+    }
+
     // Get background color. Background color is the color being drawn if there's nothing there.
     const Color& Engine::GetBackgroundColor() const
     {
@@ -1139,6 +1889,7 @@ namespace viva
 
     void Engine::GetScreenshot(vector<Color>& dst) const
     {
+#ifdef _WIN32
         RECT r;
         GetClientRect(window->GetHandle(), &r);
         POINT p = { 0,0 };
@@ -1154,55 +1905,43 @@ namespace viva
         SelectObject(captureDC, bmp);
         BitBlt(captureDC, 0, 0, w, h, desktopDC, p.x, p.y, SRCCOPY);
         GetBitmapBits(bmp, w*h * 4, dst.data());
+#else
+        // no desktop to capture, client area is the back buffer
+        renderBackend->ReadBackBuffer(dst);
+#endif
     }
 
     void Engine::_Destroy()
     {
-        // destroy objects
-        d3d.defaultPS->Destroy();
-        d3d.defaultPost->Destroy();
-
-        // release interfaces
-        d3d.constantBufferPS->Release();
-        d3d.constantBufferPSExtra->Release();
-        d3d.constantBufferUV->Release();
-        d3d.constantBufferVS->Release();
-        d3d.vertexBuffer->Release();
-        d3d.vertexBufferSurface->Release();
-        d3d.samplerLinear->Release();
-        d3d.samplerPoint->Release();
-        d3d.indexBuffer->Release();
-        d3d.blendState->Release();
-        d3d.rsSolid->Release();
-        d3d.rsWire->Release();
-        d3d.layout->Release();
-        d3d.defaultVS->Release();
-        d3d.depthStencilBuffer->Release();
-        d3d.depthStencil->Release();
-        d3d.backBuffer->Release();
-        d3d.swapChain->Release();
-        d3d.context->Release();
-        d3d.device->Release();
-
+        renderBackend->_Destroy();
+        renderBackend = nullptr;
         delete this;
     }
 
     void Engine::OpenConsole()
     {
+#ifdef _WIN32
         ::AllocConsole();
         ::SetConsoleTitle("Console");
         ::freopen("CONOUT$", "w", stdout);
         ::freopen("CONIN$", "r", stdin);
+#endif
     }
 
     void Engine::CloseConsole()
     {
+#ifdef _WIN32
         ::FreeConsole();
+#endif
     }
 
     void Engine::Exit()
     {
+#ifdef _WIN32
         ::PostMessage(window->GetHandle(), WM_CLOSE, (int)CloseReason::EngineClose, 0);
+#else
+        window->_Close(CloseReason::EngineClose);
+#endif
     }
 
     CloseReason Engine::Run(const std::function<void()>& gameloop)
@@ -1246,24 +1985,35 @@ namespace viva
 {
     Time::Time() : gameTime(0), frameTime(0)
     {
+#ifdef _WIN32
         LARGE_INTEGER li;
         if (!::QueryPerformanceFrequency(&li))
             throw Error(__FUNCTION__, "QueryPerformanceFrequency() failed");
         this->frequency = double(li.QuadPart);
         ::QueryPerformanceCounter(&li);
         this->startTime = li.QuadPart;
+#else
+        typedef std::chrono::steady_clock clock;
+        this->frequency = double(clock::period::den) / double(clock::period::num);
+        this->startTime = (long long)clock::now().time_since_epoch().count();
+#endif
         this->prevFrameTime = startTime;
     }
 
     void Time::_Activity()
     {
-        LARGE_INTEGER currentTime;
-        long long frameTickCount;
-        ::QueryPerformanceCounter(&currentTime);
-        frameTickCount = currentTime.QuadPart - this->prevFrameTime;
+        long long currentTime;
+#ifdef _WIN32
+        LARGE_INTEGER li;
+        ::QueryPerformanceCounter(&li);
+        currentTime = li.QuadPart;
+#else
+        currentTime = (long long)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+        long long frameTickCount = currentTime - this->prevFrameTime;
         this->frameTime = double(frameTickCount) / this->frequency;
-        this->prevFrameTime = currentTime.QuadPart;
-        this->gameTime = double(currentTime.QuadPart - this->startTime) / this->frequency;
+        this->prevFrameTime = currentTime;
+        this->gameTime = double(currentTime - this->startTime) / this->frequency;
     }
 
     double Time::GetGameTime() const
@@ -1289,3486 +2039,12107 @@ namespace viva
 }
 #pragma endregion
 
-    /*@// Transform ****************************************************************************************************@*/
+    /*@// JobSystem ****************************************************************************************************@*/
 namespace viva
 {
-    // Transform object responsible for position, rotation, scale etc. of its owner.
-    class Transform
+    // Pool of worker threads with one job queue per thread. Threads take jobs from the back of
+    // their own queue and steal from the front of other queues when theirs is empty.
+    class JobSystem
     {
     private:
-        Transform* parent;
-        vector<Transform*> children;
-        uint index; // index in parents collection
-        TransformMode mode;
+        struct WorkQueue
+        {
+            std::deque<std::function<void()>> jobs;
+            std::mutex lock;
+        };
 
-        Vector origin;
-        Vector position;
-        float rotation;
-        Vector scale;
-        float size;
+        // Jobs of one ParallelFor() call.
+        struct Batch
+        {
+            std::atomic<int> pending; // jobs not finished yet
+            std::mutex errorLock;
+            std::exception_ptr error; // first exception thrown by a job
+        };
 
-        Vector velocity;
-        float angularVelocity;
-        Vector scaleVelocity;
-        float sizeVelocity;
+        vector<std::thread> threads;
+        vector<WorkQueue*> queues; // 0 belongs to threads that are not workers
+        std::atomic<int> queued; // jobs waiting in queues
+        std::mutex wakeLock;
+        std::condition_variable wake;
+        bool stop;
 
-        Vector acceleration;
-        float angularAcceleration;
-        Vector scaleAcceleration;
-        float sizeAcceleration;
+        // Run one job from own queue or steal one. Returns false if all queues are empty.
+        // self: index of the queue of the calling thread
+        bool _RunOne(uint self);
 
-        Vector absolutePosition;
-        Vector abosulteScale;
-        float absoluteRotation;
+        void _WorkerLoop(uint self);
+
+        // Queue of the calling thread, workers have their own.
+        static uint& _ThreadQueue();
     public:
         // Ctor.
-        Transform();
-
-        Transform* SetCoordMode(TransformMode m);
+        // threadCount: number of worker threads, 0 runs everything on the calling thread
+        JobSystem(uint threadCount);
 
-        TransformMode GetMode() const;
+        // Number of worker threads.
+        uint GetThreadCount() const;
 
-        // Converts rotation, scale, position and parent relationship to matrix transformation.
-        Matrix GetWorld();
+        // Split [0, count) into ranges of 'grain' elements and run fun on each range.
+        // Calling thread runs queued jobs until all ranges of this call are done, so fun can call
+        // ParallelFor() again. First exception thrown by fun is thrown here after all ranges finished.
+        // count: number of elements
+        // grain: elements per job
+        // fun: called with begin and end of a range
+        void ParallelFor(uint count, uint grain, const std::function<void(uint, uint)>& fun);
 
-        Matrix GetWorldViewProj();
+        void _Destroy();
+    };
+}
 
-        Matrix GetWorldScreen();
+#pragma region code
+namespace viva
+{
+    JobSystem::JobSystem(uint threadCount) : queued(0), stop(false)
+    {
+        for (uint i = 0; i < threadCount + 1; i++)
+            this->queues.push_back(new WorkQueue());
 
-        // Get/Set origin
-        Vector& Origin();
+        for (uint i = 0; i < threadCount; i++)
+            this->threads.push_back(std::thread(&JobSystem::_WorkerLoop, this, i + 1));
+    }
 
-        // Get/Set position
-        Vector& Pos();
+    uint JobSystem::GetThreadCount() const
+    {
+        return (uint)this->threads.size();
+    }
 
-        // Get/Set velocity
-        Vector& Vel();
+    bool JobSystem::_RunOne(uint self)
+    {
+        std::function<void()> job;
+        uint n = (uint)this->queues.size();
 
-        // Get/Set acceleration
-        Vector& Acc();
-        
-        // Get/Set rotation
-        float& Rot();
+        for (uint i = 0; i < n && !job; i++)
+        {
+            WorkQueue* q = this->queues[(self + i) % n];
+            std::lock_guard<std::mutex> guard(q->lock);
 
-        // Get/Set angular velocity
-        float& RotVel();
+            if (q->jobs.empty())
+                continue;
 
-        // Get/Set angular acceleration
-        float& RotAcc();
+            // own queue from the back, others from the front
+            if (i == 0)
+            {
+                job = std::move(q->jobs.back());
+                q->jobs.pop_back();
+            }
+            else
+            {
+                job = std::move(q->jobs.front());
+                q->jobs.pop_front();
+            }
+        }
 
-        // Get/Set scale
-        Vector& Scale();
+        if (!job)
+            return false;
 
-        // Get/Set scale velocity
-        Vector& ScaleVel();
+        // jobs catch their own exceptions
+        this->queued--;
+        job();
+        return true;
+    }
 
-        // Get/Set scale acceleration
-        Vector& ScaleAcc();
+    uint& JobSystem::_ThreadQueue()
+    {
+        thread_local uint queue = 0;
+        return queue;
+    }
 
-        // Set scale to match pixel size.
-        // _size: desired size in pixels
-        Transform* SetPixelScale(const Size& size);
+    void JobSystem::_WorkerLoop(uint self)
+    {
+        _ThreadQueue() = self;
 
-        // Set scale to match pixel size.
-        // width: width in pixels
-        // height: height in pixels
-        Transform* SetPixelScale(float width, float height);
+        while (true)
+        {
+            if (this->_RunOne(self))
+                continue;
 
-        /////     SIZE     //////
-        // Get/Set size
-        float& Size();
+            std::unique_lock<std::mutex> lock(this->wakeLock);
+            this->wake.wait(lock, [this] { return this->stop || this->queued > 0; });
 
-        // Get/Set size velocity
-        float& SizeVel();
+            if (this->stop)
+                return;
+        }
+    }
 
-        // Get/Set size acceleration
-        float& SizeAcc();
+    void JobSystem::ParallelFor(uint count, uint grain, const std::function<void(uint, uint)>& fun)
+    {
+        if (grain == 0)
+            grain = 1;
 
-        Transform* SetParent(Transform* p);
+        // nothing to share
+        if (this->threads.size() == 0 || count <= grain)
+        {
+            if (count > 0)
+                fun(0, count);
+            return;
+        }
 
-        Transform* GetParent() const;
+        uint jobCount = (count + grain - 1) / grain;
+        Batch batch;
+        batch.pending = jobCount;
 
-        Transform* RemoveChild(Transform* child);
+        for (uint j = 0; j < jobCount; j++)
+        {
+            uint begin = j * grain;
+            uint end = begin + grain < count ? begin + grain : count;
+            WorkQueue* q = this->queues[j % this->queues.size()];
+            std::lock_guard<std::mutex> guard(q->lock);
+            q->jobs.push_back([&fun, &batch, begin, end]
+            {
+                try
+                {
+                    fun(begin, end);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> guard(batch.errorLock);
+                    if (!batch.error)
+                        batch.error = std::current_exception();
+                }
 
-        void _Update();
-    };
-}
+                // last touch of the batch, caller may return right after
+                batch.pending.fetch_sub(1, std::memory_order_release);
+            });
+            this->queued++;
+        }
 
-#pragma region code
-namespace viva
-{
-    // Ctor.
-    Transform::Transform()
-        : parent(nullptr), index(-1), mode(TransformMode::World), position(Vector(0, 0, 0, 1)), rotation(0), scale(Vector(1, 1, 1, 1)), size(1)
-    {
-    }
+        {
+            std::lock_guard<std::mutex> guard(this->wakeLock);
+        }
+        this->wake.notify_all();
 
-    Transform* Transform::SetCoordMode(TransformMode m)
-    {
-        this->mode = m;
-        return this;
+        // other jobs run here too, nested calls finish their own jobs the same way
+        uint self = _ThreadQueue();
+        while (batch.pending.load(std::memory_order_acquire) > 0)
+        {
+            if (!this->_RunOne(self))
+                std::this_thread::yield();
+        }
+
+        if (batch.error)
+            std::rethrow_exception(batch.error);
     }
 
-    TransformMode Transform::GetMode() const
+    void JobSystem::_Destroy()
     {
-        return this->mode;
+        {
+            std::lock_guard<std::mutex> guard(this->wakeLock);
+            this->stop = true;
+        }
+        this->wake.notify_all();
+
+        for (uint i = 0; i < this->threads.size(); i++)
+            this->threads[i].join();
+
+        for (uint i = 0; i < this->queues.size(); i++)
+            delete this->queues[i];
+
+        delete this;
     }
+}
+#pragma endregion
 
-    // Converts rotation, scale, position and parent relationship to matrix transformation.
-    Matrix Transform::GetWorld()
+    /*@// TransformSystem **********************************************************************************************@*/
+namespace viva
+{
+    // Block of transform state stored as arrays, one array per field.
+    // Chunks are never moved so references returned by Transform stay valid.
+    struct TransformChunk
+    {
+        static const uint Capacity = 1024;
+
+        Vector position[Capacity];
+        Vector velocity[Capacity];
+        Vector acceleration[Capacity];
+        Vector scale[Capacity];
+        Vector scaleVelocity[Capacity];
+        Vector scaleAcceleration[Capacity];
+        alignas(16) float rotation[Capacity];
+        alignas(16) float angularVelocity[Capacity];
+        alignas(16) float angularAcceleration[Capacity];
+        alignas(16) float size[Capacity];
+        alignas(16) float sizeVelocity[Capacity];
+        alignas(16) float sizeAcceleration[Capacity];
+        // set when position, rotation, scale or origin may have changed since world matrix was built
+        bool dirty[Capacity];
+        Transform* owner[Capacity]; // null if slot is free
+    };
+
+    // Owns state of all transforms and integrates all of them in one pass per frame.
+    class TransformSystem
     {
-        Matrix world = math::matrix::translate_negy(this->origin) *
-            math::matrix::scale(this->scale) *
-            math::matrix::rotate(this->rotation) *
-            math::matrix::translate_negy(this->position);
+    private:
+        vector<TransformChunk*> chunks;
+        vector<uint> freeSlots;
+        uint highWater; // slots below this have been used at least once
+        uint count;
+        std::atomic<long long> cacheHits;
+        std::atomic<long long> cacheMisses;
+        vector<vector<Transform*>> levels; // transforms by depth in hierarchy, roots first
+        bool hierarchyChanged;
+        bool parallel;
+
+        void _BuildLevels();
+    public:
+        TransformSystem();
 
-        if (this->parent != nullptr)
-        {
-            Matrix parentRotLoc = math::matrix::rotate(this->parent->absoluteRotation) * 
-                math::matrix::translate_negy(this->parent->absolutePosition);
-            absolutePosition = parentRotLoc.transpose() * this->position;
-            absoluteRotation = rotation + this->parent->absoluteRotation;
-            world = world * parentRotLoc;
-        }
-        else
-        {
-            this->absolutePosition = this->position;
-            this->absoluteRotation = this->rotation;
-        }
+        // Reserve slot for a transform and reset it to defaults.
+        // owner: transform that will use the slot
+        // chunk: chunk that contains the slot
+        // returns: slot id
+        uint _Acquire(Transform* owner, TransformChunk** chunk);
 
-        return world;
+        // Return slot. Velocities and accelerations are zeroed so the slot doesn't move.
+        // id: slot id
+        void _Release(uint id);
+
+        // Euler integration of position, rotation, scale and size of all transforms.
+        // dt: time step in seconds
+        void Integrate(float dt);
+
+        // Number of live transforms.
+        uint GetCount() const;
+
+        // How many times a cached matrix was returned without any math.
+        long long GetCacheHits() const;
+
+        // How many times a matrix had to be rebuilt.
+        long long GetCacheMisses() const;
+
+        // Zero hits and misses.
+        void ResetCacheStats();
+
+        void _CountHit();
+
+        void _CountMiss();
+
+        // Resolve matrices level by level on jobSystem threads. When off, everything
+        // is resolved on the main thread in the same order every frame.
+        // val: on/off
+        void SetParallel(bool val);
+
+        bool IsParallel() const;
+
+        // Transforms were created, destroyed or reparented.
+        void _InvalidateHierarchy();
+
+        // Bring world and world view proj matrices of all transforms up to date.
+        // Drawing after that only reads cached matrices.
+        void ResolveAll();
+
+        // Integrate with frame time.
+        void _Activity();
+
+        void _Destroy();
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    TransformSystem::TransformSystem() : highWater(0), count(0), cacheHits(0), cacheMisses(0),
+        hierarchyChanged(true), parallel(true)
+    {
     }
 
-    Matrix Transform::GetWorldViewProj()
+    uint TransformSystem::_Acquire(Transform* owner, TransformChunk** chunk)
     {
-        if (mode == TransformMode::World)
+        uint id;
+
+        if (this->freeSlots.size() > 0)
         {
-            return this->GetWorld() * camera->_GetScaLoc();
+            id = this->freeSlots.back();
+            this->freeSlots.pop_back();
         }
         else
         {
-            return this->GetWorldScreen() * camera->_GetSca();
+            id = this->highWater++;
+            if (id / TransformChunk::Capacity == this->chunks.size())
+                this->chunks.push_back(new TransformChunk());
         }
-    }
 
-    Matrix Transform::GetWorldScreen()
-    {
-        auto& frustumSize = camera->GetFrustumSize();
-        auto __scale = camera->Pixel2World({ this->scale.x, this->scale.y });
-        auto pos = camera->Pixel2World({ this->position.x, this->position.y });
-        Vector _origin(this->origin.x, this->origin.y);
-        Vector _scale(__scale.width, __scale.height);
-        Vector _translate(pos.width - frustumSize.width / 2, -pos.height + frustumSize.height/2, this->position.z);
+        TransformChunk* c = this->chunks[id / TransformChunk::Capacity];
+        uint i = id % TransformChunk::Capacity;
+        c->position[i] = Vector(0, 0, 0, 1);
+        c->velocity[i] = Vector(0, 0, 0, 0);
+        c->acceleration[i] = Vector(0, 0, 0, 0);
+        c->scale[i] = Vector(1, 1, 1, 1);
+        c->scaleVelocity[i] = Vector(0, 0, 0, 0);
+        c->scaleAcceleration[i] = Vector(0, 0, 0, 0);
+        c->rotation[i] = 0;
+        c->angularVelocity[i] = 0;
+        c->angularAcceleration[i] = 0;
+        c->size[i] = 1;
+        c->sizeVelocity[i] = 0;
+        c->sizeAcceleration[i] = 0;
+        c->dirty[i] = true;
+        c->owner[i] = owner;
+
+        this->count++;
+        this->hierarchyChanged = true;
+        *chunk = c;
+        return id;
+    }
+
+    void TransformSystem::_Release(uint id)
+    {
+        TransformChunk* c = this->chunks[id / TransformChunk::Capacity];
+        uint i = id % TransformChunk::Capacity;
+        c->velocity[i] = Vector(0, 0, 0, 0);
+        c->acceleration[i] = Vector(0, 0, 0, 0);
+        c->scaleVelocity[i] = Vector(0, 0, 0, 0);
+        c->scaleAcceleration[i] = Vector(0, 0, 0, 0);
+        c->angularVelocity[i] = 0;
+        c->angularAcceleration[i] = 0;
+        c->sizeVelocity[i] = 0;
+        c->sizeAcceleration[i] = 0;
+        c->owner[i] = nullptr;
+
+        this->freeSlots.push_back(id);
+        this->count--;
+        this->hierarchyChanged = true;
+    }
+
+    void TransformSystem::Integrate(float dt)
+    {
+        __m128 dt4 = _mm_set1_ps(dt);
+        __m128 zero = _mm_setzero_ps();
+
+        for (uint ci = 0; ci < this->chunks.size(); ci++)
+        {
+            TransformChunk* c = this->chunks[ci];
+            uint n = this->highWater - ci * TransformChunk::Capacity;
+            if (n > TransformChunk::Capacity)
+                n = TransformChunk::Capacity;
+
+            // v += a * dt, x += v * dt
+            for (uint i = 0; i < n; i++)
+            {
+                __m128 v = _mm_add_ps(c->velocity[i].data, _mm_mul_ps(c->acceleration[i].data, dt4));
+                c->velocity[i].data = v;
+                c->position[i].data = _mm_add_ps(c->position[i].data, _mm_mul_ps(v, dt4));
 
-        Matrix world = math::matrix::translate_negy(_origin) *
-            math::matrix::scale(_scale) *
-            math::matrix::rotate(this->rotation) *
-            math::matrix::translate_negy(_translate);
+                __m128 sv = _mm_add_ps(c->scaleVelocity[i].data, _mm_mul_ps(c->scaleAcceleration[i].data, dt4));
+                c->scaleVelocity[i].data = sv;
+                c->scale[i].data = _mm_add_ps(c->scale[i].data, _mm_mul_ps(sv, dt4));
 
-        return world;
-    }
+                // anything that moved needs new world matrix
+                if (_mm_movemask_ps(_mm_or_ps(_mm_cmpneq_ps(v, zero), _mm_cmpneq_ps(sv, zero))) != 0)
+                    c->dirty[i] = true;
+            }
 
-    // Get/Set origin
-    Vector& Transform::Origin()
-    {
-        return this->origin;
-    }
+            // scalars 4 at a time, arrays are aligned and capacity is multiple of 4
+            for (uint i = 0; i < n; i += 4)
+            {
+                __m128 rv = _mm_add_ps(_mm_load_ps(c->angularVelocity + i), _mm_mul_ps(_mm_load_ps(c->angularAcceleration + i), dt4));
+                _mm_store_ps(c->angularVelocity + i, rv);
+                _mm_store_ps(c->rotation + i, _mm_add_ps(_mm_load_ps(c->rotation + i), _mm_mul_ps(rv, dt4)));
 
-    // Get/Set position
-    Vector& Transform::Pos()
-    {
-        return this->position;
-    }
+                int rotated = _mm_movemask_ps(_mm_cmpneq_ps(rv, zero));
+                if (rotated != 0)
+                {
+                    for (uint k = 0; k < 4; k++)
+                        if (rotated & (1 << k))
+                            c->dirty[i + k] = true;
+                }
 
-    // Get/Set velocity
-    Vector& Transform::Vel()
-    {
-        return this->velocity;
+                __m128 zv = _mm_add_ps(_mm_load_ps(c->sizeVelocity + i), _mm_mul_ps(_mm_load_ps(c->sizeAcceleration + i), dt4));
+                _mm_store_ps(c->sizeVelocity + i, zv);
+                _mm_store_ps(c->size + i, _mm_add_ps(_mm_load_ps(c->size + i), _mm_mul_ps(zv, dt4)));
+            }
+        }
     }
 
-    // Get/Set acceleration
-    Vector& Transform::Acc()
+    uint TransformSystem::GetCount() const
     {
-        return this->acceleration;
+        return this->count;
     }
 
-    // Get/Set rotation
-    float& Transform::Rot()
+    long long TransformSystem::GetCacheHits() const
     {
-        return this->rotation;
+        return this->cacheHits;
     }
 
-    // Get/Set angular velocity
-    float& Transform::RotVel()
+    long long TransformSystem::GetCacheMisses() const
     {
-        return this->angularVelocity;
+        return this->cacheMisses;
     }
 
-    // Get/Set angular acceleration
-    float& Transform::RotAcc()
+    void TransformSystem::ResetCacheStats()
     {
-        return this->angularAcceleration;
+        this->cacheHits = 0;
+        this->cacheMisses = 0;
     }
 
-    // Get/Set scale
-    Vector& Transform::Scale()
+    void TransformSystem::_CountHit()
     {
-        return this->scale;
+        this->cacheHits++;
     }
 
-    // Get/Set scale velocity
-    Vector& Transform::ScaleVel()
+    void TransformSystem::_CountMiss()
     {
-        return this->scaleVelocity;
+        this->cacheMisses++;
     }
 
-    // Get/Set scale acceleration
-    Vector& Transform::ScaleAcc()
+    void TransformSystem::SetParallel(bool val)
     {
-        return this->scaleAcceleration;
+        this->parallel = val;
     }
 
-    // Get/Set size
-    float& Transform::Size()
+    bool TransformSystem::IsParallel() const
     {
-        return this->size;
+        return this->parallel;
     }
 
-    // Get/Set size velocity
-    float& Transform::SizeVel()
+    void TransformSystem::_InvalidateHierarchy()
     {
-        return this->sizeVelocity;
+        this->hierarchyChanged = true;
     }
 
-    // Get/Set size acceleration
-    float& Transform::SizeAcc()
-    {
-        return this->sizeAcceleration;
-    }
-    
-    Transform* Transform::SetPixelScale(float width, float height)
+    void TransformSystem::_BuildLevels()
     {
-        return this->SetPixelScale(viva::Size(width, height));
-    }
+        this->levels.resize(1);
+        this->levels[0].clear();
 
-    Transform* Transform::SetPixelScale(const viva::Size& size)
-    {
-        viva::Size s = camera->Pixel2World(size);
-        this->scale.x = s.width;
-        this->scale.y = s.height;
-        //Size frustum = camera->GetFrustumSize(transform.GetPosition().f.z);
-        //Size client = engine->GetClientSize();
-        //Point unitsPerPixel = { frustum.Width / client.Width, frustum.Height / client.Height };
-        //scale.x = unitsPerPixel.x * _size.width / 2;
-        //scale.y = unitsPerPixel.y * _size.height / 2;
+        for (uint id = 0; id < this->highWater; id++)
+        {
+            Transform* t = this->chunks[id / TransformChunk::Capacity]->owner[id % TransformChunk::Capacity];
+            if (t != nullptr && t->GetParent() == nullptr)
+                this->levels[0].push_back(t);
+        }
 
-        //transform.SetScale(frustum.Width / client.Width * size.Width / 2,
-        //    frustum.Height / client.Height * size.Height / 2);
+        for (uint l = 0; this->levels[l].size() > 0; l++)
+        {
+            vector<Transform*> next;
+            for (uint i = 0; i < this->levels[l].size(); i++)
+            {
+                const vector<Transform*>& children = this->levels[l][i]->_GetChildren();
+                next.insert(next.end(), children.begin(), children.end());
+            }
 
-        return this;
+            this->levels.push_back(std::move(next));
+        }
+
+        this->levels.pop_back();
+        this->hierarchyChanged = false;
     }
 
-    Transform* Transform::SetParent(Transform* p)
+    void TransformSystem::ResolveAll()
     {
-        if (index != -1)
-            throw Error(__FUNCTION__, "Object can have only one parent");
+        if (this->hierarchyChanged)
+            this->_BuildLevels();
 
-        this->parent = p;
-        this->index = (int)this->parent->children.size();
-        this->parent->children.push_back(this);
+        // parents are finished before their level, transforms in one level don't depend on each other
+        for (uint l = 0; l < this->levels.size(); l++)
+        {
+            const vector<Transform*>& level = this->levels[l];
+            auto resolve = [this, &level](uint begin, uint end)
+            {
+                long long misses = 0;
+                for (uint i = begin; i < end; i++)
+                    misses += level[i]->_Prepare() ? 1 : 0;
 
-        return this;
-    }
+                this->cacheMisses += misses;
+                this->cacheHits += (end - begin) - misses;
+            };
 
-    Transform* Transform::GetParent() const
-    {
-        return this->parent;
+            if (this->parallel)
+                jobSystem->ParallelFor((uint)level.size(), 1024, resolve);
+            else
+                resolve(0, (uint)level.size());
+        }
     }
 
-    Transform* Transform::RemoveChild(Transform* child)
+    void TransformSystem::_Activity()
     {
-        if (child->index == -1)
-            return this;
-
-        if (this->children.at(child->index) != child)
-            throw Error(__FUNCTION__, "Wrong index");
-
-        this->children.erase(this->children.begin() + child->index);
-        child->index = -1;
-        child->parent = nullptr;
-
-        return this;
+        this->Integrate((float)time->GetFrameTime());
     }
 
-    void Transform::_Update()
+    void TransformSystem::_Destroy()
     {
-        float frameTime = (float)time->GetFrameTime();
-        // v += a
-        this->velocity += this->acceleration * frameTime;
-        // x += v
-        this->position += this->velocity * frameTime;
-        // rv += ra
-        this->angularVelocity += this->angularAcceleration * frameTime;
-        // r += rv
-        this->rotation += this->angularVelocity * frameTime;
-
-        this->scaleVelocity += this->scaleAcceleration * frameTime;
-        this->scale += this->scaleVelocity * frameTime;
+        for (uint i = 0; i < this->chunks.size(); i++)
+            delete this->chunks[i];
 
-        this->sizeVelocity += this->sizeAcceleration * frameTime;
-        this->size += this->sizeVelocity * frameTime;
+        delete this;
     }
 }
 #pragma endregion
 
-    /*@// Drawable *******************************************************************************************************@*/
+    /*@// Transform ****************************************************************************************************@*/
 namespace viva
 {
-    class Drawable : public Destroyable
+    // Transform object responsible for position, rotation, scale etc. of its owner.
+    class Transform
     {
-    protected:
-        Color color;
-        void* extraBufferPSdata;
-    public:
-        Drawable();
+    private:
+        Transform* parent;
+        vector<Transform*> children;
+        uint index; // index in parents collection
+        TransformMode mode;
 
-        // Draw all objects frm this collection.
-        virtual void _Draw() = 0;
+        // position, rotation, scale, size and their derivatives live in transformSystem
+        TransformChunk* chunk;
+        uint id; // slot in transformSystem
+        uint slot; // index in chunk
 
-        virtual Surface* GetSurface() const = 0;
-
-        virtual bool IsVisible() const = 0;
+        Vector origin;
 
-        virtual Drawable* SetVisible(bool val) = 0;
+        Vector absolutePosition;
+        Vector abosulteScale;
+        float absoluteRotation;
 
-        virtual void _SetSurface(Surface* surface) = 0;
+        // cached matrices
+        Matrix world; // world or screen world depending on mode
+        Matrix worldViewProj;
+        uint worldVersion; // changes every time world is rebuilt
+        uint parentVersion; // parent's worldVersion that world was built with
+        uint wvpWorldVersion; // worldVersion that worldViewProj was built with
+        uint wvpCameraVersion; // camera version that worldViewProj was built with
+        uint screenVersion; // camera screen version that screen mode world was built with
+
+        // Rebuild world if position, rotation, scale, origin, mode or parent changed.
+        // Parent must be up to date.
+        // returns: true if world was rebuilt
+        bool _Rebuild();
+
+        // Resolve parents first, then this.
+        // returns: true if world was rebuilt
+        bool _Resolve();
+
+        // Rebuild world view proj if world or camera changed.
+        // returns: true if it was rebuilt
+        bool _RebuildWorldViewProj(bool worldRebuilt);
+    public:
+        // Ctor.
+        Transform();
 
-        virtual void _SetIndex(uint i) = 0;
+        Transform(const Transform&) = delete;
 
-        virtual int _GetIndex() const = 0;
+        Transform& operator=(const Transform&) = delete;
 
-        const Color& GetColor() const;
+        ~Transform();
 
-        Drawable* SetColor(byte r, byte g, byte b, byte a);
+        Transform* SetCoordMode(TransformMode m);
 
-        Drawable* SetColor(const Color& c);
+        TransformMode GetMode() const;
 
-        Drawable* SetR(byte r);
+        // Converts rotation, scale, position and parent relationship to matrix transformation.
+        // Matrix is cached and rebuilt only when something it depends on changes.
+        // In screen mode this is the same as GetWorldScreen().
+        Matrix GetWorld();
 
-        Drawable* SetG(byte g);
+        Matrix GetWorldViewProj();
 
-        Drawable* SetB(byte b);
+        Matrix GetWorldScreen();
 
-        Drawable* SetA(byte a);
+        // Get/Set origin
+        Vector& Origin();
 
-        void SetExtraBufferPSdata(void* data);
-    };
-}
+        // Get origin, doesn't mark world matrix for rebuild.
+        const Vector& GetOrigin() const;
 
-#pragma region code
-namespace viva
-{
-    Drawable::Drawable() :extraBufferPSdata(nullptr)
-    {
-    }
+        // Get/Set position
+        Vector& Pos();
 
-    void Drawable::SetExtraBufferPSdata(void* data)
-    {
-        extraBufferPSdata = data; 
-    }
+        // Get position, doesn't mark world matrix for rebuild.
+        const Vector& GetPos() const;
 
-    const Color& Drawable::GetColor() const
-    {
-        return this->color;
-    }
+        // Get/Set velocity
+        Vector& Vel();
 
-    Drawable* Drawable::SetColor(byte r, byte g, byte b, byte a)
-    {
-        this->color.a = a;
-        this->color.b = b;
-        this->color.g = g;
-        this->color.r = r;
+        // Get/Set acceleration
+        Vector& Acc();
+        
+        // Get/Set rotation
+        float& Rot();
 
-        return this;
-    }
+        // Get rotation, doesn't mark world matrix for rebuild.
+        float GetRot() const;
 
-    Drawable* Drawable::SetColor(const Color& c)
-    {
-        this->color = c;
-        return this;
-    }
+        // Get/Set angular velocity
+        float& RotVel();
 
-    Drawable* Drawable::SetR(byte r)
-    {
-        this->color.r = r;
-        return this;
-    }
+        // Get/Set angular acceleration
+        float& RotAcc();
 
-    Drawable* Drawable::SetG(byte g)
-    {
-        this->color.g = g;
-        return this;
-    }
+        // Get/Set scale
+        Vector& Scale();
 
-    Drawable* Drawable::SetB(byte b)
-    {
-        this->color.b = b;
-        return this;
-    }
+        // Get scale, doesn't mark world matrix for rebuild.
+        const Vector& GetScale() const;
 
-    Drawable* Drawable::SetA(byte a)
-    {
-        this->color.a = a;
-        return this;
-    }
-}
-#pragma endregion
+        // Get/Set scale velocity
+        Vector& ScaleVel();
 
-    /*@// Surface ********************************************************************************************************@*/
-namespace viva
-{
-    // Special drawable where all of its objects are drawn on it.
-    class Surface : public Destroyable
-    {
-    protected:
-        //PixelShader* pixelShader;
-        vector<Drawable*> drawables;
-        PixelShader* ps;
-        ID3D11Texture2D* tex;
-        ID3D11RenderTargetView* rtv;
-        ID3D11ShaderResourceView* srv;
-        void* extraBufferPSdata;
-    public:
-        Surface(ID3D11Texture2D* t, ID3D11RenderTargetView* r,
-            ID3D11ShaderResourceView* s);
+        // Get/Set scale acceleration
+        Vector& ScaleAcc();
 
-        // 
-        void _DrawAll();
+        // Set scale to match pixel size.
+        // _size: desired size in pixels
+        Transform* SetPixelScale(const Size& size);
 
-        // Draw surface itself.
-        void _DrawSurface();
+        // Set scale to match pixel size.
+        // width: width in pixels
+        // height: height in pixels
+        Transform* SetPixelScale(float width, float height);
 
-        // Get pixel shader.
-        PixelShader* GetPixelShader() const;
+        /////     SIZE     //////
+        // Get/Set size
+        float& Size();
 
-        // Set pixel shader.
-        // ps: ps
-        void SetPixelShader(PixelShader* ps);
+        // Get/Set size velocity
+        float& SizeVel();
 
-        // Add drawable into this surface.
-        // d: drawable to add
-        void Add(Drawable* d);
+        // Get/Set size acceleration
+        float& SizeAcc();
 
-        // Remove all drawables from the surface without destroying them.
-        void RemoveAll();
+        Transform* SetParent(Transform* p);
 
-        //
-        void Remove(Drawable* d);
+        Transform* GetParent() const;
 
-        // Destroy all drawables from this surface.
-        void Clear();
+        Transform* RemoveChild(Transform* child);
 
-        // Destroy the surface and all drawables it contains.
-        void Destroy();
+        const vector<Transform*>& _GetChildren() const;
 
-        void SetExtraBufferPSdata(void* data);
+        // Bring world and world view proj up to date assuming parent already is.
+        // Safe to call on different transforms of the same hierarchy level from different threads.
+        // returns: true if anything was rebuilt
+        bool _Prepare();
     };
 }
 
 #pragma region code
 namespace viva
 {
-    Surface::Surface(ID3D11Texture2D* t, ID3D11RenderTargetView* r,
-        ID3D11ShaderResourceView* s)
-        : tex(t), rtv(r), srv(s), extraBufferPSdata(nullptr)
+    // Ctor.
+    Transform::Transform()
+        : parent(nullptr), index(-1), mode(TransformMode::World), origin(Vector(0, 0, 0, 1)),
+        worldVersion(0), parentVersion(0), wvpWorldVersion(0), wvpCameraVersion(0), screenVersion(0)
     {
+        this->id = transformSystem->_Acquire(this, &this->chunk);
+        this->slot = this->id % TransformChunk::Capacity;
     }
 
-    void Surface::SetExtraBufferPSdata(void* data)
+    Transform::~Transform()
     {
-        this->extraBufferPSdata = data;
+        // hierarchy pass walks children, don't leave dangling pointers
+        if (this->parent != nullptr)
+            this->parent->RemoveChild(this);
+
+        while (this->children.size() > 0)
+            this->RemoveChild(this->children.back());
+
+        transformSystem->_Release(this->id);
     }
 
-    void Surface::Add(Drawable* d)
+    Transform* Transform::SetCoordMode(TransformMode m)
     {
-        d->_SetIndex((int)drawables.size());
-        d->_SetSurface(this);
-        this->drawables.push_back(d);
+        this->mode = m;
+        this->chunk->dirty[this->slot] = true;
+        return this;
     }
 
-    // Remove all drawables from the surface without destroying them.
-    void Surface::RemoveAll()
+    TransformMode Transform::GetMode() const
     {
-        for (uint i = 0; i < this->drawables.size(); i++)
-        {
-            this->drawables.at(i)->_SetIndex(-1);
-            this->drawables.at(i)->_SetSurface(nullptr);
-        }
+        return this->mode;
+    }
 
-        this->drawables.clear();
+    bool Transform::_Resolve()
+    {
+        if (this->parent != nullptr)
+            this->parent->_Resolve();
+
+        return this->_Rebuild();
     }
 
-    //
-    void Surface::Remove(Drawable* d)
+    bool Transform::_Rebuild()
     {
-        int indexOfd = d->_GetIndex();
+        bool parentChanged = this->parent != nullptr && this->parent->worldVersion != this->parentVersion;
 
-        if (indexOfd == -1)
-            return;
+        // screen world depends on frustum and pixel size too
+        bool screenChanged = this->mode == TransformMode::Screen && this->screenVersion != camera->_GetScreenVersion();
 
-        // if d is not at the end
-        if (indexOfd != this->drawables.size() - 1)
+        if (!this->chunk->dirty[this->slot] && !parentChanged && !screenChanged)
+            return false;
+
+        // read store directly, accessors would mark it dirty again
+        const Vector& position = this->chunk->position[this->slot];
+        float rotation = this->chunk->rotation[this->slot];
+
+        if (this->parent != nullptr)
         {
-            // move back to where d is and update its index
-            this->drawables.back()->_SetIndex(indexOfd);
-            this->drawables.at(indexOfd) = this->drawables.back();
+            Matrix parentRotLoc = math::matrix::affine2d(Vector(0, 0, 0), Vector(1, 1, 1),
+                this->parent->absoluteRotation, this->parent->absolutePosition);
+            this->absolutePosition = parentRotLoc.transpose() * position;
+            this->absoluteRotation = rotation + this->parent->absoluteRotation;
+            this->parentVersion = this->parent->worldVersion;
+
+            if (this->mode == TransformMode::World)
+                this->world = math::matrix::affine2d(this->origin, this->chunk->scale[this->slot], rotation, position) * parentRotLoc;
         }
+        else
+        {
+            this->absolutePosition = position;
+            this->absoluteRotation = rotation;
 
-        this->drawables.pop_back();
-        d->_SetIndex(-1);
-        d->_SetSurface(nullptr);
-    }
+            if (this->mode == TransformMode::World)
+                this->world = math::matrix::affine2d(this->origin, this->chunk->scale[this->slot], rotation, position);
+        }
 
-    // Destroy all drawables from this surface.
-    void Surface::Clear()
-    {
-        for (uint i = 0; i < this->drawables.size(); i++)
-            this->drawables.at(i)->Destroy();
+        if (this->mode == TransformMode::Screen)
+        {
+            this->world = this->GetWorldScreen();
+            this->screenVersion = camera->_GetScreenVersion();
+        }
 
-        this->drawables.clear();
-    }
+        this->chunk->dirty[this->slot] = false;
+        this->worldVersion++;
 
-    PixelShader* Surface::GetPixelShader() const
-    {
-        return this->ps;
+        return true;
     }
 
-    void Surface::SetPixelShader(PixelShader* ps)
+    // Converts rotation, scale, position and parent relationship to matrix transformation.
+    Matrix Transform::GetWorld()
     {
-        this->ps = ps;
+        if (this->_Resolve())
+            transformSystem->_CountMiss();
+        else
+            transformSystem->_CountHit();
+
+        return this->world;
     }
 
-    void Surface::_DrawAll()
+    bool Transform::_RebuildWorldViewProj(bool worldRebuilt)
     {
-        d3d.context->ClearDepthStencilView(d3d.depthStencil,
-            D3D11_CLEAR_DEPTH | D3D11_CLEAR_STENCIL, 1.0f, 0);
-        //if (Core->IsAlphaEnabled())
-        //   Core->_GetContext()->OMSetBlendState(Core->_GetBlendState(), 0, 0xffffffff);
+        uint cameraVersion = camera->_GetVersion();
 
-        d3d.context->OMSetRenderTargets(1, &(this->rtv), d3d.depthStencil);
-        float four0[4] = { 0, 0, 0, 0 };
-        d3d.context->ClearRenderTargetView(this->rtv, four0);
+        if (!worldRebuilt && this->wvpWorldVersion == this->worldVersion && this->wvpCameraVersion == cameraVersion)
+            return false;
 
-        for (int i = 0; i < this->drawables.size(); i++)
-            this->drawables.at(i)->_Draw();
+        if (mode == TransformMode::World)
+            this->worldViewProj = this->world * camera->_GetScaLoc();
+        else
+            this->worldViewProj = this->world * camera->_GetSca();
+
+        this->wvpWorldVersion = this->worldVersion;
+        this->wvpCameraVersion = cameraVersion;
+
+        return true;
     }
 
-    void Surface::_DrawSurface()
+    bool Transform::_Prepare()
     {
-        //extra buffer
-        if (this->extraBufferPSdata != nullptr)
-            d3d.context->UpdateSubresource(d3d.constantBufferPSExtra, 0, 0, this->extraBufferPSdata, 0, 0);
-
-        d3d.context->PSSetShader(this->ps->GetPS(), 0, 0);
-        //tex
-        d3d.context->PSSetShaderResources(0, 1, &(this->srv));
-        //draw
-        d3d.context->DrawIndexed(6, 0, 0);
+        return this->_RebuildWorldViewProj(this->_Rebuild());
     }
 
-    void Surface::Destroy()
+    Matrix Transform::GetWorldViewProj()
     {
-        this->Clear();
+        if (this->_RebuildWorldViewProj(this->_Resolve()))
+            transformSystem->_CountMiss();
+        else
+            transformSystem->_CountHit();
 
-        this->tex->Release();
-        this->rtv->Release();
-        this->srv->Release();
+        return this->worldViewProj;
     }
-}
-#pragma endregion
 
-    /*@// Polygon ********************************************************************************************************@*/
-namespace viva
-{
-    // Drawable that consist of lines.
-    class Polygon : public Drawable
+    Matrix Transform::GetWorldScreen()
     {
-    protected:
-        //float span; //distance from origin to the furthest vertex
-        uint vertexCount;
-        Transform transform;
-        Surface* parent;
-        uint index;
-        bool visible;
-        VertexBuffer* vertexBuffer;
-        PixelShader* ps;
-    public:
-        // Ctor.
-        // count: vertex count
-        Polygon(VertexBuffer* vb);
-
-        // Get transform of the object.
-        Transform* T();
-
-        // Get transform of the object.
-        Transform* GetTransform();
-
-        //XMMATRIX _GetScaleMatrix() override;
-
-        //float GetSpan() const { return span; }
-
-        //make exact (but independent) copy and add to draw manager
-        //stuff that is not copied: children (since they can have only one parent)
-        //virtual Polygon* Clone();
-
-        // Get pixel shader.
-        PixelShader* GetPixelShader() const;
-
-        // Set pixel shader.
-        // ps: the ps
-        void SetPixelShader(PixelShader* ps);
-
-        // Get vertex count.
-        uint GetVertexCount() const;
-
-        Surface* GetSurface() const override;
-
-        bool IsVisible() const override;
+        auto& frustumSize = camera->GetFrustumSize();
+        const Vector& position = this->chunk->position[this->slot];
+        const Vector& scale = this->chunk->scale[this->slot];
+        auto __scale = camera->Pixel2World({ scale.x, scale.y });
+        auto pos = camera->Pixel2World({ position.x, position.y });
+        Vector _origin(this->origin.x, this->origin.y);
+        Vector _scale(__scale.width, __scale.height);
+        Vector _translate(pos.width - frustumSize.width / 2, -pos.height + frustumSize.height/2, position.z);
 
-        Drawable* SetVisible(bool val) override;
+        Matrix world = math::matrix::affine2d(_origin, _scale, this->chunk->rotation[this->slot], _translate);
 
-        void _SetSurface(Surface* surface) override;
+        return world;
+    }
 
-        void _SetIndex(uint i) override;
+    // Get/Set origin
+    Vector& Transform::Origin()
+    {
+        this->chunk->dirty[this->slot] = true;
+        return this->origin;
+    }
 
-        int _GetIndex() const override;
+    const Vector& Transform::GetOrigin() const
+    {
+        return this->origin;
+    }
 
-        void _Draw() override;
+    // Get/Set position
+    Vector& Transform::Pos()
+    {
+        this->chunk->dirty[this->slot] = true;
+        return this->chunk->position[this->slot];
+    }
 
-        void Destroy() override;
-    };
-}
+    const Vector& Transform::GetPos() const
+    {
+        return this->chunk->position[this->slot];
+    }
 
-#pragma region code
-namespace viva
-{
-    Polygon::Polygon(VertexBuffer* vb)
-        : parent(nullptr), index(-1), visible(true), vertexBuffer(vb), 
-        vertexCount(vb->GetVertexCount()), ps(d3d.defaultPS)
+    // Get/Set velocity
+    Vector& Transform::Vel()
     {
+        return this->chunk->velocity[this->slot];
     }
 
-    // Get transform of the object.
-    Transform* Polygon::T()
+    // Get/Set acceleration
+    Vector& Transform::Acc()
     {
-        return &(this->transform);
+        return this->chunk->acceleration[this->slot];
     }
 
-    // Get transform of the object.
-    Transform* Polygon::GetTransform()
+    // Get/Set rotation
+    float& Transform::Rot()
     {
-        return &(this->transform);
+        this->chunk->dirty[this->slot] = true;
+        return this->chunk->rotation[this->slot];
     }
 
-    //XMMATRIX _GetScaleMatrix() override;
+    float Transform::GetRot() const
+    {
+        return this->chunk->rotation[this->slot];
+    }
 
-    //float GetSpan() const { return span; }
+    // Get/Set angular velocity
+    float& Transform::RotVel()
+    {
+        return this->chunk->angularVelocity[this->slot];
+    }
 
-    //make exact (but independent) copy and add to draw manager
-    //stuff that is not copied: children (since they can have only one parent)
-    //virtual Polygon* Clone();
-    
-    // Get vertex count.
-    uint Polygon::GetVertexCount() const
+    // Get/Set angular acceleration
+    float& Transform::RotAcc()
     {
-        return this->vertexCount;
+        return this->chunk->angularAcceleration[this->slot];
     }
 
-    Surface* Polygon::GetSurface() const
+    // Get/Set scale
+    Vector& Transform::Scale()
     {
-        return this->parent;
+        this->chunk->dirty[this->slot] = true;
+        return this->chunk->scale[this->slot];
     }
 
-    bool Polygon::IsVisible() const
+    const Vector& Transform::GetScale() const
     {
-        return this->visible;
+        return this->chunk->scale[this->slot];
     }
 
-    Drawable* Polygon::SetVisible(bool val)
+    // Get/Set scale velocity
+    Vector& Transform::ScaleVel()
     {
-        this->visible = val;
-        return this;
+        return this->chunk->scaleVelocity[this->slot];
     }
 
-    void Polygon::_SetSurface(Surface* surface)
+    // Get/Set scale acceleration
+    Vector& Transform::ScaleAcc()
     {
-        this->parent = surface;
+        return this->chunk->scaleAcceleration[this->slot];
     }
 
-    void Polygon::_SetIndex(uint i)
+    // Get/Set size
+    float& Transform::Size()
     {
-        this->index = i;
+        return this->chunk->size[this->slot];
     }
 
-    int Polygon::_GetIndex() const
+    // Get/Set size velocity
+    float& Transform::SizeVel()
     {
-        return this->index;
+        return this->chunk->sizeVelocity[this->slot];
     }
 
-    PixelShader* Polygon::GetPixelShader() const
+    // Get/Set size acceleration
+    float& Transform::SizeAcc()
     {
-        return this->ps;
+        return this->chunk->sizeAcceleration[this->slot];
+    }
+    
+    Transform* Transform::SetPixelScale(float width, float height)
+    {
+        return this->SetPixelScale(viva::Size(width, height));
     }
 
-    void Polygon::SetPixelShader(PixelShader* _ps)
+    Transform* Transform::SetPixelScale(const viva::Size& size)
     {
-        this->ps = _ps;
+        viva::Size s = camera->Pixel2World(size);
+        this->Scale().x = s.width;
+        this->Scale().y = s.height;
+        //Size frustum = camera->GetFrustumSize(transform.GetPosition().f.z);
+        //Size client = engine->GetClientSize();
+        //Point unitsPerPixel = { frustum.Width / client.Width, frustum.Height / client.Height };
+        //scale.x = unitsPerPixel.x * _size.width / 2;
+        //scale.y = unitsPerPixel.y * _size.height / 2;
+
+        //transform.SetScale(frustum.Width / client.Width * size.Width / 2,
+        //    frustum.Height / client.Height * size.Height / 2);
+
+        return this;
     }
 
-    void Polygon::_Draw()
+    Transform* Transform::SetParent(Transform* p)
     {
-        this->T()->_Update();
+        if (index != -1)
+            throw Error(__FUNCTION__, "Object can have only one parent");
 
-        if (!this->visible)
-            return;
+        this->parent = p;
+        this->index = (int)this->parent->children.size();
+        this->parent->children.push_back(this);
+        this->chunk->dirty[this->slot] = true;
+        transformSystem->_InvalidateHierarchy();
 
-        // transform
-        Matrix matT = this->transform.GetWorldViewProj().transpose();
-        d3d.context->UpdateSubresource(d3d.constantBufferVS, 0, NULL, &matT, 0, 0);
-        // color
-        float fColor[] = { this->color.r / 255.0f,this->color.g / 255.0f,this->color.b / 255.0f,this->color.a / 255.0f };
-        d3d.context->UpdateSubresource(d3d.constantBufferPS, 0, 0, fColor, 0, 0);
-        d3d.context->PSSetShader(ps->GetPS(), 0, 0);
-        d3d.context->IASetPrimitiveTopology(D3D10_PRIMITIVE_TOPOLOGY_LINESTRIP);
-        d3d.context->RSSetState(d3d.rsWire);
-        UINT stride = sizeof(Vertex);
-        UINT offset = 0;
-        d3d.context->IASetVertexBuffers(0, 1, this->vertexBuffer->GetVB(), &stride, &offset);
+        return this;
+    }
 
-        d3d.context->Draw(this->vertexCount, 0);
+    Transform* Transform::GetParent() const
+    {
+        return this->parent;
     }
 
-    void Polygon::Destroy()
+    const vector<Transform*>& Transform::_GetChildren() const
     {
-        if (!this->vertexBuffer->IsShared())
-            this->vertexBuffer->Destroy();
+        return this->children;
+    }
 
-        if (this->index != -1)
-            this->parent->Remove(this);
+    Transform* Transform::RemoveChild(Transform* child)
+    {
+        if (child->index == -1)
+            return this;
 
-        delete this;
+        if (this->children.at(child->index) != child)
+            throw Error(__FUNCTION__, "Wrong index");
+
+        this->children.erase(this->children.begin() + child->index);
+        for (uint i = child->index; i < this->children.size(); i++)
+            this->children[i]->index = i;
+
+        child->index = -1;
+        child->parent = nullptr;
+        child->chunk->dirty[child->slot] = true;
+        transformSystem->_InvalidateHierarchy();
+
+        return this;
     }
 }
 #pragma endregion
 
-    /*@// Texture ********************************************************************************************************@*/
+    /*@// Drawable *******************************************************************************************************@*/
 namespace viva
 {
-    class Texture : public Destroyable
+    class Drawable : public Destroyable
     {
     protected:
-        ID3D11ShaderResourceView* shaderResource;
-        Size size;
+        Color color;
+        void* extraBufferPSdata;
     public:
-        Texture(ID3D11ShaderResourceView* srv, const Size& size);
+        Drawable();
 
-        const Size& GetSize() const;
+        // Draw all objects frm this collection.
+        virtual void _Draw() = 0;
 
-        void Destroy();
+        // Add to sprite batch instead of drawing. Returns false if drawable can't be batched
+        // and has to be drawn with _Draw().
+        // batch: batch
+        virtual bool _Batch(SpriteBatch* batch);
 
-        ID3D11ShaderResourceView** GetSRV();
+        virtual Surface* GetSurface() const = 0;
+
+        virtual bool IsVisible() const = 0;
+
+        virtual Drawable* SetVisible(bool val) = 0;
+
+        virtual void _SetSurface(Surface* surface) = 0;
+
+        virtual void _SetIndex(uint i) = 0;
+
+        virtual int _GetIndex() const = 0;
+
+        const Color& GetColor() const;
+
+        Drawable* SetColor(byte r, byte g, byte b, byte a);
+
+        Drawable* SetColor(const Color& c);
+
+        Drawable* SetR(byte r);
+
+        Drawable* SetG(byte g);
+
+        Drawable* SetB(byte b);
+
+        Drawable* SetA(byte a);
+
+        void SetExtraBufferPSdata(void* data);
     };
 }
 
 #pragma region code
 namespace viva
 {
-    Texture::Texture(ID3D11ShaderResourceView* srv, const Size& size)
-        : shaderResource(srv), size(size)
+    Drawable::Drawable() :extraBufferPSdata(nullptr)
     {
     }
 
-    const Size& Texture::GetSize() const
+    void Drawable::SetExtraBufferPSdata(void* data)
     {
-        return this->size;
+        extraBufferPSdata = data; 
     }
 
-    void Texture::Destroy()
+    bool Drawable::_Batch(SpriteBatch* batch)
     {
-        this->shaderResource->Release();
-        delete this;
+        return false;
     }
 
-    ID3D11ShaderResourceView** Texture::GetSRV()
+    const Color& Drawable::GetColor() const
     {
-        return &(this->shaderResource);
+        return this->color;
     }
-}
-#pragma endregion
 
-    /*@// Font ***********************************************************************************************************@*/
-namespace viva
-{
-    struct CharacterMetrics
+    Drawable* Drawable::SetColor(byte r, byte g, byte b, byte a)
     {
-        int id;
-        Rect uv;
-        Size size;
-        Size sizePx;
-        Point offset;
-        Point offsetPx;
-        float advance;
-        float advancePx;
+        this->color.a = a;
+        this->color.b = b;
+        this->color.g = g;
+        this->color.r = r;
+
+        return this;
+    }
+
+    Drawable* Drawable::SetColor(const Color& c)
+    {
+        this->color = c;
+        return this;
+    }
+
+    Drawable* Drawable::SetR(byte r)
+    {
+        this->color.r = r;
+        return this;
+    }
+
+    Drawable* Drawable::SetG(byte g)
+    {
+        this->color.g = g;
+        return this;
+    }
+
+    Drawable* Drawable::SetB(byte b)
+    {
+        this->color.b = b;
+        return this;
+    }
+
+    Drawable* Drawable::SetA(byte a)
+    {
+        this->color.a = a;
+        return this;
+    }
+}
+#pragma endregion
+
+    /*@// SpriteBatch ****************************************************************************************************@*/
+namespace viva
+{
+    // One sprite in a batch. Layout matches per instance data of sprite batch vertex shader.
+    struct SpriteInstance
+    {
+        Matrix transform; // world view proj, not transposed
+        Rect uv; // final uv (flips applied)
+        float color[4]; // normalized rgba
     };
 
-    struct FontMetrics
+    // Range of instances that share texture and pixel shader and go out in one draw call.
+    struct SpriteBatchRun
     {
-        float lineHeight;
-        float lineHeightPx;
+        Texture* texture;
+        PixelShader* ps;
+        uint start;
+        uint count;
     };
 
-    // Bitmap font. Stores coordinates for where letters are on texture
-    class Font : public Destroyable
+    // Collects sprites into instance array and groups them by pixel shader and texture.
+    // Building the batch (Begin, Add, End) doesn't touch d3d and can be used without a window.
+    class SpriteBatch : public Destroyable
     {
     private:
-        Texture* texture;
-        vector<CharacterMetrics> characters;
-        FontMetrics fontMetrics;
+        struct Entry
+        {
+            Texture* texture;
+            PixelShader* ps;
+            uint order;
+        };
 
-        void InitFontFromMetrics(const char* fontMetrics);
+        vector<Entry> entries;
+        vector<SpriteInstance> pending;
+        vector<SpriteInstance> instances;
+        vector<SpriteBatchRun> runs;
+        bool sorted;
     public:
-        // Create bitmap font from texture. And calc primitive metrics
-        // tex: texture to use
-        // glyphs: exact uv coordinate for glyphs. It should contain at least ascii 0-126
-        Font(Texture* tex, const char* fontMetrics, bool fromString);
+        SpriteBatch();
 
-        // Create bitmap font from texture.
-        Font(Texture* tex, const char* fontMetricsFile);
+        // Clear instances and runs. Keeps allocated memory.
+        void Begin();
 
-        // Gets uv coordinate for char 'code'.
-        const CharacterMetrics& GetChar(uint code) const;
+        // Add one sprite.
+        // texture: texture
+        // ps: pixel shader, d3d.defaultPS is replaced with batch version when submitting
+        // transform: world view proj matrix
+        // uv: final uv
+        // color: color
+        void Add(Texture* texture, PixelShader* ps, const Matrix& transform, const Rect& uv, const Color& color);
 
-        const FontMetrics& GetFontMetrics() const;
-        
-        Texture* GetTexture() const;
+        // Sort added sprites by pixel shader and texture (stable) and build runs.
+        void End();
 
-        void Destroy();
+        // Number of added sprites.
+        uint GetCount() const;
+
+        // Instances sorted by End().
+        const vector<SpriteInstance>& GetInstances() const;
+
+        // Runs built by End(). Each run is one draw call.
+        const vector<SpriteBatchRun>& GetRuns() const;
+
+        // Draw instances, d3d backend issues one instanced draw per run.
+        void _Submit();
+
+        void Destroy() override;
     };
 }
 
 #pragma region code
 namespace viva
 {
-    Font::Font(Texture* tex, const char* fontMetrics, bool fromString)
-        : texture(tex)
+    SpriteBatch::SpriteBatch() : sorted(true)
     {
-        this->InitFontFromMetrics(fontMetrics);
     }
 
-    void Font::InitFontFromMetrics(const char* fontMetrics)
+    void SpriteBatch::Begin()
     {
-        // if string is null or empty
-        if (!fontMetrics || !*fontMetrics)
-            return;
+        this->entries.clear();
+        this->pending.clear();
+        this->instances.clear();
+        this->runs.clear();
+        this->sorted = true;
+    }
 
-        int len = (int)strlen(fontMetrics);
-        const char* eos = fontMetrics + len;
-        const char* it = fontMetrics;
-        char buf[500];
-        CharacterMetrics cm;
-        float lineHeight;
-        const Size& texSize = this->texture->GetSize();
-        int id, x, y, width, height, xoffset, yoffset, xadvance, maxId = 0;
-        std::vector<CharacterMetrics> cms;
+    void SpriteBatch::Add(Texture* texture, PixelShader* ps, const Matrix& transform, const Rect& uv, const Color& color)
+    {
+        Entry e = { texture, ps, (uint)this->entries.size() };
 
-        while (it < eos)
+        // most of the time sprites come already grouped, then sorting can be skipped
+        if (this->entries.size() > 0)
         {
-            // getline
-            const char* eol = strchr(it, '\n');
-            if (!eol)
-                eol = eos;
+            const Entry& last = this->entries.back();
+            if (ps < last.ps || (ps == last.ps && texture < last.texture))
+                this->sorted = false;
+        }
 
-            memset(buf, 0, 500);
-            memcpy(buf, it, eol - it);
-            it = eol + 1;
+        this->entries.push_back(e);
 
-            // process line
-            if (!memcmp(buf, "info", 4))
-            {
-            }
-            else if (!memcmp(buf, "common", 6))
-            {
-                sscanf(buf, "common lineHeight=%f", &lineHeight);
-                this->fontMetrics.lineHeight = camera->Pixel2World({ 0 ,lineHeight }).height;
-                this->fontMetrics.lineHeightPx = lineHeight;
-            }
-            else if (!memcmp(buf, "char ", 5))
+        SpriteInstance inst;
+        inst.transform = transform;
+        inst.uv = uv;
+        inst.color[0] = color.r / 255.0f;
+        inst.color[1] = color.g / 255.0f;
+        inst.color[2] = color.b / 255.0f;
+        inst.color[3] = color.a / 255.0f;
+        this->pending.push_back(inst);
+    }
+
+    void SpriteBatch::End()
+    {
+        if (!this->sorted)
+        {
+            std::stable_sort(this->entries.begin(), this->entries.end(), [](const Entry& a, const Entry& b)
             {
-                sscanf(buf, "char id=%d x=%d y=%d width=%d height=%d xoffset=%d yoffset=%d xadvance=%d",
-                    &id, &x, &y, &width, &height, &xoffset, &yoffset, &xadvance);
+                if (a.ps != b.ps)
+                    return a.ps < b.ps;
+                return a.texture < b.texture;
+            });
+
+            this->instances.resize(this->pending.size());
+            for (uint i = 0; i < this->entries.size(); i++)
+                this->instances[i] = this->pending[this->entries[i].order];
+        }
+        else
+        {
+            this->instances.swap(this->pending);
+        }
 
-                cm.advance = camera->Pixel2World({ (float)xadvance ,0 }).width;
-                cm.advancePx = (float)xadvance;
-                cm.id = id;
-                auto offset = camera->Pixel2World({ (float)xoffset ,(float)yoffset });
-                cm.offset = { offset.width, offset.height };
-                cm.offsetPx = { (float)xoffset , -(float)yoffset };
-                cm.size = camera->Pixel2World({ (float)width ,(float)height });
-                cm.sizePx = { (float)width ,(float)height };
-                // TODO why (top = 1 - bottom) and (bottom = 1 - top)
-                cm.uv = {
-                    x / texSize.width,
-                    1 - (y + height) / texSize.height,
-                    (x + width) / texSize.width,
-                    1 - y / texSize.height,
-                };
+        this->pending.clear();
+        this->runs.clear();
 
-                if (id > maxId)
-                    maxId = id;
+        for (uint i = 0; i < this->entries.size(); i++)
+        {
+            const Entry& e = this->entries[i];
 
-                cms.push_back(cm);
+            if (this->runs.size() > 0 && this->runs.back().texture == e.texture && this->runs.back().ps == e.ps)
+            {
+                this->runs.back().count++;
+            }
+            else
+            {
+                SpriteBatchRun run = { e.texture, e.ps, i, 1 };
+                this->runs.push_back(run);
             }
         }
 
-        this->characters.resize(maxId + 1);
-
-        for (int i = 0; i < cms.size(); i++)
-            this->characters[cms[i].id] = cms[i];
+        this->sorted = true;
     }
 
-    Font::Font(Texture* tex, const char* fontMetricsFile)
-        : texture(tex)
+    uint SpriteBatch::GetCount() const
     {
-        std::string fontMetrics = util::ReadFileToStringA(fontMetricsFile);
-        this->InitFontFromMetrics(fontMetrics.c_str());
+        return (uint)this->entries.size();
     }
 
-    // Gets uv coordinate for char 'code'.
-    const CharacterMetrics& Font::GetChar(uint code) const
+    const vector<SpriteInstance>& SpriteBatch::GetInstances() const
     {
-        return this->characters.at(code);
+        return this->instances;
     }
 
-    const FontMetrics& Font::GetFontMetrics() const
+    const vector<SpriteBatchRun>& SpriteBatch::GetRuns() const
     {
-        return this->fontMetrics;
+        return this->runs;
     }
-    
-    Texture* Font::GetTexture() const
+
+    void SpriteBatch::Destroy()
     {
-        return this->texture;
+        delete this;
     }
 
-    void Font::Destroy()
+    void SpriteBatch::_Submit()
     {
-        this->texture->Destroy();
-        delete this;
+        if (this->instances.size() == 0)
+            return;
+
+        renderBackend->_DrawSpriteBatch(this);
     }
 }
 #pragma endregion
 
-    /*@// Routine ********************************************************************************************************@*/
+    /*@// Surface ********************************************************************************************************@*/
 namespace viva
 {
-    struct Routine
+    // Special drawable where all of its objects are drawn on it.
+    class Surface : public Destroyable
     {
-        double tick;
-        double lifeTime;
-        double delay;
-        double startTime;
-        std::function<int()> activity;
-        int id;
-        double lastPulse;
-        bool remove;
-    };
-}
+    protected:
+        //PixelShader* pixelShader;
+        vector<Drawable*> drawables;
+        PixelShader* ps;
+        ID3D11Texture2D* tex;
+        ID3D11RenderTargetView* rtv;
+        ID3D11ShaderResourceView* srv;
+        vector<float> pixels; // software backend render target, rgba per pixel
+        void* extraBufferPSdata;
+        bool batching;
+        SpriteBatch batch;
 
-    /*@// RoutineManager *************************************************************************************************@*/
-namespace viva
-{
-    class RoutineManager
-    {
-    private:
-        ObjectPool<Routine> routinePool;
-        vector<Routine*> routines;
-        std::map<int, vector<std::function<void(int)>>> handlers;
+        // Draw what has been batched so far.
+        void _FlushBatch();
     public:
-        RoutineManager();
+        Surface(ID3D11Texture2D* t, ID3D11RenderTargetView* r,
+            ID3D11ShaderResourceView* s);
 
-        void _Activity();
+        // Surface in system memory.
+        // size: size in pixels
+        Surface(const Size& size);
 
-        // Add a new routine.
-        //func: code to execute by event (function pointer or closure)
-        //      func must return an int. This is to make it easier to remove routines from inside. 
-        //      If func returns 0, routine is destroyed.
-        //delay: how long to wait before start running
-        //lifeTime: destroy event after that time, 0 to never destroy
-        //tick: run event once every tick seconds, 0 to run every frame
-        Routine* AddRoutine(const std::function<int()>& func, int id, double delay, double lifeTime, double tick);
+        // 
+        void _DrawAll();
 
-        Routine* AddRoutine(const std::function<int()>& func);
+        // Enable sprite batching. Sprites are grouped by texture and pixel shader
+        // and drawn with one instanced draw per group. Order of sprites with equal z
+        // is preserved only within a group. Drawables that can't be batched (text, polygons,
+        // sprites with custom pixel shader) break the batch and are drawn in order.
+        // val: on/off
+        void SetBatching(bool val);
 
-        void RemoveRoutine(Routine* r);
+        // Is sprite batching enabled.
+        bool IsBatching() const;
 
-        // Find routine.
-        // Note, this method performs linear search to find by id.
-        // name: name of the routine
-        Routine* FindRoutine(int id);
+        // Batch used by the last frame. Useful to see how many draw calls there were.
+        const SpriteBatch& GetBatch() const;
 
-        void Trigger(int _event, int data);
+        // Draw surface itself.
+        void _DrawSurface();
 
-        void AddHandler(int _event, const std::function<void(int)>& handler);
+        // Get pixel shader.
+        PixelShader* GetPixelShader() const;
 
-        // Remove all handlers for that event.
-        void ClearHandlers(int _event);
+        // Set pixel shader.
+        // ps: ps
+        void SetPixelShader(PixelShader* ps);
 
-        // Remove all handlers.
-        void ClearHandlers();
+        // Add drawable into this surface.
+        // d: drawable to add
+        void Add(Drawable* d);
 
-        // Remove all routines.
-        // Don't call it from inside a routine.
-        void ClearRoutines();
+        // Remove all drawables from the surface without destroying them.
+        void RemoveAll();
 
-        void _Destroy();
+        //
+        void Remove(Drawable* d);
+
+        // Destroy all drawables from this surface.
+        void Clear();
+
+        // Destroy the surface and all drawables it contains.
+        void Destroy();
+
+        void SetExtraBufferPSdata(void* data);
+
+        void* _GetExtraBufferPSdata() const;
+
+        ID3D11RenderTargetView* _GetRTV() const;
+
+        ID3D11ShaderResourceView* _GetSRV() const;
+
+        vector<float>& _GetPixels();
     };
 }
 
 #pragma region code
 namespace viva
 {
-    RoutineManager::RoutineManager() :routinePool(1000)
+    Surface::Surface(ID3D11Texture2D* t, ID3D11RenderTargetView* r,
+        ID3D11ShaderResourceView* s)
+        : tex(t), rtv(r), srv(s), extraBufferPSdata(nullptr), batching(false)
     {
     }
 
-    void RoutineManager::_Activity()
+    Surface::Surface(const Size& size)
+        : tex(nullptr), rtv(nullptr), srv(nullptr), pixels((uint)size.width * (uint)size.height * 4),
+        extraBufferPSdata(nullptr), batching(false)
     {
-        double gameTime = time->GetGameTime();
+    }
 
-        //might be removed so backwards iteration
-        for (int i = (int)this->routines.size() - 1; i >= 0; i--)
-        {
-            // destroy if remove flag is up
-            if (this->routines.at(i) == nullptr && this->routines.at(i)->remove)
-            {
-                this->routinePool.Free(this->routines.at(i));
-                this->routines.at(i) = nullptr;
-            }
+    void* Surface::_GetExtraBufferPSdata() const
+    {
+        return this->extraBufferPSdata;
+    }
 
-            //pop if last routine is empty
-            if (this->routines.at(i) == nullptr && i == this->routines.size() - 1)
-            {
-                this->routines.pop_back();
-                continue;
-            }
-            //if its empty but not last then perform swap and remove
-            else if (this->routines.at(i) == nullptr)
-            {
-                this->routines.at(i) = this->routines.back();
-                this->routines.pop_back();
-                continue;
-            }
+    ID3D11RenderTargetView* Surface::_GetRTV() const
+    {
+        return this->rtv;
+    }
 
-            int ret = 1;
+    ID3D11ShaderResourceView* Surface::_GetSRV() const
+    {
+        return this->srv;
+    }
 
-            //if delay time has passed...
-            if (gameTime - this->routines.at(i)->startTime > this->routines.at(i)->delay)
-                //...and it's time for next pulse then run
-                if (this->routines.at(i)->tick == 0 ||
-                    (gameTime - this->routines.at(i)->lastPulse > this->routines.at(i)->tick))
-                {
-                    ret = this->routines.at(i)->activity();
-                    this->routines.at(i)->lastPulse = gameTime;
-                }
-            //if returned 0 or expired then remove
-            if (ret == 0 || (this->routines.at(i)->lifeTime > 0 &&
-                gameTime - this->routines.at(i)->startTime > this->routines.at(i)->lifeTime))
-            {
-                this->routinePool.Free(this->routines.at(i));
-                this->routines.at(i) = this->routines.back();
-                this->routines.pop_back();
-            }
-        }
+    vector<float>& Surface::_GetPixels()
+    {
+        return this->pixels;
     }
 
-    // Add a new routine.
-    //func: code to execute by event (function pointer or closure)
-    //      func must return an int. This is to make it easier to remove routines from inside. 
-    //      If func returns 0, routine is destroyed.
-    //delay: how long to wait before start running
-    //lifeTime: destroy event after that time, 0 to never destroy
-    //tick: run event once every tick seconds, 0 to run every frame
-    Routine* RoutineManager::AddRoutine(const std::function<int()>& func, int id, double delay, double lifeTime, double tick)
+    void Surface::SetBatching(bool val)
     {
-        Routine* newRoutine = this->routinePool.Alloc();
-
-        if (newRoutine == nullptr)
-            return nullptr;
+        this->batching = val;
+    }
 
-        newRoutine->tick = tick;
-        newRoutine->lifeTime = lifeTime;
-        newRoutine->delay = delay;
-        newRoutine->startTime = time->GetGameTime();
-        newRoutine->activity = func;
-        newRoutine->id = id;
-        newRoutine->lastPulse = 0;
-        newRoutine->remove = false;
-        this->routines.push_back(newRoutine);
+    bool Surface::IsBatching() const
+    {
+        return this->batching;
+    }
 
-        return newRoutine;
+    const SpriteBatch& Surface::GetBatch() const
+    {
+        return this->batch;
     }
 
-    void RoutineManager::RemoveRoutine(Routine* r)
+    void Surface::_FlushBatch()
     {
-        r->remove = true;
+        this->batch.End();
+        this->batch._Submit();
+        this->batch.Begin();
     }
 
-    Routine* RoutineManager::AddRoutine(const std::function<int()>& func)
+    void Surface::SetExtraBufferPSdata(void* data)
     {
-        return this->AddRoutine(func, 0, 0, 0, 0);
+        this->extraBufferPSdata = data;
     }
 
-    // Find routine.
-    // Note, this method performs linear search to find by name.
-    // name: name of the routine
-    Routine* RoutineManager::FindRoutine(int id)
+    void Surface::Add(Drawable* d)
     {
-        if (id == 0)
-            return nullptr;
+        d->_SetIndex((int)drawables.size());
+        d->_SetSurface(this);
+        this->drawables.push_back(d);
+    }
 
-        for (int i = 0; i < this->routines.size(); i++)
-            if (this->routines.at(i)->id == id)
-                return this->routines.at(i);
+    // Remove all drawables from the surface without destroying them.
+    void Surface::RemoveAll()
+    {
+        for (uint i = 0; i < this->drawables.size(); i++)
+        {
+            this->drawables.at(i)->_SetIndex(-1);
+            this->drawables.at(i)->_SetSurface(nullptr);
+        }
 
-        return nullptr;
+        this->drawables.clear();
     }
 
-    void RoutineManager::Trigger(int _event, int data)
+    //
+    void Surface::Remove(Drawable* d)
     {
-        auto it = this->handlers.find(_event);
+        int indexOfd = d->_GetIndex();
 
-        if (it == this->handlers.end())
+        if (indexOfd == -1)
             return;
 
-        for (auto& handler : it->second)
-            handler(data);
-    }
+        // if d is not at the end
+        if (indexOfd != this->drawables.size() - 1)
+        {
+            // move back to where d is and update its index
+            this->drawables.back()->_SetIndex(indexOfd);
+            this->drawables.at(indexOfd) = this->drawables.back();
+        }
 
-    void RoutineManager::AddHandler(int _event, const std::function<void(int)>& handler)
-    {
-        this->handlers[_event].push_back(handler);
+        this->drawables.pop_back();
+        d->_SetIndex(-1);
+        d->_SetSurface(nullptr);
     }
 
-    // Remove all handlers for that event.
-    void RoutineManager::ClearHandlers(int _event)
+    // Destroy all drawables from this surface.
+    void Surface::Clear()
     {
-        auto it = this->handlers.find(_event);
-
-        if (it == this->handlers.end())
-            return;
+        for (uint i = 0; i < this->drawables.size(); i++)
+            this->drawables.at(i)->Destroy();
 
-        it->second.clear();
+        this->drawables.clear();
     }
 
-    // Remove all handlers.
-    void RoutineManager::ClearHandlers()
+    PixelShader* Surface::GetPixelShader() const
     {
-        this->handlers.clear();
+        return this->ps;
     }
 
-    // Remove all routines.
-    // Don't call it from inside a routine.
-    void RoutineManager::ClearRoutines()
+    void Surface::SetPixelShader(PixelShader* ps)
     {
-        this->routines.clear();
+        this->ps = ps;
     }
 
-    void RoutineManager::_Destroy()
+    void Surface::_DrawAll()
     {
-        this->ClearRoutines();
-        this->ClearHandlers();
+        renderBackend->_BeginSurface(this);
 
-        delete this;
-    }
-}
-#pragma endregion
+        if (!this->batching)
+        {
+            for (int i = 0; i < this->drawables.size(); i++)
+                this->drawables.at(i)->_Draw();
 
-/*@// PixelShader ****************************************************************************************************@*/
-namespace viva
-{
-    class PixelShader : public Destroyable
-    {
-    protected:
-        ID3D11PixelShader* ps;
-    public:
-        PixelShader(ID3D11PixelShader* _ps);
-        void Destroy();
-        ID3D11PixelShader* GetPS() const;
-    };
-}
+            renderBackend->_EndSurface(this);
+            return;
+        }
 
-#pragma region code
-namespace viva
-{
-    PixelShader::PixelShader(ID3D11PixelShader* _ps) :ps(_ps)
-    {
+        this->batch.Begin();
+
+        for (int i = 0; i < this->drawables.size(); i++)
+        {
+            if (this->drawables.at(i)->_Batch(&this->batch))
+                continue;
+
+            // keep order between batched and non batched drawables
+            if (this->batch.GetCount() > 0)
+                this->_FlushBatch();
+
+            this->drawables.at(i)->_Draw();
+        }
+
+        this->batch.End();
+        this->batch._Submit();
+        renderBackend->_EndSurface(this);
     }
 
-    void PixelShader::Destroy()
+    void Surface::_DrawSurface()
     {
-        this->ps->Release();
-        delete this;
+        renderBackend->_DrawSurface(this);
     }
 
-    ID3D11PixelShader* PixelShader::GetPS() const
+    void Surface::Destroy()
     {
-        return this->ps;
+        this->Clear();
+
+#ifdef _WIN32
+        if (this->tex != nullptr)
+        {
+            this->tex->Release();
+            this->rtv->Release();
+            this->srv->Release();
+        }
+#endif
     }
 }
 #pragma endregion
 
-//class VertexShader
-//{
-//protected:
-//public:
-//	virtual void Destroy() = 0;
-//};
-
-    /*@// Camera *********************************************************************************************************@*/
+    /*@// Polygon ********************************************************************************************************@*/
 namespace viva
 {
-    class Camera
+    // Drawable that consist of lines.
+    class Polygon : public Drawable
     {
-    private:
-        Transform lookAt;
-        Matrix sca;
-        Matrix scaLoc;
-        Size pixel2unit;
-        Size unit2pixel;
-        // size in world units of the client rect
-        Size frustumSize;
+    protected:
+        //float span; //distance from origin to the furthest vertex
+        uint vertexCount;
+        Transform transform;
+        Surface* parent;
+        uint index;
+        bool visible;
+        VertexBuffer* vertexBuffer;
+        PixelShader* ps;
     public:
-        // Default ctor.
-        // size: viewport size
-        Camera(const Size& size);
+        // Ctor.
+        // count: vertex count
+        Polygon(VertexBuffer* vb);
 
-        /*XMFLOAT3 GetCursorWorldPos(float z);
-        XMMATRIX GetViewMatrix();
-        XMMATRIX GetProjMatrix();*/
+        // Get transform of the object.
+        Transform* T();
 
-        const Matrix& _GetSca() const;
+        // Get transform of the object.
+        Transform* GetTransform();
 
-        const Matrix& _GetScaLoc() const;
+        //XMMATRIX _GetScaleMatrix() override;
 
-        Transform* GetLookAt();
+        //float GetSpan() const { return span; }
 
-        // Returns screen coordinates in pixels of the given world coordinates
-        Point WorldToScreen(const Vector& pos) const;
+        //make exact (but independent) copy and add to draw manager
+        //stuff that is not copied: children (since they can have only one parent)
+        //virtual Polygon* Clone();
 
-        Vector ScreenToWorld(const Point& pos) const;
+        // Get pixel shader.
+        PixelShader* GetPixelShader() const;
 
-        Size Pixel2World(const Size& in) const;
+        // Set pixel shader.
+        // ps: the ps
+        void SetPixelShader(PixelShader* ps);
 
-        Size World2Pixel(const Size& in) const;
+        // Get vertex count.
+        uint GetVertexCount() const;
 
-        const Size& GetPixel2UnitConversion() const;
+        Surface* GetSurface() const override;
 
-        const Size& GetUnit2PixelConversion() const;
+        bool IsVisible() const override;
 
-        const Size& GetFrustumSize() const;
+        Drawable* SetVisible(bool val) override;
 
-        void _Destroy();
+        void _SetSurface(Surface* surface) override;
 
-        void _Activity();
+        void _SetIndex(uint i) override;
+
+        int _GetIndex() const override;
+
+        void _Draw() override;
+
+        void Destroy() override;
     };
 }
 
 #pragma region code
 namespace viva
 {
-    Camera::Camera(const Size& unitSize) : 
-        unit2pixel(unitSize)
+    Polygon::Polygon(VertexBuffer* vb)
+        : parent(nullptr), index(-1), visible(true), vertexBuffer(vb), 
+        vertexCount(vb->GetVertexCount()), ps(d3d.defaultPS)
     {
-        auto& clientSize = engine->GetClientSize();
-
-        this->pixel2unit = { 1.0f / unitSize.width,
-            1.0f / unitSize.height };
-
-        frustumSize = {clientSize.width / unitSize.width, clientSize.height / unitSize.height};
     }
 
-    void Camera::_Activity()
+    // Get transform of the object.
+    Transform* Polygon::T()
     {
-        this->lookAt._Update();
-
-        auto& clientSize = engine->GetClientSize();
-        this->sca = math::matrix::scale(
-            2.0f / clientSize.width * this->unit2pixel.width,
-            2.0f / clientSize.height * this->unit2pixel.height);
-        this->scaLoc = this->sca *
-            math::matrix::translate(-this->lookAt.Pos().x, this->lookAt.Pos().y);
+        return &(this->transform);
     }
 
-    Transform* Camera::GetLookAt()
+    // Get transform of the object.
+    Transform* Polygon::GetTransform()
     {
-        return &this->lookAt;
+        return &(this->transform);
     }
 
-    const Size& Camera::GetFrustumSize() const
+    //XMMATRIX _GetScaleMatrix() override;
+
+    //float GetSpan() const { return span; }
+
+    //make exact (but independent) copy and add to draw manager
+    //stuff that is not copied: children (since they can have only one parent)
+    //virtual Polygon* Clone();
+    
+    // Get vertex count.
+    uint Polygon::GetVertexCount() const
     {
-        return this->frustumSize;
+        return this->vertexCount;
     }
 
-    const Size& Camera::GetPixel2UnitConversion() const
+    Surface* Polygon::GetSurface() const
     {
-        return this->pixel2unit;
+        return this->parent;
     }
 
-    const Size& Camera::GetUnit2PixelConversion() const
+    bool Polygon::IsVisible() const
     {
-        return this->unit2pixel;
+        return this->visible;
     }
 
-    Size Camera::Pixel2World(const Size& in) const
+    Drawable* Polygon::SetVisible(bool val)
     {
-        return Size(in.width * this->pixel2unit.width, in.height * this->pixel2unit.height);
+        this->visible = val;
+        return this;
     }
 
-    Size Camera::World2Pixel(const Size& in) const
+    void Polygon::_SetSurface(Surface* surface)
     {
-        return Size(in.width * this->unit2pixel.width, in.height * this->unit2pixel.height);
+        this->parent = surface;
     }
 
-    /*XMFLOAT3 GetCursorWorldPos(float z);
-    XMMATRIX GetViewMatrix();
-    XMMATRIX GetProjMatrix();*/
-    
-    // Get view matrix.
-    const Matrix& Camera::_GetSca() const
+    void Polygon::_SetIndex(uint i)
     {
-        return this->sca;
+        this->index = i;
     }
 
-    const Matrix& Camera::_GetScaLoc() const
+    int Polygon::_GetIndex() const
     {
-        return this->scaLoc;
+        return this->index;
     }
 
-    // Returns screen coordinates in pixels of the given world coordinates
-    Point Camera::WorldToScreen(const Vector& pos) const
+    PixelShader* Polygon::GetPixelShader() const
     {
-        throw Error(__FUNCTION__, "Not implemented");
-        return Point(0, 0);
+        return this->ps;
     }
 
-    Vector Camera::ScreenToWorld(const Point& pos) const
+    void Polygon::SetPixelShader(PixelShader* _ps)
     {
-        throw Error(__FUNCTION__, "Not implemented");
-        return Vector();
+        this->ps = _ps;
     }
 
-    void Camera::_Destroy()
+    void Polygon::_Draw()
+    {
+        if (!this->visible)
+            return;
+
+        renderBackend->_DrawLineStrip(this->transform.GetWorldViewProj(), this->vertexBuffer, this->color, this->ps);
+    }
+
+    void Polygon::Destroy()
     {
+        if (!this->vertexBuffer->IsShared())
+            this->vertexBuffer->Destroy();
+
+        if (this->index != -1)
+            this->parent->Remove(this);
+
         delete this;
     }
 }
 #pragma endregion
 
-/*@// Sprite *********************************************************************************************************@*/
+    /*@// Texture ********************************************************************************************************@*/
 namespace viva
 {
-    // Drawable picture.
-    class Sprite : public Drawable
+    class Texture : public Destroyable
     {
     protected:
-        TextureFilter filter;
-        Rect uv;
-        bool flipHorizontally;
-        bool flipVertically;
-        Transform transform;
-        Surface* parent;
-        uint index;
-        bool visible;
-        Texture* texture;
-        PixelShader* ps;
+        ID3D11ShaderResourceView* shaderResource;
+        vector<Color> pixels; // software backend samples from here
+        Size size;
+        bool loaded; // false while it's a placeholder of async load
+        std::string loadError; // empty unless async load failed
+        Texture* page; // atlas page this texture is part of, nullptr if it has its own SRV
+        Rect region; // part of the page, 0-1 from left top
     public:
-        // Ctor.
-        Sprite(Texture* tex, PixelShader* _ps);
-
-        // Get transform of the object.
-        Transform* T();
-
-        // Get transform of the object.
-        Transform* GetTransform();
-
-        // Set filter type.
-        Sprite* SetTextureFilter(TextureFilter _filter);
-
-        // Get filter type.
-        TextureFilter GetTextureFilter() const;
-
-        // Set scale to match texture size.
-        Sprite* SetScale2TextureSize();
-
-        // Is sprite flipped horizontally.
-        bool IsFlippedHorizontally() const;
-
-        // Set horizontal flip.
-        // _flipHorizontally: flip or not
-        Sprite* SetFlipHorizontally(bool _flipHorizontally);
+        Texture(ID3D11ShaderResourceView* srv, const Size& size);
 
-        // Is sprite flipped vertically.
-        bool IsFlippedVertically() const;
+        // Texture in system memory.
+        // pixels: pixels starting from left top
+        // size: size in pixels
+        Texture(const Color* pixels, const Size& size);
 
-        // Set vertical flip.
-        // _flipVertically: flip or not
-        Sprite* SetFlipVertically(bool _flipVertically);
-        
-        // Get uv.
-        const Rect& GetUV() const;
+        // Part of atlas page. It's drawn with page's SRV so sprites on one page batch together.
+        // page: atlas page
+        // regionPx: part of the page in pixels, left top right bottom
+        Texture(Texture* page, const Rect& regionPx);
 
-        // Get PS.
-        PixelShader* GetPixelShader() const;
+        const Size& GetSize() const;
 
-        //Set Ps.
-        Sprite* SetPixelShader(PixelShader* ps);
+        void Destroy();
 
-        // Set uv.
-        // _uv: new uv
-        //         0          
-        //    +---------+     
-        //    |         |     
-        // 0  |         | 1    
-        //    |         |      
-        //    +---------+      
-        //         1          
-        Sprite* SetUV(const Rect& _uv);
+        ID3D11ShaderResourceView** GetSRV();
 
-        // Set uv.
-        Sprite* SetUV(float left, float top, float right, float bottom);
+        const vector<Color>& _GetPixels() const;
 
-        // Get texture associated with this sprite. Sprites can share a texture.
-        Texture* GetTexture() const;
+        // Placeholder is drawn until async load finishes.
+        bool IsLoaded() const;
 
-        Surface* GetSurface() const override;
+        // Why async load failed, nullptr if it didn't. Failed texture stays a placeholder.
+        const char* GetLoadError() const;
 
-        bool IsVisible() const override;
+        void _SetLoaded(bool val);
 
-        Drawable* SetVisible(bool val) override;
+        void _SetLoadError(const std::string& error);
 
-        void _SetSurface(Surface* surface) override;
+        // Take over contents of other texture and destroy it. Placeholders become real textures this way
+        // so everything that points at them gets the real one.
+        void _Adopt(Texture* other);
 
-        void _SetIndex(uint i) override;
+        // Atlas page or nullptr if the texture is standalone.
+        Texture* GetPage() const;
 
-        int _GetIndex() const override;
+        // Part of the page, 0-1 from left top. Whole texture for standalone textures.
+        const Rect& GetRegion() const;
 
-        void _Draw() override;
+        // Texture that is actually bound when drawing, the page or this.
+        Texture* _GetDrawTexture();
 
-        void Destroy() override;
+        // Map sprite uv (see Sprite::SetUV()) of this texture to uv of the page.
+        Rect _MapUV(const Rect& uv) const;
     };
 }
 
 #pragma region code
 namespace viva
 {
-    Sprite::Sprite(Texture* tex, PixelShader* ps) 
-        : filter(drawManager->GetDefaultTextureFilter()), uv(0, 0, 1, 1), flipHorizontally(false),
-        flipVertically(false), parent(nullptr), index(-1), visible(true), texture(tex), ps(ps)
+    Texture::Texture(ID3D11ShaderResourceView* srv, const Size& size)
+        : shaderResource(srv), size(size), loaded(true), page(nullptr), region(0, 0, 1, 1)
     {
-        this->color = { 255,255,255,255 };
     }
 
-    void Sprite::_Draw()
+    Texture::Texture(const Color* pixels, const Size& size)
+        : shaderResource(nullptr), pixels(pixels, pixels + (uint)size.width * (uint)size.height), size(size), loaded(true),
+        page(nullptr), region(0, 0, 1, 1)
     {
-        //update transform
-        this->T()->_Update();
-
-        if (!this->visible)
-            return;
-
-        // transform
-        Matrix matT = this->transform.GetWorldViewProj().transpose();
-        d3d.context->UpdateSubresource(d3d.constantBufferVS, 0, NULL, &matT, 0, 0);
-        // uv
-        Rect finaluv;
-        finaluv.left = flipHorizontally ? this->uv.right : this->uv.left;
-        finaluv.right = flipHorizontally ? this->uv.left : this->uv.right;
-        finaluv.top = flipVertically ? this->uv.bottom : this->uv.top;
-        finaluv.bottom = flipVertically ? this->uv.top : this->uv.bottom;
-        d3d.context->UpdateSubresource(d3d.constantBufferUV, 0, 0, &finaluv, 0, 0);
-        // rs
-        d3d.context->RSSetState(d3d.rsSolid);
-        // sampler and color
-        d3d.context->PSSetSamplers(0, 1, &d3d.samplerPoint);
-        float fColor[] = { this->color.r / 255.0f,this->color.g / 255.0f,this->color.b / 255.0f,this->color.a / 255.0f };
-        d3d.context->UpdateSubresource(d3d.constantBufferPS, 0, 0, fColor, 0, 0);
-        //extra buffer
-        if (extraBufferPSdata != nullptr)
-            d3d.context->UpdateSubresource(d3d.constantBufferPSExtra, 0, 0, extraBufferPSdata, 0, 0);
-        // ps
-        d3d.context->PSSetShader(ps->GetPS(), 0, 0);
-        // vb
-        UINT stride = sizeof(Vertex);
-        UINT offset = 0;
-        d3d.context->IASetVertexBuffers(0, 1, &d3d.vertexBuffer, &stride, &offset);
-        d3d.context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-        // texture
-        d3d.context->PSSetShaderResources(0, 1, this->texture->GetSRV());
-
-        d3d.context->DrawIndexed(6, 0, 0);
     }
 
-    // Get transform of the object.
-    Transform* Sprite::T()
+    Texture::Texture(Texture* page, const Rect& regionPx)
+        : shaderResource(nullptr), size(regionPx.right - regionPx.left, regionPx.bottom - regionPx.top), loaded(true),
+        page(page)
     {
-        return &(this->transform);
+        const Size& pageSize = page->GetSize();
+        this->region = Rect(regionPx.left / pageSize.width, regionPx.top / pageSize.height,
+            regionPx.right / pageSize.width, regionPx.bottom / pageSize.height);
     }
 
-    // Get transform of the object.
-    Transform* Sprite::GetTransform()
+    Texture* Texture::GetPage() const
     {
-        return &(this->transform);
+        return this->page;
     }
 
-    Sprite* Sprite::SetScale2TextureSize()
+    const Rect& Texture::GetRegion() const
     {
-        this->transform.SetPixelScale(this->texture->GetSize());
-        return this;
+        return this->region;
     }
 
-    // Set filter type.
-    Sprite* Sprite::SetTextureFilter(TextureFilter _filter)
+    Texture* Texture::_GetDrawTexture()
     {
-        this->filter = _filter;
-        return this;
+        return this->page != nullptr ? this->page : this;
     }
 
-    // Get filter type.
-    TextureFilter Sprite::GetTextureFilter() const
+    Rect Texture::_MapUV(const Rect& uv) const
     {
-        return this->filter;
-    }
+        if (this->page == nullptr)
+            return uv;
 
-    // Is sprite flipped horizontally.
-    bool Sprite::IsFlippedHorizontally() const
-    {
-        return this->flipHorizontally;
+        // sprite uv has v flipped, see Sprite::SetUV()
+        float width = this->region.right - this->region.left;
+        float height = this->region.bottom - this->region.top;
+        return Rect(
+            this->region.left + uv.left * width,
+            1 - (this->region.top + (1 - uv.top) * height),
+            this->region.left + uv.right * width,
+            1 - (this->region.top + (1 - uv.bottom) * height));
     }
 
-    // Set horizontal flip.
-    // _flipHorizontally: flip or not
-    Sprite* Sprite::SetFlipHorizontally(bool _flipHorizontally)
+    bool Texture::IsLoaded() const
     {
-        this->flipHorizontally = _flipHorizontally;
-        return this;
+        return this->loaded;
     }
 
-    // Is sprite flipped vertically.
-    bool Sprite::IsFlippedVertically() const
+    void Texture::_SetLoaded(bool val)
     {
-        return this->flipVertically;
+        this->loaded = val;
     }
 
-    // Set vertical flip.
-    // _flipVertically: flip or not
-    Sprite* Sprite::SetFlipVertically(bool _flipVertically)
+    const char* Texture::GetLoadError() const
     {
-        this->flipVertically = _flipVertically;
-        return this;
+        return this->loadError.empty() ? nullptr : this->loadError.c_str();
     }
 
-    // Get uv.
-    const Rect& Sprite::GetUV() const
-    {
-        return this->uv;
-    }
-    
-    // Set uv.
-    // _uv: new uv
-    //         0          
-    //    +---------+     
-    //    |         |     
-    // 0  |         | 1    
-    //    |         |      
-    //    +---------+      
-    //         1          
-    Sprite* Sprite::SetUV(const Rect& _uv)
+    void Texture::_SetLoadError(const std::string& error)
     {
-        this->uv = Rect(_uv.left, 1 - _uv.bottom, _uv.right, 1 - _uv.top);
-        return this;
+        this->loadError = error;
     }
 
-    // Set uv.
-    Sprite* Sprite::SetUV(float left, float top, float right, float bottom)
+    void Texture::_Adopt(Texture* other)
     {
-        return this->SetUV(Rect(left, top, right, bottom));
-    }
+#ifdef _WIN32
+        if (this->shaderResource != nullptr)
+            this->shaderResource->Release();
+#endif
 
-    Surface* Sprite::GetSurface() const
-    {
-        return this->parent;
-    }
+        this->shaderResource = other->shaderResource;
+        this->pixels.swap(other->pixels);
+        this->size = other->size;
+        this->loaded = true;
 
-    bool Sprite::IsVisible() const
-    {
-        return this->visible;
+        other->shaderResource = nullptr;
+        other->Destroy();
     }
 
-    Drawable* Sprite::SetVisible(bool val)
+    const vector<Color>& Texture::_GetPixels() const
     {
-        this->visible = val;
-        return this;
-    }
+        if (this->page != nullptr)
+            return this->page->_GetPixels();
 
-    void Sprite::_SetSurface(Surface* surface)
-    {
-        this->parent = surface;
+        return this->pixels;
     }
 
-    void Sprite::_SetIndex(uint i)
+    const Size& Texture::GetSize() const
     {
-        this->index = i;
+        return this->size;
     }
 
-    int Sprite::_GetIndex() const
+    void Texture::Destroy()
     {
-        return this->index;
-    }
+        // cached textures are shared
+        if (resourceManager->_Release(this))
+            return;
 
-    void Sprite::Destroy()
-    {
-        if (this->index != -1)
-            drawManager->Remove(this);
+        // decoded pixels have nowhere to go
+        if (!this->loaded)
+            textureLoader->_Cancel(this);
+
+#ifdef _WIN32
+        if (this->shaderResource != nullptr)
+            this->shaderResource->Release();
+#endif
 
         delete this;
     }
 
-    Texture* Sprite::GetTexture() const
+    ID3D11ShaderResourceView** Texture::GetSRV()
     {
-        return this->texture;
-    }
+        if (this->page != nullptr)
+            return this->page->GetSRV();
 
-    // Get PS.
-    PixelShader* Sprite::GetPixelShader() const
-    {
-        return this->ps;
+        return &(this->shaderResource);
     }
+}
+#pragma endregion
 
-    //Set Ps.
-    Sprite* Sprite::SetPixelShader(PixelShader* ps)
+    /*@// TextureLoader **************************************************************************************************@*/
+namespace viva
+{
+    // Loads textures in the background. Files are read and decoded on a pool of threads, main thread
+    // uploads decoded pixels to the render backend at the start of the frame, within upload budget.
+    class TextureLoader
     {
-        this->ps = ps;
-        return this;
-    }
-}
-#pragma endregion
-
-    /*@// Animation ******************************************************************************************************@*/
-namespace viva
-{
-    class Animation : public Drawable
-    {
-    protected:
-        vector<Action> actions;
-        vector<std::function<void(int)>> onFrameChangedhandlers;
-        vector<std::function<void(int)>> onActionLoopedHandlers;
-        Action* currentAction;
-        Sprite* sprite;
-
-        // progress of the animation
-        double indicator;
-
-        // currently displayed frame
-        int currentFrame;
-    public:
-        Animation(Sprite* _sprite);
-
-        // Get transform of the object.
-        Transform* T();
-
-        // Get transform of the object.
-        Transform* GetTransform();
-
-        void _Play();
-
-        // Advances animation to the next frame.
-        // If the current frame is the last then this method sets current frame to 0.
-        void NextFrame();
-
-        // Goes back in the animation.
-        // If the current frame is the first then this method sets current frame to the last one.
-        void PreviousFrame();
-
-        Sprite* GetSprite() const;
-
-        double GetSpeed() const;
-
-        void SetSpeed(double speed);
-
-        int GetFrame() const;
-
-        void SetFrame(int _currentFrame);
-
-        void SetAction(int id);
-
-        Action* GetAction() const;
-
-        void AddAction(double speed, int columns, int rows, int first, int last);
-
-        void AddAction(double speed, const vector<Rect>& uvTable);
-
-        void AddAction(double speed, const Size& texSizePx, const vector<Rect>& uvTablePx);
-
-        void AddOnFrameChangeHandler(const std::function<void(int)>& fun);
+    private:
+        struct Job
+        {
+            Texture* texture; // placeholder, main thread only
+            std::string filename;
+            Color* pixels; // from stb, free()
+            Size size;
+            std::string error;
+            double decodeSeconds;
+            std::atomic<bool> cancelled;
+        };
 
-        void AddOnActionLoopedHandler(const std::function<void(int)>& fun);
+        vector<std::thread> threads;
+        std::deque<Job*> queue; // waiting for decode
+        std::deque<Job*> decoded; // waiting for upload
+        mutable std::mutex lock; // queue, decoded, decodeSeconds
+        std::condition_variable wake; // workers wait for jobs
+        std::condition_variable done; // Finish() waits for decoded jobs
+        std::unordered_map<Texture*, Job*> inflight; // main thread, jobs of textures that are not loaded yet
+        uint uploadCount; // 0 is no limit
+        double uploadSeconds;
+        double decodeSeconds;
+        bool stop;
 
-        void ClearOnFrameChangeHandlers();
+        void _WorkerLoop();
 
-        void ClearAddOnActionLoopedHandlers();
+        void _StartThreads(uint count);
 
-        void _Draw() override;
+        void _StopThreads();
 
-        Surface* GetSurface() const override;
+        // Upload decoded jobs, at most maxCount. Returns how many were uploaded.
+        uint _Upload(uint maxCount, double maxSeconds);
+    public:
+        // Ctor.
+        // threadCount: decode threads, at least 1
+        TextureLoader(uint threadCount);
 
-        bool IsVisible() const override;
+        // Start loading file. Returns 1x1 transparent placeholder that becomes the texture when it's
+        // uploaded, check Texture::IsLoaded(). Size of the placeholder is not the size of the image.
+        // If the file can't be loaded, Texture::GetLoadError() says why.
+        // filename: file path
+        Texture* Load(const char* filename);
 
-        Drawable* SetVisible(bool val) override;
+        // Queue all files at once so every decode thread has work.
+        // filenames: file paths
+        vector<Texture*> LoadBatch(const vector<std::string>& filenames);
 
-        void _SetSurface(Surface* surface) override;
+        // Limit how many textures are uploaded every frame, the rest waits for the next frame.
+        // 0 means no limit which is default.
+        // maxCount: max textures per frame
+        // maxSeconds: max time per frame
+        void SetUploadBudget(uint maxCount, double maxSeconds);
 
-        void _SetIndex(uint i) override;
+        // Change number of decode threads. Waits for decodes that are running.
+        void SetThreadCount(uint count);
 
-        int _GetIndex() const override;
+        uint GetThreadCount() const;
 
-        void Destroy() override;
-        
-        // Set scale to match texture size.
-        Animation* SetScale2TextureSize();
+        // Textures that are not uploaded yet.
+        uint GetPending() const;
 
-        // Is sprite flipped horizontally.
-        bool IsFlippedHorizontally() const;
+        // Sum of time all threads spent reading and decoding.
+        double GetDecodeSeconds() const;
 
-        // Set horizontal flip.
-        // _flipHorizontally: flip or not
-        Animation* SetFlipHorizontally(bool _flipHorizontally);
+        void ResetStats();
 
-        // Is sprite flipped vertically.
-        bool IsFlippedVertically() const;
+        // Block until everything queued is decoded and uploaded, ignores upload budget.
+        void Finish();
 
-        // Set vertical flip.
-        // _flipVertically: flip or not
-        Animation* SetFlipVertically(bool _flipVertically);
+        // Texture was destroyed before it was loaded.
+        void _Cancel(Texture* texture);
 
-        // Set filter type.
-        Animation* SetTextureFilter(TextureFilter _filter);
+        // Upload what was decoded.
+        void _Activity();
 
-        // Get filter type.
-        TextureFilter GetTextureFilter() const;
+        void _Destroy();
     };
 }
 
 #pragma region code
 namespace viva
 {
-    Animation::Animation(Sprite* _sprite)
-        : currentAction(nullptr), sprite(_sprite), indicator(0), currentFrame(0)
+    TextureLoader::TextureLoader(uint threadCount) : uploadCount(0), uploadSeconds(0), decodeSeconds(0), stop(false)
     {
+        this->_StartThreads(threadCount);
     }
 
-    // Get transform of the object.
-    Transform* Animation::T()
+    void TextureLoader::_StartThreads(uint count)
     {
-        return this->sprite->T();
+        if (count == 0)
+            count = 1;
+
+        this->stop = false;
+        for (uint i = 0; i < count; i++)
+            this->threads.push_back(std::thread(&TextureLoader::_WorkerLoop, this));
     }
 
-    // Get transform of the object.
-    Transform* Animation::GetTransform()
+    void TextureLoader::_StopThreads()
     {
-        return this->sprite->T();
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->stop = true;
+        }
+        this->wake.notify_all();
+
+        // jobs that were not started stay in the queue for the next threads
+        for (uint i = 0; i < this->threads.size(); i++)
+            this->threads[i].join();
+        this->threads.clear();
     }
 
-    void Animation::_Play()
+    void TextureLoader::_WorkerLoop()
     {
-        if (this->currentAction != nullptr && this->currentAction->speed != 0)
+        while (true)
         {
-            this->indicator += this->currentAction->speed * time->GetFrameTime();
-            if (this->indicator >= 1)
+            Job* job;
             {
-                this->indicator = 0;
-                this->NextFrame();
+                std::unique_lock<std::mutex> guard(this->lock);
+                this->wake.wait(guard, [this] { return this->stop || !this->queue.empty(); });
+
+                if (this->stop)
+                    return;
+
+                job = this->queue.front();
+                this->queue.pop_front();
             }
-            else if (this->indicator < 0)
+
+            auto start = std::chrono::steady_clock::now();
+
+            if (!job->cancelled)
             {
-                this->indicator = 1;
-                this->PreviousFrame();
+                try
+                {
+                    job->size = util::ReadImageToPixels(job->filename.c_str(), &job->pixels);
+                }
+                catch (const std::exception& e)
+                {
+                    job->error = e.what();
+                }
+                catch (...)
+                {
+                    job->error = "Unknown error";
+                }
             }
-        }
 
-        if (this->currentAction != nullptr)
-            this->sprite->SetUV(this->currentAction->uvTable.at(this->currentFrame));
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            {
+                std::lock_guard<std::mutex> guard(this->lock);
+                job->decodeSeconds = seconds;
+                this->decodeSeconds += seconds;
+                this->decoded.push_back(job);
+            }
+            this->done.notify_all();
+        }
     }
 
-    // Advances animation to the next frame.
-    // If the current frame is the last then this method sets current frame to 0.
-    void Animation::NextFrame()
+    Texture* TextureLoader::Load(const char* filename)
     {
-        if (this->currentAction == nullptr)
-            return;
-
-        this->currentFrame++;
+        Color transparent(0, 0, 0, 0);
+        Texture* texture = renderBackend->_CreateTexture(&transparent, Size(1, 1));
+        texture->_SetLoaded(false);
 
-        for (int i = 0; i < this->onFrameChangedhandlers.size(); i++)
-            this->onFrameChangedhandlers.at(i)(currentFrame);
+        Job* job = new Job();
+        job->texture = texture;
+        job->filename = filename;
+        job->pixels = nullptr;
+        job->decodeSeconds = 0;
+        job->cancelled = false;
+        this->inflight[texture] = job;
 
-        if (this->currentFrame >= this->currentAction->length)
         {
-            this->currentFrame = 0;
-
-            for (int i = 0; i < this->onActionLoopedHandlers.size(); i++)
-                this->onActionLoopedHandlers.at(i)(this->currentFrame);
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->queue.push_back(job);
         }
+        this->wake.notify_one();
+
+        return texture;
     }
 
-    // Goes back in the animation.
-    // If the current frame is the first then this method sets current frame to the last one.
-    void Animation::PreviousFrame()
+    vector<Texture*> TextureLoader::LoadBatch(const vector<std::string>& filenames)
     {
-        if (this->currentAction == nullptr)
-            return;
+        vector<Texture*> textures;
+        textures.reserve(filenames.size());
 
-        this->currentFrame--;
-
-        for (int i = 0; i < this->onFrameChangedhandlers.size(); i++)
-            this->onFrameChangedhandlers.at(i)(this->currentFrame);
-
-        if (this->currentFrame < 0)
-        {
-            this->currentFrame = this->currentAction->length - 1;
+        for (size_t i = 0; i < filenames.size(); i++)
+            textures.push_back(this->Load(filenames[i].c_str()));
 
-            for (int i = 0; i < this->onActionLoopedHandlers.size(); i++)
-                this->onActionLoopedHandlers.at(i)(currentFrame);
-        }
+        return textures;
     }
 
-    Sprite* Animation::GetSprite() const
+    void TextureLoader::SetUploadBudget(uint maxCount, double maxSeconds)
     {
-        return this->sprite;
+        this->uploadCount = maxCount;
+        this->uploadSeconds = maxSeconds;
     }
 
-    double Animation::Animation::GetSpeed() const
+    void TextureLoader::SetThreadCount(uint count)
     {
-        if (this->currentAction == nullptr)
-            return INFINITY;
-
-        return this->currentAction->speed;
+        this->_StopThreads();
+        this->_StartThreads(count);
     }
 
-    void Animation::SetSpeed(double speed)
+    uint TextureLoader::GetThreadCount() const
     {
-        if (this->currentAction == nullptr)
-            return;
-
-        this->currentAction->speed = speed;
+        return (uint)this->threads.size();
     }
 
-    int Animation::GetFrame() const
+    uint TextureLoader::GetPending() const
     {
-        return this->currentFrame;
+        return (uint)this->inflight.size();
     }
 
-    void Animation::SetFrame(int _currentFrame)
+    double TextureLoader::GetDecodeSeconds() const
     {
-        if (this->currentAction == nullptr)
-            return;
-
-        this->currentFrame = _currentFrame % this->currentAction->length;
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->decodeSeconds;
     }
 
-    void Animation::SetAction(int index)
+    void TextureLoader::ResetStats()
     {
-        this->currentAction = &this->actions[index];
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->decodeSeconds = 0;
     }
 
-    Action* Animation::GetAction() const
+    void TextureLoader::_Cancel(Texture* texture)
     {
-        if (this->currentAction == nullptr)
-            return nullptr;
+        auto it = this->inflight.find(texture);
+        if (it == this->inflight.end())
+            return;
 
-        return this->currentAction;
+        // job is deleted when it comes back from decode
+        it->second->cancelled = true;
+        this->inflight.erase(it);
     }
 
-    void Animation::AddAction(double speed, int columns, int rows, int first, int last)
+    uint TextureLoader::_Upload(uint maxCount, double maxSeconds)
     {
-        vector<Rect> uvTable;
+        auto start = std::chrono::steady_clock::now();
+        uint count = 0;
 
-        float width = 1.0f / columns;
-        float height = 1.0f / rows;
+        while (maxCount == 0 || count < maxCount)
+        {
+            if (maxSeconds > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= maxSeconds)
+                break;
 
-        for (int i = 0; i < rows; i++)
-            for (int j = 0; j < columns; j++)
+            Job* job;
             {
-                if (columns * i + j >= first)
-                    uvTable.push_back(Rect(width*j, height*i, width*(j + 1), height*(i + 1)));
-                if (columns * i + j >= last)
+                std::lock_guard<std::mutex> guard(this->lock);
+                if (this->decoded.empty())
+                    break;
+
+                job = this->decoded.front();
+                this->decoded.pop_front();
+            }
+
+            if (!job->cancelled)
+            {
+                this->inflight.erase(job->texture);
+
+                if (job->pixels != nullptr)
                 {
-                    // break;
-                    i = rows;
-                    j = columns;
+                    job->texture->_Adopt(renderBackend->_CreateTexture(job->pixels, job->size));
+                    count++;
+                }
+                else
+                {
+                    // failed texture stays a placeholder, the rest keep loading
+                    job->texture->_SetLoadError(job->error.empty() ? "Image has no pixels" : job->error);
                 }
             }
 
-        this->AddAction(speed, uvTable);
+            // free used because library uses malloc
+            if (job->pixels != nullptr)
+                free(job->pixels);
+            delete job;
+        }
+
+        return count;
     }
 
-    void Animation::AddAction(double speed, const Size& texSizePx, const vector<Rect>& uvTablePx)
+    void TextureLoader::Finish()
     {
-        vector<Rect> uvTable;
-
-        for (int i = 0; i < uvTablePx.size(); i++)
+        while (this->inflight.size() > 0)
         {
-            uvTable.push_back({
-                uvTablePx.at(i).left / texSizePx.width,
-                uvTablePx.at(i).top / texSizePx.height,
-                uvTablePx.at(i).right / texSizePx.width,
-                uvTablePx.at(i).bottom / texSizePx.height
-                });
-        }
+            {
+                std::unique_lock<std::mutex> guard(this->lock);
+                this->done.wait(guard, [this] { return !this->decoded.empty(); });
+            }
 
-        this->AddAction(speed, uvTable);
+            this->_Upload(0, 0);
+        }
     }
 
-    void Animation::AddAction(double speed, const vector<Rect>& uvTable)
+    void TextureLoader::_Activity()
     {
-        this->actions.push_back(Action(uvTable, speed));
+        this->_Upload(this->uploadCount, this->uploadSeconds);
     }
 
-    void Animation::AddOnFrameChangeHandler(const std::function<void(int)>& fun)
+    void TextureLoader::_Destroy()
     {
-        this->onFrameChangedhandlers.push_back(fun);
-    }
+        this->_StopThreads();
 
-    void Animation::AddOnActionLoopedHandler(const std::function<void(int)>& fun)
-    {
-        this->onActionLoopedHandlers.push_back(fun);
-    }
+        // placeholders stay placeholders
+        for (size_t i = 0; i < this->queue.size(); i++)
+            delete this->queue[i];
 
-    void Animation::ClearOnFrameChangeHandlers()
-    {
-        this->onFrameChangedhandlers.clear();
-    }
+        for (size_t i = 0; i < this->decoded.size(); i++)
+        {
+            if (this->decoded[i]->pixels != nullptr)
+                free(this->decoded[i]->pixels);
+            delete this->decoded[i];
+        }
 
-    void Animation::ClearAddOnActionLoopedHandlers()
-    {
-        this->onActionLoopedHandlers.clear();
-    }
+        for (auto it = this->inflight.begin(); it != this->inflight.end(); it++)
+            it->first->_SetLoaded(true);
 
-    void Animation::_Draw()
-    {
-        this->_Play();
-
-        if (this->currentAction != nullptr)
-            this->sprite->_Draw();
+        delete this;
     }
+}
+#pragma endregion
 
-    Surface* Animation::GetSurface() const
+    /*@// Atlas **********************************************************************************************************@*/
+namespace viva
+{
+    // Image to be packed.
+    struct AtlasImage
     {
-        return this->sprite->GetSurface();
-    }
+        std::string name;
+        const Color* pixels; // starting from left top
+        int width;
+        int height;
+    };
 
-    bool Animation::IsVisible() const
+    // Where packed image ended up.
+    struct AtlasRegion
     {
-        return this->sprite->IsVisible();
-    }
+        std::string name;
+        uint page;
+        int x, y, width, height; // pixels, without padding
+    };
 
-    Drawable* Animation::SetVisible(bool val)
+    // Skyline bottom-left packer. Only places rectangles, pixels are copied by Pack().
+    // Skyline is a list of segments of the top edge of everything placed so far, new rectangle goes
+    // where its bottom ends up the lowest (highest on the screen, y goes down).
+    class AtlasPacker
     {
-        this->sprite->SetVisible(val);
-        return this;
-    }
+    private:
+        struct Segment
+        {
+            int x, y, width;
+        };
 
-    void Animation::_SetSurface(Surface* surface)
-    {
-        this->sprite->_SetSurface(surface);
-    }
+        vector<Segment> skyline;
+        int width;
+        int height;
+        long long usedArea;
 
-    void Animation::_SetIndex(uint i)
-    {
-        this->sprite->_SetIndex(i);
-    }
+        // y where rectangle fits when it starts at segment 'index', -1 if it doesn't.
+        int _Fit(uint index, int w, int h) const;
+    public:
+        // width, height: page size in pixels
+        AtlasPacker(int width, int height);
+
+        // Empty page.
+        void Reset();
+
+        // Place rectangle. Returns false if page has no room for it.
+        // x, y: left top of the rectangle
+        bool Insert(int w, int h, int& x, int& y);
+
+        // Used area / page area.
+        float GetOccupancy() const;
+
+        // Lowest point of the skyline, page can be cut there.
+        int GetUsedHeight() const;
+
+        // Pack images into pages. Images are sorted by height so skyline stays flat. Padding is
+        // filled with edge pixels so linear filtering doesn't pick up neighbours. No images give no pages,
+        // images without pixels throw.
+        // pageSize: width and height of page in pixels
+        // padding: pixels around each image
+        // pages: pixels of pages, last page is cut to used height
+        // pageSizes: size of each page
+        // regions: one per image, same order as images
+        // returns occupancy of all pages together
+        static float Pack(const vector<AtlasImage>& images, int pageSize, int padding, vector<vector<Color>>& pages,
+            vector<Size>& pageSizes, vector<AtlasRegion>& regions);
+
+        // Offline atlas. Packs image files and writes pages as 'outPrefix'_N.tga and metadata as
+        // 'outPrefix'.atlas. Doesn't need the engine running. Load it with Creator::CreateAtlasFromFile().
+        // filenames: images, regions are named by them
+        // returns occupancy
+        static float Bake(const vector<std::string>& filenames, const char* outPrefix, int pageSize, int padding);
+    };
 
-    int Animation::_GetIndex() const
+    // Pages with many textures on them. Textures of the atlas draw with the SRV of their page so sprites
+    // using them batch together. Sprite::SetUV() and Animation::AddAction() take uv of the texture itself.
+    class Atlas : public Destroyable
     {
-        return this->sprite->_GetIndex();
-    }
+    protected:
+        vector<Texture*> pages;
+        vector<Texture*> textures; // same order as regions
+        std::unordered_map<std::string, Texture*> byName;
+        float occupancy;
+    public:
+        // Throws if a region is not on its page, caller still owns pages then.
+        // pages: atlas owns them
+        // regions: where are textures on pages
+        Atlas(const vector<Texture*>& pages, const vector<AtlasRegion>& regions, float occupancy);
 
-    void Animation::Destroy()
-    {
-        this->sprite->Destroy();
-        delete this;
-    }
+        // Get texture by name, file name if atlas was created from files. Atlas owns it.
+        Texture* Get(const std::string& name) const;
 
-    // Set scale to match texture size.
-    Animation* Animation::SetScale2TextureSize()
-    {
-        this->sprite->SetScale2TextureSize();
-        return this;
-    }
+        // Get texture by index, the same order as images were given.
+        Texture* Get(uint index) const;
 
-    // Is sprite flipped horizontally.
-    bool Animation::IsFlippedHorizontally() const
+        uint GetCount() const;
+
+        Texture* GetPage(uint index) const;
+
+        uint GetPageCount() const;
+
+        // Used area / page area.
+        float GetOccupancy() const;
+
+        // Destroys textures and pages.
+        void Destroy();
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    AtlasPacker::AtlasPacker(int width, int height) : width(width), height(height)
     {
-        return this->sprite->IsFlippedHorizontally();
+        this->Reset();
     }
 
-    // Set horizontal flip.
-    // _flipHorizontally: flip or not
-    Animation* Animation::SetFlipHorizontally(bool _flipHorizontally)
+    void AtlasPacker::Reset()
     {
-        this->sprite->SetFlipHorizontally(_flipHorizontally);
-        return this;
+        this->skyline.clear();
+        this->skyline.push_back({ 0, 0, this->width });
+        this->usedArea = 0;
     }
 
-    // Is sprite flipped vertically.
-    bool Animation::IsFlippedVertically() const
+    int AtlasPacker::_Fit(uint index, int w, int h) const
     {
-        return this->sprite->IsFlippedVertically();
+        int x = this->skyline[index].x;
+        if (x + w > this->width)
+            return -1;
+
+        // rectangle rests on the highest segment under it
+        int y = 0;
+        int left = w;
+        for (uint i = index; left > 0; i++)
+        {
+            y = std::max(y, this->skyline[i].y);
+            if (y + h > this->height)
+                return -1;
+
+            left -= this->skyline[i].width;
+        }
+
+        return y;
     }
 
-    // Set vertical flip.
-    // _flipVertically: flip or not
-    Animation* Animation::SetFlipVertically(bool _flipVertically)
+    bool AtlasPacker::Insert(int w, int h, int& x, int& y)
     {
-        this->sprite->SetFlipVertically(_flipVertically);
-        return this;
+        int best = -1;
+        int bestBottom = INT_MAX;
+        int bestWidth = INT_MAX;
+
+        for (uint i = 0; i < this->skyline.size(); i++)
+        {
+            int fit = this->_Fit(i, w, h);
+            if (fit < 0)
+                continue;
+
+            // lowest bottom, then narrowest segment to waste less
+            if (fit + h < bestBottom || (fit + h == bestBottom && this->skyline[i].width < bestWidth))
+            {
+                best = i;
+                bestBottom = fit + h;
+                bestWidth = this->skyline[i].width;
+            }
+        }
+
+        if (best == -1)
+            return false;
+
+        x = this->skyline[best].x;
+        y = bestBottom - h;
+        this->skyline.insert(this->skyline.begin() + best, { x, bestBottom, w });
+
+        // cut segments covered by the new one
+        for (uint i = best + 1; i < this->skyline.size();)
+        {
+            Segment& s = this->skyline[i];
+            int covered = x + w - s.x;
+            if (covered <= 0)
+                break;
+
+            if (covered < s.width)
+            {
+                s.x += covered;
+                s.width -= covered;
+                break;
+            }
+
+            this->skyline.erase(this->skyline.begin() + i);
+        }
+
+        // merge neighbours of the same height
+        for (uint i = 0; i + 1 < this->skyline.size();)
+        {
+            if (this->skyline[i].y == this->skyline[i + 1].y)
+            {
+                this->skyline[i].width += this->skyline[i + 1].width;
+                this->skyline.erase(this->skyline.begin() + i + 1);
+            }
+            else
+                i++;
+        }
+
+        this->usedArea += (long long)w * h;
+        return true;
     }
 
-    // Set filter type.
-    Animation* Animation::SetTextureFilter(TextureFilter _filter)
+    float AtlasPacker::GetOccupancy() const
     {
-        this->sprite->SetTextureFilter(_filter);
-        return this;
+        return (float)((double)this->usedArea / ((double)this->width * this->height));
     }
 
-    // Get filter type.
-    TextureFilter Animation::GetTextureFilter() const
+    int AtlasPacker::GetUsedHeight() const
     {
-        return this->sprite->GetTextureFilter();
+        int result = 0;
+        for (auto& s : this->skyline)
+            result = std::max(result, s.y);
+
+        return result;
     }
-}
-#pragma endregion
 
-    /*@// Creator ********************************************************************************************************@*/
-namespace viva
-{
-    // Factory for all objects.
-    class Creator
+    float AtlasPacker::Pack(const vector<AtlasImage>& images, int pageSize, int padding, vector<vector<Color>>& pages,
+        vector<Size>& pageSizes, vector<AtlasRegion>& regions)
     {
-    private:
-        ID3D11ShaderResourceView* SrvFromPixels(const Color* pixels, const Size& _size);
-    public:
-        // Create pixel shader from file.
-        // filename: path to file containing pixel shader.
-        PixelShader* CreatePixelShaderFromFile(const char* filename);
+        pages.clear();
+        pageSizes.clear();
+        regions.clear();
+        if (images.size() == 0)
+            return 0;
 
-        // Create pixel shader from string.
-        // str: pixel shader code itself
-        PixelShader* CreatePixelShader(const char* str);
-        
-        Font* CreateFontV(Texture* tex, const char* fontMetrics, bool fromString);
+        vector<uint> order(images.size());
+        for (uint i = 0; i < order.size(); i++)
+        {
+            order[i] = i;
 
-        Font* CreateFontV(Texture* tex, const char* fontMetricsFile);
+            // padding is clamped to the edge pixels, there must be some
+            if (images[i].width <= 0 || images[i].height <= 0 || images[i].pixels == nullptr)
+            {
+                std::string msg = images[i].name + " has no pixels";
+                throw Error(__FUNCTION__, msg.c_str());
+            }
 
-        // Create texture from file. Supported files BMP, GIF, JPEG, PNG, TIFF, Exif, WMF, EMF.
-        // Named (name is given by filename) textures are stored in resource manager automatically. Can be removed by resourceManager::Remove()
-        // filename: file path
-        Texture* CreateTexture(const char* filename);
+            if (images[i].width + padding * 2 > pageSize || images[i].height + padding * 2 > pageSize)
+            {
+                std::string msg = images[i].name + " doesn't fit on atlas page";
+                throw Error(__FUNCTION__, msg.c_str());
+            }
+        }
 
-        // Create texture from pixels. Noname texture are not stored in resource manager but can be stored by resourceManager::Add()
-        // pixels: pixels for the texture starting from left top
-        // size: size of the image in pixels
-        Texture* CreateTexture(const Color* pixels, const Size& size);
+        std::stable_sort(order.begin(), order.end(), [&images](uint a, uint b)
+        {
+            if (images[a].height != images[b].height)
+                return images[a].height > images[b].height;
 
-        Text* CreateText(const wchar_t* str);
+            return images[a].width > images[b].width;
+        });
 
-        Text* CreateText(const wchar_t* str, Font* font);
+        // place everything first, pages are cut to used height later
+        AtlasPacker packer(pageSize, pageSize);
+        vector<int> usedHeights;
+        long long usedArea = 0;
+        regions.resize(images.size());
+        for (uint i : order)
+        {
+            const AtlasImage& image = images[i];
+            int w = image.width + padding * 2;
+            int h = image.height + padding * 2;
+            int x, y;
+            if (!packer.Insert(w, h, x, y))
+            {
+                usedHeights.push_back(packer.GetUsedHeight());
+                packer.Reset();
+                packer.Insert(w, h, x, y);
+            }
 
-        // Create sprite from texture.
-        // texture: existing texture object
-        Sprite* CreateSprite(Texture* texture);
+            regions[i] = { image.name, (uint)usedHeights.size(), x + padding, y + padding, image.width, image.height };
+            usedArea += (long long)image.width * image.height;
+        }
+        usedHeights.push_back(packer.GetUsedHeight());
 
-        // Create polygon from points.
-        // points: vector of points where each point is x,y in world coordinates
-        Polygon* CreatePolygon(const vector<Point>& points);
+        long long pageArea = 0;
+        for (int usedHeight : usedHeights)
+        {
+            pages.push_back(vector<Color>((size_t)pageSize * usedHeight, Color(0, 0, 0, 0)));
+            pageSizes.push_back(Size((float)pageSize, (float)usedHeight));
+            pageArea += (long long)pageSize * usedHeight;
+        }
 
-        // Create polygon from vertex buffer.
-        Polygon* CreatePolygon(VertexBuffer* vb);
+        for (uint i = 0; i < images.size(); i++)
+        {
+            const AtlasImage& image = images[i];
+            const AtlasRegion& r = regions[i];
+            Color* page = pages[r.page].data();
 
-        // Create shared vertex buffer. That can be used by multiple polygons.
-        VertexBuffer* CreateVertexBuffer(const vector<Point>& points, bool shared);
+            // clamp to edge in padding
+            for (int y = -padding; y < r.height + padding; y++)
+            {
+                int sy = std::min(std::max(y, 0), r.height - 1);
+                const Color* src = image.pixels + (size_t)sy * image.width;
+                Color* dst = page + (size_t)(r.y + y) * pageSize + r.x;
+                for (int x = -padding; x < 0; x++)
+                    dst[x] = src[0];
+                memcpy(dst, src, r.width * sizeof(Color));
+                for (int x = r.width; x < r.width + padding; x++)
+                    dst[x] = src[r.width - 1];
+            }
+        }
 
-        // Create shared vertex buffer. That can be used by multiple polygons.
-        VertexBuffer* CreateVertexBuffer(const vector<Point>& points);
+        return pageArea == 0 ? 0 : (float)((double)usedArea / pageArea);
+    }
 
-        net::Server* CreateServer(unsigned short port);
+    float AtlasPacker::Bake(const vector<std::string>& filenames, const char* outPrefix, int pageSize, int padding)
+    {
+        vector<AtlasImage> images;
+        vector<Color*> decoded;
+        vector<vector<Color>> pages;
+        vector<Size> pageSizes;
+        vector<AtlasRegion> regions;
+        float occupancy;
+        try
+        {
+            for (auto& filename : filenames)
+            {
+                Color* pixels;
+                Size size = util::ReadImageToPixels(filename.c_str(), &pixels);
+                decoded.push_back(pixels);
+                images.push_back({ filename, pixels, (int)size.width, (int)size.height });
+            }
 
-        net::Client* CreateClient(const char* ip, unsigned short port);
+            occupancy = Pack(images, pageSize, padding, pages, pageSizes, regions);
+        }
+        catch (...)
+        {
+            for (auto p : decoded)
+                free(p);
+            throw;
+        }
 
-        // Create surface to render objects on.
-        Surface* CreateSurface();
+        for (auto p : decoded)
+            free(p);
+
+        // page file names in metadata are relative to it
+        std::string prefix = outPrefix;
+        size_t slash = prefix.find_last_of("/\\");
+        std::string baseName = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+
+        std::ofstream meta(prefix + ".atlas");
+        if (!meta)
+            throw Error(__FUNCTION__, "could not write atlas metadata");
+
+        meta << "viva atlas 1\n";
+        for (uint i = 0; i < pages.size(); i++)
+        {
+            std::string pageFile = baseName + "_" + std::to_string(i) + ".tga";
+            int w = (int)pageSizes[i].width;
+            int h = (int)pageSizes[i].height;
+
+            // uncompressed 32 bit tga, left top origin, stb_image reads it back
+            std::ofstream tga(prefix + "_" + std::to_string(i) + ".tga", std::ios::binary);
+            if (!tga)
+                throw Error(__FUNCTION__, "could not write atlas page");
+
+            byte header[18] = {};
+            header[2] = 2;
+            header[12] = w & 0xff;
+            header[13] = (w >> 8) & 0xff;
+            header[14] = h & 0xff;
+            header[15] = (h >> 8) & 0xff;
+            header[16] = 32;
+            header[17] = 0x28;
+            tga.write((const char*)header, sizeof(header));
+
+            vector<byte> bgra(pages[i].size() * 4);
+            for (size_t j = 0; j < pages[i].size(); j++)
+            {
+                const Color& c = pages[i][j];
+                bgra[j * 4] = c.b;
+                bgra[j * 4 + 1] = c.g;
+                bgra[j * 4 + 2] = c.r;
+                bgra[j * 4 + 3] = c.a;
+            }
+            tga.write((const char*)bgra.data(), bgra.size());
 
-        Animation* CreateAnimation(Sprite* sprite);
+            meta << "page " << w << " " << h << " " << pageFile << "\n";
+        }
 
-        Animation* CreateAnimation(Texture* texture);
+        for (auto& r : regions)
+            meta << "region " << r.page << " " << r.x << " " << r.y << " " << r.width << " " << r.height << " " << r.name << "\n";
 
-        void _Destroy();
-    };
-}
+        return occupancy;
+    }
 
-#pragma region code
-namespace viva
-{
-    Texture* Creator::CreateTexture(const char* filename)
+    Atlas::Atlas(const vector<Texture*>& pages, const vector<AtlasRegion>& regions, float occupancy)
+        : pages(pages), occupancy(occupancy)
     {
-        Color* pixels = nullptr;
-        Size size = util::ReadImageToPixels(filename, &pixels);
-        Texture* tex = this->CreateTexture(pixels, size);
+        // check everything before creating anything
+        for (auto& r : regions)
+        {
+            if (r.page >= pages.size())
+            {
+                std::string msg = r.name + " is on page " + std::to_string(r.page) + " that doesn't exist";
+                throw Error(__FUNCTION__, msg.c_str());
+            }
 
-        // free used because library uses malloc
-        if (pixels != nullptr)
-            free(pixels);
+            const Size& size = pages[r.page]->GetSize();
+            if (r.x < 0 || r.y < 0 || r.width <= 0 || r.height <= 0 || r.x + r.width > size.width || r.y + r.height > size.height)
+            {
+                std::string msg = r.name + " is not on its page";
+                throw Error(__FUNCTION__, msg.c_str());
+            }
+        }
 
-        return tex;
+        for (auto& r : regions)
+        {
+            Texture* t = new Texture(pages[r.page],
+                Rect((float)r.x, (float)r.y, (float)(r.x + r.width), (float)(r.y + r.height)));
+            this->textures.push_back(t);
+            this->byName[r.name] = t;
+        }
     }
 
-    Font* Creator::CreateFontV(Texture* tex, const char* fontMetrics, bool fromString)
+    Texture* Atlas::Get(const std::string& name) const
     {
-        return new Font(tex, fontMetrics, fromString);
-    }
+        auto it = this->byName.find(name);
+        if (it == this->byName.end())
+        {
+            std::string msg = name + " is not in the atlas";
+            throw Error(__FUNCTION__, msg.c_str());
+        }
 
-    Font* Creator::CreateFontV(Texture* tex, const char* fontMetricsFile)
-    {
-        return new Font(tex, fontMetricsFile);
+        return it->second;
     }
 
-    Text* Creator::CreateText(const wchar_t* str)
+    Texture* Atlas::Get(uint index) const
     {
-        return new Text(str);
+        return this->textures.at(index);
     }
 
-    Text* Creator::CreateText(const wchar_t* str, Font* font)
+    uint Atlas::GetCount() const
     {
-        return new Text(str, font);
+        return (uint)this->textures.size();
     }
 
-    Animation* Creator::CreateAnimation(Sprite* sprite)
+    Texture* Atlas::GetPage(uint index) const
     {
-        return new Animation(sprite);
+        return this->pages.at(index);
     }
 
-    Animation* Creator::CreateAnimation(Texture* texture)
+    uint Atlas::GetPageCount() const
     {
-        Sprite* s = this->CreateSprite(texture);
-        return new Animation(s);
+        return (uint)this->pages.size();
     }
 
-    Polygon* Creator::CreatePolygon(const vector<Point>& points)
+    float Atlas::GetOccupancy() const
     {
-        VertexBuffer* vb = CreateVertexBuffer(points, false);
-        return new Polygon(vb);
+        return this->occupancy;
     }
 
-    Polygon* Creator::CreatePolygon(VertexBuffer* vb)
+    void Atlas::Destroy()
     {
-        return new Polygon(vb);
-    }
+        for (auto t : this->textures)
+            t->Destroy();
 
-    VertexBuffer* Creator::CreateVertexBuffer(const vector<Point>& points)
-    {
-        return this->CreateVertexBuffer(points, true);
+        for (auto p : this->pages)
+            p->Destroy();
+
+        delete this;
     }
+}
+#pragma endregion
 
-    VertexBuffer* Creator::CreateVertexBuffer(const vector<Point>& points, bool shared)
+    /*@// Font ***********************************************************************************************************@*/
+namespace viva
+{
+    struct CharacterMetrics
     {
-        uint count = (uint)points.size();
-
-        D3D11_BUFFER_DESC bd;
-        ZeroMemory(&bd, sizeof(bd));
-        bd.Usage = D3D11_USAGE_DEFAULT;				   // GPU writes and reads
-        bd.ByteWidth = (UINT)(sizeof(Vertex) * count);
-        bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;       // use as a vertex buffer
-        bd.CPUAccessFlags = 0;		                   // CPU does nothing
-
-        vector<Vertex> temp;
-        for (int i = 0; i < points.size(); i++)
-        {
-            //float distFromOrigin = sqrtf(points[i].x*points[i].x + points[i].y*points[i].y);
-            //if (distFromOrigin > span)
-            //    span = distFromOrigin;
-            //vertices.push_back(DirectX::XMVectorSet(points[i].x, points[i].y, 0, 0));
+        int id;
+        Rect uv;
+        Size size;
+        Size sizePx;
+        Point offset;
+        Point offsetPx;
+        float advance;
+        float advancePx;
+    };
 
-            // IMPORTANT, Y is negated because I want +Y to be up not down
-            // IMPORTANT, red must be non 0, 0 is reserved for sprites
-            temp.push_back({ points.at(i).x, -points.at(i).y, 0, 1, 1, 1, 0, 0 }); 
-        }
-        //transformedVertices = vertices;
+    struct FontMetrics
+    {
+        float lineHeight;
+        float lineHeightPx;
+    };
 
-        D3D11_SUBRESOURCE_DATA sd;
-        ZeroMemory(&sd, sizeof(sd));
-        sd.pSysMem = temp.data();                   //Memory in CPU to copy in to GPU
+    // Glyph as it is in BMFont metrics file, pixels.
+    struct FontGlyph
+    {
+        int id, x, y, width, height, xoffset, yoffset, xadvance;
+    };
 
-        ID3D11Buffer* vertexBuffer;
-        d3d.device->CreateBuffer(&bd, &sd, &vertexBuffer);
+    // Bitmap font. Stores coordinates for where letters are on texture
+    class Font : public Destroyable
+    {
+    private:
+        Texture* texture;
+        vector<CharacterMetrics> characters;
+        FontMetrics fontMetrics;
 
-        return new VertexBuffer(vertexBuffer, count, shared);
-    }
+        void InitFontFromMetrics(const char* fontMetrics);
 
-    /// SURFACE ///
-    Surface* Creator::CreateSurface()
-    {
-        ID3D11Texture2D* tex;
-        ID3D11ShaderResourceView* srv;
-        ID3D11RenderTargetView* rtv;
+        void InitFontFromGlyphs(const FontGlyph* glyphs, uint count, float lineHeightPx);
+    public:
+        // Parse BMFont text metrics.
+        // glyphs: parsed glyphs are added here
+        // lineHeightPx: line height from 'common' line, 0 if there is none
+        static void ParseMetrics(const char* fontMetrics, vector<FontGlyph>& glyphs, float& lineHeightPx);
 
-        D3D11_TEXTURE2D_DESC textureDesc;
-        ZeroMemory(&textureDesc, sizeof(textureDesc));
-        textureDesc.Width = (UINT)engine->GetClientSize().width;
-        textureDesc.Height = (UINT)engine->GetClientSize().height;
-        textureDesc.MipLevels = 1;
-        textureDesc.ArraySize = 1;
-        textureDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
-        textureDesc.SampleDesc.Count = 1;
-        textureDesc.Usage = D3D11_USAGE_DEFAULT;
-        textureDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
-        textureDesc.CPUAccessFlags = 0;
-        textureDesc.MiscFlags = 0;
-        HRESULT hr = d3d.device->CreateTexture2D(&textureDesc, NULL, &tex);
-        util::Checkhr(hr, "CreateTexture2D()");
+        // Create bitmap font from texture. And calc primitive metrics
+        // tex: texture to use
+        // glyphs: exact uv coordinate for glyphs. It should contain at least ascii 0-126
+        Font(Texture* tex, const char* fontMetrics, bool fromString);
 
-        D3D11_RENDER_TARGET_VIEW_DESC renderTargetViewDesc;
-        renderTargetViewDesc.Format = textureDesc.Format;
-        renderTargetViewDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
-        renderTargetViewDesc.Texture2D.MipSlice = 0;
-        hr = d3d.device->CreateRenderTargetView(tex,
-            &renderTargetViewDesc, &rtv);
-        util::Checkhr(hr, "CreateRenderTargetView()");
+        // Create bitmap font from texture.
+        Font(Texture* tex, const char* fontMetricsFile);
 
-        D3D11_SHADER_RESOURCE_VIEW_DESC shaderResourceViewDesc;
-        shaderResourceViewDesc.Format = textureDesc.Format;
-        shaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-        shaderResourceViewDesc.Texture2D.MostDetailedMip = 0;
-        shaderResourceViewDesc.Texture2D.MipLevels = 1;
-        hr = d3d.device->CreateShaderResourceView(tex,
-            &shaderResourceViewDesc, &srv);
-        util::Checkhr(hr, "CreateShaderResourceView()");
+        // Create bitmap font from glyphs that are already parsed, see Archive.
+        // glyphs: pixel metrics
+        // lineHeightPx: line height in pixels
+        Font(Texture* tex, const FontGlyph* glyphs, uint count, float lineHeightPx);
 
-        Surface* surf = new Surface(tex, rtv, srv);
-        surf->SetPixelShader(d3d.defaultPost);
-        return surf;
+        // Gets uv coordinate for char 'code'.
+        const CharacterMetrics& GetChar(uint code) const;
+
+        const FontMetrics& GetFontMetrics() const;
+        
+        Texture* GetTexture() const;
+
+        void Destroy();
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    Font::Font(Texture* tex, const char* fontMetrics, bool fromString)
+        : texture(tex)
+    {
+        this->InitFontFromMetrics(fontMetrics);
     }
 
-    /// SHADERS ///
-    PixelShader* Creator::CreatePixelShaderFromFile(const char* filename)
+    void Font::InitFontFromMetrics(const char* fontMetrics)
     {
-        std::string ps = util::ReadFileToStringA(filename);
-        return CreatePixelShader(ps.c_str());
+        // if string is null or empty
+        if (!fontMetrics || !*fontMetrics)
+            return;
+
+        std::vector<FontGlyph> glyphs;
+        float lineHeight;
+        ParseMetrics(fontMetrics, glyphs, lineHeight);
+        this->InitFontFromGlyphs(glyphs.data(), (uint)glyphs.size(), lineHeight);
     }
 
-    PixelShader* Creator::CreatePixelShader(const char* str)
+    void Font::ParseMetrics(const char* fontMetrics, vector<FontGlyph>& glyphs, float& lineHeightPx)
     {
-        ID3D11PixelShader* result;
+        int len = (int)strlen(fontMetrics);
+        const char* eos = fontMetrics + len;
+        const char* it = fontMetrics;
+        char buf[500];
+        FontGlyph glyph;
+        lineHeightPx = 0;
 
-        ID3D10Blob *ps;
-        HRESULT hr = D3DCompile(str, strlen(str), 0, 0, 0, "main", "ps_5_0", 0, 0, &ps, 0);
-        util::Checkhr(hr, "CreatePixelShader()");
+        while (it < eos)
+        {
+            // getline
+            const char* eol = strchr(it, '\n');
+            if (!eol)
+                eol = eos;
 
-        hr = d3d.device->CreatePixelShader(ps->GetBufferPointer(), ps->GetBufferSize(), 0, &result);
-        util::Checkhr(hr, "CreatePixelShader()");
-        ps->Release();
+            memset(buf, 0, 500);
+            memcpy(buf, it, eol - it);
+            it = eol + 1;
 
-        return new PixelShader(result);
-    }
+            // process line
+            if (!memcmp(buf, "info", 4))
+            {
+            }
+            else if (!memcmp(buf, "common", 6))
+            {
+                sscanf(buf, "common lineHeight=%f", &lineHeightPx);
+            }
+            else if (!memcmp(buf, "char ", 5))
+            {
+                sscanf(buf, "char id=%d x=%d y=%d width=%d height=%d xoffset=%d yoffset=%d xadvance=%d",
+                    &glyph.id, &glyph.x, &glyph.y, &glyph.width, &glyph.height, &glyph.xoffset, &glyph.yoffset,
+                    &glyph.xadvance);
 
-    net::Server* Creator::CreateServer(unsigned short port)
-    {
-        net::Server* s = new net::Server(port);
-        networkManager->_Add(s);
-        return s;
+                glyphs.push_back(glyph);
+            }
+        }
     }
 
-    net::Client* Creator::CreateClient(const char* ip, unsigned short port)
+    void Font::InitFontFromGlyphs(const FontGlyph* glyphs, uint count, float lineHeightPx)
     {
-        net::Client* c = new net::Client(ip, port);
-        networkManager->_Add(c);
-        return c;
-    }
+        CharacterMetrics cm;
+        const Size& texSize = this->texture->GetSize();
+        int maxId = 0;
 
-    ID3D11ShaderResourceView* Creator::SrvFromPixels(const Color* pixels, const Size& _size)
-    {
-        ID3D11Texture2D *tex;
-        ID3D11ShaderResourceView* srv;
+        this->fontMetrics.lineHeight = camera->Pixel2World({ 0 ,lineHeightPx }).height;
+        this->fontMetrics.lineHeightPx = lineHeightPx;
 
-        D3D11_SUBRESOURCE_DATA sub;
-        sub.pSysMem = pixels;
-        sub.SysMemPitch = (UINT)_size.width * 4;
-        sub.SysMemSlicePitch = (UINT)_size.height*(UINT)_size.width * 4;
+        for (uint i = 0; i < count; i++)
+            if (glyphs[i].id > maxId)
+                maxId = glyphs[i].id;
 
-        D3D11_TEXTURE2D_DESC desc;
-        desc.Width = (UINT)_size.width;
-        desc.Height = (UINT)_size.height;
-        desc.MipLevels = 1;
-        desc.ArraySize = 1;
-        desc.SampleDesc.Count = 1;
-        desc.SampleDesc.Quality = 0;
-        desc.Usage = D3D11_USAGE_DEFAULT;
-        desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-        desc.CPUAccessFlags = 0;
-        desc.MiscFlags = 0;
+        this->characters.resize(maxId + 1);
 
-        HRESULT hr = d3d.device->CreateTexture2D(&desc, &sub, &tex);
-        util::Checkhr(hr, "CreateTexture2D()");
+        for (uint i = 0; i < count; i++)
+        {
+            const FontGlyph& g = glyphs[i];
+            cm.advance = camera->Pixel2World({ (float)g.xadvance ,0 }).width;
+            cm.advancePx = (float)g.xadvance;
+            cm.id = g.id;
+            auto offset = camera->Pixel2World({ (float)g.xoffset ,(float)g.yoffset });
+            cm.offset = { offset.width, offset.height };
+            cm.offsetPx = { (float)g.xoffset , -(float)g.yoffset };
+            cm.size = camera->Pixel2World({ (float)g.width ,(float)g.height });
+            cm.sizePx = { (float)g.width ,(float)g.height };
+            // TODO why (top = 1 - bottom) and (bottom = 1 - top)
+            cm.uv = {
+                g.x / texSize.width,
+                1 - (g.y + g.height) / texSize.height,
+                (g.x + g.width) / texSize.width,
+                1 - g.y / texSize.height,
+            };
 
-        D3D11_TEXTURE2D_DESC desc2;
-        tex->GetDesc(&desc2);
-        hr = d3d.device->CreateShaderResourceView(tex, 0, &srv);
-        util::Checkhr(hr, "CreateShaderResourceView()");
-        tex->Release();
+            this->characters[g.id] = cm;
+        }
+    }
 
-        return srv;
+    Font::Font(Texture* tex, const FontGlyph* glyphs, uint count, float lineHeightPx)
+        : texture(tex)
+    {
+        this->InitFontFromGlyphs(glyphs, count, lineHeightPx);
     }
 
-    /// SPRITE ///
-    Sprite* Creator::CreateSprite(Texture* texture)
+    Font::Font(Texture* tex, const char* fontMetricsFile)
+        : texture(tex)
     {
-        return new Sprite(texture, d3d.defaultPS);
+        std::string fontMetrics = util::ReadFileToStringA(fontMetricsFile);
+        this->InitFontFromMetrics(fontMetrics.c_str());
     }
 
-    /// TEXTURE ///
-    Texture* Creator::CreateTexture(const Color* pixels, const Size& size)
+    // Gets uv coordinate for char 'code'.
+    const CharacterMetrics& Font::GetChar(uint code) const
     {
-        Texture* t = new Texture(this->SrvFromPixels(pixels, size), size);
-        return t;
+        return this->characters.at(code);
     }
 
-    //
-    void Creator::_Destroy()
+    const FontMetrics& Font::GetFontMetrics() const
+    {
+        return this->fontMetrics;
+    }
+    
+    Texture* Font::GetTexture() const
+    {
+        return this->texture;
+    }
+
+    void Font::Destroy()
     {
+        if (resourceManager->_Release(this))
+            return;
+
+        this->texture->Destroy();
         delete this;
     }
 }
 #pragma endregion
 
-    /*@// Text ***********************************************************************************************************@*/
+    /*@// Routine ********************************************************************************************************@*/
 namespace viva
 {
-    class Text : public Sprite
+    // Refers to a routine without keeping a pointer to it. Handle becomes stale when the
+    // routine is removed, even if its memory is reused by a new routine.
+    struct RoutineHandle
     {
-    private:
-        std::wstring text;
-        Font* font;
-    public:
-        Text(const wchar_t* str, Font* f);
-
-        Text(const wchar_t* str);
-
-        Text* SetText(const wchar_t* _text);
-
-        const wchar_t* GetText() const;
-
-        void _Draw() override;
-
-        // sprite functions that dont make sense
-        // SetScale2TextureSize
-        // IsFlippedHorizontally
-        // SetFlipHorizontally
-        // IsFlippedVertically
-        // SetFlipVertically
-        // GetUV
-        // SetUV
-        // GetTexture
+        uint slot;
+        uint generation; // 0 is never used so default handle is always stale
     };
-}
 
-#pragma region code
-namespace viva
-{
-    Text::Text(const wchar_t* str, Font* f)
-        : Sprite(f->GetTexture(), d3d.defaultPS), text(str), font(f)
+    enum class RoutineWait
     {
-        this->transform.Origin().x = -1;
-        this->transform.Origin().y = 1;
-    }
+        None,
+        Frames,
+        Event,
+        Future
+    };
 
-    Text::Text(const wchar_t* str)
-        : Text(str, drawManager->GetDefaultFont())
+    struct Routine
     {
-    }
+        double tick;
+        double lifeTime;
+        double delay;
+        double startTime;
+        std::function<int()> activity;
+        int id;
+        double lastPulse;
+        double nextPulse; // game time of the next run
+        unsigned long long dueTick; // when it has to be looked at next, in wheel ticks
+        Routine* next; // list of the wheel slot, every frame routines or routines waiting for something
+        Routine** prev; // pointer to 'next' of previous routine or to list head, nullptr if not in a list
+        Routine* idNext; // next routine with the same id
+        Routine** idPrev; // pointer to 'idNext' of previous routine or to the head in RoutineManager::routinesById
+        uint slot; // index in RoutineManager::slots
+        bool inWheel; // counted in RoutineManager::scheduled
+        bool running; // activity is being called right now or it's waiting in the parallel batch
+        bool remove;
+        bool parallel; // can run on worker threads
+        int result; // what activity returned when it ran in parallel
+
+        // what suspended coroutine waits for, timed waits just set nextPulse
+        RoutineWait wait;
+        unsigned long long wakeFrame;
+        int waitEvent;
+        int* eventData; // where to write data of the event
+        bool(*poll)(void* awaiter); // true when future is ready
+        void* awaiter;
+    };
+}
 
-    Text* Text::SetText(const wchar_t* str)
+    /*@// EventHandler ***************************************************************************************************@*/
+namespace viva
+{
+    // Function that takes event data, like std::function<void(int)>. Callables up to BufferSize bytes
+    // are stored inside, only bigger ones are allocated.
+    class EventHandler
     {
-        this->text = str;
-        return this;
-    }
+    private:
+        static const uint BufferSize = 64;
+        enum class Op { Copy, Move, Destroy };
 
-    const wchar_t* Text::GetText() const
-    {
-        return this->text.c_str();
-    }
+        mutable std::aligned_storage<BufferSize, 16>::type buffer;
+        void(*invoke)(void* buffer, int data);
+        void(*manage)(Op op, void* dst, void* src);
 
-    void Text::_Draw()
-    {
-        this->T()->_Update();
+        // callable lives in the buffer
+        template <typename F>
+        struct Local
+        {
+            static void Invoke(void* buffer, int data)
+            {
+                (*reinterpret_cast<F*>(buffer))(data);
+            }
 
-        if (!this->visible)
-            return;
-               
-        // state commmon for all letters
-        // rs
-        d3d.context->RSSetState(d3d.rsSolid);
-        // sampler and color
-        d3d.context->PSSetSamplers(0, 1, &d3d.samplerPoint);
-        float fColor[] = { this->color.r / 255.0f,this->color.g / 255.0f,this->color.b / 255.0f,this->color.a / 255.0f };
-        d3d.context->UpdateSubresource(d3d.constantBufferPS, 0, 0, fColor, 0, 0);
-        // ps
-        d3d.context->PSSetShader(ps->GetPS(), 0, 0);
-        // vb
-        UINT stride = sizeof(Vertex);
-        UINT offset = 0;
-        d3d.context->IASetVertexBuffers(0, 1, &d3d.vertexBuffer, &stride, &offset);
-        d3d.context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-        // texture
-        d3d.context->PSSetShaderResources(0, 1, this->texture->GetSRV());
+            static void Manage(Op op, void* dst, void* src)
+            {
+                if (op == Op::Copy)
+                    new (dst) F(*reinterpret_cast<const F*>(src));
+                else if (op == Op::Move)
+                {
+                    new (dst) F(std::move(*reinterpret_cast<F*>(src)));
+                    reinterpret_cast<F*>(src)->~F();
+                }
+                else
+                    reinterpret_cast<F*>(dst)->~F();
+            }
+        };
 
-        float x = this->transform.Pos().x;
-        float y = this->transform.Pos().y;
-        float advance = 0;
-        float line = 0;
-        
-        // TODO figure out why origin of letters are in lower right corner instead of upper left
-        float _x = x;
-        float _y = y;
+        // buffer holds pointer to the callable
+        template <typename F>
+        struct Remote
+        {
+            static void Invoke(void* buffer, int data)
+            {
+                (**reinterpret_cast<F**>(buffer))(data);
+            }
+
+            static void Manage(Op op, void* dst, void* src)
+            {
+                if (op == Op::Copy)
+                    *reinterpret_cast<F**>(dst) = new F(**reinterpret_cast<F**>(src));
+                else if (op == Op::Move)
+                    *reinterpret_cast<F**>(dst) = *reinterpret_cast<F**>(src);
+                else
+                    delete *reinterpret_cast<F**>(dst);
+            }
+        };
+
+        template <typename F>
+        void _Init(F&& f, std::true_type)
+        {
+            typedef typename std::decay<F>::type T;
+            new (&this->buffer) T(std::forward<F>(f));
+            this->invoke = &Local<T>::Invoke;
+            this->manage = &Local<T>::Manage;
+        }
+
+        template <typename F>
+        void _Init(F&& f, std::false_type)
+        {
+            typedef typename std::decay<F>::type T;
+            *reinterpret_cast<T**>(&this->buffer) = new T(std::forward<F>(f));
+            this->invoke = &Remote<T>::Invoke;
+            this->manage = &Remote<T>::Manage;
+        }
+    public:
+        EventHandler() : invoke(nullptr), manage(nullptr)
+        {
+        }
 
-        if (text.length() > 0 && text[0] != '\n')
+        // Ctor.
+        // f: anything that can be called with int
+        template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, EventHandler>::value>::type>
+        EventHandler(F&& f)
         {
-            const CharacterMetrics& firstChar = this->font->GetChar(text.at(0));
-            _x += this->transform.GetMode() == TransformMode::World ? firstChar.size.width : firstChar.sizePx.width;
-            _y += this->transform.GetMode() == TransformMode::World ? firstChar.size.height : firstChar.sizePx.height;
+            typedef typename std::decay<F>::type T;
+            this->_Init(std::forward<F>(f), std::integral_constant<bool, sizeof(T) <= BufferSize && alignof(T) <= 16>());
         }
 
+        EventHandler(const EventHandler& other) : invoke(other.invoke), manage(other.manage)
+        {
+            if (this->manage != nullptr)
+                this->manage(Op::Copy, &this->buffer, &other.buffer);
+        }
 
-        //// only transform changes
-        for (int i = 0; i < text.length(); i++)
+        EventHandler(EventHandler&& other) : invoke(other.invoke), manage(other.manage)
         {
-            if (text.at(i) == '\n')
-            {
-                advance = 0;
-                line += this->transform.GetMode() == TransformMode::World ? this->font->GetFontMetrics().lineHeight : 
-                    -this->font->GetFontMetrics().lineHeightPx;
-                continue;
-            }
+            if (this->manage != nullptr)
+                this->manage(Op::Move, &this->buffer, &other.buffer);
 
-            const CharacterMetrics& cm = this->font->GetChar(text.at(i));
-            const Rect curUv = cm.uv;
+            other.invoke = nullptr;
+            other.manage = nullptr;
+        }
 
-            if (this->transform.GetMode() == TransformMode::World)
+        EventHandler& operator=(const EventHandler& other)
+        {
+            if (this != &other)
             {
-                this->transform.Pos().x = _x + advance + cm.offset.x;
-                this->transform.Pos().y = _y - line - cm.offset.y;
-                this->transform.Scale().x = cm.size.width;
-                this->transform.Scale().y = cm.size.height;
-                advance += cm.advance;
+                this->~EventHandler();
+                new (this) EventHandler(other);
             }
-            else
+
+            return *this;
+        }
+
+        EventHandler& operator=(EventHandler&& other)
+        {
+            if (this != &other)
             {
-                this->transform.Pos().x = _x + advance + cm.offsetPx.x;
-                this->transform.Pos().y = _y - line - cm.offsetPx.y;
-                this->transform.Scale().x = cm.sizePx.width;
-                this->transform.Scale().y = cm.sizePx.height;
-                advance += cm.advancePx;
+                this->~EventHandler();
+                new (this) EventHandler(std::move(other));
             }
 
-            Matrix matT = this->transform.GetWorldViewProj().transpose();
-            d3d.context->UpdateSubresource(d3d.constantBufferVS, 0, NULL, &matT, 0, 0);
-            d3d.context->UpdateSubresource(d3d.constantBufferUV, 0, 0, &curUv, 0, 0);
-            d3d.context->DrawIndexed(6, 0, 0);
+            return *this;
         }
 
-        this->transform.Pos().x = x;
-        this->transform.Pos().y = y;
-    }
+        ~EventHandler()
+        {
+            if (this->manage != nullptr)
+                this->manage(Op::Destroy, &this->buffer, nullptr);
+        }
+
+        void operator()(int data) const
+        {
+            this->invoke(&this->buffer, data);
+        }
+
+        explicit operator bool() const
+        {
+            return this->invoke != nullptr;
+        }
+    };
 }
-#pragma endregion
 
-    /*@// DrawManager ****************************************************************************************************@*/
+#ifdef VIVA_COROUTINES
+    /*@// Coroutine ******************************************************************************************************@*/
 namespace viva
 {
-    // Wrapper for adding and removing drawables.
-    class DrawManager
+    // Return type of coroutines that RoutineManager can run. Coroutine doesn't start until it's
+    // passed to RoutineManager::StartCoroutine. It can co_await WaitSeconds, WaitFrames, WaitEvent
+    // and WaitFuture.
+    class Coroutine
     {
+    public:
+        struct promise_type
+        {
+            Routine* routine = nullptr;
+
+            Coroutine get_return_object()
+            {
+                return Coroutine(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            // stays suspended so routine can see it's done, routine destroys it
+            std::suspend_always final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void return_void()
+            {
+            }
+
+            // goes out of RoutineManager like exception from any routine
+            void unhandled_exception()
+            {
+                throw;
+            }
+        };
     private:
-        Surface* defaultSurface;
-        Texture* whitePixel;
-        vector<Surface*> surfaces;
-        Font* defaultFont;
-        TextureFilter defaultFilter;
-        VertexBuffer* rectVertexBuffer;
-        VertexBuffer* circleVertexBuffer;
+        std::coroutine_handle<promise_type> handle;
     public:
-        DrawManager();
+        explicit Coroutine(std::coroutine_handle<promise_type> handle) : handle(handle)
+        {
+        }
 
-        // Destroys DrawManager and all drawables.
-        void _Destroy();
+        Coroutine(Coroutine&& other) noexcept : handle(other.handle)
+        {
+            other.handle = nullptr;
+        }
 
-        // Draw all objects on their surfaces.
-        void _DrawNodes();
+        Coroutine(const Coroutine&) = delete;
+        Coroutine& operator=(const Coroutine&) = delete;
 
-        // Draw surfaces.
-        void _DrawSurfaces();
+        // Destroys coroutine that was never started.
+        ~Coroutine()
+        {
+            if (this->handle)
+                this->handle.destroy();
+        }
 
-        Surface* GetDefaultSurface();
+        // Take the coroutine, this object becomes empty.
+        std::coroutine_handle<promise_type> _Release()
+        {
+            std::coroutine_handle<promise_type> h = this->handle;
+            this->handle = nullptr;
+            return h;
+        }
+    };
+}
+#endif
 
-        Surface* AddSurface();
+    /*@// RoutineManager *************************************************************************************************@*/
+namespace viva
+{
+    // Routines that run every frame are kept in a list. All other routines wait in a hierarchical
+    // timer wheel, so every frame only routines that are due are touched.
+    class RoutineManager
+    {
+    private:
+        static const uint WheelLevels = 4;
+        static const uint WheelSlots = 256; // per level, level n slot spans 256^n ticks
+        static const uint TicksPerSecond = 1000;
+        static const uint FrameWaitSlots = 256;
 
-        void AddSurface(Surface* s);
+        struct RoutineSlot
+        {
+            Routine* routine; // nullptr if free
+            uint generation; // bumped when routine is removed
+        };
 
-        void RemoveSurface(Surface* s);
+        ObjectPool<Routine> routinePool;
+        vector<RoutineSlot> slots;
+        vector<uint> freeSlots;
+        std::unordered_map<int, Routine*> routinesById; // head of the list of every id, id 0 is not here
+        Routine* frameRoutines;
+        Routine** frameTail; // every frame routines are appended so they keep their order
+        Routine* wheel[WheelLevels][WheelSlots];
+        unsigned long long currentTick; // wheel processed all ticks before that
+        uint scheduled; // number of routines in the wheel
+        unsigned long long frame; // number of _Activity() calls
+        Routine* frameWaits[FrameWaitSlots]; // waiting for frame, slot is wakeFrame % FrameWaitSlots
+        std::unordered_map<int, Routine*> eventWaits; // waiting for event, node based so list heads don't move
+
+        // event table, open addressing with linear probing
+        struct EventSlot
+        {
+            int event;
+            bool used;
+            vector<EventHandler> handlers;
+        };
 
-        void MoveSurfaceUp(Surface* s);
+        vector<EventSlot> events; // size is power of 2
+        uint eventCount;
+        vector<std::pair<int, int>> deferred; // event and data
+        vector<std::pair<int, int>> draining; // deferred events that are being triggered
+        vector<std::pair<int, EventHandler>> pendingHandlers; // added from inside a handler
+        int dispatching; // Trigger() depth
 
-        void MoveSurfaceDown(Surface* s);
+        // Slot of the event or free slot where it would be.
+        EventSlot& _FindEvent(int _event);
 
-        void MoveSurfaceTop(Surface* s);
+        static void _Link(Routine*& head, Routine* r);
 
-        void MoveSurfaceBottom(Surface* s);
+        static void _Unlink(Routine* r);
 
-        // Create and add polygon to be drawn.
-        // points: list of points
-        // surface: which surface
-        Polygon* AddPolygon(const vector<Point>& points, Surface* surface);
+        // Lists are filled at the front, reverse one so routines added first come first.
+        // head: list whose first routine points back to it
+        static void _Reverse(Routine*& head);
 
-        // Create and add polygon to be drawn.
-        // points: list of points
-        // surface: which surface
-        Polygon* AddPolygon(VertexBuffer* vb, Surface* surface);
+        // Append to every frame routines.
+        void _LinkFrame(Routine* r);
 
-        Polygon* AddRectangle();
+        // Put routine in the wheel.
+        void _Schedule(Routine* r);
 
-        Polygon* AddRectangle(Surface* surface);
+        // Move routines of one slot to lower levels.
+        void _Cascade(uint level, uint slot);
 
-        Polygon* AddCircle();
+        vector<Routine*> parallelBatch; // due parallel routines, run at the end of _Activity()
 
-        Polygon* AddCircle(Surface* surface);
+        // Run routine if its pulse is due, then remove or schedule it again.
+        // Parallel routines are only added to the batch.
+        // gameTime: current game time
+        void _Run(Routine* r, double gameTime);
 
-        Polygon* AddCircle(uint vertices);
+        // Remove or schedule routine after it ran.
+        // ret: what activity returned, 1 if it didn't run
+        void _AfterRun(Routine* r, double gameTime, int ret);
 
-        Polygon* AddCircle(uint vertices, Surface* surface);
+        // Run the batch on the job system and wait for it.
+        void _RunParallel(double gameTime);
 
-        // Create and add polygon to be drawn.
-        // points: list of points
-        Polygon* AddPolygon(const vector<Point>& points);
+        // Invalidate handles to the slot and make it free.
+        void _ReleaseSlot(uint slot);
 
-        // Create and add polygon to be drawn.
-        // points: list of points
-        Polygon* AddPolygon(VertexBuffer* vb);
+        // Remove from slots and id map and return to the pool.
+        void _Free(Routine* r);
+    public:
+        RoutineManager();
 
-        // Create and add sprite to be drawn.
-        // t: texture to be used by the sprite
-        // surface: which surface
-        Sprite* AddSprite(Texture* t, Surface* surface);
+        void _Activity();
 
-        // Create and add sprite to be drawn.
-        // t: texture to be used by the sprite
-        Sprite* AddSprite(Texture* t);
+        // Add a new routine.
+        //func: code to execute by event (function pointer or closure)
+        //      func must return an int. This is to make it easier to remove routines from inside. 
+        //      If func returns 0, routine is destroyed.
+        //delay: how long to wait before start running
+        //lifeTime: destroy event after that time, 0 to never destroy
+        //tick: run event once every tick seconds, 0 to run every frame
+        Routine* AddRoutine(const std::function<int()>& func, int id, double delay, double lifeTime, double tick);
 
-        // Create and add a unicolor rectangle to be drawn.
-        // surface: which surface,nullptr for default
-        Sprite* AddFillRectangle(Surface* surface);
+        // Add a new routine.
+        //parallel: routine can run on worker threads at the same time as other parallel routines.
+        //          All parallel routines that are due run after serial routines and are done before
+        //          input and drawing. They must only touch their own data. Allowed engine calls are
+        //          jobSystem->ParallelFor(), ObjectPool Alloc()/Free() and const getters such as
+        //          Transform::GetPos(). Adding or removing routines, raising events, creating or
+        //          destroying objects (creator, drawManager), setters and Pos()/Rot()/Scale() that mark
+        //          transforms dirty, and network sends are main thread only. If one throws, it's
+        //          removed and the exception is thrown from the frame after the batch finished.
+        Routine* AddRoutine(const std::function<int()>& func, int id, double delay, double lifeTime, double tick, bool parallel);
 
-        // Create and add a unicolor rectangle to be drawn.
-        Sprite* AddFillRectangle();
+        Routine* AddRoutine(const std::function<int()>& func);
 
-        Text* AddText(const wchar_t* str);
+        // Destroy routine. It's O(1), routine is removed from the wheel right away.
+        // Routine can remove itself from inside its func.
+        void RemoveRoutine(Routine* r);
 
-        Text* AddText(const wchar_t* str, Font* font);
+        // Destroy routine if handle is not stale.
+        // Returns false if routine was removed already.
+        bool RemoveRoutine(RoutineHandle h);
 
-        Text* AddText(const wchar_t* str, Surface* surface);
+        // Get handle that detects if routine was removed.
+        RoutineHandle GetHandle(Routine* r) const;
 
-        Text* AddText(const wchar_t* str, Font* font, Surface* surface);
+        // Get routine by handle, nullptr if it was removed.
+        Routine* GetRoutine(RoutineHandle h) const;
 
-        Animation* AddAnimation(Sprite* sprite, Surface* surface);
+        // Find routine by id, nullptr if there is none or id is 0.
+        // If more routines have the same id, any of them is returned.
+        Routine* FindRoutine(int id);
 
-        Animation* AddAnimation(Sprite* sprite);
+#ifdef VIVA_COROUTINES
+        // Run coroutine as a routine. It starts in the next frame and it's only touched
+        // when what it waits for happens.
+        // coroutine: function that returns Coroutine
+        // id: id for FindRoutine, 0 for none
+        Routine* StartCoroutine(Coroutine&& coroutine, int id);
 
-        Animation* AddAnimation(Texture* texture, Surface* surface);
+        Routine* StartCoroutine(Coroutine&& coroutine);
+#endif
 
-        Animation* AddAnimation(Texture* texture);
+        // Used by awaitables of suspended coroutines.
+        void _WaitSeconds(Routine* r, double seconds);
 
-        void Remove(Drawable* drawable) const;
+        void _WaitFrames(Routine* r, uint frames);
 
-        void Add(Drawable* drawable, Surface* surface) const;
+        void _WaitEvent(Routine* r, int _event, int* data);
 
-        void Add(Drawable* drawable);
+        void _WaitFuture(Routine* r, bool(*poll)(void* awaiter), void* awaiter);
 
-        TextureFilter GetDefaultTextureFilter() const;
+        // Call all handlers of the event now.
+        void Trigger(int _event, int data);
 
-        void SetDefaultTextureFilter(TextureFilter filter);
+        // Queue the event, it's triggered at the start of the next frame.
+        // Events deferred by handlers of deferred events are triggered in the frame after.
+        void TriggerDeferred(int _event, int data);
 
-        Texture* GetPixel();
+        // Handler added from inside a handler is not called until that Trigger() returns.
+        // handler: lambda, function pointer or std::function, captures up to 64 bytes don't allocate
+        void AddHandler(int _event, const EventHandler& handler);
 
-        Font* GetDefaultFont() const;
+        // Remove all handlers for that event.
+        // Don't call it from inside a handler.
+        void ClearHandlers(int _event);
 
-        // Destroy all surfaces (except the default one) and all object from the default surface.
-        void Clear();
+        // Remove all handlers.
+        // Don't call it from inside a handler.
+        void ClearHandlers();
 
-        // Resize the shared user buffer for PS
-        // size: must be multiple of 16
-        void ResizeExtraPSBuffer(uint size);
+        // Remove all routines.
+        // Don't call it from inside a routine.
+        void ClearRoutines();
+
+        void _Destroy();
     };
 }
 
 #pragma region code
 namespace viva
 {
-    DrawManager::DrawManager()
+    RoutineManager::RoutineManager() :routinePool(256), frameRoutines(nullptr), frameTail(&frameRoutines), currentTick(0), scheduled(0),
+        frame(0), events(64), eventCount(0), dispatching(0)
     {
-        this->defaultFilter = TextureFilter::Point;
-        this->defaultSurface = creator->CreateSurface();
-        this->surfaces.push_back(this->defaultSurface);
+        for (uint i = 0; i < WheelLevels; i++)
+            for (uint j = 0; j < WheelSlots; j++)
+                this->wheel[i][j] = nullptr;
 
-        // create default font
+        for (uint i = 0; i < FrameWaitSlots; i++)
+            this->frameWaits[i] = nullptr;
+    }
+
+    void RoutineManager::_Link(Routine*& head, Routine* r)
+    {
+        r->next = head;
+        r->prev = &head;
+
+        if (head != nullptr)
+            head->prev = &r->next;
+
+        head = r;
+    }
+
+    void RoutineManager::_Unlink(Routine* r)
+    {
+        if (r->prev == nullptr)
+            return;
+
+        *r->prev = r->next;
+
+        if (r->next != nullptr)
+            r->next->prev = r->prev;
+
+        r->next = nullptr;
+        r->prev = nullptr;
+    }
+
+    void RoutineManager::_Reverse(Routine*& head)
+    {
+        Routine* list = nullptr;
+
+        while (head != nullptr)
         {
-            vector<int> data =
-            {
-                604,1,2,1,6,1,111,1,47,1,8,2,1,2,6,1,2,1,5,5,5,2,18,3,11,1,4,1,11,1,51,1,6,4,7,2,6,5,17,1,
-                8,2,1,2,5,1,2,1,5,1,4,1,4,1,2,1,17,3,10,1,6,1,10,1,9,1,40,1,6,1,4,1,4,2,1,1,5,1,5,1,
-                16,1,8,1,2,1,6,1,2,1,5,1,9,1,2,1,8,3,7,1,11,1,6,1,7,7,6,1,40,1,6,1,4,1,7,1,5,1,5,1,
-                16,1,8,1,2,1,4,8,3,1,10,2,8,1,10,1,10,1,8,1,9,1,9,1,39,1,7,1,4,1,7,1,11,1,16,1,18,1,2,1,
-                6,4,8,3,5,1,10,1,10,1,8,1,8,1,1,1,8,1,39,1,7,1,4,1,7,1,10,1,17,1,18,1,2,1,10,1,4,3,8,2,
-                20,1,8,1,7,1,3,1,4,7,13,7,15,1,8,1,4,1,7,1,8,2,18,1,16,8,8,1,7,2,5,1,1,1,2,1,17,1,8,1,
-                19,1,38,1,8,1,4,1,7,1,7,1,39,1,2,1,10,1,6,1,2,1,4,1,2,2,18,1,8,1,19,1,8,2,27,1,9,1,4,1,
-                7,1,6,1,20,3,17,1,2,1,5,1,4,1,6,1,2,1,4,1,3,1,18,1,8,1,19,1,8,1,19,2,7,1,9,1,4,1,7,1,
-                5,1,5,1,15,3,16,1,2,1,6,5,8,2,6,5,18,1,6,1,20,1,7,2,19,2,6,1,11,4,5,7,2,7,34,1,2,1,8,1,
-                41,1,6,1,28,1,28,1,82,1,42,1,4,1,29,1,1400,4,9,1,5,5,8,4,2,7,5,4,6,4,67,4,53,2,4,1,7,2,5,1,
-                11,1,6,1,5,1,4,1,4,1,4,1,4,1,29,2,12,2,10,4,6,1,4,1,4,3,5,6,6,4,1,1,2,6,4,7,9,1,6,1,
-                1,1,5,1,10,1,13,1,4,1,4,1,4,1,4,1,28,1,16,1,8,1,4,1,4,1,5,1,5,2,6,1,4,1,4,1,4,2,3,1,
-                4,1,4,1,4,1,9,1,5,1,2,1,5,1,9,1,13,1,5,1,4,1,4,1,4,1,5,2,9,2,8,2,5,8,5,2,6,1,4,1,
-                4,1,3,3,4,1,2,1,5,1,4,1,3,1,6,1,3,1,5,1,3,1,4,1,6,3,6,1,2,1,5,5,5,1,1,4,8,1,6,4,
-                5,1,3,2,5,2,9,2,7,1,22,1,10,1,4,1,2,1,2,1,4,1,2,1,5,1,4,1,3,1,10,1,5,1,3,1,2,1,10,1,
-                5,1,3,1,10,1,4,2,4,1,6,1,6,1,4,1,5,3,1,1,23,2,24,2,7,1,5,1,2,1,2,1,4,1,2,1,5,5,4,1,
-                10,1,5,1,3,4,11,1,4,6,9,1,4,1,5,1,6,1,6,1,4,1,9,1,25,1,7,8,7,1,8,1,6,1,2,1,2,1,3,6,
-                4,1,4,1,3,1,10,1,5,1,3,1,2,1,11,1,8,1,10,1,4,1,5,1,6,1,6,1,4,1,8,1,17,2,8,2,18,2,16,1,
-                3,3,3,1,4,1,4,1,4,1,3,1,10,1,5,1,3,1,4,1,3,1,5,1,8,1,4,1,5,1,4,1,5,1,5,1,7,1,4,1,
-                7,1,7,2,9,1,11,1,16,1,10,2,6,1,8,1,6,1,3,1,4,1,4,1,5,1,3,1,4,1,4,1,4,1,4,5,7,4,4,5,
-                6,5,6,1,8,4,5,3,8,2,8,2,12,2,12,2,11,2,7,1,3,1,2,3,4,3,1,6,6,5,3,6,4,7,85,1,50,3,1764,7,
-                5,4,1,1,2,3,2,3,2,7,5,6,2,3,1,4,2,5,4,3,3,3,1,3,3,3,4,4,5,6,5,4,4,6,6,3,1,1,3,7,
-                3,3,2,3,1,3,4,7,1,4,1,3,3,3,3,1,4,1,4,1,4,2,3,1,4,1,6,1,11,1,5,1,3,1,6,1,7,2,3,2,
-                3,2,4,1,4,1,4,1,5,1,4,1,3,1,4,1,4,1,4,1,4,1,3,2,3,1,2,1,2,1,4,1,4,1,3,1,6,1,2,1,
-                5,1,3,1,5,1,4,1,4,1,3,1,10,1,4,1,6,1,11,1,5,1,2,1,7,1,7,1,1,1,1,1,1,1,3,1,1,1,3,1,
-                3,1,6,1,4,1,4,1,2,1,6,1,3,1,4,1,4,1,4,1,3,1,2,1,2,1,4,1,4,1,4,1,4,1,3,1,2,1,2,1,
-                4,1,3,1,5,1,2,1,5,1,10,1,4,1,6,1,11,1,5,1,1,1,8,1,7,1,1,1,1,1,1,1,3,1,1,1,3,1,3,1,
-                6,1,4,1,4,1,2,1,6,1,3,1,4,1,4,1,8,1,2,1,2,1,4,1,4,1,4,1,4,1,3,1,2,1,2,1,5,1,1,1,
-                6,4,5,1,10,6,6,1,11,1,5,4,7,1,7,1,1,1,1,1,1,1,3,1,2,1,2,1,3,1,6,1,4,1,4,1,2,1,6,1,
-                3,5,6,4,7,1,7,1,4,1,5,1,2,1,4,1,1,1,1,1,1,1,6,1,7,1,2,1,5,1,3,5,2,1,4,1,6,1,6,1,
-                4,1,5,1,3,1,6,1,4,1,2,1,2,1,2,1,3,1,3,1,1,1,3,1,6,1,4,5,3,1,6,1,3,1,2,1,11,1,6,1,
-                7,1,4,1,5,1,2,1,4,1,1,1,1,1,1,1,5,1,1,1,6,1,8,1,6,1,3,1,4,1,6,1,6,1,4,1,5,1,3,1,
-                6,1,4,1,2,1,5,1,3,1,3,1,1,1,3,1,6,1,4,1,7,1,6,1,3,1,3,1,5,1,4,1,6,1,7,1,4,1,5,1,
-                2,1,4,1,1,1,1,1,1,1,4,1,3,1,5,1,9,1,5,1,3,1,4,1,6,1,6,1,4,1,5,1,4,1,5,1,4,1,2,1,
-                5,1,3,1,4,2,4,1,4,1,5,1,8,1,4,1,4,1,4,1,4,2,3,1,6,1,7,1,4,1,6,2,5,1,1,1,1,1,1,1,
-                3,1,5,1,3,5,7,5,3,3,2,3,2,7,4,4,5,3,3,2,2,8,1,3,3,3,1,3,3,2,5,4,5,5,6,4,4,3,3,2,
-                3,1,1,3,5,5,6,4,7,2,6,1,3,1,3,3,3,3,115,5,1432,1,22,1,109,1,10,1,38,3,4,1,10,3,9,1,18,1,17,2,
-                23,2,16,5,12,2,11,1,10,1,5,2,7,3,3,3,3,6,6,1,7,1,11,1,8,1,1,1,18,1,17,1,24,1,15,1,18,1,29,1,
-                8,1,5,1,4,1,4,1,6,1,7,1,11,1,7,1,3,1,18,1,16,1,24,1,15,1,18,1,29,1,9,1,3,1,9,1,7,1,8,1,
-                10,1,6,1,5,1,25,4,5,1,1,3,6,4,1,1,4,3,1,1,5,3,5,7,5,3,1,2,3,1,1,3,5,3,7,5,5,1,2,3,
-                5,1,1,1,9,1,8,1,8,1,10,1,37,1,4,1,4,2,3,1,4,1,4,2,3,1,3,2,4,1,3,1,6,1,8,1,3,2,4,2,
-                3,1,6,1,11,1,5,1,2,1,8,1,10,1,8,1,8,1,10,1,42,1,4,1,5,1,2,1,9,1,5,1,3,1,5,1,5,1,7,1,
-                5,1,4,1,4,1,6,1,11,1,5,1,1,1,9,1,9,1,9,1,9,1,9,1,37,6,4,1,5,1,2,1,9,1,5,1,3,7,5,1,
-                7,1,5,1,4,1,4,1,6,1,11,1,5,3,9,1,8,1,3,1,6,1,9,1,9,1,36,1,5,1,4,1,5,1,2,1,9,1,5,1,
-                3,1,11,1,7,1,5,1,4,1,4,1,6,1,11,1,5,1,2,1,8,1,7,1,4,1,6,1,10,1,8,1,36,1,4,2,4,2,3,1,
-                4,1,5,1,3,1,3,2,4,1,4,1,5,1,8,1,3,2,4,1,4,1,6,1,11,1,5,1,3,1,5,5,5,6,6,1,10,1,8,1,
-                37,4,1,2,2,2,1,3,6,5,5,3,1,2,4,4,5,5,6,3,1,1,3,3,2,3,2,7,8,1,4,2,2,4,25,1,11,1,7,1,
-                102,1,28,1,37,3,15,3,102,1,28,1,155,5,24,5,74,10,1072,3,159,1,29,1,77,1,72,1,8,1,9,1,19,1,77,1,71,1,9,1,
-                10,1,18,1,5,2,1,1,2,1,4,2,1,3,6,3,5,2,1,3,6,3,1,2,3,2,2,3,3,4,1,1,2,7,4,2,3,2,3,3,
-                2,3,1,3,5,2,1,3,2,3,1,3,3,3,2,7,6,1,9,1,10,1,18,1,6,2,1,2,1,1,4,2,3,1,4,1,3,1,5,2,
-                3,1,4,1,3,2,5,3,5,1,4,2,4,1,9,1,4,1,4,1,4,1,3,1,3,1,3,1,2,1,4,1,3,1,5,1,3,1,4,1,
-                7,1,9,1,10,1,6,2,10,1,6,1,2,1,2,1,4,1,4,1,3,1,5,1,4,1,5,1,2,1,5,1,5,1,7,1,10,1,9,1,
-                4,1,5,1,2,1,4,1,3,1,3,1,3,1,2,1,5,1,3,1,8,1,8,1,9,1,10,1,5,1,2,1,2,1,6,1,6,1,2,1,
-                2,1,4,1,4,1,3,1,5,1,4,1,5,1,2,1,5,1,5,1,8,5,5,1,9,1,4,1,5,1,2,1,5,1,1,1,1,1,1,1,
-                5,2,6,1,3,1,7,1,8,1,10,1,11,1,8,2,7,1,6,1,2,1,2,1,4,1,4,1,3,1,5,1,4,1,5,1,2,1,5,1,
-                5,1,13,1,4,1,9,1,4,1,5,1,2,1,5,1,1,1,1,1,1,1,4,1,2,1,6,1,1,1,7,1,10,1,9,1,10,1,18,1,
-                6,1,2,1,2,1,4,1,4,1,4,1,3,1,5,2,3,1,4,1,3,2,5,1,7,1,5,1,4,1,4,1,4,1,3,2,6,2,6,1,
-                1,1,1,1,1,1,3,1,4,1,5,1,1,1,6,1,4,1,6,1,9,1,10,1,15,7,2,3,1,2,1,2,2,3,2,3,4,3,6,1,
-                1,3,6,3,1,1,4,5,4,6,6,4,6,3,1,2,5,2,7,1,3,1,3,3,2,3,5,1,6,7,6,1,9,1,10,1,56,1,14,1,
-                76,1,19,1,9,1,10,1,56,1,14,1,75,1,21,1,8,1,9,1,56,3,12,3,71,5,435
-            };
+            Routine* r = head;
+            _Unlink(r);
+            _Link(list, r);
+        }
 
-            // here's how above encoding works, each number represents how many consecutive pixels in a row are transparent or white
-            // they simply alternate between white or transparent
-            // e.g. 4,7,2 means 4 pixels transparent then 7 pixels white then 2 pixels transparent
-            vector<Color> data2;
-            Color current(0, 0, 0, 0);
+        head = list;
+        if (head != nullptr)
+            head->prev = &head;
+    }
 
-            for (auto i : data)
-            {
-                for (int j = 0; j < i; j++)
-                    data2.push_back(current);
+    void RoutineManager::_LinkFrame(Routine* r)
+    {
+        r->next = nullptr;
+        r->prev = this->frameTail;
+        *this->frameTail = r;
+        this->frameTail = &r->next;
+    }
 
-                current = current.r == 0 ? Color(255, 255, 255, 255) : Color(0, 0, 0, 0);
-            }
+    void RoutineManager::_Schedule(Routine* r)
+    {
+        double due = r->nextPulse;
+        if (r->lifeTime > 0 && r->startTime + r->lifeTime < due)
+            due = r->startTime + r->lifeTime;
 
-            // build font metrics fro default font
-            std::string defaultMetrics = "common lineHeight=20\n";
-            char buf[500];
-            int id = 32;
+        r->dueTick = (unsigned long long)std::ceil(due * TicksPerSecond);
 
-            for (int i = 0; i < 5; i++)
-            {
-                for (int j = 0; j < 19; j++)
-                {
-                    sprintf(buf, "char id=%d x=%d y=%d width=%d height=%d xoffset=%d yoffset=%d xadvance=%d\n",
-                        id, j * 10, i * 19, 10, 19, 0, 0, 10);
-                    defaultMetrics += buf;
-                    id++;
-                }
-            }
+        // slot of the current tick was taken already
+        if (r->dueTick < this->currentTick)
+            r->dueTick = this->currentTick;
 
-            Texture* t = creator->CreateTexture(data2.data(), Size(190, 95));
-            this->defaultFont = creator->CreateFontV(t, defaultMetrics.c_str(), true);
-        }
+        unsigned long long delta = r->dueTick - this->currentTick;
+        unsigned long long tick = r->dueTick;
+        uint level = 0;
 
-        Color p[] = { Color(255,255,255,255) };
-        this->whitePixel = creator->CreateTexture(p, Size(1, 1));
+        while (level < WheelLevels - 1 && delta >= (1ull << (8 * (level + 1))))
+            level++;
 
-        vector<Point> square({ Point(0,0),Point(1,0) ,Point(1,-1) ,Point(0,-1) ,Point(0,0) });
-        this->rectVertexBuffer = creator->CreateVertexBuffer(square);
+        // too far, park it in the furthest slot, it's scheduled again when that slot cascades
+        if (delta >= (1ull << (8 * WheelLevels)))
+            tick = this->currentTick + (1ull << (8 * WheelLevels)) - 1;
 
-        vector<Point> circle;
-        for (int i = 0; i < 21; i++)
-            circle.push_back(Point(sinf(2 * math::PI / 20.0f * i) / 2.0f, cosf(2 * math::PI / 20.0f * i) / 2.0f ));
-        this->circleVertexBuffer = creator->CreateVertexBuffer(circle);
+        _Link(this->wheel[level][(tick >> (8 * level)) & (WheelSlots - 1)], r);
+        r->inWheel = true;
+        this->scheduled++;
     }
 
-    // Destroys DrawManager and all drawables.
-    void DrawManager::_Destroy()
+    void RoutineManager::_Cascade(uint level, uint slot)
     {
-        for (Surface* s : this->surfaces)
-            s->Destroy();
+        Routine* list = this->wheel[level][slot];
+        this->wheel[level][slot] = nullptr;
+        if (list != nullptr)
+            list->prev = &list;
+        _Reverse(list);
 
-        this->defaultFont->Destroy();
-        this->whitePixel->Destroy();
-        this->rectVertexBuffer->Destroy();
-        this->circleVertexBuffer->Destroy();
-        delete this;
+        while (list != nullptr)
+        {
+            Routine* r = list;
+            list = r->next;
+            r->next = nullptr;
+            r->prev = nullptr;
+            r->inWheel = false;
+            this->scheduled--;
+            this->_Schedule(r);
+        }
     }
 
-    // Draw all objects on their surfaces.
-    void DrawManager::_DrawNodes()
+    void RoutineManager::_Run(Routine* r, double gameTime)
     {
-        for(int i=0;i<this->surfaces.size();i++)
-            surfaces.at(i)->_DrawAll();
-    }
+        int ret = 1;
 
-    // Draw surfaces.
-    void DrawManager::_DrawSurfaces()
-    {
-        for (int i = 0; i < this->surfaces.size(); i++)
-            surfaces.at(i)->_DrawSurface();
-    }
+        if (gameTime >= r->nextPulse)
+        {
+            // set before so coroutines can change it when they suspend
+            r->nextPulse = gameTime + r->tick;
+            r->running = true;
 
-    Surface* DrawManager::AddSurface()
-    {
-        Surface* newSurface = creator->CreateSurface();
-        this->surfaces.push_back(newSurface);
-        return newSurface;
-    }
+            if (r->parallel)
+            {
+                this->parallelBatch.push_back(r);
+                return;
+            }
 
-    Surface* DrawManager::GetDefaultSurface()
-    {
-        return this->defaultSurface;
-    }
+            ret = r->activity();
+            r->running = false;
+            r->lastPulse = gameTime;
+        }
 
-    void DrawManager::AddSurface(Surface* s)
-    {
-        this->surfaces.push_back(s);
+        this->_AfterRun(r, gameTime, ret);
     }
 
-    void DrawManager::RemoveSurface(Surface* s)
+    void RoutineManager::_RunParallel(double gameTime)
     {
-        if (s == this->defaultSurface)
+        if (this->parallelBatch.empty())
             return;
 
-        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
+        // routines after a throwing one in the same range don't run
+        for (auto r : this->parallelBatch)
+            r->result = 1;
 
-        if (it != this->surfaces.end())
-            this->surfaces.erase(it);
-    }
+        std::exception_ptr error;
+        try
+        {
+            jobSystem->ParallelFor((uint)this->parallelBatch.size(), 64, [this](uint begin, uint end)
+            {
+                for (uint i = begin; i < end; i++)
+                {
+                    // 0 removes it if it throws
+                    this->parallelBatch[i]->result = 0;
+                    this->parallelBatch[i]->result = this->parallelBatch[i]->activity();
+                }
+            });
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
 
-    void DrawManager::MoveSurfaceUp(Surface* s)
-    {
-        if (this->surfaces[0] == s)
-            return;
+        // back on main thread, in the order they became due
+        for (auto r : this->parallelBatch)
+        {
+            r->running = false;
+            r->lastPulse = gameTime;
+            this->_AfterRun(r, gameTime, r->result);
+        }
 
-        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
-        auto prev = --it;
-        *it = *prev;
-        *prev = s;
+        this->parallelBatch.clear();
+
+        if (error)
+            std::rethrow_exception(error);
     }
 
-    void DrawManager::MoveSurfaceDown(Surface* s)
+    void RoutineManager::_AfterRun(Routine* r, double gameTime, int ret)
     {
-        if (this->surfaces.back() == s)
-            return;
-
-        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
-        auto next = ++it;
-        *it = *next;
-        *next = s;
+        //if returned 0, removed from inside or expired then remove
+        if (ret == 0 || r->remove || (r->lifeTime > 0 && gameTime - r->startTime >= r->lifeTime))
+        {
+            this->_Free(r);
+        }
+        else if (r->wait == RoutineWait::Frames)
+        {
+            _Link(this->frameWaits[r->wakeFrame % FrameWaitSlots], r);
+        }
+        else if (r->wait == RoutineWait::Event)
+        {
+            _Link(this->eventWaits[r->waitEvent], r);
+        }
+        // started and runs every frame, futures are polled every frame too
+        else if (r->tick == 0 && gameTime >= r->nextPulse)
+        {
+            this->_LinkFrame(r);
+        }
+        else
+        {
+            this->_Schedule(r);
+        }
     }
 
-    void DrawManager::MoveSurfaceTop(Surface* s)
+    void RoutineManager::_Free(Routine* r)
     {
-        if (this->surfaces[0] == s)
-            return;
+        if (r->id != 0)
+        {
+            *r->idPrev = r->idNext;
+            if (r->idNext != nullptr)
+                r->idNext->idPrev = r->idPrev;
 
-        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
-        this->surfaces.erase(it);
-        this->surfaces.insert(this->surfaces.begin(), s);
-    }
+            // list is empty, drop the head too
+            else if (this->routinesById[r->id] == nullptr)
+                this->routinesById.erase(r->id);
+        }
 
-    void DrawManager::MoveSurfaceBottom(Surface* s)
-    {
-        if (this->surfaces.back() == s)
-            return;
+        this->_ReleaseSlot(r->slot);
 
-        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
-        this->surfaces.erase(it);
-        this->surfaces.push_back(s);
+        this->routinePool.Free(r);
     }
 
-    // Create and add polygon to be drawn.
-    // points: list of points
-    // surface: which surface
-    Polygon* DrawManager::AddPolygon(const vector<Point>& points, Surface* surface)
+    void RoutineManager::_ReleaseSlot(uint slot)
     {
-        Polygon* p = creator->CreatePolygon(points);
-        this->Add(p, surface);
-        return p;
-    }
+        RoutineSlot& s = this->slots.at(slot);
+        s.routine = nullptr;
+        s.generation++;
 
-    // Create and add polygon to be drawn.
-    // points: list of points
-    // surface: which surface
-    Polygon* DrawManager::AddPolygon(VertexBuffer* vb, Surface* surface)
-    {
-        Polygon* p = creator->CreatePolygon(vb);
-        this->Add(p, surface);
-        return p;
-    }
+        // 0 is reserved for default handles
+        if (s.generation == 0)
+            s.generation = 1;
 
-    Polygon* DrawManager::AddRectangle()
-    {
-        return this->AddRectangle(this->defaultSurface);
+        this->freeSlots.push_back(slot);
     }
 
-    Polygon* DrawManager::AddRectangle(Surface* surface)
+    void RoutineManager::_Activity()
     {
-        Polygon* p = creator->CreatePolygon(this->rectVertexBuffer);
-        this->Add(p, surface);
-        return p;
-    }
+        this->frame++;
 
-    Polygon* DrawManager::AddCircle()
-    {
-        return this->AddCircle(this->defaultSurface);
-    }
+        // swap so events deferred now wait for the next frame
+        this->draining.swap(this->deferred);
+        for (auto& e : this->draining)
+            this->Trigger(e.first, e.second);
+        this->draining.clear();
 
-    Polygon* DrawManager::AddCircle(Surface* surface)
-    {
-        Polygon* p = creator->CreatePolygon(this->circleVertexBuffer);
-        this->Add(p, surface);
-        return p;
-    }
+        double gameTime = time->GetGameTime();
+        unsigned long long now = (unsigned long long)(gameTime * TicksPerSecond);
 
-    Polygon* DrawManager::AddCircle(uint vertices)
-    {
-        return this->AddCircle(vertices, this->defaultSurface);
-    }
+        // every frame routines, detached so routines added now run next frame
+        Routine* everyFrame = this->frameRoutines;
+        this->frameRoutines = nullptr;
+        this->frameTail = &this->frameRoutines;
+        if (everyFrame != nullptr)
+            everyFrame->prev = &everyFrame;
 
-    Polygon* DrawManager::AddCircle(uint vertices, Surface* surface)
-    {
-        vector<Point> circle;
-        for (uint i = 0; i < vertices + 1; i++)
-            circle.push_back(Point(sinf(2.0f * math::PI / vertices * i), cosf(2.0f * math::PI / vertices * i)));
+        while (everyFrame != nullptr)
+        {
+            Routine* r = everyFrame;
+            _Unlink(r);
+            this->_Run(r, gameTime);
+        }
 
-        Polygon* p = creator->CreatePolygon(circle);
-        this->Add(p, surface);
-        return p;
-    }
+        // coroutines waiting for frames, slot can have routines waiting for later frames too
+        Routine* waits = this->frameWaits[this->frame % FrameWaitSlots];
+        this->frameWaits[this->frame % FrameWaitSlots] = nullptr;
+        if (waits != nullptr)
+            waits->prev = &waits;
+        _Reverse(waits);
 
-    // Create and add polygon to be drawn.
-    // points: list of points
-    Polygon* DrawManager::AddPolygon(const vector<Point>& points)
-    {
-        return this->AddPolygon(points, this->defaultSurface);
+        while (waits != nullptr)
+        {
+            Routine* r = waits;
+            _Unlink(r);
+
+            if (r->wakeFrame > this->frame)
+                _Link(this->frameWaits[this->frame % FrameWaitSlots], r);
+            else
+                this->_Run(r, gameTime);
+        }
+
+        // nothing to wait for
+        if (this->scheduled == 0 && this->currentTick <= now)
+            this->currentTick = now + 1;
+
+        while (this->currentTick <= now)
+        {
+            unsigned long long tick = this->currentTick;
+
+            // entering new span of upper level slot, move its routines down
+            for (uint level = 1; level < WheelLevels; level++)
+            {
+                if ((tick & ((1ull << (8 * level)) - 1)) != 0)
+                    break;
+
+                this->_Cascade(level, (tick >> (8 * level)) & (WheelSlots - 1));
+            }
+
+            Routine* due = this->wheel[0][tick & (WheelSlots - 1)];
+            this->wheel[0][tick & (WheelSlots - 1)] = nullptr;
+            if (due != nullptr)
+                due->prev = &due;
+            _Reverse(due);
+
+            // so routines scheduled from now on don't go to the slot that's being emptied
+            this->currentTick++;
+
+            while (due != nullptr)
+            {
+                Routine* r = due;
+                _Unlink(r);
+                r->inWheel = false;
+                this->scheduled--;
+
+                // parked because it was too far
+                if (r->dueTick > tick)
+                    this->_Schedule(r);
+                else
+                    this->_Run(r, gameTime);
+            }
+        }
+
+        this->_RunParallel(gameTime);
     }
 
-    // Create and add polygon to be drawn.
-    // points: list of points
-    Polygon* DrawManager::AddPolygon(VertexBuffer* vb)
+    // Add a new routine.
+    //func: code to execute by event (function pointer or closure)
+    //      func must return an int. This is to make it easier to remove routines from inside. 
+    //      If func returns 0, routine is destroyed.
+    //delay: how long to wait before start running
+    //lifeTime: destroy event after that time, 0 to never destroy
+    //tick: run event once every tick seconds, 0 to run every frame
+    Routine* RoutineManager::AddRoutine(const std::function<int()>& func, int id, double delay, double lifeTime, double tick)
     {
-        return this->AddPolygon(vb, this->defaultSurface);
+        return this->AddRoutine(func, id, delay, lifeTime, tick, false);
     }
 
-    // Create and add sprite to be drawn.
-    // t: texture to be used by the sprite
-    // surface: which surface
-    Sprite* DrawManager::AddSprite(Texture* t, Surface* surface)
+    // Add a new routine.
+    //parallel: routine can run on worker threads at the same time as other parallel routines.
+    //          All parallel routines that are due run after serial routines and are done before
+    //          input and drawing. They must only touch their own data. Allowed engine calls are
+    //          jobSystem->ParallelFor(), ObjectPool Alloc()/Free() and const getters such as
+    //          Transform::GetPos(). Adding or removing routines, raising events, creating or
+    //          destroying objects (creator, drawManager), setters and Pos()/Rot()/Scale() that mark
+    //          transforms dirty, and network sends are main thread only. If one throws, it's
+    //          removed and the exception is thrown from the frame after the batch finished.
+    Routine* RoutineManager::AddRoutine(const std::function<int()>& func, int id, double delay, double lifeTime, double tick, bool parallel)
     {
-        Sprite* s = creator->CreateSprite(t);
-        this->Add(s, surface);
-        return s;
+        Routine* newRoutine = this->routinePool.Alloc();
+
+        if (this->freeSlots.empty())
+        {
+            this->freeSlots.push_back((uint)this->slots.size());
+            this->slots.push_back({ nullptr, 1 });
+        }
+
+        newRoutine->slot = this->freeSlots.back();
+        this->freeSlots.pop_back();
+        this->slots.at(newRoutine->slot).routine = newRoutine;
+
+        if (id != 0)
+        {
+            Routine*& head = this->routinesById[id];
+            newRoutine->idNext = head;
+            newRoutine->idPrev = &head;
+            if (head != nullptr)
+                head->idPrev = &newRoutine->idNext;
+            head = newRoutine;
+        }
+
+        newRoutine->tick = tick;
+        newRoutine->lifeTime = lifeTime;
+        newRoutine->delay = delay;
+        newRoutine->startTime = time->GetGameTime();
+        newRoutine->activity = func;
+        newRoutine->id = id;
+        newRoutine->lastPulse = 0;
+        newRoutine->nextPulse = newRoutine->startTime + delay;
+        newRoutine->next = nullptr;
+        newRoutine->prev = nullptr;
+        newRoutine->inWheel = false;
+        newRoutine->wait = RoutineWait::None;
+        newRoutine->running = false;
+        newRoutine->remove = false;
+        newRoutine->parallel = parallel;
+
+        // first run is always in the wheel, even without delay, so it doesn't run in the frame it was added
+        this->_Schedule(newRoutine);
+
+        return newRoutine;
     }
 
-    // Create and add sprite to be drawn.
-    // t: texture to be used by the sprite
-    Sprite* DrawManager::AddSprite(Texture* t)
+    void RoutineManager::RemoveRoutine(Routine* r)
     {
-        return this->AddSprite(t, this->defaultSurface);
+        // removed after its func returns
+        if (r->running)
+        {
+            r->remove = true;
+            return;
+        }
+
+        if (r->inWheel)
+            this->scheduled--;
+
+        if (this->frameTail == &r->next)
+            this->frameTail = r->prev;
+
+        _Unlink(r);
+        this->_Free(r);
     }
 
-    // Create and add a unicolor rectangle to be drawn.
-    // surface: which surface,nullptr for default
-    Sprite* DrawManager::AddFillRectangle(Surface* surface)
+    Routine* RoutineManager::AddRoutine(const std::function<int()>& func)
     {
-        Sprite* s = this->AddSprite(this->whitePixel, surface);
-        return s;
+        return this->AddRoutine(func, 0, 0, 0, 0);
     }
 
-    // Create and add a unicolor rectangle to be drawn.
-    Sprite* DrawManager::AddFillRectangle()
+#ifdef VIVA_COROUTINES
+    Routine* RoutineManager::StartCoroutine(Coroutine&& coroutine, int id)
     {
-        return this->AddFillRectangle(this->defaultSurface);
+        std::coroutine_handle<Coroutine::promise_type> handle = coroutine._Release();
+
+        // frame is destroyed with the routine, also when it's removed while suspended
+        std::shared_ptr<void> frame(handle.address(), [](void* address)
+        {
+            std::coroutine_handle<>::from_address(address).destroy();
+        });
+
+        Routine* r = this->AddRoutine(nullptr, id, 0, 0, 0);
+        handle.promise().routine = r;
+
+        r->activity = [r, frame]()
+        {
+            if (r->wait == RoutineWait::Future && !r->poll(r->awaiter))
+                return 1;
+
+            std::coroutine_handle<> h = std::coroutine_handle<>::from_address(frame.get());
+            r->wait = RoutineWait::None;
+            h.resume();
+
+            return h.done() ? 0 : 1;
+        };
+
+        return r;
     }
 
-    Text* DrawManager::AddText(const wchar_t* str)
+    Routine* RoutineManager::StartCoroutine(Coroutine&& coroutine)
     {
-        return this->AddText(str, this->defaultSurface);
+        return this->StartCoroutine(std::move(coroutine), 0);
     }
+#endif
 
-    Text* DrawManager::AddText(const wchar_t* str, Font* font)
+    void RoutineManager::_WaitSeconds(Routine* r, double seconds)
     {
-        return this->AddText(str, font, this->defaultSurface);
+        r->nextPulse = time->GetGameTime() + seconds;
     }
 
-    Text* DrawManager::AddText(const wchar_t* str, Surface* surface)
+    void RoutineManager::_WaitFrames(Routine* r, uint frames)
     {
-        Text* t = creator->CreateText(str);
-        this->Add(t, surface);
-
-        return t;
+        r->wait = RoutineWait::Frames;
+        r->wakeFrame = this->frame + frames;
     }
 
-    Text* DrawManager::AddText(const wchar_t* str, Font* font, Surface* surface)
+    void RoutineManager::_WaitEvent(Routine* r, int _event, int* data)
     {
-        Text* t = creator->CreateText(str, font);
-        this->Add(t, surface);
-
-        return t;
+        r->wait = RoutineWait::Event;
+        r->waitEvent = _event;
+        r->eventData = data;
     }
 
-    Animation* DrawManager::AddAnimation(Sprite* sprite, Surface* surface)
+    void RoutineManager::_WaitFuture(Routine* r, bool(*poll)(void* awaiter), void* awaiter)
     {
-        Animation* ani = creator->CreateAnimation(sprite);
-        this->Add(ani, surface);
-        return ani;
+        r->wait = RoutineWait::Future;
+        r->poll = poll;
+        r->awaiter = awaiter;
     }
 
-    Animation* DrawManager::AddAnimation(Sprite* sprite)
+    bool RoutineManager::RemoveRoutine(RoutineHandle h)
     {
-        Animation* ani = creator->CreateAnimation(sprite);
-        this->Add(ani, this->defaultSurface);
-        return ani;
+        Routine* r = this->GetRoutine(h);
+
+        if (r == nullptr || r->remove)
+            return false;
+
+        this->RemoveRoutine(r);
+        return true;
     }
 
-    Animation* DrawManager::AddAnimation(Texture* texture, Surface* surface)
+    RoutineHandle RoutineManager::GetHandle(Routine* r) const
     {
-        Animation* ani = creator->CreateAnimation(texture);
-        this->Add(ani, surface);
-        return ani;        
+        return { r->slot, this->slots.at(r->slot).generation };
     }
 
-    Animation* DrawManager::AddAnimation(Texture* texture)
+    Routine* RoutineManager::GetRoutine(RoutineHandle h) const
     {
-        Animation* ani = creator->CreateAnimation(texture);
-        this->Add(ani, this->defaultSurface);
-        return ani;
+        if (h.slot >= this->slots.size() || this->slots[h.slot].generation != h.generation)
+            return nullptr;
+
+        return this->slots[h.slot].routine;
     }
 
-    void DrawManager::Remove(Drawable* drawable) const
+    // Find routine by id, nullptr if there is none or id is 0.
+    // If more routines have the same id, any of them is returned.
+    Routine* RoutineManager::FindRoutine(int id)
     {
-        drawable->GetSurface()->Remove(drawable);
+        if (id == 0)
+            return nullptr;
+
+        auto it = this->routinesById.find(id);
+
+        if (it == this->routinesById.end())
+            return nullptr;
+
+        return it->second;
     }
 
-    void DrawManager::Add(Drawable* drawable, Surface* surface) const
+    RoutineManager::EventSlot& RoutineManager::_FindEvent(int _event)
     {
-        surface->Add(drawable);
+        uint mask = (uint)this->events.size() - 1;
+        uint i = ((uint)_event * 2654435769u) & mask;
+
+        while (this->events[i].used && this->events[i].event != _event)
+            i = (i + 1) & mask;
+
+        return this->events[i];
     }
 
-    void DrawManager::Add(Drawable* drawable)
+    void RoutineManager::Trigger(int _event, int data)
     {
-        this->defaultSurface->Add(drawable);
+        // coroutines waiting for the event resume with every frame routines
+        auto waits = this->eventWaits.empty() ? this->eventWaits.end() : this->eventWaits.find(_event);
+
+        if (waits != this->eventWaits.end() && waits->second != nullptr)
+        {
+            Routine* list = waits->second;
+            waits->second = nullptr;
+            list->prev = &list;
+
+            while (list != nullptr)
+            {
+                Routine* r = list;
+                _Unlink(r);
+                *r->eventData = data;
+                r->wait = RoutineWait::None;
+                this->_LinkFrame(r);
+            }
+        }
+
+        EventSlot& slot = this->_FindEvent(_event);
+
+        if (!slot.used)
+            return;
+
+        this->dispatching++;
+
+        for (auto& handler : slot.handlers)
+            handler(data);
+
+        this->dispatching--;
+
+        if (this->dispatching > 0 || this->pendingHandlers.empty())
+            return;
+
+        for (auto& pending : this->pendingHandlers)
+            this->AddHandler(pending.first, pending.second);
+
+        this->pendingHandlers.clear();
     }
 
-    TextureFilter DrawManager::GetDefaultTextureFilter() const
+    void RoutineManager::TriggerDeferred(int _event, int data)
     {
-        return this->defaultFilter;
+        this->deferred.push_back({ _event, data });
     }
 
-    void DrawManager::SetDefaultTextureFilter(TextureFilter filter)
+    void RoutineManager::AddHandler(int _event, const EventHandler& handler)
     {
-        this->defaultFilter = filter;
+        // table and handler lists must not move while handlers are called
+        if (this->dispatching > 0)
+        {
+            this->pendingHandlers.push_back({ _event, handler });
+            return;
+        }
+
+        // keep load under 1/2
+        if ((this->eventCount + 1) * 2 > this->events.size())
+        {
+            vector<EventSlot> old(this->events.size() * 2);
+            old.swap(this->events);
+
+            for (auto& slot : old)
+            {
+                if (!slot.used)
+                    continue;
+
+                EventSlot& newSlot = this->_FindEvent(slot.event);
+                newSlot.event = slot.event;
+                newSlot.used = true;
+                newSlot.handlers.swap(slot.handlers);
+            }
+        }
+
+        EventSlot& slot = this->_FindEvent(_event);
+
+        if (!slot.used)
+        {
+            slot.event = _event;
+            slot.used = true;
+            this->eventCount++;
+        }
+
+        slot.handlers.push_back(handler);
     }
 
-    Texture* DrawManager::GetPixel()
+    // Remove all handlers for that event.
+    void RoutineManager::ClearHandlers(int _event)
     {
-        return this->whitePixel;
+        EventSlot& slot = this->_FindEvent(_event);
+
+        // slot stays used, there are no tombstones
+        if (slot.used)
+            slot.handlers.clear();
     }
 
-    Font* DrawManager::GetDefaultFont() const
+    // Remove all handlers.
+    void RoutineManager::ClearHandlers()
     {
-        return this->defaultFont;
+        for (auto& slot : this->events)
+        {
+            slot.used = false;
+            slot.handlers.clear();
+        }
+
+        this->eventCount = 0;
+        this->deferred.clear();
+        this->pendingHandlers.clear();
     }
 
-    // Destroy all surfaces (except the default one) and all object from the default surface.
-    void DrawManager::Clear()
+    // Remove all routines.
+    // Don't call it from inside a routine.
+    void RoutineManager::ClearRoutines()
     {
-        for (Surface* surface : this->surfaces)
-            if (surface != this->defaultSurface)
-                surface->Destroy();
+        for (uint i = 0; i < this->slots.size(); i++)
+        {
+            RoutineSlot& slot = this->slots[i];
 
-        this->defaultSurface->Clear();
-        this->surfaces.clear();
-        this->surfaces.push_back(this->defaultSurface);
+            if (slot.routine == nullptr)
+                continue;
+
+            this->routinePool.Free(slot.routine);
+            this->_ReleaseSlot(i);
+        }
+
+        this->routinesById.clear();
+        this->frameRoutines = nullptr;
+        this->frameTail = &this->frameRoutines;
+        this->scheduled = 0;
+        this->eventWaits.clear();
+
+        for (uint i = 0; i < FrameWaitSlots; i++)
+            this->frameWaits[i] = nullptr;
+
+        for (uint i = 0; i < WheelLevels; i++)
+            for (uint j = 0; j < WheelSlots; j++)
+                this->wheel[i][j] = nullptr;
     }
 
-    void DrawManager::ResizeExtraPSBuffer(uint size)
+    void RoutineManager::_Destroy()
     {
-        d3d.constantBufferPSExtra->Release();
-        d3d.constantBufferPSExtra = util::CreateConstantBuffer(size);
-        d3d.context->PSSetConstantBuffers(1, 1, &d3d.constantBufferPSExtra);
+        this->ClearRoutines();
+        this->ClearHandlers();
+
+        delete this;
     }
 }
 #pragma endregion
 
-/*@// Window *********************************************************************************************************@*/
+#ifdef VIVA_COROUTINES
+    /*@// Awaitables *****************************************************************************************************@*/
 namespace viva
 {
-    // Window where everything is being drawn.
-    class Window
+    // co_await WaitSeconds(2) resumes coroutine after 2 seconds of game time.
+    struct WaitSeconds
     {
-    private:
-        RAWINPUTDEVICE Rid; //RAWINPUTDEVICE Rid[1]; // you can have more than one
-        HWND handle;
-        MSG msg;
-        std::function<void()> worker;   // lib side worker
-        std::function<void()> activity; // client size activity
-        static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam);
-    public:
-        // Ctor.
-        Window(const char* title, const Size& size);
+        double seconds;
 
-        HWND GetHandle() const;
+        WaitSeconds(double seconds) : seconds(seconds)
+        {
+        }
 
-        void _Destroy();
+        bool await_ready() const
+        {
+            return false;
+        }
 
-        void SetWindowTitle(const char* title);
+        void await_suspend(std::coroutine_handle<Coroutine::promise_type> h)
+        {
+            routineManager->_WaitSeconds(h.promise().routine, this->seconds);
+        }
 
-        // start win32 message pump
-        // gameloop: user's function that runs every frame
-        // intloop: engine function that runs every frame
-        CloseReason Run(const std::function<void()>& gameloop, const std::function<void()>& intloop);
+        void await_resume()
+        {
+        }
     };
-}
 
-#pragma region code
-namespace viva
-{
-    LRESULT CALLBACK Window::WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+    // co_await WaitFrames(1) resumes coroutine in the next frame.
+    struct WaitFrames
     {
-        switch (msg)
-        {
-        case WM_SYSKEYDOWN:
+        uint frames;
+
+        WaitFrames(uint frames) : frames(frames)
+        {
+        }
+
+        bool await_ready() const
+        {
+            return this->frames == 0;
+        }
+
+        void await_suspend(std::coroutine_handle<Coroutine::promise_type> h)
+        {
+            routineManager->_WaitFrames(h.promise().routine, this->frames);
+        }
+
+        void await_resume()
+        {
+        }
+    };
+
+    // int data = co_await WaitEvent(id) resumes coroutine in the frame after event is triggered.
+    // Returns data of the event.
+    struct WaitEvent
+    {
+        int _event;
+        int data;
+
+        WaitEvent(int _event) : _event(_event), data(0)
+        {
+        }
+
+        bool await_ready() const
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<Coroutine::promise_type> h)
+        {
+            routineManager->_WaitEvent(h.promise().routine, this->_event, &this->data);
+        }
+
+        int await_resume()
+        {
+            return this->data;
+        }
+    };
+
+    // T value = co_await WaitFuture(future) resumes coroutine when future is ready. Future is polled
+    // once a frame, there is no way to get notified.
+    template <typename T>
+    struct WaitFuture
+    {
+        std::future<T>& future;
+
+        WaitFuture(std::future<T>& future) : future(future)
+        {
+        }
+
+        static bool _Poll(void* awaiter)
+        {
+            return static_cast<WaitFuture*>(awaiter)->await_ready();
+        }
+
+        bool await_ready() const
+        {
+            return this->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        void await_suspend(std::coroutine_handle<Coroutine::promise_type> h)
+        {
+            routineManager->_WaitFuture(h.promise().routine, &WaitFuture::_Poll, this);
+        }
+
+        T await_resume()
+        {
+            return this->future.get();
+        }
+    };
+}
+#endif
+
+/*@// PixelShader ****************************************************************************************************@*/
+namespace viva
+{
+    class PixelShader : public Destroyable
+    {
+    protected:
+        ID3D11PixelShader* ps;
+    public:
+        PixelShader(ID3D11PixelShader* _ps);
+        void Destroy();
+        ID3D11PixelShader* GetPS() const;
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    PixelShader::PixelShader(ID3D11PixelShader* _ps) :ps(_ps)
+    {
+    }
+
+    void PixelShader::Destroy()
+    {
+        if (resourceManager->_Release(this))
+            return;
+
+        // software backend shaders have nothing to release
+#ifdef _WIN32
+        if (this->ps != nullptr)
+            this->ps->Release();
+#endif
+
+        delete this;
+    }
+
+    ID3D11PixelShader* PixelShader::GetPS() const
+    {
+        return this->ps;
+    }
+}
+#pragma endregion
+
+//class VertexShader
+//{
+//protected:
+//public:
+//	virtual void Destroy() = 0;
+//};
+
+    /*@// ResourceManager ************************************************************************************************@*/
+namespace viva
+{
+    // Cache of textures, fonts and pixel shaders loaded from files. Resources are found by path and
+    // by hash of file contents, so the same image under two names is decoded once. Every Get*()
+    // adds a reference and Destroy() of the resource takes it away. Resources nobody references stay
+    // cached and the least recently used ones are freed when resident bytes go over budget.
+    class ResourceManager
+    {
+    private:
+        enum class ResourceType
+        {
+            Texture,
+            Font,
+            PixelShader
+        };
+
+        struct Entry
+        {
+            ResourceType type;
+            Destroyable* resource;
+            unsigned long long hash; // of file contents, 0 if added by hand
+            size_t bytes;
+            uint refs;
+            vector<std::string> paths; // names it can be found by
+            std::list<Entry*>::iterator lru; // in unused if refs is 0
+        };
+
+        std::unordered_map<std::string, Entry*> byPath;
+        std::unordered_map<unsigned long long, Entry*> byHash;
+        std::unordered_map<const void*, Entry*> byResource;
+        std::list<Entry*> unused; // not referenced, front was released last
+        size_t budget;
+        size_t resident;
+        long long pathHits;
+        long long contentHits;
+        long long misses;
+        long long evictions;
+
+        // FNV-1a, seed keeps different resource types apart.
+        static unsigned long long _Hash(const byte* data, size_t size, unsigned long long seed);
+
+        Destroyable* _Acquire(Entry* e);
+
+        // Found by path or contents, null if not cached.
+        Entry* _Find(const std::string& path, unsigned long long hash, ResourceType type);
+
+        Entry* _Insert(ResourceType type, Destroyable* resource, const std::string& path, unsigned long long hash, size_t bytes);
+
+        void _Add(const char* name, ResourceType type, Destroyable* resource, size_t bytes);
+
+        // Free unused until resident is under budget.
+        void _Evict();
+
+        void _Free(Entry* e);
+    public:
+        ResourceManager();
+
+        // Load texture or get cached one.
+        // filename: file path
+        Texture* GetTexture(const char* filename);
+
+        // Load font or get cached one. Font texture is cached too.
+        // textureFile: image with glyphs
+        // metricsFile: character metrics
+        Font* GetFont(const char* textureFile, const char* metricsFile);
+
+        // Compile pixel shader from file or get cached one.
+        // filename: file path
+        PixelShader* GetPixelShader(const char* filename);
+
+        // Cache resource that was not loaded from file under a name. Caller's pointer counts as reference.
+        // name: Get*() with this name returns the resource
+        void Add(const char* name, Texture* texture);
+
+        void Add(const char* name, Font* font);
+
+        void Add(const char* name, PixelShader* ps);
+
+        // Forget the name. Resource is freed when nothing references it and it has no other name.
+        void Remove(const char* name);
+
+        // Unused resources are evicted when resident bytes go over this. Referenced resources are
+        // never evicted. Default is 256MB.
+        void SetBudget(size_t bytes);
+
+        size_t GetBudget() const;
+
+        // Bytes of everything cached, referenced or not.
+        size_t GetResidentBytes() const;
+
+        // Number of cached resources.
+        uint GetCount() const;
+
+        // Hits over all Get*() calls since last ResetStats().
+        double GetHitRate() const;
+
+        // Found by path.
+        long long GetPathHits() const;
+
+        // Found by contents under a different path.
+        long long GetContentHits() const;
+
+        long long GetMisses() const;
+
+        long long GetEvictions() const;
+
+        void ResetStats();
+
+        // Free everything that is not referenced.
+        void Trim();
+
+        // Resource is being destroyed. Returns true if it's cached and the call only took away a
+        // reference, false if caller should free it.
+        bool _Release(const void* resource);
+
+        void _Destroy();
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    ResourceManager::ResourceManager() : budget(256 * 1024 * 1024), resident(0), pathHits(0), contentHits(0),
+        misses(0), evictions(0)
+    {
+    }
+
+    unsigned long long ResourceManager::_Hash(const byte* data, size_t size, unsigned long long seed)
+    {
+        unsigned long long hash = 14695981039346656037ull ^ seed;
+
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+
+        // 0 means no hash
+        return hash == 0 ? 1 : hash;
+    }
+
+    Destroyable* ResourceManager::_Acquire(Entry* e)
+    {
+        if (e->refs == 0)
+            this->unused.erase(e->lru);
+
+        e->refs++;
+        return e->resource;
+    }
+
+    ResourceManager::Entry* ResourceManager::_Find(const std::string& path, unsigned long long hash, ResourceType type)
+    {
+        auto h = this->byHash.find(hash);
+        if (h == this->byHash.end() || h->second->type != type)
+            return nullptr;
+
+        // same contents under new name
+        Entry* e = h->second;
+        e->paths.push_back(path);
+        this->byPath[path] = e;
+        this->contentHits++;
+        return e;
+    }
+
+    ResourceManager::Entry* ResourceManager::_Insert(ResourceType type, Destroyable* resource, const std::string& path,
+        unsigned long long hash, size_t bytes)
+    {
+        Entry* e = new Entry();
+        e->type = type;
+        e->resource = resource;
+        e->hash = hash;
+        e->bytes = bytes;
+        e->refs = 1;
+        e->paths.push_back(path);
+
+        this->byPath[path] = e;
+        this->byResource[resource] = e;
+        if (hash != 0)
+            this->byHash[hash] = e;
+
+        this->resident += bytes;
+        this->_Evict();
+        return e;
+    }
+
+    Texture* ResourceManager::GetTexture(const char* filename)
+    {
+        auto it = this->byPath.find(filename);
+        if (it != this->byPath.end() && it->second->type == ResourceType::Texture)
+        {
+            this->pathHits++;
+            return (Texture*)this->_Acquire(it->second);
+        }
+
+        // hashed and decoded in place, file is not copied
+        util::MappedFile file(filename);
+        unsigned long long hash = _Hash(file.GetData(), file.GetSize(), (unsigned long long)ResourceType::Texture);
+
+        Entry* e = this->_Find(filename, hash, ResourceType::Texture);
+        if (e != nullptr)
+            return (Texture*)this->_Acquire(e);
+
+        this->misses++;
+        Color* pixels = nullptr;
+        Size size = util::DecodeImageToPixels(file.GetData(), file.GetSize(), filename, &pixels);
+        Texture* tex = renderBackend->_CreateTexture(pixels, size);
+
+        // free used because library uses malloc
+        free(pixels);
+
+        size_t textureBytes = (size_t)size.width * (size_t)size.height * sizeof(Color);
+        return (Texture*)this->_Insert(ResourceType::Texture, tex, filename, hash, textureBytes)->resource;
+    }
+
+    Font* ResourceManager::GetFont(const char* textureFile, const char* metricsFile)
+    {
+        std::string path = std::string(textureFile) + "|" + metricsFile;
+        auto it = this->byPath.find(path);
+        if (it != this->byPath.end() && it->second->type == ResourceType::Font)
+        {
+            this->pathHits++;
+            return (Font*)this->_Acquire(it->second);
+        }
+
+        std::string metrics = util::ReadFileToStringA(metricsFile);
+        Texture* tex = this->GetTexture(textureFile);
+
+        // same metrics on the same texture, texture pointer stands for its contents
+        unsigned long long hash = _Hash((const byte*)metrics.data(), metrics.size(), (unsigned long long)ResourceType::Font);
+        hash = _Hash((const byte*)&tex, sizeof(tex), hash);
+
+        Entry* e = this->_Find(path, hash, ResourceType::Font);
+        if (e != nullptr)
+        {
+            // cached font already has a reference to the texture
+            tex->Destroy();
+            return (Font*)this->_Acquire(e);
+        }
+
+        this->misses++;
+        Font* font = new Font(tex, metrics.c_str(), true);
+        return (Font*)this->_Insert(ResourceType::Font, font, path, hash, sizeof(Font) + metrics.size())->resource;
+    }
+
+    PixelShader* ResourceManager::GetPixelShader(const char* filename)
+    {
+        auto it = this->byPath.find(filename);
+        if (it != this->byPath.end() && it->second->type == ResourceType::PixelShader)
+        {
+            this->pathHits++;
+            return (PixelShader*)this->_Acquire(it->second);
+        }
+
+        std::string source = util::ReadFileToStringA(filename);
+        unsigned long long hash = _Hash((const byte*)source.data(), source.size(), (unsigned long long)ResourceType::PixelShader);
+
+        Entry* e = this->_Find(filename, hash, ResourceType::PixelShader);
+        if (e != nullptr)
+            return (PixelShader*)this->_Acquire(e);
+
+        this->misses++;
+        PixelShader* ps = renderBackend->_CreatePixelShader(source.c_str());
+
+        // bytecode size is not known, source is close enough
+        return (PixelShader*)this->_Insert(ResourceType::PixelShader, ps, filename, hash, source.size())->resource;
+    }
+
+    void ResourceManager::_Add(const char* name, ResourceType type, Destroyable* resource, size_t bytes)
+    {
+        if (this->byPath.find(name) != this->byPath.end())
+            throw Error(__FUNCTION__, "Name is already used");
+
+        // one more name for cached resource
+        auto it = this->byResource.find(resource);
+        if (it != this->byResource.end())
+        {
+            it->second->paths.push_back(name);
+            this->byPath[name] = it->second;
+            return;
+        }
+
+        this->_Insert(type, resource, name, 0, bytes);
+    }
+
+    void ResourceManager::Add(const char* name, Texture* texture)
+    {
+        const Size& size = texture->GetSize();
+        this->_Add(name, ResourceType::Texture, texture, (size_t)size.width * (size_t)size.height * sizeof(Color));
+    }
+
+    void ResourceManager::Add(const char* name, Font* font)
+    {
+        this->_Add(name, ResourceType::Font, font, sizeof(Font));
+    }
+
+    void ResourceManager::Add(const char* name, PixelShader* ps)
+    {
+        this->_Add(name, ResourceType::PixelShader, ps, 0);
+    }
+
+    void ResourceManager::Remove(const char* name)
+    {
+        auto it = this->byPath.find(name);
+        if (it == this->byPath.end())
+            return;
+
+        Entry* e = it->second;
+        this->byPath.erase(it);
+        e->paths.erase(std::find(e->paths.begin(), e->paths.end(), std::string(name)));
+
+        if (e->paths.empty() && e->refs == 0)
+            this->_Free(e);
+    }
+
+    void ResourceManager::SetBudget(size_t bytes)
+    {
+        this->budget = bytes;
+        this->_Evict();
+    }
+
+    size_t ResourceManager::GetBudget() const
+    {
+        return this->budget;
+    }
+
+    size_t ResourceManager::GetResidentBytes() const
+    {
+        return this->resident;
+    }
+
+    uint ResourceManager::GetCount() const
+    {
+        return (uint)this->byResource.size();
+    }
+
+    double ResourceManager::GetHitRate() const
+    {
+        long long hits = this->pathHits + this->contentHits;
+        long long total = hits + this->misses;
+        return total > 0 ? (double)hits / total : 0;
+    }
+
+    long long ResourceManager::GetPathHits() const
+    {
+        return this->pathHits;
+    }
+
+    long long ResourceManager::GetContentHits() const
+    {
+        return this->contentHits;
+    }
+
+    long long ResourceManager::GetMisses() const
+    {
+        return this->misses;
+    }
+
+    long long ResourceManager::GetEvictions() const
+    {
+        return this->evictions;
+    }
+
+    void ResourceManager::ResetStats()
+    {
+        this->pathHits = 0;
+        this->contentHits = 0;
+        this->misses = 0;
+        this->evictions = 0;
+    }
+
+    void ResourceManager::_Evict()
+    {
+        // freeing a font releases its texture, it goes to the front and is evicted later if needed
+        while (this->resident > this->budget && this->unused.size() > 0)
+        {
+            this->evictions++;
+            this->_Free(this->unused.back());
+        }
+    }
+
+    void ResourceManager::Trim()
+    {
+        while (this->unused.size() > 0)
+            this->_Free(this->unused.back());
+    }
+
+    void ResourceManager::_Free(Entry* e)
+    {
+        if (e->refs == 0)
+            this->unused.erase(e->lru);
+
+        for (size_t i = 0; i < e->paths.size(); i++)
+            this->byPath.erase(e->paths[i]);
+
+        auto h = this->byHash.find(e->hash);
+        if (h != this->byHash.end() && h->second == e)
+            this->byHash.erase(h);
+
+        this->byResource.erase(e->resource);
+        this->resident -= e->bytes;
+
+        // not cached anymore so Destroy() frees it
+        Destroyable* resource = e->resource;
+        delete e;
+        resource->Destroy();
+    }
+
+    bool ResourceManager::_Release(const void* resource)
+    {
+        auto it = this->byResource.find(resource);
+        if (it == this->byResource.end())
+            return false;
+
+        Entry* e = it->second;
+        if (e->refs == 0)
+            throw Error(__FUNCTION__, "Resource destroyed more times than it was created");
+
+        e->refs--;
+        if (e->refs > 0)
+            return true;
+
+        // nobody can get it again
+        if (e->paths.empty())
+        {
+            this->_Free(e);
+            return true;
+        }
+
+        this->unused.push_front(e);
+        e->lru = this->unused.begin();
+        this->_Evict();
+        return true;
+    }
+
+    void ResourceManager::_Destroy()
+    {
+        // whatever is still referenced goes too, engine is shutting down. Fonts first, they release
+        // their textures.
+        for (int pass = 0; pass < 2; pass++)
+        {
+            vector<Entry*> entries;
+            for (auto it = this->byResource.begin(); it != this->byResource.end(); it++)
+            {
+                if (pass == 1 || it->second->type == ResourceType::Font)
+                    entries.push_back(it->second);
+            }
+
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                Entry* e = entries[i];
+                if (this->byResource.find(e->resource) == this->byResource.end())
+                    continue;
+
+                if (e->refs > 0)
+                {
+                    e->refs = 0;
+                    this->unused.push_front(e);
+                    e->lru = this->unused.begin();
+                }
+                this->_Free(e);
+            }
+        }
+
+        delete this;
+    }
+}
+#pragma endregion
+
+    /*@// Camera *********************************************************************************************************@*/
+namespace viva
+{
+    class Camera
+    {
+    private:
+        Transform lookAt;
+        Matrix sca;
+        Matrix scaLoc;
+        uint version;
+        uint screenVersion;
+        Size pixel2unit;
+        Size unit2pixel;
+        // size in world units of the client rect
+        Size frustumSize;
+    public:
+        // Default ctor.
+        // size: viewport size
+        Camera(const Size& size);
+
+        /*XMFLOAT3 GetCursorWorldPos(float z);
+        XMMATRIX GetViewMatrix();
+        XMMATRIX GetProjMatrix();*/
+
+        const Matrix& _GetSca() const;
+
+        const Matrix& _GetScaLoc() const;
+
+        Transform* GetLookAt();
+
+        // Changes every time view matrices change.
+        uint _GetVersion() const;
+
+        // Changes every time frustum size or pixel conversion change, screen mode depends on them.
+        uint _GetScreenVersion() const;
+
+        // Returns screen coordinates in pixels of the given world coordinates
+        Point WorldToScreen(const Vector& pos) const;
+
+        Vector ScreenToWorld(const Point& pos) const;
+
+        Size Pixel2World(const Size& in) const;
+
+        Size World2Pixel(const Size& in) const;
+
+        const Size& GetPixel2UnitConversion() const;
+
+        const Size& GetUnit2PixelConversion() const;
+
+        const Size& GetFrustumSize() const;
+
+        void _Destroy();
+
+        void _Activity();
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    Camera::Camera(const Size& unitSize) : 
+        unit2pixel(unitSize), version(0), screenVersion(1)
+    {
+        auto& clientSize = engine->GetClientSize();
+
+        this->pixel2unit = { 1.0f / unitSize.width,
+            1.0f / unitSize.height };
+
+        frustumSize = {clientSize.width / unitSize.width, clientSize.height / unitSize.height};
+    }
+
+    void Camera::_Activity()
+    {
+        auto& clientSize = engine->GetClientSize();
+
+        // client rect resized, screen mode transforms are placed from its corner
+        Size frustumSize = { clientSize.width / this->unit2pixel.width, clientSize.height / this->unit2pixel.height };
+        if (frustumSize.width != this->frustumSize.width || frustumSize.height != this->frustumSize.height)
+        {
+            this->frustumSize = frustumSize;
+            this->screenVersion++;
+        }
+
+        Matrix sca = math::matrix::scale(
+            2.0f / clientSize.width * this->unit2pixel.width,
+            2.0f / clientSize.height * this->unit2pixel.height);
+        const Vector& lookAtPos = this->lookAt.GetPos();
+        Matrix scaLoc = sca * math::matrix::translate(-lookAtPos.x, lookAtPos.y);
+
+        // transforms rebuild their cached matrices only when this changes
+        if (memcmp(&sca, &this->sca, sizeof(Matrix)) != 0 || memcmp(&scaLoc, &this->scaLoc, sizeof(Matrix)) != 0)
+        {
+            this->sca = sca;
+            this->scaLoc = scaLoc;
+            this->version++;
+        }
+    }
+
+    uint Camera::_GetVersion() const
+    {
+        return this->version;
+    }
+
+    uint Camera::_GetScreenVersion() const
+    {
+        return this->screenVersion;
+    }
+
+    Transform* Camera::GetLookAt()
+    {
+        return &this->lookAt;
+    }
+
+    const Size& Camera::GetFrustumSize() const
+    {
+        return this->frustumSize;
+    }
+
+    const Size& Camera::GetPixel2UnitConversion() const
+    {
+        return this->pixel2unit;
+    }
+
+    const Size& Camera::GetUnit2PixelConversion() const
+    {
+        return this->unit2pixel;
+    }
+
+    Size Camera::Pixel2World(const Size& in) const
+    {
+        return Size(in.width * this->pixel2unit.width, in.height * this->pixel2unit.height);
+    }
+
+    Size Camera::World2Pixel(const Size& in) const
+    {
+        return Size(in.width * this->unit2pixel.width, in.height * this->unit2pixel.height);
+    }
+
+    /*XMFLOAT3 GetCursorWorldPos(float z);
+    XMMATRIX GetViewMatrix();
+    XMMATRIX GetProjMatrix();*/
+    
+    // Get view matrix.
+    const Matrix& Camera::_GetSca() const
+    {
+        return this->sca;
+    }
+
+    const Matrix& Camera::_GetScaLoc() const
+    {
+        return this->scaLoc;
+    }
+
+    // Returns screen coordinates in pixels of the given world coordinates
+    Point Camera::WorldToScreen(const Vector& pos) const
+    {
+        throw Error(__FUNCTION__, "Not implemented");
+        return Point(0, 0);
+    }
+
+    Vector Camera::ScreenToWorld(const Point& pos) const
+    {
+        throw Error(__FUNCTION__, "Not implemented");
+        return Vector();
+    }
+
+    void Camera::_Destroy()
+    {
+        delete this;
+    }
+}
+#pragma endregion
+
+/*@// Sprite *********************************************************************************************************@*/
+namespace viva
+{
+    // Drawable picture.
+    class Sprite : public Drawable
+    {
+    protected:
+        TextureFilter filter;
+        Rect uv;
+        bool flipHorizontally;
+        bool flipVertically;
+        Transform transform;
+        Surface* parent;
+        uint index;
+        bool visible;
+        Texture* texture;
+        PixelShader* ps;
+    public:
+        // Ctor.
+        Sprite(Texture* tex, PixelShader* _ps);
+
+        // Get transform of the object.
+        Transform* T();
+
+        // Get transform of the object.
+        Transform* GetTransform();
+
+        // Set filter type.
+        Sprite* SetTextureFilter(TextureFilter _filter);
+
+        // Get filter type.
+        TextureFilter GetTextureFilter() const;
+
+        // Set scale to match texture size.
+        Sprite* SetScale2TextureSize();
+
+        // Is sprite flipped horizontally.
+        bool IsFlippedHorizontally() const;
+
+        // Set horizontal flip.
+        // _flipHorizontally: flip or not
+        Sprite* SetFlipHorizontally(bool _flipHorizontally);
+
+        // Is sprite flipped vertically.
+        bool IsFlippedVertically() const;
+
+        // Set vertical flip.
+        // _flipVertically: flip or not
+        Sprite* SetFlipVertically(bool _flipVertically);
+        
+        // Get uv.
+        const Rect& GetUV() const;
+
+        // Get PS.
+        PixelShader* GetPixelShader() const;
+
+        //Set Ps.
+        Sprite* SetPixelShader(PixelShader* ps);
+
+        // Set uv.
+        // _uv: new uv
+        //         0          
+        //    +---------+     
+        //    |         |     
+        // 0  |         | 1    
+        //    |         |      
+        //    +---------+      
+        //         1          
+        Sprite* SetUV(const Rect& _uv);
+
+        // Set uv.
+        Sprite* SetUV(float left, float top, float right, float bottom);
+
+        // Get texture associated with this sprite. Sprites can share a texture.
+        Texture* GetTexture() const;
+
+        Surface* GetSurface() const override;
+
+        bool IsVisible() const override;
+
+        Drawable* SetVisible(bool val) override;
+
+        void _SetSurface(Surface* surface) override;
+
+        void _SetIndex(uint i) override;
+
+        int _GetIndex() const override;
+
+        void _Draw() override;
+
+        bool _Batch(SpriteBatch* batch) override;
+
+        // Can be drawn by sprite batch. Custom shaders read color from constant buffer so they can't.
+        bool _CanBatch() const;
+
+        // uv with flips applied.
+        Rect _GetFinalUV() const;
+
+        void Destroy() override;
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    Sprite::Sprite(Texture* tex, PixelShader* ps) 
+        : filter(drawManager->GetDefaultTextureFilter()), uv(0, 0, 1, 1), flipHorizontally(false),
+        flipVertically(false), parent(nullptr), index(-1), visible(true), texture(tex), ps(ps)
+    {
+        this->color = { 255,255,255,255 };
+    }
+
+    void Sprite::_Draw()
+    {
+        if (!this->visible)
+            return;
+
+        renderBackend->_DrawQuad(this->transform.GetWorldViewProj(), this->_GetFinalUV(), this->color,
+            this->texture->_GetDrawTexture(), this->ps, this->extraBufferPSdata);
+    }
+
+    bool Sprite::_Batch(SpriteBatch* batch)
+    {
+        if (!this->_CanBatch())
+            return false;
+
+        if (this->visible)
+            batch->Add(this->texture->_GetDrawTexture(), this->ps, this->transform.GetWorldViewProj(), this->_GetFinalUV(),
+                this->color);
+
+        return true;
+    }
+
+    bool Sprite::_CanBatch() const
+    {
+        return this->ps == d3d.defaultPS && this->extraBufferPSdata == nullptr;
+    }
+
+    Rect Sprite::_GetFinalUV() const
+    {
+        Rect finaluv;
+        finaluv.left = flipHorizontally ? this->uv.right : this->uv.left;
+        finaluv.right = flipHorizontally ? this->uv.left : this->uv.right;
+        finaluv.top = flipVertically ? this->uv.bottom : this->uv.top;
+        finaluv.bottom = flipVertically ? this->uv.top : this->uv.bottom;
+        return this->texture->_MapUV(finaluv);
+    }
+
+    // Get transform of the object.
+    Transform* Sprite::T()
+    {
+        return &(this->transform);
+    }
+
+    // Get transform of the object.
+    Transform* Sprite::GetTransform()
+    {
+        return &(this->transform);
+    }
+
+    Sprite* Sprite::SetScale2TextureSize()
+    {
+        this->transform.SetPixelScale(this->texture->GetSize());
+        return this;
+    }
+
+    // Set filter type.
+    Sprite* Sprite::SetTextureFilter(TextureFilter _filter)
+    {
+        this->filter = _filter;
+        return this;
+    }
+
+    // Get filter type.
+    TextureFilter Sprite::GetTextureFilter() const
+    {
+        return this->filter;
+    }
+
+    // Is sprite flipped horizontally.
+    bool Sprite::IsFlippedHorizontally() const
+    {
+        return this->flipHorizontally;
+    }
+
+    // Set horizontal flip.
+    // _flipHorizontally: flip or not
+    Sprite* Sprite::SetFlipHorizontally(bool _flipHorizontally)
+    {
+        this->flipHorizontally = _flipHorizontally;
+        return this;
+    }
+
+    // Is sprite flipped vertically.
+    bool Sprite::IsFlippedVertically() const
+    {
+        return this->flipVertically;
+    }
+
+    // Set vertical flip.
+    // _flipVertically: flip or not
+    Sprite* Sprite::SetFlipVertically(bool _flipVertically)
+    {
+        this->flipVertically = _flipVertically;
+        return this;
+    }
+
+    // Get uv.
+    const Rect& Sprite::GetUV() const
+    {
+        return this->uv;
+    }
+    
+    // Set uv.
+    // _uv: new uv
+    //         0          
+    //    +---------+     
+    //    |         |     
+    // 0  |         | 1    
+    //    |         |      
+    //    +---------+      
+    //         1          
+    Sprite* Sprite::SetUV(const Rect& _uv)
+    {
+        this->uv = Rect(_uv.left, 1 - _uv.bottom, _uv.right, 1 - _uv.top);
+        return this;
+    }
+
+    // Set uv.
+    Sprite* Sprite::SetUV(float left, float top, float right, float bottom)
+    {
+        return this->SetUV(Rect(left, top, right, bottom));
+    }
+
+    Surface* Sprite::GetSurface() const
+    {
+        return this->parent;
+    }
+
+    bool Sprite::IsVisible() const
+    {
+        return this->visible;
+    }
+
+    Drawable* Sprite::SetVisible(bool val)
+    {
+        this->visible = val;
+        return this;
+    }
+
+    void Sprite::_SetSurface(Surface* surface)
+    {
+        this->parent = surface;
+    }
+
+    void Sprite::_SetIndex(uint i)
+    {
+        this->index = i;
+    }
+
+    int Sprite::_GetIndex() const
+    {
+        return this->index;
+    }
+
+    void Sprite::Destroy()
+    {
+        if (this->index != -1)
+            drawManager->Remove(this);
+
+        delete this;
+    }
+
+    Texture* Sprite::GetTexture() const
+    {
+        return this->texture;
+    }
+
+    // Get PS.
+    PixelShader* Sprite::GetPixelShader() const
+    {
+        return this->ps;
+    }
+
+    //Set Ps.
+    Sprite* Sprite::SetPixelShader(PixelShader* ps)
+    {
+        this->ps = ps;
+        return this;
+    }
+}
+#pragma endregion
+
+    /*@// Animation ******************************************************************************************************@*/
+namespace viva
+{
+    class Animation : public Drawable
+    {
+    protected:
+        vector<Action> actions;
+        vector<std::function<void(int)>> onFrameChangedhandlers;
+        vector<std::function<void(int)>> onActionLoopedHandlers;
+        Action* currentAction;
+        Sprite* sprite;
+
+        // progress of the animation
+        double indicator;
+
+        // currently displayed frame
+        int currentFrame;
+    public:
+        Animation(Sprite* _sprite);
+
+        // Get transform of the object.
+        Transform* T();
+
+        // Get transform of the object.
+        Transform* GetTransform();
+
+        void _Play();
+
+        // Advances animation to the next frame.
+        // If the current frame is the last then this method sets current frame to 0.
+        void NextFrame();
+
+        // Goes back in the animation.
+        // If the current frame is the first then this method sets current frame to the last one.
+        void PreviousFrame();
+
+        Sprite* GetSprite() const;
+
+        double GetSpeed() const;
+
+        void SetSpeed(double speed);
+
+        int GetFrame() const;
+
+        void SetFrame(int _currentFrame);
+
+        void SetAction(int id);
+
+        Action* GetAction() const;
+
+        void AddAction(double speed, int columns, int rows, int first, int last);
+
+        // Uv table of frames first to last of a grid, frames go left to right, top to bottom.
+        static vector<Rect> GridUVTable(int columns, int rows, int first, int last);
+
+        void AddAction(double speed, const vector<Rect>& uvTable);
+
+        void AddAction(double speed, const Size& texSizePx, const vector<Rect>& uvTablePx);
+
+        void AddOnFrameChangeHandler(const std::function<void(int)>& fun);
+
+        void AddOnActionLoopedHandler(const std::function<void(int)>& fun);
+
+        void ClearOnFrameChangeHandlers();
+
+        void ClearAddOnActionLoopedHandlers();
+
+        void _Draw() override;
+
+        bool _Batch(SpriteBatch* batch) override;
+
+        Surface* GetSurface() const override;
+
+        bool IsVisible() const override;
+
+        Drawable* SetVisible(bool val) override;
+
+        void _SetSurface(Surface* surface) override;
+
+        void _SetIndex(uint i) override;
+
+        int _GetIndex() const override;
+
+        void Destroy() override;
+        
+        // Set scale to match texture size.
+        Animation* SetScale2TextureSize();
+
+        // Is sprite flipped horizontally.
+        bool IsFlippedHorizontally() const;
+
+        // Set horizontal flip.
+        // _flipHorizontally: flip or not
+        Animation* SetFlipHorizontally(bool _flipHorizontally);
+
+        // Is sprite flipped vertically.
+        bool IsFlippedVertically() const;
+
+        // Set vertical flip.
+        // _flipVertically: flip or not
+        Animation* SetFlipVertically(bool _flipVertically);
+
+        // Set filter type.
+        Animation* SetTextureFilter(TextureFilter _filter);
+
+        // Get filter type.
+        TextureFilter GetTextureFilter() const;
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    Animation::Animation(Sprite* _sprite)
+        : currentAction(nullptr), sprite(_sprite), indicator(0), currentFrame(0)
+    {
+    }
+
+    // Get transform of the object.
+    Transform* Animation::T()
+    {
+        return this->sprite->T();
+    }
+
+    // Get transform of the object.
+    Transform* Animation::GetTransform()
+    {
+        return this->sprite->T();
+    }
+
+    void Animation::_Play()
+    {
+        if (this->currentAction != nullptr && this->currentAction->speed != 0)
+        {
+            this->indicator += this->currentAction->speed * time->GetFrameTime();
+            if (this->indicator >= 1)
+            {
+                this->indicator = 0;
+                this->NextFrame();
+            }
+            else if (this->indicator < 0)
+            {
+                this->indicator = 1;
+                this->PreviousFrame();
+            }
+        }
+
+        if (this->currentAction != nullptr)
+            this->sprite->SetUV(this->currentAction->uvTable.at(this->currentFrame));
+    }
+
+    // Advances animation to the next frame.
+    // If the current frame is the last then this method sets current frame to 0.
+    void Animation::NextFrame()
+    {
+        if (this->currentAction == nullptr)
+            return;
+
+        this->currentFrame++;
+
+        for (int i = 0; i < this->onFrameChangedhandlers.size(); i++)
+            this->onFrameChangedhandlers.at(i)(currentFrame);
+
+        if (this->currentFrame >= this->currentAction->length)
+        {
+            this->currentFrame = 0;
+
+            for (int i = 0; i < this->onActionLoopedHandlers.size(); i++)
+                this->onActionLoopedHandlers.at(i)(this->currentFrame);
+        }
+    }
+
+    // Goes back in the animation.
+    // If the current frame is the first then this method sets current frame to the last one.
+    void Animation::PreviousFrame()
+    {
+        if (this->currentAction == nullptr)
+            return;
+
+        this->currentFrame--;
+
+        for (int i = 0; i < this->onFrameChangedhandlers.size(); i++)
+            this->onFrameChangedhandlers.at(i)(this->currentFrame);
+
+        if (this->currentFrame < 0)
+        {
+            this->currentFrame = this->currentAction->length - 1;
+
+            for (int i = 0; i < this->onActionLoopedHandlers.size(); i++)
+                this->onActionLoopedHandlers.at(i)(currentFrame);
+        }
+    }
+
+    Sprite* Animation::GetSprite() const
+    {
+        return this->sprite;
+    }
+
+    double Animation::Animation::GetSpeed() const
+    {
+        if (this->currentAction == nullptr)
+            return INFINITY;
+
+        return this->currentAction->speed;
+    }
+
+    void Animation::SetSpeed(double speed)
+    {
+        if (this->currentAction == nullptr)
+            return;
+
+        this->currentAction->speed = speed;
+    }
+
+    int Animation::GetFrame() const
+    {
+        return this->currentFrame;
+    }
+
+    void Animation::SetFrame(int _currentFrame)
+    {
+        if (this->currentAction == nullptr)
+            return;
+
+        this->currentFrame = _currentFrame % this->currentAction->length;
+    }
+
+    void Animation::SetAction(int index)
+    {
+        this->currentAction = &this->actions[index];
+    }
+
+    Action* Animation::GetAction() const
+    {
+        if (this->currentAction == nullptr)
+            return nullptr;
+
+        return this->currentAction;
+    }
+
+    void Animation::AddAction(double speed, int columns, int rows, int first, int last)
+    {
+        this->AddAction(speed, GridUVTable(columns, rows, first, last));
+    }
+
+    vector<Rect> Animation::GridUVTable(int columns, int rows, int first, int last)
+    {
+        vector<Rect> uvTable;
+
+        float width = 1.0f / columns;
+        float height = 1.0f / rows;
+
+        for (int i = 0; i < rows; i++)
+            for (int j = 0; j < columns; j++)
+            {
+                if (columns * i + j >= first)
+                    uvTable.push_back(Rect(width*j, height*i, width*(j + 1), height*(i + 1)));
+                if (columns * i + j >= last)
+                {
+                    // break;
+                    i = rows;
+                    j = columns;
+                }
+            }
+
+        return uvTable;
+    }
+
+    void Animation::AddAction(double speed, const Size& texSizePx, const vector<Rect>& uvTablePx)
+    {
+        vector<Rect> uvTable;
+
+        for (int i = 0; i < uvTablePx.size(); i++)
+        {
+            uvTable.push_back({
+                uvTablePx.at(i).left / texSizePx.width,
+                uvTablePx.at(i).top / texSizePx.height,
+                uvTablePx.at(i).right / texSizePx.width,
+                uvTablePx.at(i).bottom / texSizePx.height
+                });
+        }
+
+        this->AddAction(speed, uvTable);
+    }
+
+    void Animation::AddAction(double speed, const vector<Rect>& uvTable)
+    {
+        this->actions.push_back(Action(uvTable, speed));
+    }
+
+    void Animation::AddOnFrameChangeHandler(const std::function<void(int)>& fun)
+    {
+        this->onFrameChangedhandlers.push_back(fun);
+    }
+
+    void Animation::AddOnActionLoopedHandler(const std::function<void(int)>& fun)
+    {
+        this->onActionLoopedHandlers.push_back(fun);
+    }
+
+    void Animation::ClearOnFrameChangeHandlers()
+    {
+        this->onFrameChangedhandlers.clear();
+    }
+
+    void Animation::ClearAddOnActionLoopedHandlers()
+    {
+        this->onActionLoopedHandlers.clear();
+    }
+
+    void Animation::_Draw()
+    {
+        this->_Play();
+
+        if (this->currentAction != nullptr)
+            this->sprite->_Draw();
+    }
+
+    bool Animation::_Batch(SpriteBatch* batch)
+    {
+        // check before playing so the animation doesn't advance twice when falling back to _Draw()
+        if (!this->sprite->_CanBatch())
+            return false;
+
+        this->_Play();
+
+        if (this->currentAction != nullptr)
+            return this->sprite->_Batch(batch);
+
+        return true;
+    }
+
+    Surface* Animation::GetSurface() const
+    {
+        return this->sprite->GetSurface();
+    }
+
+    bool Animation::IsVisible() const
+    {
+        return this->sprite->IsVisible();
+    }
+
+    Drawable* Animation::SetVisible(bool val)
+    {
+        this->sprite->SetVisible(val);
+        return this;
+    }
+
+    void Animation::_SetSurface(Surface* surface)
+    {
+        this->sprite->_SetSurface(surface);
+    }
+
+    void Animation::_SetIndex(uint i)
+    {
+        this->sprite->_SetIndex(i);
+    }
+
+    int Animation::_GetIndex() const
+    {
+        return this->sprite->_GetIndex();
+    }
+
+    void Animation::Destroy()
+    {
+        this->sprite->Destroy();
+        delete this;
+    }
+
+    // Set scale to match texture size.
+    Animation* Animation::SetScale2TextureSize()
+    {
+        this->sprite->SetScale2TextureSize();
+        return this;
+    }
+
+    // Is sprite flipped horizontally.
+    bool Animation::IsFlippedHorizontally() const
+    {
+        return this->sprite->IsFlippedHorizontally();
+    }
+
+    // Set horizontal flip.
+    // _flipHorizontally: flip or not
+    Animation* Animation::SetFlipHorizontally(bool _flipHorizontally)
+    {
+        this->sprite->SetFlipHorizontally(_flipHorizontally);
+        return this;
+    }
+
+    // Is sprite flipped vertically.
+    bool Animation::IsFlippedVertically() const
+    {
+        return this->sprite->IsFlippedVertically();
+    }
+
+    // Set vertical flip.
+    // _flipVertically: flip or not
+    Animation* Animation::SetFlipVertically(bool _flipVertically)
+    {
+        this->sprite->SetFlipVertically(_flipVertically);
+        return this;
+    }
+
+    // Set filter type.
+    Animation* Animation::SetTextureFilter(TextureFilter _filter)
+    {
+        this->sprite->SetTextureFilter(_filter);
+        return this;
+    }
+
+    // Get filter type.
+    TextureFilter Animation::GetTextureFilter() const
+    {
+        return this->sprite->GetTextureFilter();
+    }
+}
+#pragma endregion
+
+    /*@// Archive ********************************************************************************************************@*/
+namespace viva
+{
+    enum class ArchiveEntryType : uint
+    {
+        Pixels, // rgba, width * height
+        Font, // FontGlyph[count], texture is entry 'link', 'value' is line height in pixels
+        UVTable, // Rect[count] for Animation::AddAction(), 'value' is speed
+        PixelShader, // ps_5_0 bytecode
+    };
+
+    // Table of contents entry. Archive is used in place so layout can't change without bumping ArchiveVersion.
+    struct ArchiveEntry
+    {
+        char name[56]; // zero terminated, entries are sorted by name
+        ArchiveEntryType type;
+        uint link; // index of other entry
+        unsigned long long offset; // from the start of the file, 16 byte aligned
+        unsigned long long size;
+        uint width;
+        uint height;
+        uint count;
+        float value;
+    };
+
+    // Start of the archive file, table of contents follows.
+    struct ArchiveHeader
+    {
+        char magic[4]; // VPAK
+        uint version;
+        uint count;
+        uint reserved;
+    };
+
+    const uint ArchiveVersion = 1;
+
+    // Assets cooked by AssetCooker, mapped to memory. Resources are created straight from the mapped
+    // bytes, nothing is decoded or parsed. Resources don't depend on the archive once created.
+    class Archive : public Destroyable
+    {
+    protected:
+        util::MappedFile file;
+        const ArchiveEntry* entries;
+        uint count;
+
+        // Throws if there is no entry 'name' of 'type'.
+        const ArchiveEntry* _Find(const char* name, ArchiveEntryType type) const;
+
+        const byte* _GetData(const ArchiveEntry* entry) const;
+    public:
+        // filename: archive written by AssetCooker::Write()
+        Archive(const char* filename);
+
+        // Create texture from cooked pixels.
+        Texture* CreateTexture(const char* name);
+
+        // Create font from cooked glyphs and its cooked texture.
+        Font* CreateFontV(const char* name);
+
+        // Create pixel shader from cooked bytecode.
+        PixelShader* CreatePixelShader(const char* name);
+
+        // Cooked uv table, points into the archive so it's valid until Destroy().
+        // count: number of frames
+        const Rect* GetUVTable(const char* name, uint& count) const;
+
+        // Add cooked uv table to animation as an action with cooked speed.
+        void AddAction(Animation* animation, const char* name) const;
+
+        uint GetCount() const;
+
+        const ArchiveEntry& GetEntry(uint index) const;
+
+        void Destroy();
+    };
+
+    // Turns source assets into archive for Archive. Images are decoded, font metrics are parsed and shaders
+    // are compiled here once instead of at every start. Doesn't need the engine running.
+    class AssetCooker
+    {
+    private:
+        struct Item
+        {
+            ArchiveEntry entry;
+            std::string link;
+            vector<byte> data;
+        };
+
+        vector<Item> items;
+
+        Item& _Add(const char* name, ArchiveEntryType type);
+
+        bool _Has(const char* name) const;
+    public:
+        // Decode image to rgba pixels.
+        // name: name in the archive
+        // filename: image file
+        void AddImage(const char* name, const char* filename);
+
+        // Parse BMFont metrics. Texture is added as image named 'textureFile' unless it's already there.
+        void AddFont(const char* name, const char* textureFile, const char* metricsFile);
+
+        // Uv table for Animation::AddAction().
+        void AddUVTable(const char* name, double speed, const vector<Rect>& uvTable);
+
+        // Uv table of grid frames, see Animation::GridUVTable().
+        void AddUVTable(const char* name, double speed, int columns, int rows, int first, int last);
+
+        // Compile pixel shader.
+        void AddPixelShader(const char* name, const char* filename);
+
+        // AddPixelShader() works, it needs d3dcompiler that is only on windows.
+        static bool CanCompileShaders();
+
+        // Write archive, entries are sorted by name.
+        void Write(const char* filename);
+
+        // Cook assets listed in manifest file, one per line:
+        // image <name> <file>
+        // font <name> <texture file> <metrics file>
+        // uv <name> <speed> <columns> <rows> <first> <last>
+        // shader <name> <file>
+        static void CookManifest(const char* manifestFile, const char* archiveFile);
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    Archive::Archive(const char* filename) : file(filename), entries(nullptr), count(0)
+    {
+        size_t size = this->file.GetSize();
+        const byte* data = this->file.GetData();
+        if (size < sizeof(ArchiveHeader))
+            throw Error(__FUNCTION__, "not an archive");
+
+        const ArchiveHeader* header = (const ArchiveHeader*)data;
+        if (memcmp(header->magic, "VPAK", 4) != 0 || header->version != ArchiveVersion)
+            throw Error(__FUNCTION__, "not an archive or different version");
+
+        if (sizeof(ArchiveHeader) + (size_t)header->count * sizeof(ArchiveEntry) > size)
+            throw Error(__FUNCTION__, "archive is truncated");
+
+        this->entries = (const ArchiveEntry*)(data + sizeof(ArchiveHeader));
+        this->count = header->count;
+    }
+
+    const ArchiveEntry* Archive::_Find(const char* name, ArchiveEntryType type) const
+    {
+        const ArchiveEntry* end = this->entries + this->count;
+        const ArchiveEntry* e = std::lower_bound(this->entries, end, name, [](const ArchiveEntry& a, const char* b)
+        {
+            return strncmp(a.name, b, sizeof(a.name)) < 0;
+        });
+
+        if (e == end || strncmp(e->name, name, sizeof(e->name)) != 0 || e->type != type)
+        {
+            std::string msg = std::string(name) + " is not in the archive";
+            throw Error(__FUNCTION__, msg.c_str());
+        }
+
+        // offset + size could wrap around
+        unsigned long long fileSize = this->file.GetSize();
+        if (e->offset > fileSize || e->size > fileSize - e->offset)
+            throw Error(__FUNCTION__, "archive is truncated");
+
+        // entry must hold as many bytes as its width, height or count says
+        unsigned long long items = e->count;
+        unsigned long long itemSize = 1;
+        if (type == ArchiveEntryType::Pixels)
+        {
+            items = (unsigned long long)e->width * e->height;
+            itemSize = sizeof(Color);
+        }
+        else if (type == ArchiveEntryType::Font)
+            itemSize = sizeof(FontGlyph);
+        else if (type == ArchiveEntryType::UVTable)
+            itemSize = sizeof(Rect);
+        else
+            items = 0;
+
+        if (items > e->size / itemSize)
+        {
+            std::string msg = std::string(name) + " is smaller than its contents";
+            throw Error(__FUNCTION__, msg.c_str());
+        }
+
+        return e;
+    }
+
+    const byte* Archive::_GetData(const ArchiveEntry* entry) const
+    {
+        return this->file.GetData() + entry->offset;
+    }
+
+    Texture* Archive::CreateTexture(const char* name)
+    {
+        const ArchiveEntry* e = this->_Find(name, ArchiveEntryType::Pixels);
+        return renderBackend->_CreateTexture((const Color*)this->_GetData(e), Size((float)e->width, (float)e->height));
+    }
+
+    Font* Archive::CreateFontV(const char* name)
+    {
+        const ArchiveEntry* e = this->_Find(name, ArchiveEntryType::Font);
+        if (e->link >= this->count)
+            throw Error(__FUNCTION__, "font has no texture");
+
+        Texture* texture = this->CreateTexture(this->entries[e->link].name);
+        return new Font(texture, (const FontGlyph*)this->_GetData(e), e->count, e->value);
+    }
+
+    PixelShader* Archive::CreatePixelShader(const char* name)
+    {
+        const ArchiveEntry* e = this->_Find(name, ArchiveEntryType::PixelShader);
+        return renderBackend->_CreatePixelShader(this->_GetData(e), (size_t)e->size);
+    }
+
+    const Rect* Archive::GetUVTable(const char* name, uint& count) const
+    {
+        const ArchiveEntry* e = this->_Find(name, ArchiveEntryType::UVTable);
+        count = e->count;
+        return (const Rect*)this->_GetData(e);
+    }
+
+    void Archive::AddAction(Animation* animation, const char* name) const
+    {
+        uint frames;
+        const Rect* uvTable = this->GetUVTable(name, frames);
+        float speed = this->_Find(name, ArchiveEntryType::UVTable)->value;
+        animation->AddAction(speed, vector<Rect>(uvTable, uvTable + frames));
+    }
+
+    uint Archive::GetCount() const
+    {
+        return this->count;
+    }
+
+    const ArchiveEntry& Archive::GetEntry(uint index) const
+    {
+        if (index >= this->count)
+            throw Error(__FUNCTION__, "index out of range");
+
+        return this->entries[index];
+    }
+
+    void Archive::Destroy()
+    {
+        delete this;
+    }
+
+    AssetCooker::Item& AssetCooker::_Add(const char* name, ArchiveEntryType type)
+    {
+        if (strlen(name) >= sizeof(ArchiveEntry::name))
+        {
+            std::string msg = std::string(name) + " is too long for archive entry name";
+            throw Error(__FUNCTION__, msg.c_str());
+        }
+
+        if (this->_Has(name))
+        {
+            std::string msg = std::string(name) + " is already in the archive";
+            throw Error(__FUNCTION__, msg.c_str());
+        }
+
+        this->items.push_back(Item());
+        Item& item = this->items.back();
+        memset(&item.entry, 0, sizeof(item.entry));
+        strcpy(item.entry.name, name);
+        item.entry.type = type;
+        return item;
+    }
+
+    bool AssetCooker::_Has(const char* name) const
+    {
+        for (auto& item : this->items)
+            if (strcmp(item.entry.name, name) == 0)
+                return true;
+
+        return false;
+    }
+
+    void AssetCooker::AddImage(const char* name, const char* filename)
+    {
+        Color* pixels;
+        Size size = util::ReadImageToPixels(filename, &pixels);
+        size_t bytes = (size_t)size.width * (size_t)size.height * sizeof(Color);
+
+        Item& item = this->_Add(name, ArchiveEntryType::Pixels);
+        item.entry.width = (uint)size.width;
+        item.entry.height = (uint)size.height;
+        item.data.assign((const byte*)pixels, (const byte*)pixels + bytes);
+        free(pixels);
+    }
+
+    void AssetCooker::AddFont(const char* name, const char* textureFile, const char* metricsFile)
+    {
+        vector<FontGlyph> glyphs;
+        float lineHeightPx;
+        std::string metrics = util::ReadFileToStringA(metricsFile);
+        Font::ParseMetrics(metrics.c_str(), glyphs, lineHeightPx);
+
+        if (!this->_Has(textureFile))
+            this->AddImage(textureFile, textureFile);
+
+        Item& item = this->_Add(name, ArchiveEntryType::Font);
+        item.link = textureFile;
+        item.entry.count = (uint)glyphs.size();
+        item.entry.value = lineHeightPx;
+        item.data.assign((const byte*)glyphs.data(), (const byte*)(glyphs.data() + glyphs.size()));
+    }
+
+    void AssetCooker::AddUVTable(const char* name, double speed, const vector<Rect>& uvTable)
+    {
+        Item& item = this->_Add(name, ArchiveEntryType::UVTable);
+        item.entry.count = (uint)uvTable.size();
+        item.entry.value = (float)speed;
+        item.data.assign((const byte*)uvTable.data(), (const byte*)(uvTable.data() + uvTable.size()));
+    }
+
+    void AssetCooker::AddUVTable(const char* name, double speed, int columns, int rows, int first, int last)
+    {
+        this->AddUVTable(name, speed, Animation::GridUVTable(columns, rows, first, last));
+    }
+
+    void AssetCooker::AddPixelShader(const char* name, const char* filename)
+    {
+#ifdef _WIN32
+        std::string source = util::ReadFileToStringA(filename);
+
+        ID3D10Blob* ps;
+        HRESULT hr = D3DCompile(source.c_str(), source.size(), filename, 0, 0, "main", "ps_5_0", 0, 0, &ps, 0);
+        util::Checkhr(hr, "D3DCompile()");
+
+        Item& item = this->_Add(name, ArchiveEntryType::PixelShader);
+        item.data.assign((const byte*)ps->GetBufferPointer(), (const byte*)ps->GetBufferPointer() + ps->GetBufferSize());
+        ps->Release();
+#else
+        throw Error(__FUNCTION__, "compiling shaders needs d3dcompiler");
+#endif
+    }
+
+    bool AssetCooker::CanCompileShaders()
+    {
+#ifdef _WIN32
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void AssetCooker::Write(const char* filename)
+    {
+        // sorted so Archive can binary search names
+        std::sort(this->items.begin(), this->items.end(), [](const Item& a, const Item& b)
+        {
+            return strcmp(a.entry.name, b.entry.name) < 0;
+        });
+
+        uint count = (uint)this->items.size();
+        unsigned long long offset = sizeof(ArchiveHeader) + (unsigned long long)count * sizeof(ArchiveEntry);
+        for (auto& item : this->items)
+        {
+            item.entry.link = count;
+            for (uint i = 0; i < count && !item.link.empty(); i++)
+                if (item.link == this->items[i].entry.name)
+                    item.entry.link = i;
+
+            offset = (offset + 15) & ~15ull;
+            item.entry.offset = offset;
+            item.entry.size = item.data.size();
+            offset += item.data.size();
+        }
+
+        std::ofstream out(filename, std::ios::binary);
+        if (!out)
+            throw Error(__FUNCTION__, "could not write archive");
+
+        ArchiveHeader header = { { 'V', 'P', 'A', 'K' }, ArchiveVersion, count, 0 };
+        out.write((const char*)&header, sizeof(header));
+        for (auto& item : this->items)
+            out.write((const char*)&item.entry, sizeof(item.entry));
+
+        const char zeros[16] = {};
+        unsigned long long position = sizeof(ArchiveHeader) + (unsigned long long)count * sizeof(ArchiveEntry);
+        for (auto& item : this->items)
+        {
+            out.write(zeros, (std::streamsize)(item.entry.offset - position));
+            out.write((const char*)item.data.data(), item.data.size());
+            position = item.entry.offset + item.data.size();
+        }
+
+        if (!out)
+            throw Error(__FUNCTION__, "could not write archive");
+    }
+
+    void AssetCooker::CookManifest(const char* manifestFile, const char* archiveFile)
+    {
+        std::ifstream manifest(manifestFile);
+        if (!manifest)
+            throw Error(__FUNCTION__, "could not open the file");
+
+        AssetCooker cooker;
+        std::string line;
+        char name[256], a[256], b[256];
+        double speed;
+        int columns, rows, first, last;
+        while (std::getline(manifest, line))
+        {
+            if (sscanf(line.c_str(), "image %255s %255s", name, a) == 2)
+                cooker.AddImage(name, a);
+            else if (sscanf(line.c_str(), "font %255s %255s %255s", name, a, b) == 3)
+                cooker.AddFont(name, a, b);
+            else if (sscanf(line.c_str(), "uv %255s %lf %d %d %d %d", name, &speed, &columns, &rows, &first, &last) == 6)
+                cooker.AddUVTable(name, speed, columns, rows, first, last);
+            else if (sscanf(line.c_str(), "shader %255s %255s", name, a) == 2)
+                cooker.AddPixelShader(name, a);
+        }
+
+        cooker.Write(archiveFile);
+    }
+}
+#pragma endregion
+
+    /*@// Creator ********************************************************************************************************@*/
+namespace viva
+{
+    // Factory for all objects.
+    class Creator
+    {
+    public:
+        // Create pixel shader from file. Shaders from the same file are shared through resourceManager.
+        // filename: path to file containing pixel shader.
+        PixelShader* CreatePixelShaderFromFile(const char* filename);
+
+        // Create pixel shader from string.
+        // str: pixel shader code itself
+        PixelShader* CreatePixelShader(const char* str);
+        
+        Font* CreateFontV(Texture* tex, const char* fontMetrics, bool fromString);
+
+        Font* CreateFontV(Texture* tex, const char* fontMetricsFile);
+
+        // Create texture from file. Supported files BMP, GIF, JPEG, PNG, TIFF, Exif, WMF, EMF.
+        // Named (name is given by filename) textures are stored in resource manager automatically. Can be removed by resourceManager::Remove()
+        // Every call adds a reference, Destroy() takes one away.
+        // filename: file path
+        Texture* CreateTexture(const char* filename);
+
+        // Create texture from pixels. Noname texture are not stored in resource manager but can be stored by resourceManager::Add()
+        // pixels: pixels for the texture starting from left top
+        // size: size of the image in pixels
+        Texture* CreateTexture(const Color* pixels, const Size& size);
+
+        // Load texture on textureLoader threads. Returns placeholder that becomes the texture
+        // when it's uploaded, see Texture::IsLoaded().
+        // filename: file path
+        Texture* CreateTextureAsync(const char* filename);
+
+        // Load many textures at once on all textureLoader threads.
+        // filenames: file paths
+        vector<Texture*> CreateTexturesAsync(const vector<std::string>& filenames);
+
+        // Pack images into atlas pages. Textures of the atlas are named by image names.
+        // pageSize: width and height of page in pixels
+        // padding: edge pixels repeated around each image so filtering doesn't bleed
+        Atlas* CreateAtlas(const vector<AtlasImage>& images, int pageSize = 2048, int padding = 1);
+
+        // Load image files and pack them into atlas pages. Textures of the atlas are named by file names.
+        // filenames: file paths
+        Atlas* CreateAtlas(const vector<std::string>& filenames, int pageSize = 2048, int padding = 1);
+
+        // Load atlas made offline by AtlasPacker::Bake(), nothing is packed at load time.
+        // metadataFile: the .atlas file
+        Atlas* CreateAtlasFromFile(const char* metadataFile);
+
+        // Map archive cooked by AssetCooker. Resources are created from it without decoding or parsing.
+        // filename: archive file
+        Archive* OpenArchive(const char* filename);
+
+        Text* CreateText(const wchar_t* str);
+
+        Text* CreateText(const wchar_t* str, Font* font);
+
+        // Create sprite from texture.
+        // texture: existing texture object
+        Sprite* CreateSprite(Texture* texture);
+
+        // Create standalone sprite batch. Surfaces have their own, this one is for building batches by hand.
+        SpriteBatch* CreateSpriteBatch();
+
+        // Create polygon from points.
+        // points: vector of points where each point is x,y in world coordinates
+        Polygon* CreatePolygon(const vector<Point>& points);
+
+        // Create polygon from vertex buffer.
+        Polygon* CreatePolygon(VertexBuffer* vb);
+
+        // Create shared vertex buffer. That can be used by multiple polygons.
+        VertexBuffer* CreateVertexBuffer(const vector<Point>& points, bool shared);
+
+        // Create shared vertex buffer. That can be used by multiple polygons.
+        VertexBuffer* CreateVertexBuffer(const vector<Point>& points);
+
+        net::Server* CreateServer(unsigned short port);
+
+        net::Client* CreateClient(const char* ip, unsigned short port);
+
+        // Udp socket bound to port, 0 picks a free one.
+        net::UdpSocket* CreateUdpSocket(unsigned short port);
+
+        // Replicate registered entities to clients of server.
+        net::Replicator* CreateReplicator(net::Server* server);
+
+        // Receive snapshots of a replicator on the client side.
+        net::ReplicaReader* CreateReplicaReader(net::Client* client);
+
+        // Create surface to render objects on.
+        Surface* CreateSurface();
+
+        Animation* CreateAnimation(Sprite* sprite);
+
+        Animation* CreateAnimation(Texture* texture);
+
+        void _Destroy();
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    Texture* Creator::CreateTexture(const char* filename)
+    {
+        return resourceManager->GetTexture(filename);
+    }
+
+    Texture* Creator::CreateTextureAsync(const char* filename)
+    {
+        return textureLoader->Load(filename);
+    }
+
+    vector<Texture*> Creator::CreateTexturesAsync(const vector<std::string>& filenames)
+    {
+        return textureLoader->LoadBatch(filenames);
+    }
+
+    Atlas* Creator::CreateAtlas(const vector<AtlasImage>& images, int pageSize, int padding)
+    {
+        vector<vector<Color>> pixels;
+        vector<Size> pageSizes;
+        vector<AtlasRegion> regions;
+        float occupancy = AtlasPacker::Pack(images, pageSize, padding, pixels, pageSizes, regions);
+
+        vector<Texture*> pages;
+        for (uint i = 0; i < pixels.size(); i++)
+            pages.push_back(renderBackend->_CreateTexture(pixels[i].data(), pageSizes[i]));
+
+        return new Atlas(pages, regions, occupancy);
+    }
+
+    Atlas* Creator::CreateAtlas(const vector<std::string>& filenames, int pageSize, int padding)
+    {
+        // decoding is most of the time, files are independent
+        vector<AtlasImage> images(filenames.size());
+        vector<Color*> decoded(filenames.size(), nullptr);
+        vector<std::string> errors(filenames.size());
+        jobSystem->ParallelFor((uint)filenames.size(), 1, [&](uint begin, uint end)
+        {
+            for (uint i = begin; i < end; i++)
+            {
+                try
+                {
+                    Size size = util::ReadImageToPixels(filenames[i].c_str(), &decoded[i]);
+                    images[i] = { filenames[i], decoded[i], (int)size.width, (int)size.height };
+                }
+                catch (Error& e)
+                {
+                    errors[i] = e.what();
+                }
+            }
+        });
+
+        Atlas* atlas = nullptr;
+        std::string error;
+        for (auto& e : errors)
+            if (error.empty())
+                error = e;
+
+        if (error.empty())
+        {
+            try
+            {
+                atlas = this->CreateAtlas(images, pageSize, padding);
+            }
+            catch (Error& e)
+            {
+                error = e.what();
+            }
+        }
+
+        for (auto p : decoded)
+            if (p != nullptr)
+                free(p);
+
+        if (atlas == nullptr)
+            throw Error(__FUNCTION__, error.c_str());
+
+        return atlas;
+    }
+
+    Atlas* Creator::CreateAtlasFromFile(const char* metadataFile)
+    {
+        std::ifstream file(metadataFile);
+        if (!file)
+            throw Error(__FUNCTION__, "could not open the file");
+
+        std::string dir = metadataFile;
+        size_t slash = dir.find_last_of("/\\");
+        dir = slash == std::string::npos ? "" : dir.substr(0, slash + 1);
+
+        std::string line;
+        std::getline(file, line);
+        if (line != "viva atlas 1")
+            throw Error(__FUNCTION__, "not an atlas file");
+
+        vector<Texture*> pages;
+        vector<AtlasRegion> regions;
+        long long usedArea = 0;
+        long long pageArea = 0;
+        try
+        {
+            while (std::getline(file, line))
+            {
+                AtlasRegion r;
+                int w, h, nameStart = 0;
+                if (sscanf(line.c_str(), "page %d %d %n", &w, &h, &nameStart) == 2 && nameStart > 0)
+                {
+                    pages.push_back(this->CreateTexture((dir + line.substr(nameStart)).c_str()));
+                    pageArea += (long long)w * h;
+                }
+                else if (sscanf(line.c_str(), "region %u %d %d %d %d %n", &r.page, &r.x, &r.y, &r.width, &r.height,
+                    &nameStart) == 5 && nameStart > 0)
+                {
+                    r.name = line.substr(nameStart);
+                    regions.push_back(r);
+                    usedArea += (long long)r.width * r.height;
+                }
+            }
+
+            return new Atlas(pages, regions, pageArea == 0 ? 0 : (float)((double)usedArea / pageArea));
+        }
+        catch (...)
+        {
+            // pages loaded before the error
+            for (auto p : pages)
+                p->Destroy();
+            throw;
+        }
+    }
+
+    Archive* Creator::OpenArchive(const char* filename)
+    {
+        return new Archive(filename);
+    }
+
+    Font* Creator::CreateFontV(Texture* tex, const char* fontMetrics, bool fromString)
+    {
+        return new Font(tex, fontMetrics, fromString);
+    }
+
+    Font* Creator::CreateFontV(Texture* tex, const char* fontMetricsFile)
+    {
+        return new Font(tex, fontMetricsFile);
+    }
+
+    Text* Creator::CreateText(const wchar_t* str)
+    {
+        return new Text(str);
+    }
+
+    Text* Creator::CreateText(const wchar_t* str, Font* font)
+    {
+        return new Text(str, font);
+    }
+
+    Animation* Creator::CreateAnimation(Sprite* sprite)
+    {
+        return new Animation(sprite);
+    }
+
+    Animation* Creator::CreateAnimation(Texture* texture)
+    {
+        Sprite* s = this->CreateSprite(texture);
+        return new Animation(s);
+    }
+
+    Polygon* Creator::CreatePolygon(const vector<Point>& points)
+    {
+        VertexBuffer* vb = CreateVertexBuffer(points, false);
+        return new Polygon(vb);
+    }
+
+    Polygon* Creator::CreatePolygon(VertexBuffer* vb)
+    {
+        return new Polygon(vb);
+    }
+
+    VertexBuffer* Creator::CreateVertexBuffer(const vector<Point>& points)
+    {
+        return this->CreateVertexBuffer(points, true);
+    }
+
+    VertexBuffer* Creator::CreateVertexBuffer(const vector<Point>& points, bool shared)
+    {
+        vector<Vertex> temp;
+        for (int i = 0; i < points.size(); i++)
+        {
+            //float distFromOrigin = sqrtf(points[i].x*points[i].x + points[i].y*points[i].y);
+            //if (distFromOrigin > span)
+            //    span = distFromOrigin;
+            //vertices.push_back(DirectX::XMVectorSet(points[i].x, points[i].y, 0, 0));
+
+            // IMPORTANT, Y is negated because I want +Y to be up not down
+            // IMPORTANT, red must be non 0, 0 is reserved for sprites
+            temp.push_back({ points.at(i).x, -points.at(i).y, 0, 1, 1, 1, 0, 0 }); 
+        }
+        //transformedVertices = vertices;
+
+        return renderBackend->_CreateVertexBuffer(temp, shared);
+    }
+
+    /// SURFACE ///
+    Surface* Creator::CreateSurface()
+    {
+        Surface* surf = renderBackend->_CreateSurface();
+        surf->SetPixelShader(d3d.defaultPost);
+        return surf;
+    }
+
+    /// SHADERS ///
+    PixelShader* Creator::CreatePixelShaderFromFile(const char* filename)
+    {
+        return resourceManager->GetPixelShader(filename);
+    }
+
+    PixelShader* Creator::CreatePixelShader(const char* str)
+    {
+        return renderBackend->_CreatePixelShader(str);
+    }
+
+    net::Server* Creator::CreateServer(unsigned short port)
+    {
+        net::Server* s = new net::Server(port);
+        networkManager->_Add(s);
+        return s;
+    }
+
+    net::Client* Creator::CreateClient(const char* ip, unsigned short port)
+    {
+        net::Client* c = new net::Client(ip, port);
+        networkManager->_Add(c);
+        return c;
+    }
+
+    net::UdpSocket* Creator::CreateUdpSocket(unsigned short port)
+    {
+        net::UdpSocket* u = new net::UdpSocket(port);
+        networkManager->_Add(u);
+        return u;
+    }
+
+    net::Replicator* Creator::CreateReplicator(net::Server* server)
+    {
+        return new net::Replicator(server);
+    }
+
+    net::ReplicaReader* Creator::CreateReplicaReader(net::Client* client)
+    {
+        return new net::ReplicaReader(client);
+    }
+
+    /// SPRITE ///
+    Sprite* Creator::CreateSprite(Texture* texture)
+    {
+        return new Sprite(texture, d3d.defaultPS);
+    }
+
+    /// SPRITE BATCH ///
+    SpriteBatch* Creator::CreateSpriteBatch()
+    {
+        return new SpriteBatch();
+    }
+
+    /// TEXTURE ///
+    Texture* Creator::CreateTexture(const Color* pixels, const Size& size)
+    {
+        return renderBackend->_CreateTexture(pixels, size);
+    }
+
+    //
+    void Creator::_Destroy()
+    {
+        delete this;
+    }
+}
+#pragma endregion
+
+    /*@// Text ***********************************************************************************************************@*/
+namespace viva
+{
+    // One letter of laid out text. Text local space, +y is up.
+    struct GlyphQuad
+    {
+        float x, y; // lower left corner
+        float width, height;
+        Rect uv;
+    };
+
+    class Text : public Sprite
+    {
+    private:
+        std::wstring text;
+        Font* font;
+        vector<GlyphQuad> glyphs;
+        VertexBuffer* glyphBuffer; // 6 vertices per glyph, rebuilt when layout changes
+        uint glyphVertexCount;
+        bool layoutDirty;
+        TransformMode layoutMode;
+
+        // Rebuild glyphs and vertex buffer if text, font or coord mode changed.
+        void _UpdateLayout();
+    public:
+        Text(const wchar_t* str, Font* f);
+
+        Text(const wchar_t* str);
+
+        Text* SetText(const wchar_t* _text);
+
+        const wchar_t* GetText() const;
+
+        // Set font. Text uses font's texture.
+        Text* SetFont(Font* f);
+
+        Font* GetFont() const;
+
+        // Compute glyph quads for a string. Doesn't touch d3d.
+        // str: text
+        // font: font to take metrics from
+        // mode: World uses world metrics, Screen uses pixel metrics
+        // dst: output, cleared first
+        static void Layout(const wchar_t* str, const Font* font, TransformMode mode, vector<GlyphQuad>& dst);
+
+        void _Draw() override;
+
+        // Text is drawn in one call from its own vertex buffer.
+        bool _Batch(SpriteBatch* batch) override;
+
+        void Destroy() override;
+
+        // sprite functions that dont make sense
+        // SetScale2TextureSize
+        // IsFlippedHorizontally
+        // SetFlipHorizontally
+        // IsFlippedVertically
+        // SetFlipVertically
+        // GetUV
+        // SetUV
+        // GetTexture
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    Text::Text(const wchar_t* str, Font* f)
+        : Sprite(f->GetTexture(), d3d.defaultPS), text(str), font(f), glyphBuffer(nullptr),
+        glyphVertexCount(0), layoutDirty(true), layoutMode(TransformMode::World)
+    {
+    }
+
+    Text::Text(const wchar_t* str)
+        : Text(str, drawManager->GetDefaultFont())
+    {
+    }
+
+    Text* Text::SetText(const wchar_t* str)
+    {
+        this->text = str;
+        this->layoutDirty = true;
+        return this;
+    }
+
+    const wchar_t* Text::GetText() const
+    {
+        return this->text.c_str();
+    }
+
+    Text* Text::SetFont(Font* f)
+    {
+        this->font = f;
+        this->texture = f->GetTexture();
+        this->layoutDirty = true;
+        return this;
+    }
+
+    Font* Text::GetFont() const
+    {
+        return this->font;
+    }
+
+    bool Text::_Batch(SpriteBatch* batch)
+    {
+        return false;
+    }
+
+    void Text::Layout(const wchar_t* str, const Font* font, TransformMode mode, vector<GlyphQuad>& dst)
+    {
+        dst.clear();
+
+        bool world = mode == TransformMode::World;
+        float advance = 0;
+        float line = 0;
+        // letters used to be positioned by their lower right corner, first letter is shifted by its size
+        // so that text position is upper left corner
+        float _x = 0;
+        float _y = 0;
+
+        if (str[0] != 0 && str[0] != '\n')
+        {
+            const CharacterMetrics& firstChar = font->GetChar(str[0]);
+            _x += world ? firstChar.size.width : firstChar.sizePx.width;
+            _y += world ? firstChar.size.height : firstChar.sizePx.height;
+        }
+
+        for (const wchar_t* c = str; *c != 0; c++)
+        {
+            if (*c == '\n')
+            {
+                advance = 0;
+                line += world ? font->GetFontMetrics().lineHeight : -font->GetFontMetrics().lineHeightPx;
+                continue;
+            }
+
+            const CharacterMetrics& cm = font->GetChar(*c);
+            GlyphQuad g;
+            g.width = world ? cm.size.width : cm.sizePx.width;
+            g.height = world ? cm.size.height : cm.sizePx.height;
+            // right/top edge of the letter relative to text position
+            float right = _x + advance + (world ? cm.offset.x : cm.offsetPx.x);
+            float top = _y - line - (world ? cm.offset.y : cm.offsetPx.y);
+            g.x = right - g.width;
+            // world matrix negates y of position but not of vertices, screen matrix keeps both
+            g.y = (world ? -top : top) - g.height;
+            g.uv = cm.uv;
+            advance += world ? cm.advance : cm.advancePx;
+            dst.push_back(g);
+        }
+    }
+
+    void Text::_UpdateLayout()
+    {
+        if (!this->layoutDirty && this->layoutMode == this->transform.GetMode())
+            return;
+
+        this->layoutDirty = false;
+        this->layoutMode = this->transform.GetMode();
+        Text::Layout(this->text.c_str(), this->font, this->layoutMode, this->glyphs);
+
+        if (this->glyphBuffer != nullptr)
+        {
+            this->glyphBuffer->Destroy();
+            this->glyphBuffer = nullptr;
+        }
+
+        this->glyphVertexCount = (uint)this->glyphs.size() * 6;
+        if (this->glyphVertexCount == 0)
+            return;
+
+        // tex coords are final, same mapping as sprite vs does with uv constant buffer
+        vector<Vertex> vertices;
+        vertices.reserve(this->glyphVertexCount);
+        for (uint i = 0; i < this->glyphs.size(); i++)
+        {
+            const GlyphQuad& g = this->glyphs[i];
+            float l = g.x, r = g.x + g.width, b = g.y, t = g.y + g.height;
+            Vertex lb(l, b, 0, 0, 0, 0, g.uv.left, 1 - g.uv.bottom);
+            Vertex rb(r, b, 0, 0, 0, 0, g.uv.right, 1 - g.uv.bottom);
+            Vertex rt(r, t, 0, 0, 0, 0, g.uv.right, 1 - g.uv.top);
+            Vertex lt(l, t, 0, 0, 0, 0, g.uv.left, 1 - g.uv.top);
+            vertices.push_back(lb);
+            vertices.push_back(rb);
+            vertices.push_back(rt);
+            vertices.push_back(lb);
+            vertices.push_back(rt);
+            vertices.push_back(lt);
+        }
+
+        this->glyphBuffer = renderBackend->_CreateVertexBuffer(vertices, false);
+    }
+
+    void Text::_Draw()
+    {
+        if (!this->visible)
+            return;
+
+        this->_UpdateLayout();
+
+        if (this->glyphVertexCount == 0)
+            return;
+
+        // glyphs are already placed in local space
+        renderBackend->_DrawTriangles(this->transform.GetWorldViewProj(), this->glyphBuffer, this->color,
+            this->texture, this->ps);
+    }
+
+    void Text::Destroy()
+    {
+        if (this->glyphBuffer != nullptr)
+            this->glyphBuffer->Destroy();
+
+        Sprite::Destroy();
+    }
+}
+#pragma endregion
+
+    /*@// DrawManager ****************************************************************************************************@*/
+namespace viva
+{
+    // Wrapper for adding and removing drawables.
+    class DrawManager
+    {
+    private:
+        Surface* defaultSurface;
+        Texture* whitePixel;
+        vector<Surface*> surfaces;
+        Font* defaultFont;
+        TextureFilter defaultFilter;
+        VertexBuffer* rectVertexBuffer;
+        VertexBuffer* circleVertexBuffer;
+    public:
+        DrawManager();
+
+        // Destroys DrawManager and all drawables.
+        void _Destroy();
+
+        // Draw all objects on their surfaces.
+        void _DrawNodes();
+
+        // Draw surfaces.
+        void _DrawSurfaces();
+
+        Surface* GetDefaultSurface();
+
+        Surface* AddSurface();
+
+        void AddSurface(Surface* s);
+
+        void RemoveSurface(Surface* s);
+
+        void MoveSurfaceUp(Surface* s);
+
+        void MoveSurfaceDown(Surface* s);
+
+        void MoveSurfaceTop(Surface* s);
+
+        void MoveSurfaceBottom(Surface* s);
+
+        // Create and add polygon to be drawn.
+        // points: list of points
+        // surface: which surface
+        Polygon* AddPolygon(const vector<Point>& points, Surface* surface);
+
+        // Create and add polygon to be drawn.
+        // points: list of points
+        // surface: which surface
+        Polygon* AddPolygon(VertexBuffer* vb, Surface* surface);
+
+        Polygon* AddRectangle();
+
+        Polygon* AddRectangle(Surface* surface);
+
+        Polygon* AddCircle();
+
+        Polygon* AddCircle(Surface* surface);
+
+        Polygon* AddCircle(uint vertices);
+
+        Polygon* AddCircle(uint vertices, Surface* surface);
+
+        // Create and add polygon to be drawn.
+        // points: list of points
+        Polygon* AddPolygon(const vector<Point>& points);
+
+        // Create and add polygon to be drawn.
+        // points: list of points
+        Polygon* AddPolygon(VertexBuffer* vb);
+
+        // Create and add sprite to be drawn.
+        // t: texture to be used by the sprite
+        // surface: which surface
+        Sprite* AddSprite(Texture* t, Surface* surface);
+
+        // Create and add sprite to be drawn.
+        // t: texture to be used by the sprite
+        Sprite* AddSprite(Texture* t);
+
+        // Create and add a unicolor rectangle to be drawn.
+        // surface: which surface,nullptr for default
+        Sprite* AddFillRectangle(Surface* surface);
+
+        // Create and add a unicolor rectangle to be drawn.
+        Sprite* AddFillRectangle();
+
+        Text* AddText(const wchar_t* str);
+
+        Text* AddText(const wchar_t* str, Font* font);
+
+        Text* AddText(const wchar_t* str, Surface* surface);
+
+        Text* AddText(const wchar_t* str, Font* font, Surface* surface);
+
+        Animation* AddAnimation(Sprite* sprite, Surface* surface);
+
+        Animation* AddAnimation(Sprite* sprite);
+
+        Animation* AddAnimation(Texture* texture, Surface* surface);
+
+        Animation* AddAnimation(Texture* texture);
+
+        void Remove(Drawable* drawable) const;
+
+        void Add(Drawable* drawable, Surface* surface) const;
+
+        void Add(Drawable* drawable);
+
+        TextureFilter GetDefaultTextureFilter() const;
+
+        void SetDefaultTextureFilter(TextureFilter filter);
+
+        Texture* GetPixel();
+
+        Font* GetDefaultFont() const;
+
+        // Destroy all surfaces (except the default one) and all object from the default surface.
+        void Clear();
+
+        // Resize the shared user buffer for PS
+        // size: must be multiple of 16
+        void ResizeExtraPSBuffer(uint size);
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    DrawManager::DrawManager()
+    {
+        this->defaultFilter = TextureFilter::Point;
+        this->defaultSurface = creator->CreateSurface();
+        this->surfaces.push_back(this->defaultSurface);
+
+        // create default font
+        {
+            vector<int> data =
+            {
+                604,1,2,1,6,1,111,1,47,1,8,2,1,2,6,1,2,1,5,5,5,2,18,3,11,1,4,1,11,1,51,1,6,4,7,2,6,5,17,1,
+                8,2,1,2,5,1,2,1,5,1,4,1,4,1,2,1,17,3,10,1,6,1,10,1,9,1,40,1,6,1,4,1,4,2,1,1,5,1,5,1,
+                16,1,8,1,2,1,6,1,2,1,5,1,9,1,2,1,8,3,7,1,11,1,6,1,7,7,6,1,40,1,6,1,4,1,7,1,5,1,5,1,
+                16,1,8,1,2,1,4,8,3,1,10,2,8,1,10,1,10,1,8,1,9,1,9,1,39,1,7,1,4,1,7,1,11,1,16,1,18,1,2,1,
+                6,4,8,3,5,1,10,1,10,1,8,1,8,1,1,1,8,1,39,1,7,1,4,1,7,1,10,1,17,1,18,1,2,1,10,1,4,3,8,2,
+                20,1,8,1,7,1,3,1,4,7,13,7,15,1,8,1,4,1,7,1,8,2,18,1,16,8,8,1,7,2,5,1,1,1,2,1,17,1,8,1,
+                19,1,38,1,8,1,4,1,7,1,7,1,39,1,2,1,10,1,6,1,2,1,4,1,2,2,18,1,8,1,19,1,8,2,27,1,9,1,4,1,
+                7,1,6,1,20,3,17,1,2,1,5,1,4,1,6,1,2,1,4,1,3,1,18,1,8,1,19,1,8,1,19,2,7,1,9,1,4,1,7,1,
+                5,1,5,1,15,3,16,1,2,1,6,5,8,2,6,5,18,1,6,1,20,1,7,2,19,2,6,1,11,4,5,7,2,7,34,1,2,1,8,1,
+                41,1,6,1,28,1,28,1,82,1,42,1,4,1,29,1,1400,4,9,1,5,5,8,4,2,7,5,4,6,4,67,4,53,2,4,1,7,2,5,1,
+                11,1,6,1,5,1,4,1,4,1,4,1,4,1,29,2,12,2,10,4,6,1,4,1,4,3,5,6,6,4,1,1,2,6,4,7,9,1,6,1,
+                1,1,5,1,10,1,13,1,4,1,4,1,4,1,4,1,28,1,16,1,8,1,4,1,4,1,5,1,5,2,6,1,4,1,4,1,4,2,3,1,
+                4,1,4,1,4,1,9,1,5,1,2,1,5,1,9,1,13,1,5,1,4,1,4,1,4,1,5,2,9,2,8,2,5,8,5,2,6,1,4,1,
+                4,1,3,3,4,1,2,1,5,1,4,1,3,1,6,1,3,1,5,1,3,1,4,1,6,3,6,1,2,1,5,5,5,1,1,4,8,1,6,4,
+                5,1,3,2,5,2,9,2,7,1,22,1,10,1,4,1,2,1,2,1,4,1,2,1,5,1,4,1,3,1,10,1,5,1,3,1,2,1,10,1,
+                5,1,3,1,10,1,4,2,4,1,6,1,6,1,4,1,5,3,1,1,23,2,24,2,7,1,5,1,2,1,2,1,4,1,2,1,5,5,4,1,
+                10,1,5,1,3,4,11,1,4,6,9,1,4,1,5,1,6,1,6,1,4,1,9,1,25,1,7,8,7,1,8,1,6,1,2,1,2,1,3,6,
+                4,1,4,1,3,1,10,1,5,1,3,1,2,1,11,1,8,1,10,1,4,1,5,1,6,1,6,1,4,1,8,1,17,2,8,2,18,2,16,1,
+                3,3,3,1,4,1,4,1,4,1,3,1,10,1,5,1,3,1,4,1,3,1,5,1,8,1,4,1,5,1,4,1,5,1,5,1,7,1,4,1,
+                7,1,7,2,9,1,11,1,16,1,10,2,6,1,8,1,6,1,3,1,4,1,4,1,5,1,3,1,4,1,4,1,4,1,4,5,7,4,4,5,
+                6,5,6,1,8,4,5,3,8,2,8,2,12,2,12,2,11,2,7,1,3,1,2,3,4,3,1,6,6,5,3,6,4,7,85,1,50,3,1764,7,
+                5,4,1,1,2,3,2,3,2,7,5,6,2,3,1,4,2,5,4,3,3,3,1,3,3,3,4,4,5,6,5,4,4,6,6,3,1,1,3,7,
+                3,3,2,3,1,3,4,7,1,4,1,3,3,3,3,1,4,1,4,1,4,2,3,1,4,1,6,1,11,1,5,1,3,1,6,1,7,2,3,2,
+                3,2,4,1,4,1,4,1,5,1,4,1,3,1,4,1,4,1,4,1,4,1,3,2,3,1,2,1,2,1,4,1,4,1,3,1,6,1,2,1,
+                5,1,3,1,5,1,4,1,4,1,3,1,10,1,4,1,6,1,11,1,5,1,2,1,7,1,7,1,1,1,1,1,1,1,3,1,1,1,3,1,
+                3,1,6,1,4,1,4,1,2,1,6,1,3,1,4,1,4,1,4,1,3,1,2,1,2,1,4,1,4,1,4,1,4,1,3,1,2,1,2,1,
+                4,1,3,1,5,1,2,1,5,1,10,1,4,1,6,1,11,1,5,1,1,1,8,1,7,1,1,1,1,1,1,1,3,1,1,1,3,1,3,1,
+                6,1,4,1,4,1,2,1,6,1,3,1,4,1,4,1,8,1,2,1,2,1,4,1,4,1,4,1,4,1,3,1,2,1,2,1,5,1,1,1,
+                6,4,5,1,10,6,6,1,11,1,5,4,7,1,7,1,1,1,1,1,1,1,3,1,2,1,2,1,3,1,6,1,4,1,4,1,2,1,6,1,
+                3,5,6,4,7,1,7,1,4,1,5,1,2,1,4,1,1,1,1,1,1,1,6,1,7,1,2,1,5,1,3,5,2,1,4,1,6,1,6,1,
+                4,1,5,1,3,1,6,1,4,1,2,1,2,1,2,1,3,1,3,1,1,1,3,1,6,1,4,5,3,1,6,1,3,1,2,1,11,1,6,1,
+                7,1,4,1,5,1,2,1,4,1,1,1,1,1,1,1,5,1,1,1,6,1,8,1,6,1,3,1,4,1,6,1,6,1,4,1,5,1,3,1,
+                6,1,4,1,2,1,5,1,3,1,3,1,1,1,3,1,6,1,4,1,7,1,6,1,3,1,3,1,5,1,4,1,6,1,7,1,4,1,5,1,
+                2,1,4,1,1,1,1,1,1,1,4,1,3,1,5,1,9,1,5,1,3,1,4,1,6,1,6,1,4,1,5,1,4,1,5,1,4,1,2,1,
+                5,1,3,1,4,2,4,1,4,1,5,1,8,1,4,1,4,1,4,1,4,2,3,1,6,1,7,1,4,1,6,2,5,1,1,1,1,1,1,1,
+                3,1,5,1,3,5,7,5,3,3,2,3,2,7,4,4,5,3,3,2,2,8,1,3,3,3,1,3,3,2,5,4,5,5,6,4,4,3,3,2,
+                3,1,1,3,5,5,6,4,7,2,6,1,3,1,3,3,3,3,115,5,1432,1,22,1,109,1,10,1,38,3,4,1,10,3,9,1,18,1,17,2,
+                23,2,16,5,12,2,11,1,10,1,5,2,7,3,3,3,3,6,6,1,7,1,11,1,8,1,1,1,18,1,17,1,24,1,15,1,18,1,29,1,
+                8,1,5,1,4,1,4,1,6,1,7,1,11,1,7,1,3,1,18,1,16,1,24,1,15,1,18,1,29,1,9,1,3,1,9,1,7,1,8,1,
+                10,1,6,1,5,1,25,4,5,1,1,3,6,4,1,1,4,3,1,1,5,3,5,7,5,3,1,2,3,1,1,3,5,3,7,5,5,1,2,3,
+                5,1,1,1,9,1,8,1,8,1,10,1,37,1,4,1,4,2,3,1,4,1,4,2,3,1,3,2,4,1,3,1,6,1,8,1,3,2,4,2,
+                3,1,6,1,11,1,5,1,2,1,8,1,10,1,8,1,8,1,10,1,42,1,4,1,5,1,2,1,9,1,5,1,3,1,5,1,5,1,7,1,
+                5,1,4,1,4,1,6,1,11,1,5,1,1,1,9,1,9,1,9,1,9,1,9,1,37,6,4,1,5,1,2,1,9,1,5,1,3,7,5,1,
+                7,1,5,1,4,1,4,1,6,1,11,1,5,3,9,1,8,1,3,1,6,1,9,1,9,1,36,1,5,1,4,1,5,1,2,1,9,1,5,1,
+                3,1,11,1,7,1,5,1,4,1,4,1,6,1,11,1,5,1,2,1,8,1,7,1,4,1,6,1,10,1,8,1,36,1,4,2,4,2,3,1,
+                4,1,5,1,3,1,3,2,4,1,4,1,5,1,8,1,3,2,4,1,4,1,6,1,11,1,5,1,3,1,5,5,5,6,6,1,10,1,8,1,
+                37,4,1,2,2,2,1,3,6,5,5,3,1,2,4,4,5,5,6,3,1,1,3,3,2,3,2,7,8,1,4,2,2,4,25,1,11,1,7,1,
+                102,1,28,1,37,3,15,3,102,1,28,1,155,5,24,5,74,10,1072,3,159,1,29,1,77,1,72,1,8,1,9,1,19,1,77,1,71,1,9,1,
+                10,1,18,1,5,2,1,1,2,1,4,2,1,3,6,3,5,2,1,3,6,3,1,2,3,2,2,3,3,4,1,1,2,7,4,2,3,2,3,3,
+                2,3,1,3,5,2,1,3,2,3,1,3,3,3,2,7,6,1,9,1,10,1,18,1,6,2,1,2,1,1,4,2,3,1,4,1,3,1,5,2,
+                3,1,4,1,3,2,5,3,5,1,4,2,4,1,9,1,4,1,4,1,4,1,3,1,3,1,3,1,2,1,4,1,3,1,5,1,3,1,4,1,
+                7,1,9,1,10,1,6,2,10,1,6,1,2,1,2,1,4,1,4,1,3,1,5,1,4,1,5,1,2,1,5,1,5,1,7,1,10,1,9,1,
+                4,1,5,1,2,1,4,1,3,1,3,1,3,1,2,1,5,1,3,1,8,1,8,1,9,1,10,1,5,1,2,1,2,1,6,1,6,1,2,1,
+                2,1,4,1,4,1,3,1,5,1,4,1,5,1,2,1,5,1,5,1,8,5,5,1,9,1,4,1,5,1,2,1,5,1,1,1,1,1,1,1,
+                5,2,6,1,3,1,7,1,8,1,10,1,11,1,8,2,7,1,6,1,2,1,2,1,4,1,4,1,3,1,5,1,4,1,5,1,2,1,5,1,
+                5,1,13,1,4,1,9,1,4,1,5,1,2,1,5,1,1,1,1,1,1,1,4,1,2,1,6,1,1,1,7,1,10,1,9,1,10,1,18,1,
+                6,1,2,1,2,1,4,1,4,1,4,1,3,1,5,2,3,1,4,1,3,2,5,1,7,1,5,1,4,1,4,1,4,1,3,2,6,2,6,1,
+                1,1,1,1,1,1,3,1,4,1,5,1,1,1,6,1,4,1,6,1,9,1,10,1,15,7,2,3,1,2,1,2,2,3,2,3,4,3,6,1,
+                1,3,6,3,1,1,4,5,4,6,6,4,6,3,1,2,5,2,7,1,3,1,3,3,2,3,5,1,6,7,6,1,9,1,10,1,56,1,14,1,
+                76,1,19,1,9,1,10,1,56,1,14,1,75,1,21,1,8,1,9,1,56,3,12,3,71,5,435
+            };
+
+            // here's how above encoding works, each number represents how many consecutive pixels in a row are transparent or white
+            // they simply alternate between white or transparent
+            // e.g. 4,7,2 means 4 pixels transparent then 7 pixels white then 2 pixels transparent
+            vector<Color> data2;
+            Color current(0, 0, 0, 0);
+
+            for (auto i : data)
+            {
+                for (int j = 0; j < i; j++)
+                    data2.push_back(current);
+
+                current = current.r == 0 ? Color(255, 255, 255, 255) : Color(0, 0, 0, 0);
+            }
+
+            // build font metrics fro default font
+            std::string defaultMetrics = "common lineHeight=20\n";
+            char buf[500];
+            int id = 32;
+
+            for (int i = 0; i < 5; i++)
+            {
+                for (int j = 0; j < 19; j++)
+                {
+                    sprintf(buf, "char id=%d x=%d y=%d width=%d height=%d xoffset=%d yoffset=%d xadvance=%d\n",
+                        id, j * 10, i * 19, 10, 19, 0, 0, 10);
+                    defaultMetrics += buf;
+                    id++;
+                }
+            }
+
+            Texture* t = creator->CreateTexture(data2.data(), Size(190, 95));
+            this->defaultFont = creator->CreateFontV(t, defaultMetrics.c_str(), true);
+        }
+
+        Color p[] = { Color(255,255,255,255) };
+        this->whitePixel = creator->CreateTexture(p, Size(1, 1));
+
+        vector<Point> square({ Point(0,0),Point(1,0) ,Point(1,-1) ,Point(0,-1) ,Point(0,0) });
+        this->rectVertexBuffer = creator->CreateVertexBuffer(square);
+
+        vector<Point> circle;
+        for (int i = 0; i < 21; i++)
+            circle.push_back(Point(sinf(2 * math::PI / 20.0f * i) / 2.0f, cosf(2 * math::PI / 20.0f * i) / 2.0f ));
+        this->circleVertexBuffer = creator->CreateVertexBuffer(circle);
+    }
+
+    // Destroys DrawManager and all drawables.
+    void DrawManager::_Destroy()
+    {
+        for (Surface* s : this->surfaces)
+            s->Destroy();
+
+        this->defaultFont->Destroy();
+        this->whitePixel->Destroy();
+        this->rectVertexBuffer->Destroy();
+        this->circleVertexBuffer->Destroy();
+        delete this;
+    }
+
+    // Draw all objects on their surfaces.
+    void DrawManager::_DrawNodes()
+    {
+        for(int i=0;i<this->surfaces.size();i++)
+            surfaces.at(i)->_DrawAll();
+    }
+
+    // Draw surfaces.
+    void DrawManager::_DrawSurfaces()
+    {
+        for (int i = 0; i < this->surfaces.size(); i++)
+            surfaces.at(i)->_DrawSurface();
+    }
+
+    Surface* DrawManager::AddSurface()
+    {
+        Surface* newSurface = creator->CreateSurface();
+        this->surfaces.push_back(newSurface);
+        return newSurface;
+    }
+
+    Surface* DrawManager::GetDefaultSurface()
+    {
+        return this->defaultSurface;
+    }
+
+    void DrawManager::AddSurface(Surface* s)
+    {
+        this->surfaces.push_back(s);
+    }
+
+    void DrawManager::RemoveSurface(Surface* s)
+    {
+        if (s == this->defaultSurface)
+            return;
+
+        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
+
+        if (it != this->surfaces.end())
+            this->surfaces.erase(it);
+    }
+
+    void DrawManager::MoveSurfaceUp(Surface* s)
+    {
+        if (this->surfaces[0] == s)
+            return;
+
+        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
+        auto prev = --it;
+        *it = *prev;
+        *prev = s;
+    }
+
+    void DrawManager::MoveSurfaceDown(Surface* s)
+    {
+        if (this->surfaces.back() == s)
+            return;
+
+        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
+        auto next = ++it;
+        *it = *next;
+        *next = s;
+    }
+
+    void DrawManager::MoveSurfaceTop(Surface* s)
+    {
+        if (this->surfaces[0] == s)
+            return;
+
+        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
+        this->surfaces.erase(it);
+        this->surfaces.insert(this->surfaces.begin(), s);
+    }
+
+    void DrawManager::MoveSurfaceBottom(Surface* s)
+    {
+        if (this->surfaces.back() == s)
+            return;
+
+        auto it = std::find(this->surfaces.begin(), this->surfaces.end(), s);
+        this->surfaces.erase(it);
+        this->surfaces.push_back(s);
+    }
+
+    // Create and add polygon to be drawn.
+    // points: list of points
+    // surface: which surface
+    Polygon* DrawManager::AddPolygon(const vector<Point>& points, Surface* surface)
+    {
+        Polygon* p = creator->CreatePolygon(points);
+        this->Add(p, surface);
+        return p;
+    }
+
+    // Create and add polygon to be drawn.
+    // points: list of points
+    // surface: which surface
+    Polygon* DrawManager::AddPolygon(VertexBuffer* vb, Surface* surface)
+    {
+        Polygon* p = creator->CreatePolygon(vb);
+        this->Add(p, surface);
+        return p;
+    }
+
+    Polygon* DrawManager::AddRectangle()
+    {
+        return this->AddRectangle(this->defaultSurface);
+    }
+
+    Polygon* DrawManager::AddRectangle(Surface* surface)
+    {
+        Polygon* p = creator->CreatePolygon(this->rectVertexBuffer);
+        this->Add(p, surface);
+        return p;
+    }
+
+    Polygon* DrawManager::AddCircle()
+    {
+        return this->AddCircle(this->defaultSurface);
+    }
+
+    Polygon* DrawManager::AddCircle(Surface* surface)
+    {
+        Polygon* p = creator->CreatePolygon(this->circleVertexBuffer);
+        this->Add(p, surface);
+        return p;
+    }
+
+    Polygon* DrawManager::AddCircle(uint vertices)
+    {
+        return this->AddCircle(vertices, this->defaultSurface);
+    }
+
+    Polygon* DrawManager::AddCircle(uint vertices, Surface* surface)
+    {
+        vector<Point> circle;
+        for (uint i = 0; i < vertices + 1; i++)
+            circle.push_back(Point(sinf(2.0f * math::PI / vertices * i), cosf(2.0f * math::PI / vertices * i)));
+
+        Polygon* p = creator->CreatePolygon(circle);
+        this->Add(p, surface);
+        return p;
+    }
+
+    // Create and add polygon to be drawn.
+    // points: list of points
+    Polygon* DrawManager::AddPolygon(const vector<Point>& points)
+    {
+        return this->AddPolygon(points, this->defaultSurface);
+    }
+
+    // Create and add polygon to be drawn.
+    // points: list of points
+    Polygon* DrawManager::AddPolygon(VertexBuffer* vb)
+    {
+        return this->AddPolygon(vb, this->defaultSurface);
+    }
+
+    // Create and add sprite to be drawn.
+    // t: texture to be used by the sprite
+    // surface: which surface
+    Sprite* DrawManager::AddSprite(Texture* t, Surface* surface)
+    {
+        Sprite* s = creator->CreateSprite(t);
+        this->Add(s, surface);
+        return s;
+    }
+
+    // Create and add sprite to be drawn.
+    // t: texture to be used by the sprite
+    Sprite* DrawManager::AddSprite(Texture* t)
+    {
+        return this->AddSprite(t, this->defaultSurface);
+    }
+
+    // Create and add a unicolor rectangle to be drawn.
+    // surface: which surface,nullptr for default
+    Sprite* DrawManager::AddFillRectangle(Surface* surface)
+    {
+        Sprite* s = this->AddSprite(this->whitePixel, surface);
+        return s;
+    }
+
+    // Create and add a unicolor rectangle to be drawn.
+    Sprite* DrawManager::AddFillRectangle()
+    {
+        return this->AddFillRectangle(this->defaultSurface);
+    }
+
+    Text* DrawManager::AddText(const wchar_t* str)
+    {
+        return this->AddText(str, this->defaultSurface);
+    }
+
+    Text* DrawManager::AddText(const wchar_t* str, Font* font)
+    {
+        return this->AddText(str, font, this->defaultSurface);
+    }
+
+    Text* DrawManager::AddText(const wchar_t* str, Surface* surface)
+    {
+        Text* t = creator->CreateText(str);
+        this->Add(t, surface);
+
+        return t;
+    }
+
+    Text* DrawManager::AddText(const wchar_t* str, Font* font, Surface* surface)
+    {
+        Text* t = creator->CreateText(str, font);
+        this->Add(t, surface);
+
+        return t;
+    }
+
+    Animation* DrawManager::AddAnimation(Sprite* sprite, Surface* surface)
+    {
+        Animation* ani = creator->CreateAnimation(sprite);
+        this->Add(ani, surface);
+        return ani;
+    }
+
+    Animation* DrawManager::AddAnimation(Sprite* sprite)
+    {
+        Animation* ani = creator->CreateAnimation(sprite);
+        this->Add(ani, this->defaultSurface);
+        return ani;
+    }
+
+    Animation* DrawManager::AddAnimation(Texture* texture, Surface* surface)
+    {
+        Animation* ani = creator->CreateAnimation(texture);
+        this->Add(ani, surface);
+        return ani;        
+    }
+
+    Animation* DrawManager::AddAnimation(Texture* texture)
+    {
+        Animation* ani = creator->CreateAnimation(texture);
+        this->Add(ani, this->defaultSurface);
+        return ani;
+    }
+
+    void DrawManager::Remove(Drawable* drawable) const
+    {
+        drawable->GetSurface()->Remove(drawable);
+    }
+
+    void DrawManager::Add(Drawable* drawable, Surface* surface) const
+    {
+        surface->Add(drawable);
+    }
+
+    void DrawManager::Add(Drawable* drawable)
+    {
+        this->defaultSurface->Add(drawable);
+    }
+
+    TextureFilter DrawManager::GetDefaultTextureFilter() const
+    {
+        return this->defaultFilter;
+    }
+
+    void DrawManager::SetDefaultTextureFilter(TextureFilter filter)
+    {
+        this->defaultFilter = filter;
+    }
+
+    Texture* DrawManager::GetPixel()
+    {
+        return this->whitePixel;
+    }
+
+    Font* DrawManager::GetDefaultFont() const
+    {
+        return this->defaultFont;
+    }
+
+    // Destroy all surfaces (except the default one) and all object from the default surface.
+    void DrawManager::Clear()
+    {
+        for (Surface* surface : this->surfaces)
+            if (surface != this->defaultSurface)
+                surface->Destroy();
+
+        this->defaultSurface->Clear();
+        this->surfaces.clear();
+        this->surfaces.push_back(this->defaultSurface);
+    }
+
+    void DrawManager::ResizeExtraPSBuffer(uint size)
+    {
+        renderBackend->_ResizeExtraPSBuffer(size);
+    }
+}
+#pragma endregion
+
+/*@// D3D11Backend *************************************************************************************************@*/
+#ifdef _WIN32
+namespace viva
+{
+    // Draws with Direct3D 11. Device and shared state live in d3d.
+    class D3D11Backend : public RenderBackend
+    {
+    private:
+        ID3D11ShaderResourceView* _SrvFromPixels(const Color* pixels, const Size& size);
+    public:
+        // Create device, swap chain, default shaders and buffers.
+        // size: back buffer size
+        D3D11Backend(const Size& size);
+
+        RenderBackendType GetType() const override;
+
+        void ReadBackBuffer(vector<Color>& dst) override;
+
+        Texture* _CreateTexture(const Color* pixels, const Size& size) override;
+
+        Surface* _CreateSurface() override;
+
+        PixelShader* _CreatePixelShader(const char* str) override;
+
+        PixelShader* _CreatePixelShader(const byte* bytecode, size_t size) override;
+
+        VertexBuffer* _CreateVertexBuffer(const vector<Vertex>& vertices, bool shared) override;
+
+        void _ResizeExtraPSBuffer(uint size) override;
+
+        void _BeginSurface(Surface* surface) override;
+
+        void _DrawQuad(const Matrix& wvp, const Rect& uv, const Color& color, Texture* texture,
+            PixelShader* ps, void* extraBufferPSdata) override;
+
+        void _DrawTriangles(const Matrix& wvp, VertexBuffer* vb, const Color& color, Texture* texture,
+            PixelShader* ps) override;
+
+        void _DrawLineStrip(const Matrix& wvp, VertexBuffer* vb, const Color& color, PixelShader* ps) override;
+
+        void _DrawSpriteBatch(const SpriteBatch* batch) override;
+
+        void _EndSurface(Surface* surface) override;
+
+        void _BeginFrame(const Color& background) override;
+
+        void _DrawSurface(Surface* surface) override;
+
+        void _Present() override;
+
+        void _Destroy() override;
+    };
+}
+
+#endif
+#pragma region code
+#ifdef _WIN32
+namespace viva
+{
+    D3D11Backend::D3D11Backend(const Size& size)
+    {
+        HRESULT hr = 0;
+
+        const char* strPixelShader = "cbuffer cbBufferPS {float4 color;};"
+            "Texture2D ObjTexture;"
+            "SamplerState ObjSamplerState;"
+            "struct VS_OUTPUT { float4 Pos:SV_POSITION; float3 Col:COLOR; float2 TexCoord:TEXCOORD; };"
+            "float4 main(VS_OUTPUT input):SV_TARGET{"
+            "if(input.Col.r == 0){"
+            "float4 result = ObjTexture.Sample(ObjSamplerState,input.TexCoord);"
+            "clip(result.a-0.001f);"
+            "return result*color;"
+            "return result;"
+            "}"
+            "else{"
+            "return color;"
+            "}"
+            "}";
+
+        const char* strVertexShader = "cbuffer cbBufferVS { float4x4 transformation; };"
+            "cbuffer cbBufferUV { float4 uv; };"
+            "struct VS_OUTPUT { float4 Pos:SV_POSITION; float3 Col:COLOR; float2 TexCoord:TEXCOORD; };"
+            "VS_OUTPUT main(float4 inPos:POSITION, float3 inCol:COLOR, float2 inTexCoord:TEXCOORD){"
+            "VS_OUTPUT output;"
+            "output.Pos = mul(inPos, transformation);"
+            "output.Col = inCol;"
+            "output.TexCoord = inTexCoord;"
+            "if(inTexCoord[0] == 0 && inTexCoord[1] == 0) output.TexCoord = float2(uv[0], 1 - uv[1]);"
+            "if(inTexCoord[0] == 1 && inTexCoord[1] == 0) output.TexCoord = float2(uv[2], 1 - uv[1]);"
+            "if(inTexCoord[0] == 0 && inTexCoord[1] == 1) output.TexCoord = float2(uv[0], 1 - uv[3]);"
+            "if(inTexCoord[0] == 1 && inTexCoord[1] == 1) output.TexCoord = float2(uv[2], 1 - uv[3]);"
+            "return output;}";
+
+        // same as default shaders but transform, uv and color come per instance
+        const char* strSpriteBatchPS = "Texture2D ObjTexture;"
+            "SamplerState ObjSamplerState;"
+            "struct VS_OUTPUT { float4 Pos:SV_POSITION; float3 Col:COLOR; float2 TexCoord:TEXCOORD; float4 Tint:COLOR1; };"
+            "float4 main(VS_OUTPUT input):SV_TARGET{"
+            "float4 result = ObjTexture.Sample(ObjSamplerState,input.TexCoord);"
+            "clip(result.a-0.001f);"
+            "return result*input.Tint;"
+            "}";
+
+        const char* strSpriteBatchVS = "struct VS_OUTPUT { float4 Pos:SV_POSITION; float3 Col:COLOR; float2 TexCoord:TEXCOORD; float4 Tint:COLOR1; };"
+            "VS_OUTPUT main(float4 inPos:POSITION, float3 inCol:COLOR, float2 inTexCoord:TEXCOORD,"
+            "float4 r1:TRANSFORM0, float4 r2:TRANSFORM1, float4 r3:TRANSFORM2, float4 r4:TRANSFORM3,"
+            "float4 uv:UVRECT, float4 tint:TINT){"
+            "VS_OUTPUT output;"
+            "output.Pos = mul(inPos, float4x4(r1, r2, r3, r4));"
+            "output.Col = inCol;"
+            "output.TexCoord = float2(lerp(uv[0], uv[2], inTexCoord[0]), 1 - lerp(uv[1], uv[3], inTexCoord[1]));"
+            "output.Tint = tint;"
+            "return output;}";
+
+        const char* strPostShader = "cbuffer cbBufferPS{};"
+            "Texture2D ObjTexture;"
+            "SamplerState ObjSamplerState;"
+            "struct VS_OUTPUT { float4 Pos:SV_POSITION; float3 Col:COLOR; float2 TexCoord:TEXCOORD; };"
+            "float4 main(VS_OUTPUT input):SV_TARGET{"
+            "float4 result = ObjTexture.Sample(ObjSamplerState, input.TexCoord);"
+            "clip(result.a-0.001f);"
+            "return result;}";
+
+        //    DEVICE, DEVICE CONTEXT AND SWAP CHAIN    ////
+        DXGI_SWAP_CHAIN_DESC scd;
+        ZeroMemory(&scd, sizeof(DXGI_SWAP_CHAIN_DESC));
+        scd.BufferCount = 1;                                    // one back buffer
+        scd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;     // use 32-bit color
+        scd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;      // how swap chain is to be used
+        scd.OutputWindow = (HWND)window->GetHandle();     // the window to be used
+        scd.SampleDesc.Quality = 0;
+        scd.SampleDesc.Count = 1;                               // no anti aliasing
+        scd.Windowed = TRUE;                                    // windowed/full-screen mode
+                                                                //scd.Flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;   // alternative fullscreen mode
+
+        hr = D3D11CreateDeviceAndSwapChain(NULL,
+            D3D_DRIVER_TYPE_HARDWARE, NULL, NULL, NULL, NULL,
+            D3D11_SDK_VERSION, &scd, &d3d.swapChain, &d3d.device, NULL,
+            &d3d.context);
+        util::Checkhr(hr, "D3D11CreateDeviceAndSwapChain()");
+
+        ////    BACK BUFFER AS RENDER TARGET, DEPTH STENCIL   ////
+        ID3D11Texture2D* buf;
+        d3d.swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (LPVOID*)&buf);
+        // use the back buffer address to create the render target
+        hr = d3d.device->CreateRenderTargetView(buf, NULL, &d3d.backBuffer);
+        util::Checkhr(hr, "CreateRenderTargetView()");
+
+        // same as back buffer but not bound anywhere, ReadBackBuffer() reads it
+        D3D11_TEXTURE2D_DESC lastFrameDesc;
+        buf->GetDesc(&lastFrameDesc);
+        lastFrameDesc.BindFlags = 0;
+        hr = d3d.device->CreateTexture2D(&lastFrameDesc, NULL, &d3d.lastFrame);
+        util::Checkhr(hr, "CreateTexture2D() for last frame");
+        buf->Release();
+
+        D3D11_TEXTURE2D_DESC depthStencilDesc;
+        depthStencilDesc.Width = (UINT)size.width;
+        depthStencilDesc.Height = (UINT)size.height;
+        depthStencilDesc.MipLevels = 1;
+        depthStencilDesc.ArraySize = 1;
+        depthStencilDesc.Format = DXGI_FORMAT_D24_UNORM_S8_UINT;
+        depthStencilDesc.SampleDesc.Count = 1; // ANTIALIASING, increase to 2
+        depthStencilDesc.SampleDesc.Quality = 0;
+        depthStencilDesc.Usage = D3D11_USAGE_DEFAULT;
+        depthStencilDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+        depthStencilDesc.CPUAccessFlags = 0;
+        depthStencilDesc.MiscFlags = 0;
+
+        hr = d3d.device->CreateTexture2D(&depthStencilDesc, NULL, &d3d.depthStencilBuffer);
+        util::Checkhr(hr, "CreateTexture2D() for depthStencilDesc");
+        hr = d3d.device->CreateDepthStencilView(d3d.depthStencilBuffer, NULL, &d3d.depthStencil);
+        util::Checkhr(hr, "CreateDepthStencilView()");
+
+        ////   VIEWPORT    ////
+        // Set the viewport
+        D3D11_VIEWPORT viewport;
+        ZeroMemory(&viewport, sizeof(D3D11_VIEWPORT));
+        viewport.TopLeftX = 0;
+        viewport.TopLeftY = 0;
+        viewport.Width = (float)size.width;
+        viewport.Height = (float)size.height;
+        viewport.MinDepth = 0.0f;
+        viewport.MaxDepth = 1.0f;
+        d3d.context->RSSetViewports(1, &viewport);
+
+        ////    VS   ////
+        ID3D10Blob *vs; //release vs after CreateInputLayout()
+                        //alternative to loading shader from cso file
+        hr = D3DCompile(strVertexShader, strlen(strVertexShader), 0, 0, 0, "main", "vs_5_0", D3DCOMPILE_DEBUG, 0, &vs, 0);
+        util::Checkhr(hr, "D3DCompile() vs");
+        hr = d3d.device->CreateVertexShader(vs->GetBufferPointer(), vs->GetBufferSize(), 0,
+            &d3d.defaultVS);
+        util::Checkhr(hr, "CreateVertexShader()");
+        d3d.context->VSSetShader(d3d.defaultVS, 0, 0);
+        // TODO: why is this here ?
+        util::Checkhr(hr, "CreateVertexShader()");
+
+        //    INPUT LAYOUT    ////
+        D3D11_INPUT_ELEMENT_DESC ied[] =
+        {
+            { "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT,
+            0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+            { "COLOR", 0, DXGI_FORMAT_R32G32B32_FLOAT,
+            0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+            { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,
+            0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+            //if you need to pass something on your own to PS or VS per vertex
+            //{ "SOME_MORE_DATA", 0, DXGI_FORMAT_R32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 }
+        };
+        hr = d3d.device->CreateInputLayout(ied, 3, vs->GetBufferPointer(), vs->GetBufferSize(),
+            &d3d.layout);
+        util::Checkhr(hr, "CreateInputLayout()");
+        vs->Release();
+        d3d.context->IASetInputLayout(d3d.layout);
+
+        ////    SPRITE BATCH VS AND INPUT LAYOUT   ////
+        hr = D3DCompile(strSpriteBatchVS, strlen(strSpriteBatchVS), 0, 0, 0, "main", "vs_5_0", D3DCOMPILE_DEBUG, 0, &vs, 0);
+        util::Checkhr(hr, "D3DCompile() sprite batch vs");
+        hr = d3d.device->CreateVertexShader(vs->GetBufferPointer(), vs->GetBufferSize(), 0,
+            &d3d.spriteBatchVS);
+        util::Checkhr(hr, "CreateVertexShader()");
+
+        // slot 0 is the same sprite quad, slot 1 is SpriteInstance
+        D3D11_INPUT_ELEMENT_DESC iedBatch[] =
+        {
+            { "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+            { "COLOR", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+            { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+            { "TRANSFORM", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 0, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+            { "TRANSFORM", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+            { "TRANSFORM", 2, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+            { "TRANSFORM", 3, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+            { "UVRECT", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+            { "TINT", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        };
+        hr = d3d.device->CreateInputLayout(iedBatch, 9, vs->GetBufferPointer(), vs->GetBufferSize(),
+            &d3d.layoutSpriteBatch);
+        util::Checkhr(hr, "CreateInputLayout() sprite batch");
+        vs->Release();
+
+        ///    BLEND STATE    ////
+        D3D11_BLEND_DESC blendDesc;
+        ZeroMemory(&blendDesc, sizeof(blendDesc));
+        D3D11_RENDER_TARGET_BLEND_DESC rtbd;
+        ZeroMemory(&rtbd, sizeof(rtbd));
+        rtbd.BlendEnable = true;
+        rtbd.SrcBlend = D3D11_BLEND_SRC_ALPHA;
+        rtbd.DestBlend = D3D11_BLEND_INV_SRC_ALPHA;
+        rtbd.BlendOp = D3D11_BLEND_OP_ADD;
+        rtbd.SrcBlendAlpha = D3D11_BLEND_INV_DEST_ALPHA;// D3D11_BLEND_ONE;
+        rtbd.DestBlendAlpha = D3D11_BLEND_ONE;//D3D11_BLEND_ZERO;
+        rtbd.BlendOpAlpha = D3D11_BLEND_OP_ADD;
+        rtbd.RenderTargetWriteMask = D3D10_COLOR_WRITE_ENABLE_ALL;
+        blendDesc.AlphaToCoverageEnable = false;
+        blendDesc.RenderTarget[0] = rtbd;
+        hr = d3d.device->CreateBlendState(&blendDesc, &d3d.blendState);
+        util::Checkhr(hr, "CreateBlendState()");
+
+        ////    RASTERIZERS     ////
+        D3D11_RASTERIZER_DESC rd;
+        ZeroMemory(&rd, sizeof(rd));
+        rd.FillMode = D3D11_FILL_WIREFRAME;
+        rd.CullMode = D3D11_CULL_NONE;
+        hr = d3d.device->CreateRasterizerState(&rd, &d3d.rsWire);
+        util::Checkhr(hr, "CreateRasterizerState()");
+        rd.FillMode = D3D11_FILL_SOLID;
+        rd.CullMode = D3D11_CULL_FRONT;
+        //rd.AntialiasedLineEnable = true; // ANTIALIASING
+        //rd.MultisampleEnable = true; // ANTIALIASING
+        hr = d3d.device->CreateRasterizerState(&rd, &d3d.rsSolid);
+        util::Checkhr(hr, "CreateRasterizerState()");
+
+        ////    SAMPLERS    //////
+        D3D11_SAMPLER_DESC sampDesc;
+        ZeroMemory(&sampDesc, sizeof(sampDesc));
+        sampDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_POINT;
+        sampDesc.AddressU = D3D11_TEXTURE_ADDRESS_WRAP;
+        sampDesc.AddressV = D3D11_TEXTURE_ADDRESS_WRAP;
+        sampDesc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
+        sampDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+        sampDesc.MinLOD = 0;
+        sampDesc.MaxLOD = D3D11_FLOAT32_MAX;
+        d3d.device->CreateSamplerState(&sampDesc, &d3d.samplerPoint);
+        sampDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+        d3d.device->CreateSamplerState(&sampDesc, &d3d.samplerLinear);
+
+        //// SO FAR ONLY INDEX BUFFER ////
+        vector<int> indices({ 0, 1, 2, 0, 2, 3, });
+
+        D3D11_BUFFER_DESC indexBufferDesc;
+        ZeroMemory(&indexBufferDesc, sizeof(indexBufferDesc));
+        indexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
+        indexBufferDesc.ByteWidth = sizeof(int) * (UINT)indices.size();
+        indexBufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+        indexBufferDesc.CPUAccessFlags = 0;
+        indexBufferDesc.MiscFlags = 0;
+
+        D3D11_SUBRESOURCE_DATA srd;
+        srd.pSysMem = indices.data();
+        d3d.device->CreateBuffer(&indexBufferDesc, &srd, &d3d.indexBuffer);
+        d3d.context->IASetIndexBuffer(d3d.indexBuffer, DXGI_FORMAT_R32_UINT, 0);
+        
+        //////   PS    ///////
+        d3d.defaultPS = this->_CreatePixelShader(strPixelShader);
+        d3d.defaultPost = this->_CreatePixelShader(strPostShader);
+        d3d.spriteBatchPS = this->_CreatePixelShader(strSpriteBatchPS);
+
+        /////// CONSTANT BUFFERS ///////
+        d3d.constantBufferVS = util::CreateConstantBuffer(sizeof(Matrix));
+        d3d.context->VSSetConstantBuffers(0, 1, &d3d.constantBufferVS);
+
+        d3d.constantBufferUV = util::CreateConstantBuffer(sizeof(Rect));
+        d3d.context->VSSetConstantBuffers(1, 1, &d3d.constantBufferUV);
+
+        d3d.constantBufferPS = util::CreateConstantBuffer(16);
+        d3d.context->PSSetConstantBuffers(0, 1, &d3d.constantBufferPS);
+
+        // NOTES
+        // there's one extra buffer for the entire project
+        // it meamns it might be updated for every many objects
+        // it's fine because if object had separated buffers, they all would be updated
+        // one optimization might be to have a separate buffer if it has a lot of data that is not updated frequently
+        d3d.constantBufferPSExtra = util::CreateConstantBuffer(16);
+        d3d.context->PSSetConstantBuffers(1, 1, &d3d.constantBufferPSExtra);
+
+        /////// SQUARE VERTEX BUFFER //////
+        vector<Vertex> verticesSprite({
+            Vertex(0, 0, 0, 0, 0, 0, 0, 1),
+            Vertex(1, 0, 0, 0, 0, 0, 1, 1),
+            Vertex(1, 1, 0, 0, 0, 0, 1, 0),
+            Vertex(0, 1, 0, 0, 0, 0, 0, 0) });
+
+        vector<Vertex> verticesSurface({
+            Vertex(-1, -1, 0, 0, 0, 0, 0, 1),
+            Vertex(1, -1, 0, 0, 0, 0, 1, 1),
+            Vertex(1, 1, 0, 0, 0, 0, 1, 0),
+            Vertex(-1, 1, 0, 0, 0, 0, 0, 0) });
+
+        D3D11_BUFFER_DESC vertexBufferDesc;
+        ZeroMemory(&vertexBufferDesc, sizeof(vertexBufferDesc));
+        vertexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
+        vertexBufferDesc.ByteWidth = sizeof(Vertex) * 4;
+        vertexBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+        vertexBufferDesc.CPUAccessFlags = 0;
+        vertexBufferDesc.MiscFlags = 0;
+
+        D3D11_SUBRESOURCE_DATA vertexBufferData;
+        ZeroMemory(&vertexBufferData, sizeof(vertexBufferData));
+        vertexBufferData.pSysMem = verticesSprite.data();
+        d3d.device->CreateBuffer(&vertexBufferDesc, &vertexBufferData, &d3d.vertexBuffer);
+
+        vertexBufferData.pSysMem = verticesSurface.data();
+        d3d.device->CreateBuffer(&vertexBufferDesc, &vertexBufferData, &d3d.vertexBufferSurface);
+    }
+
+    RenderBackendType D3D11Backend::GetType() const
+    {
+        return RenderBackendType::D3D11;
+    }
+
+    void D3D11Backend::ReadBackBuffer(vector<Color>& dst)
+    {
+        // copy to texture that cpu can read
+        D3D11_TEXTURE2D_DESC desc;
+        d3d.lastFrame->GetDesc(&desc);
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.BindFlags = 0;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        desc.MiscFlags = 0;
+        ID3D11Texture2D* staging;
+        HRESULT hr = d3d.device->CreateTexture2D(&desc, NULL, &staging);
+        util::Checkhr(hr, "CreateTexture2D()");
+        d3d.context->CopyResource(staging, d3d.lastFrame);
+
+        D3D11_MAPPED_SUBRESOURCE ms;
+        hr = d3d.context->Map(staging, 0, D3D11_MAP_READ, 0, &ms);
+        util::Checkhr(hr, "Map()");
+        dst.resize(desc.Width * desc.Height);
+        for (UINT i = 0; i < desc.Height; i++)
+            memcpy(dst.data() + i * desc.Width, (byte*)ms.pData + i * ms.RowPitch, desc.Width * sizeof(Color));
+        d3d.context->Unmap(staging, 0);
+        staging->Release();
+    }
+
+    Texture* D3D11Backend::_CreateTexture(const Color* pixels, const Size& size)
+    {
+        return new Texture(this->_SrvFromPixels(pixels, size), size);
+    }
+
+    ID3D11ShaderResourceView* D3D11Backend::_SrvFromPixels(const Color* pixels, const Size& _size)
+    {
+        ID3D11Texture2D *tex;
+        ID3D11ShaderResourceView* srv;
+
+        D3D11_SUBRESOURCE_DATA sub;
+        sub.pSysMem = pixels;
+        sub.SysMemPitch = (UINT)_size.width * 4;
+        sub.SysMemSlicePitch = (UINT)_size.height*(UINT)_size.width * 4;
+
+        D3D11_TEXTURE2D_DESC desc;
+        desc.Width = (UINT)_size.width;
+        desc.Height = (UINT)_size.height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.SampleDesc.Count = 1;
+        desc.SampleDesc.Quality = 0;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        desc.CPUAccessFlags = 0;
+        desc.MiscFlags = 0;
+
+        HRESULT hr = d3d.device->CreateTexture2D(&desc, &sub, &tex);
+        util::Checkhr(hr, "CreateTexture2D()");
+
+        D3D11_TEXTURE2D_DESC desc2;
+        tex->GetDesc(&desc2);
+        hr = d3d.device->CreateShaderResourceView(tex, 0, &srv);
+        util::Checkhr(hr, "CreateShaderResourceView()");
+        tex->Release();
+
+        return srv;
+    }
+
+    Surface* D3D11Backend::_CreateSurface()
+    {
+        ID3D11Texture2D* tex;
+        ID3D11ShaderResourceView* srv;
+        ID3D11RenderTargetView* rtv;
+
+        D3D11_TEXTURE2D_DESC textureDesc;
+        ZeroMemory(&textureDesc, sizeof(textureDesc));
+        textureDesc.Width = (UINT)engine->GetClientSize().width;
+        textureDesc.Height = (UINT)engine->GetClientSize().height;
+        textureDesc.MipLevels = 1;
+        textureDesc.ArraySize = 1;
+        textureDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+        textureDesc.SampleDesc.Count = 1;
+        textureDesc.Usage = D3D11_USAGE_DEFAULT;
+        textureDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+        textureDesc.CPUAccessFlags = 0;
+        textureDesc.MiscFlags = 0;
+        HRESULT hr = d3d.device->CreateTexture2D(&textureDesc, NULL, &tex);
+        util::Checkhr(hr, "CreateTexture2D()");
+
+        D3D11_RENDER_TARGET_VIEW_DESC renderTargetViewDesc;
+        renderTargetViewDesc.Format = textureDesc.Format;
+        renderTargetViewDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+        renderTargetViewDesc.Texture2D.MipSlice = 0;
+        hr = d3d.device->CreateRenderTargetView(tex,
+            &renderTargetViewDesc, &rtv);
+        util::Checkhr(hr, "CreateRenderTargetView()");
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC shaderResourceViewDesc;
+        shaderResourceViewDesc.Format = textureDesc.Format;
+        shaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+        shaderResourceViewDesc.Texture2D.MostDetailedMip = 0;
+        shaderResourceViewDesc.Texture2D.MipLevels = 1;
+        hr = d3d.device->CreateShaderResourceView(tex,
+            &shaderResourceViewDesc, &srv);
+        util::Checkhr(hr, "CreateShaderResourceView()");
+
+        return new Surface(tex, rtv, srv);
+    }
+
+    PixelShader* D3D11Backend::_CreatePixelShader(const char* str)
+    {
+        ID3D10Blob *ps;
+        HRESULT hr = D3DCompile(str, strlen(str), 0, 0, 0, "main", "ps_5_0", 0, 0, &ps, 0);
+        util::Checkhr(hr, "CreatePixelShader()");
+
+        PixelShader* result = this->_CreatePixelShader((const byte*)ps->GetBufferPointer(), ps->GetBufferSize());
+        ps->Release();
+
+        return result;
+    }
+
+    PixelShader* D3D11Backend::_CreatePixelShader(const byte* bytecode, size_t size)
+    {
+        ID3D11PixelShader* result;
+        HRESULT hr = d3d.device->CreatePixelShader(bytecode, size, 0, &result);
+        util::Checkhr(hr, "CreatePixelShader()");
+
+        return new PixelShader(result);
+    }
+
+    VertexBuffer* D3D11Backend::_CreateVertexBuffer(const vector<Vertex>& vertices, bool shared)
+    {
+        uint count = (uint)vertices.size();
+
+        D3D11_BUFFER_DESC bd;
+        ZeroMemory(&bd, sizeof(bd));
+        bd.Usage = D3D11_USAGE_DEFAULT;				   // GPU writes and reads
+        bd.ByteWidth = (UINT)(sizeof(Vertex) * count);
+        bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;       // use as a vertex buffer
+        bd.CPUAccessFlags = 0;		                   // CPU does nothing
+
+        D3D11_SUBRESOURCE_DATA sd;
+        ZeroMemory(&sd, sizeof(sd));
+        sd.pSysMem = vertices.data();                   //Memory in CPU to copy in to GPU
+
+        ID3D11Buffer* vertexBuffer;
+        HRESULT hr = d3d.device->CreateBuffer(&bd, &sd, &vertexBuffer);
+        util::Checkhr(hr, "CreateBuffer()");
+
+        return new VertexBuffer(vertexBuffer, count, shared);
+    }
+
+    void D3D11Backend::_ResizeExtraPSBuffer(uint size)
+    {
+        d3d.constantBufferPSExtra->Release();
+        d3d.constantBufferPSExtra = util::CreateConstantBuffer(size);
+        d3d.context->PSSetConstantBuffers(1, 1, &d3d.constantBufferPSExtra);
+    }
+
+    void D3D11Backend::_BeginSurface(Surface* surface)
+    {
+        d3d.context->ClearDepthStencilView(d3d.depthStencil,
+            D3D11_CLEAR_DEPTH | D3D11_CLEAR_STENCIL, 1.0f, 0);
+        //if (Core->IsAlphaEnabled())
+        //   Core->_GetContext()->OMSetBlendState(Core->_GetBlendState(), 0, 0xffffffff);
+
+        ID3D11RenderTargetView* rtv = surface->_GetRTV();
+        d3d.context->OMSetRenderTargets(1, &rtv, d3d.depthStencil);
+        float four0[4] = { 0, 0, 0, 0 };
+        d3d.context->ClearRenderTargetView(rtv, four0);
+    }
+
+    void D3D11Backend::_DrawQuad(const Matrix& wvp, const Rect& uv, const Color& color, Texture* texture,
+        PixelShader* ps, void* extraBufferPSdata)
+    {
+        // transform
+        Matrix matT = wvp;
+        matT = matT.transpose();
+        d3d.context->UpdateSubresource(d3d.constantBufferVS, 0, NULL, &matT, 0, 0);
+        // uv
+        d3d.context->UpdateSubresource(d3d.constantBufferUV, 0, 0, &uv, 0, 0);
+        // rs
+        d3d.context->RSSetState(d3d.rsSolid);
+        // sampler and color
+        d3d.context->PSSetSamplers(0, 1, &d3d.samplerPoint);
+        float fColor[] = { color.r / 255.0f,color.g / 255.0f,color.b / 255.0f,color.a / 255.0f };
+        d3d.context->UpdateSubresource(d3d.constantBufferPS, 0, 0, fColor, 0, 0);
+        //extra buffer
+        if (extraBufferPSdata != nullptr)
+            d3d.context->UpdateSubresource(d3d.constantBufferPSExtra, 0, 0, extraBufferPSdata, 0, 0);
+        // ps
+        d3d.context->PSSetShader(ps->GetPS(), 0, 0);
+        // vb
+        UINT stride = sizeof(Vertex);
+        UINT offset = 0;
+        d3d.context->IASetVertexBuffers(0, 1, &d3d.vertexBuffer, &stride, &offset);
+        d3d.context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        // texture
+        d3d.context->PSSetShaderResources(0, 1, texture->GetSRV());
+
+        d3d.context->DrawIndexed(6, 0, 0);
+    }
+
+    void D3D11Backend::_DrawTriangles(const Matrix& wvp, VertexBuffer* vb, const Color& color, Texture* texture,
+        PixelShader* ps)
+    {
+        // rs
+        d3d.context->RSSetState(d3d.rsSolid);
+        // sampler and color
+        d3d.context->PSSetSamplers(0, 1, &d3d.samplerPoint);
+        float fColor[] = { color.r / 255.0f,color.g / 255.0f,color.b / 255.0f,color.a / 255.0f };
+        d3d.context->UpdateSubresource(d3d.constantBufferPS, 0, 0, fColor, 0, 0);
+        // ps
+        d3d.context->PSSetShader(ps->GetPS(), 0, 0);
+        // vb
+        UINT stride = sizeof(Vertex);
+        UINT offset = 0;
+        d3d.context->IASetVertexBuffers(0, 1, vb->GetVB(), &stride, &offset);
+        d3d.context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        // texture
+        d3d.context->PSSetShaderResources(0, 1, texture->GetSRV());
+
+        Matrix matT = wvp;
+        matT = matT.transpose();
+        d3d.context->UpdateSubresource(d3d.constantBufferVS, 0, NULL, &matT, 0, 0);
+        // maps corner tex coords to themselves
+        Rect uv(0, 1, 1, 0);
+        d3d.context->UpdateSubresource(d3d.constantBufferUV, 0, 0, &uv, 0, 0);
+
+        d3d.context->Draw(vb->GetVertexCount(), 0);
+    }
+
+    void D3D11Backend::_DrawLineStrip(const Matrix& wvp, VertexBuffer* vb, const Color& color, PixelShader* ps)
+    {
+        // transform
+        Matrix matT = wvp;
+        matT = matT.transpose();
+        d3d.context->UpdateSubresource(d3d.constantBufferVS, 0, NULL, &matT, 0, 0);
+        // color
+        float fColor[] = { color.r / 255.0f,color.g / 255.0f,color.b / 255.0f,color.a / 255.0f };
+        d3d.context->UpdateSubresource(d3d.constantBufferPS, 0, 0, fColor, 0, 0);
+        d3d.context->PSSetShader(ps->GetPS(), 0, 0);
+        d3d.context->IASetPrimitiveTopology(D3D10_PRIMITIVE_TOPOLOGY_LINESTRIP);
+        d3d.context->RSSetState(d3d.rsWire);
+        UINT stride = sizeof(Vertex);
+        UINT offset = 0;
+        d3d.context->IASetVertexBuffers(0, 1, vb->GetVB(), &stride, &offset);
+
+        d3d.context->Draw(vb->GetVertexCount(), 0);
+    }
+
+    void D3D11Backend::_DrawSpriteBatch(const SpriteBatch* batch)
+    {
+        const vector<SpriteInstance>& instances = batch->GetInstances();
+        const vector<SpriteBatchRun>& runs = batch->GetRuns();
+
+        // grow shared instance buffer
+        if (d3d.instanceBufferCapacity < instances.size())
+        {
+            if (d3d.instanceBuffer != nullptr)
+                d3d.instanceBuffer->Release();
+
+            uint capacity = d3d.instanceBufferCapacity == 0 ? 1024 : d3d.instanceBufferCapacity;
+            while (capacity < instances.size())
+                capacity *= 2;
+
+            D3D11_BUFFER_DESC bd;
+            ZeroMemory(&bd, sizeof(bd));
+            bd.Usage = D3D11_USAGE_DYNAMIC;
+            bd.ByteWidth = sizeof(SpriteInstance) * capacity;
+            bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+            bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+            HRESULT hr = d3d.device->CreateBuffer(&bd, NULL, &d3d.instanceBuffer);
+            util::Checkhr(hr, "CreateBuffer()");
+            d3d.instanceBufferCapacity = capacity;
+        }
+
+        D3D11_MAPPED_SUBRESOURCE ms;
+        HRESULT hr = d3d.context->Map(d3d.instanceBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &ms);
+        util::Checkhr(hr, "Map()");
+        memcpy(ms.pData, instances.data(), sizeof(SpriteInstance) * instances.size());
+        d3d.context->Unmap(d3d.instanceBuffer, 0);
+
+        // state common for all runs
+        d3d.context->IASetInputLayout(d3d.layoutSpriteBatch);
+        d3d.context->VSSetShader(d3d.spriteBatchVS, 0, 0);
+        d3d.context->RSSetState(d3d.rsSolid);
+        d3d.context->PSSetSamplers(0, 1, &d3d.samplerPoint);
+        ID3D11Buffer* vbs[] = { d3d.vertexBuffer, d3d.instanceBuffer };
+        UINT strides[] = { sizeof(Vertex), sizeof(SpriteInstance) };
+        UINT offsets[] = { 0, 0 };
+        d3d.context->IASetVertexBuffers(0, 2, vbs, strides, offsets);
+        d3d.context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+        for (uint i = 0; i < runs.size(); i++)
+        {
+            const SpriteBatchRun& run = runs[i];
+            // custom shaders must take color from instance tint (COLOR1)
+            PixelShader* ps = run.ps == d3d.defaultPS ? d3d.spriteBatchPS : run.ps;
+            d3d.context->PSSetShader(ps->GetPS(), 0, 0);
+            d3d.context->PSSetShaderResources(0, 1, run.texture->GetSRV());
+            d3d.context->DrawIndexedInstanced(6, run.count, 0, 0, run.start);
+        }
+
+        // back to defaults for non batched drawables
+        ID3D11Buffer* nullvb = nullptr;
+        UINT zero = 0;
+        d3d.context->IASetVertexBuffers(1, 1, &nullvb, &zero, &zero);
+        d3d.context->IASetInputLayout(d3d.layout);
+        d3d.context->VSSetShader(d3d.defaultVS, 0, 0);
+    }
+
+    void D3D11Backend::_EndSurface(Surface* surface)
+    {
+    }
+
+    void D3D11Backend::_BeginFrame(const Color& background)
+    {
+        // this snippet is here because
+        // also this is common for all render targets, I need to set this up only once
+        float col[4] = { background.r / 255.0f,background.g / 255.0f,background.b / 255.0f,background.a / 255.0f };
+        d3d.context->ClearRenderTargetView(d3d.backBuffer, col);
+        d3d.context->ClearDepthStencilView(d3d.depthStencil, D3D11_CLEAR_DEPTH | D3D11_CLEAR_STENCIL, 1.0f, 0);
+        d3d.context->OMSetRenderTargets(1, &d3d.backBuffer, d3d.depthStencil);
+        d3d.context->RSSetState(d3d.rsSolid);
+        d3d.context->PSSetSamplers(0, 1, &d3d.samplerPoint);
+        UINT stride = sizeof(Vertex);
+        UINT offset = 0;
+        d3d.context->IASetVertexBuffers(0, 1, &d3d.vertexBufferSurface, &stride, &offset);
+        d3d.context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        float identityMatrix[] = { 1,0,0,0,0,1,0,0,0,0,1,0,0,0,0,1 };
+        Rect surfaceuv(0, 0, 1, 1);
+        d3d.context->UpdateSubresource(d3d.constantBufferUV, 0, 0, &surfaceuv, 0, 0);
+        d3d.context->UpdateSubresource(d3d.constantBufferVS, 0, NULL, identityMatrix, 0, 0);
+    }
+
+    void D3D11Backend::_DrawSurface(Surface* surface)
+    {
+        //extra buffer
+        if (surface->_GetExtraBufferPSdata() != nullptr)
+            d3d.context->UpdateSubresource(d3d.constantBufferPSExtra, 0, 0, surface->_GetExtraBufferPSdata(), 0, 0);
+
+        d3d.context->PSSetShader(surface->GetPixelShader()->GetPS(), 0, 0);
+        //tex
+        ID3D11ShaderResourceView* srv = surface->_GetSRV();
+        d3d.context->PSSetShaderResources(0, 1, &srv);
+        //draw
+        d3d.context->DrawIndexed(6, 0, 0);
+    }
+
+    void D3D11Backend::_Present()
+    {
+        ID3D11Resource* buf;
+        d3d.backBuffer->GetResource(&buf);
+        d3d.context->CopyResource(d3d.lastFrame, buf);
+        buf->Release();
+
+        d3d.swapChain->Present(0, 0);
+    }
+
+    void D3D11Backend::_Destroy()
+    {
+        // destroy objects
+        d3d.defaultPS->Destroy();
+        d3d.defaultPost->Destroy();
+        d3d.spriteBatchPS->Destroy();
+
+        // release interfaces
+        d3d.constantBufferPS->Release();
+        d3d.constantBufferPSExtra->Release();
+        d3d.constantBufferUV->Release();
+        d3d.constantBufferVS->Release();
+        d3d.vertexBuffer->Release();
+        d3d.vertexBufferSurface->Release();
+        d3d.samplerLinear->Release();
+        d3d.samplerPoint->Release();
+        d3d.indexBuffer->Release();
+        d3d.blendState->Release();
+        d3d.rsSolid->Release();
+        d3d.rsWire->Release();
+        d3d.layout->Release();
+        d3d.defaultVS->Release();
+        d3d.layoutSpriteBatch->Release();
+        d3d.spriteBatchVS->Release();
+        if (d3d.instanceBuffer != nullptr)
+            d3d.instanceBuffer->Release();
+        d3d.lastFrame->Release();
+        d3d.depthStencilBuffer->Release();
+        d3d.depthStencil->Release();
+        d3d.backBuffer->Release();
+        d3d.swapChain->Release();
+        d3d.context->Release();
+        d3d.device->Release();
+
+        delete this;
+    }
+}
+#endif
+#pragma endregion
+
+/*@// SoftwareBackend **********************************************************************************************@*/
+namespace viva
+{
+    // Triangle or line ready for rasterizer. Coordinates are pixels, y goes down.
+    struct SoftwarePrimitive
+    {
+        __m128 color; // normalized rgba
+        double a[3], b[3], c[3]; // edges, pixel center (x, y) is inside if a * x + b * y + c >= 0 for all three
+        bool topLeft[3]; // center exactly on an edge is inside only if it's top or left edge
+        float z[3], u[3], v[3]; // planes, value = p[0] + p[1] * (x - left) + p[2] * (y - top) for pixel x, y
+        float x0, y0, x1, y1; // line from (x0, y0) to (x1, y1), depth at the ends is z[0] and z[1]
+        Texture* texture; // nullptr for solid color
+        int left, top, right, bottom; // pixels that can be touched, inclusive
+        bool line;
+    };
+
+    // Draws on the CPU, doesn't need GPU. What is drawn on a surface is recorded, binned into tiles
+    // and tiles are rasterized in parallel on the job system.
+    // Output is the same as d3d backend: point sampling with wrap, alpha test, color multiply,
+    // depth test less, no blending, d3d fill rules. Custom pixel shaders are not executed,
+    // drawables that use them are drawn with the default shading.
+    class SoftwareBackend : public RenderBackend
+    {
+    private:
+        static const int TileSize = 64;
+        int width;
+        int height;
+        int tilesX;
+        int tilesY;
+        vector<Color> backBuffer;
+        vector<uint> present; // back buffer as bgra for gdi
+        vector<float> depth; // shared by all surfaces like d3d depth buffer
+        vector<SoftwarePrimitive> primitives; // what is drawn on current surface, in order
+        vector<vector<uint>> bins; // primitive indices per tile, in order
+
+        // Vertex shader and viewport.
+        // dst: x, y in pixels, z, w
+        void _Project(const Matrix& wvp, float x, float y, float z, float* dst) const;
+
+        // Add triangle. Front faces are culled like d3d rsSolid does.
+        // p0, p1, p2: projected vertices
+        // uv: tex coords, two per vertex
+        // texture: nullptr for solid color
+        void _AddTriangle(const float* p0, const float* p1, const float* p2, const float* uv,
+            __m128 color, Texture* texture);
+
+        // Add sprite quad, two triangles.
+        void _AddQuad(const Matrix& wvp, const Rect& uv, __m128 color, Texture* texture);
+
+        // Add line from p0 to p1. p1 itself is not drawn.
+        void _AddLine(const float* p0, const float* p1, __m128 color);
+
+        // Clear tile of the surface and draw primitives binned into it.
+        void _RenderTile(Surface* surface, int tile);
+
+        // Rasterize triangle inside rectangle x0, y0, x1, y1 (inclusive).
+        void _RasterTriangle(const SoftwarePrimitive& p, float* target, int x0, int y0, int x1, int y1);
+
+        // Rasterize line inside rectangle x0, y0, x1, y1 (inclusive).
+        void _RasterLine(const SoftwarePrimitive& p, float* target, int x0, int y0, int x1, int y1);
+
+        // Draw tile of the surface on the back buffer.
+        void _ComposeTile(Surface* surface, int tile);
+
+        // Color to 0-1 floats.
+        static __m128 _ToFloat(const Color& c);
+
+        // Round down to int.
+        static __m128i _Floor(__m128 v);
+    public:
+        // size: back buffer size
+        SoftwareBackend(const Size& size);
+
+        RenderBackendType GetType() const override;
+
+        void ReadBackBuffer(vector<Color>& dst) override;
+
+        Texture* _CreateTexture(const Color* pixels, const Size& size) override;
+
+        Surface* _CreateSurface() override;
+
+        // Shader code is not compiled. Drawables with this shader get default shading.
+        PixelShader* _CreatePixelShader(const char* str) override;
+
+        PixelShader* _CreatePixelShader(const byte* bytecode, size_t size) override;
+
+        VertexBuffer* _CreateVertexBuffer(const vector<Vertex>& vertices, bool shared) override;
+
+        void _ResizeExtraPSBuffer(uint size) override;
+
+        void _BeginSurface(Surface* surface) override;
+
+        void _DrawQuad(const Matrix& wvp, const Rect& uv, const Color& color, Texture* texture,
+            PixelShader* ps, void* extraBufferPSdata) override;
+
+        void _DrawTriangles(const Matrix& wvp, VertexBuffer* vb, const Color& color, Texture* texture,
+            PixelShader* ps) override;
+
+        void _DrawLineStrip(const Matrix& wvp, VertexBuffer* vb, const Color& color, PixelShader* ps) override;
+
+        void _DrawSpriteBatch(const SpriteBatch* batch) override;
+
+        void _EndSurface(Surface* surface) override;
+
+        void _BeginFrame(const Color& background) override;
+
+        void _DrawSurface(Surface* surface) override;
+
+        void _Present() override;
+
+        void _Destroy() override;
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    SoftwareBackend::SoftwareBackend(const Size& size)
+        : width((int)size.width), height((int)size.height)
+    {
+        this->tilesX = (this->width + TileSize - 1) / TileSize;
+        this->tilesY = (this->height + TileSize - 1) / TileSize;
+        this->bins.resize(this->tilesX * this->tilesY);
+        this->backBuffer.resize(this->width * this->height);
+#ifdef _WIN32
+        this->present.resize(this->width * this->height);
+#endif
+        this->depth.resize(this->width * this->height, 1.0f);
+
+        // nothing to compile, drawables compare against these to know they use default shading
+        d3d.defaultPS = new PixelShader(nullptr);
+        d3d.defaultPost = new PixelShader(nullptr);
+        d3d.spriteBatchPS = new PixelShader(nullptr);
+    }
+
+    RenderBackendType SoftwareBackend::GetType() const
+    {
+        return RenderBackendType::Software;
+    }
+
+    void SoftwareBackend::ReadBackBuffer(vector<Color>& dst)
+    {
+        dst = this->backBuffer;
+    }
+
+    Texture* SoftwareBackend::_CreateTexture(const Color* pixels, const Size& size)
+    {
+        return new Texture(pixels, size);
+    }
+
+    Surface* SoftwareBackend::_CreateSurface()
+    {
+        return new Surface(Size((float)this->width, (float)this->height));
+    }
+
+    PixelShader* SoftwareBackend::_CreatePixelShader(const char* str)
+    {
+        return new PixelShader(nullptr);
+    }
+
+    PixelShader* SoftwareBackend::_CreatePixelShader(const byte* bytecode, size_t size)
+    {
+        return new PixelShader(nullptr);
+    }
+
+    VertexBuffer* SoftwareBackend::_CreateVertexBuffer(const vector<Vertex>& vertices, bool shared)
+    {
+        return new VertexBuffer(vertices, shared);
+    }
+
+    void SoftwareBackend::_ResizeExtraPSBuffer(uint size)
+    {
+        // custom shaders don't run so there is nothing to read the buffer
+    }
+
+    __m128 SoftwareBackend::_ToFloat(const Color& c)
+    {
+        int packed;
+        memcpy(&packed, &c, sizeof(int));
+        __m128i zero = _mm_setzero_si128();
+        __m128i i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        return _mm_div_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(255.0f));
+    }
+
+    __m128i SoftwareBackend::_Floor(__m128 v)
+    {
+        __m128i i = _mm_cvttps_epi32(v);
+        // truncation goes up for negative numbers, cmpgt is -1 there
+        return _mm_add_epi32(i, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(i), v)));
+    }
+
+    void SoftwareBackend::_Project(const Matrix& m, float x, float y, float z, float* dst) const
+    {
+        // mul(inPos, transformation) from the vertex shader, w of the position is 1
+        float px = x * m.f[0][0] + y * m.f[1][0] + z * m.f[2][0] + m.f[3][0];
+        float py = x * m.f[0][1] + y * m.f[1][1] + z * m.f[2][1] + m.f[3][1];
+        float pz = x * m.f[0][2] + y * m.f[1][2] + z * m.f[2][2] + m.f[3][2];
+        float pw = x * m.f[0][3] + y * m.f[1][3] + z * m.f[2][3] + m.f[3][3];
+
+        // viewport, depth range 0 to 1
+        dst[0] = (px / pw + 1) * 0.5f * this->width;
+        dst[1] = (1 - py / pw) * 0.5f * this->height;
+        dst[2] = pz / pw;
+        dst[3] = pw;
+    }
+
+    void SoftwareBackend::_AddTriangle(const float* p0, const float* p1, const float* p2, const float* uv,
+        __m128 color, Texture* texture)
+    {
+        const float* p[] = { p0, p1, p2 };
+        double x[3], y[3];
+
+        for (int i = 0; i < 3; i++)
+        {
+            // behind the camera
+            if (p[i][3] <= 0)
+                return;
+
+            // d3d snaps vertices to 1/256 of a pixel
+            x[i] = std::round(p[i][0] * 256.0) / 256.0;
+            y[i] = std::round(p[i][1] * 256.0) / 256.0;
+        }
+
+        // y goes down so positive area is clockwise, that's front face and rsSolid culls front faces
+        double area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (area >= 0)
+            return;
+
+        double l = std::ceil(std::min({ x[0], x[1], x[2] }) - 0.5);
+        double r = std::floor(std::max({ x[0], x[1], x[2] }) - 0.5);
+        double t = std::ceil(std::min({ y[0], y[1], y[2] }) - 0.5);
+        double b = std::floor(std::max({ y[0], y[1], y[2] }) - 0.5);
+        l = std::max(l, 0.0);
+        t = std::max(t, 0.0);
+        r = std::min(r, this->width - 1.0);
+        b = std::min(b, this->height - 1.0);
+
+        if (l > r || t > b)
+            return;
+
+        SoftwarePrimitive prim;
+        prim.color = color;
+        prim.texture = texture;
+        prim.line = false;
+        prim.left = (int)l;
+        prim.top = (int)t;
+        prim.right = (int)r;
+        prim.bottom = (int)b;
+
+        // counter clockwise, walk edges backwards so inside is positive
+        const int order[] = { 0, 2, 1, 0 };
+        for (int i = 0; i < 3; i++)
+        {
+            int from = order[i];
+            int to = order[i + 1];
+            prim.a[i] = y[from] - y[to];
+            prim.b[i] = x[to] - x[from];
+            prim.c[i] = -(prim.a[i] * x[from] + prim.b[i] * y[from]);
+            // left edge has inside on the right, top edge is horizontal with inside below
+            prim.topLeft[i] = prim.a[i] > 0 || (prim.a[i] == 0 && prim.b[i] > 0);
+        }
+
+        // attribute planes evaluated at the center of the first pixel
+        double cx = prim.left + 0.5 - x[0];
+        double cy = prim.top + 0.5 - y[0];
+        auto plane = [&](double f0, double f1, double f2, float* dst)
+        {
+            double dx = ((f1 - f0) * (y[2] - y[0]) - (f2 - f0) * (y[1] - y[0])) / area;
+            double dy = ((f2 - f0) * (x[1] - x[0]) - (f1 - f0) * (x[2] - x[0])) / area;
+            dst[0] = (float)(f0 + dx * cx + dy * cy);
+            dst[1] = (float)dx;
+            dst[2] = (float)dy;
+        };
+
+        plane(p0[2], p1[2], p2[2], prim.z);
+        plane(uv[0], uv[2], uv[4], prim.u);
+        plane(uv[1], uv[3], uv[5], prim.v);
+
+        this->primitives.push_back(prim);
+    }
+
+    void SoftwareBackend::_AddQuad(const Matrix& wvp, const Rect& uv, __m128 color, Texture* texture)
+    {
+        float p[4][4];
+        this->_Project(wvp, 0, 0, 0, p[0]);
+        this->_Project(wvp, 1, 0, 0, p[1]);
+        this->_Project(wvp, 1, 1, 0, p[2]);
+        this->_Project(wvp, 0, 1, 0, p[3]);
+
+        // corners get tex coords the same way vertex shader does it
+        float l = uv.left, r = uv.right, t = 1 - uv.top, b = 1 - uv.bottom;
+        float uv0[] = { l, b, r, b, r, t };
+        float uv1[] = { l, b, r, t, l, t };
+        this->_AddTriangle(p[0], p[1], p[2], uv0, color, texture);
+        this->_AddTriangle(p[0], p[2], p[3], uv1, color, texture);
+    }
+
+    void SoftwareBackend::_AddLine(const float* p0, const float* p1, __m128 color)
+    {
+        if (p0[3] <= 0 || p1[3] <= 0)
+            return;
+
+        float l = std::max(std::floor(std::min(p0[0], p1[0])), 0.0f);
+        float r = std::min(std::floor(std::max(p0[0], p1[0])), this->width - 1.0f);
+        float t = std::max(std::floor(std::min(p0[1], p1[1])), 0.0f);
+        float b = std::min(std::floor(std::max(p0[1], p1[1])), this->height - 1.0f);
+
+        if (l > r || t > b)
+            return;
+
+        SoftwarePrimitive prim;
+        prim.color = color;
+        prim.texture = nullptr;
+        prim.line = true;
+        prim.left = (int)l;
+        prim.top = (int)t;
+        prim.right = (int)r;
+        prim.bottom = (int)b;
+        prim.x0 = p0[0];
+        prim.y0 = p0[1];
+        prim.x1 = p1[0];
+        prim.y1 = p1[1];
+        prim.z[0] = p0[2];
+        prim.z[1] = p1[2];
+
+        this->primitives.push_back(prim);
+    }
+
+    void SoftwareBackend::_BeginSurface(Surface* surface)
+    {
+        this->primitives.clear();
+    }
+
+    void SoftwareBackend::_DrawQuad(const Matrix& wvp, const Rect& uv, const Color& color, Texture* texture,
+        PixelShader* ps, void* extraBufferPSdata)
+    {
+        this->_AddQuad(wvp, uv, _ToFloat(color), texture);
+    }
+
+    void SoftwareBackend::_DrawTriangles(const Matrix& wvp, VertexBuffer* vb, const Color& color, Texture* texture,
+        PixelShader* ps)
+    {
+        const vector<Vertex>& vertices = vb->_GetVertices();
+        __m128 fColor = _ToFloat(color);
+
+        for (uint i = 0; i + 2 < vertices.size(); i += 3)
+        {
+            float p[3][4];
+            float uv[6];
+            for (uint j = 0; j < 3; j++)
+            {
+                const Vertex& v = vertices[i + j];
+                this->_Project(wvp, v.x, v.y, v.z, p[j]);
+                uv[j * 2] = v.u;
+                uv[j * 2 + 1] = v.v;
+            }
+
+            // default ps samples the texture only if red is 0
+            this->_AddTriangle(p[0], p[1], p[2], uv, fColor, vertices[i].r == 0 ? texture : nullptr);
+        }
+    }
+
+    void SoftwareBackend::_DrawLineStrip(const Matrix& wvp, VertexBuffer* vb, const Color& color, PixelShader* ps)
+    {
+        const vector<Vertex>& vertices = vb->_GetVertices();
+        __m128 fColor = _ToFloat(color);
+        float prev[4];
+        float next[4];
+
+        for (uint i = 0; i < vertices.size(); i++)
+        {
+            this->_Project(wvp, vertices[i].x, vertices[i].y, vertices[i].z, next);
+
+            if (i > 0)
+                this->_AddLine(prev, next, fColor);
+
+            memcpy(prev, next, sizeof(prev));
+        }
+    }
+
+    void SoftwareBackend::_DrawSpriteBatch(const SpriteBatch* batch)
+    {
+        const vector<SpriteInstance>& instances = batch->GetInstances();
+        const vector<SpriteBatchRun>& runs = batch->GetRuns();
+
+        for (const SpriteBatchRun& run : runs)
+        {
+            for (uint i = run.start; i < run.start + run.count; i++)
+            {
+                const SpriteInstance& instance = instances[i];
+                this->_AddQuad(instance.transform, instance.uv, _mm_loadu_ps(instance.color), run.texture);
+            }
+        }
+    }
+
+    void SoftwareBackend::_EndSurface(Surface* surface)
+    {
+        for (vector<uint>& bin : this->bins)
+            bin.clear();
+
+        for (uint i = 0; i < this->primitives.size(); i++)
+        {
+            const SoftwarePrimitive& p = this->primitives[i];
+            for (int y = p.top / TileSize; y <= p.bottom / TileSize; y++)
+                for (int x = p.left / TileSize; x <= p.right / TileSize; x++)
+                    this->bins[y * this->tilesX + x].push_back(i);
+        }
+
+        // tiles don't share pixels so they can go in parallel
+        jobSystem->ParallelFor((uint)this->bins.size(), 1, [this, surface](uint begin, uint end)
+        {
+            for (uint i = begin; i < end; i++)
+                this->_RenderTile(surface, (int)i);
+        });
+    }
+
+    void SoftwareBackend::_RenderTile(Surface* surface, int tile)
+    {
+        int x0 = (tile % this->tilesX) * TileSize;
+        int y0 = (tile / this->tilesX) * TileSize;
+        int x1 = std::min(x0 + TileSize, this->width) - 1;
+        int y1 = std::min(y0 + TileSize, this->height) - 1;
+        float* target = surface->_GetPixels().data();
+
+        for (int y = y0; y <= y1; y++)
+        {
+            memset(target + (y * this->width + x0) * 4, 0, (x1 - x0 + 1) * 4 * sizeof(float));
+            std::fill(this->depth.begin() + y * this->width + x0, this->depth.begin() + y * this->width + x1 + 1, 1.0f);
+        }
+
+        for (uint i : this->bins[tile])
+        {
+            const SoftwarePrimitive& p = this->primitives[i];
+
+            if (p.line)
+                this->_RasterLine(p, target, x0, y0, x1, y1);
+            else
+                this->_RasterTriangle(p, target, x0, y0, x1, y1);
+        }
+    }
+
+    void SoftwareBackend::_RasterTriangle(const SoftwarePrimitive& p, float* target, int x0, int y0, int x1, int y1)
+    {
+        int top = std::max(p.top, y0);
+        int bottom = std::min(p.bottom, y1);
+        int left = std::max(p.left, x0);
+        int right = std::min(p.right, x1);
+
+        const Color* texels = nullptr;
+        int texWidth = 0;
+        int texHeight = 0;
+        if (p.texture != nullptr)
+        {
+            texels = p.texture->_GetPixels().data();
+            texWidth = (int)p.texture->GetSize().width;
+            texHeight = (int)p.texture->GetSize().height;
+        }
+
+        const __m128 lanes = _mm_set_ps(3, 2, 1, 0);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1);
+        const __m128 texScaleU = _mm_set1_ps((float)texWidth);
+        const __m128 texScaleV = _mm_set1_ps((float)texHeight);
+        const __m128 zdx = _mm_set1_ps(p.z[1]);
+        const __m128 udx = _mm_set1_ps(p.u[1]);
+        const __m128 vdx = _mm_set1_ps(p.v[1]);
+
+        for (int y = top; y <= bottom; y++)
+        {
+            // span of pixel centers inside all three edges
+            double cy = y + 0.5;
+            double first = left;
+            double last = right;
+            for (int e = 0; e < 3; e++)
+            {
+                double k = p.b[e] * cy + p.c[e];
+
+                if (p.a[e] == 0)
+                {
+                    if (k < 0 || (k == 0 && !p.topLeft[e]))
+                        first = last + 1;
+
+                    continue;
+                }
+
+                // edge crosses the row at x = -k / a and pixel centers are at x + 0.5
+                double cross = -k / p.a[e] - 0.5;
+                if (p.a[e] > 0)
+                    first = std::max(first, p.topLeft[e] ? std::ceil(cross) : std::floor(cross) + 1);
+                else
+                    last = std::min(last, p.topLeft[e] ? std::floor(cross) : std::ceil(cross) - 1);
+            }
+
+            if (first > last)
+                continue;
+
+            int begin = (int)first;
+            int end = (int)last;
+            float fy = (float)(y - p.top);
+            __m128 zRow = _mm_set1_ps(p.z[0] + p.z[2] * fy);
+            __m128 uRow = _mm_set1_ps(p.u[0] + p.u[2] * fy);
+            __m128 vRow = _mm_set1_ps(p.v[0] + p.v[2] * fy);
+            float* depthRow = this->depth.data() + y * this->width;
+            float* colorRow = target + y * this->width * 4;
+
+            for (int x = begin; x <= end; x += 4)
+            {
+                int n = std::min(4, end - x + 1);
+                __m128 fx = _mm_add_ps(_mm_set1_ps((float)(x - p.left)), lanes);
+                __m128 z = _mm_add_ps(zRow, _mm_mul_ps(zdx, fx));
+
+                // don't read past the tile, neighbour tile belongs to another thread
+                float dst[4] = { 0, 0, 0, 0 };
+                memcpy(dst, depthRow + x, n * sizeof(float));
+
+                // depth test less, z outside 0-1 is clipped
+                __m128 pass = _mm_and_ps(_mm_cmplt_ps(z, _mm_loadu_ps(dst)),
+                    _mm_and_ps(_mm_cmpge_ps(z, zero), _mm_cmple_ps(z, one)));
+                int mask = _mm_movemask_ps(pass) & ((1 << n) - 1);
+
+                if (mask == 0)
+                    continue;
+
+                float zs[4];
+                _mm_storeu_ps(zs, z);
+                int tx[4];
+                int ty[4];
+
+                if (texels != nullptr)
+                {
+                    __m128 u = _mm_mul_ps(_mm_add_ps(uRow, _mm_mul_ps(udx, fx)), texScaleU);
+                    __m128 v = _mm_mul_ps(_mm_add_ps(vRow, _mm_mul_ps(vdx, fx)), texScaleV);
+                    _mm_storeu_si128((__m128i*)tx, _Floor(u));
+                    _mm_storeu_si128((__m128i*)ty, _Floor(v));
+                }
+
+                for (int i = 0; i < n; i++)
+                {
+                    if ((mask & (1 << i)) == 0)
+                        continue;
+
+                    __m128 result = p.color;
+
+                    if (texels != nullptr)
+                    {
+                        // point sampler, wrap
+                        int sx = tx[i] % texWidth;
+                        int sy = ty[i] % texHeight;
+                        if (sx < 0)
+                            sx += texWidth;
+                        if (sy < 0)
+                            sy += texHeight;
+
+                        const Color& texel = texels[sy * texWidth + sx];
+
+                        // clip(result.a - 0.001f), for 8 bit alpha only 0 is below
+                        if (texel.a == 0)
+                            continue;
+
+                        result = _mm_mul_ps(_ToFloat(texel), p.color);
+                    }
+
+                    _mm_storeu_ps(colorRow + (x + i) * 4, result);
+                    depthRow[x + i] = zs[i];
+                }
+            }
+        }
+    }
+
+    void SoftwareBackend::_RasterLine(const SoftwarePrimitive& p, float* target, int x0, int y0, int x1, int y1)
+    {
+        float dx = p.x1 - p.x0;
+        float dy = p.y1 - p.y0;
+        // step one pixel at a time along the longer axis
+        bool xMajor = std::fabs(dx) >= std::fabs(dy);
+        float length = xMajor ? dx : dy;
+        float start = xMajor ? p.x0 : p.y0;
+        float end = xMajor ? p.x1 : p.y1;
+
+        if (length == 0)
+            return;
+
+        // pixel centers from start to end, end is left for the next line in the strip
+        float first = length > 0 ? std::ceil(start - 0.5f) : std::floor(end - 0.5f) + 1;
+        float last = length > 0 ? std::ceil(end - 0.5f) - 1 : std::floor(start - 0.5f);
+        first = std::max(first, (float)(xMajor ? x0 : y0));
+        last = std::min(last, (float)(xMajor ? x1 : y1));
+
+        if (first > last)
+            return;
+
+        for (int i = (int)first; i <= (int)last; i++)
+        {
+            float t = (i + 0.5f - start) / length;
+            int j = (int)std::floor(xMajor ? p.y0 + t * dy : p.x0 + t * dx);
+            int x = xMajor ? i : j;
+            int y = xMajor ? j : i;
+
+            if (x < x0 || x > x1 || y < y0 || y > y1)
+                continue;
+
+            float z = p.z[0] + t * (p.z[1] - p.z[0]);
+            float& dst = this->depth[y * this->width + x];
+
+            if (!(z < dst) || z < 0 || z > 1)
+                continue;
+
+            dst = z;
+            _mm_storeu_ps(target + (y * this->width + x) * 4, p.color);
+        }
+    }
+
+    void SoftwareBackend::_BeginFrame(const Color& background)
+    {
+        std::fill(this->backBuffer.begin(), this->backBuffer.end(), background);
+        std::fill(this->depth.begin(), this->depth.end(), 1.0f);
+    }
+
+    void SoftwareBackend::_DrawSurface(Surface* surface)
+    {
+        jobSystem->ParallelFor((uint)this->bins.size(), 1, [this, surface](uint begin, uint end)
+        {
+            for (uint i = begin; i < end; i++)
+                this->_ComposeTile(surface, (int)i);
+        });
+    }
+
+    void SoftwareBackend::_ComposeTile(Surface* surface, int tile)
+    {
+        int x0 = (tile % this->tilesX) * TileSize;
+        int y0 = (tile / this->tilesX) * TileSize;
+        int x1 = std::min(x0 + TileSize, this->width) - 1;
+        int y1 = std::min(y0 + TileSize, this->height) - 1;
+        const float* source = surface->_GetPixels().data();
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1);
+        const __m128 scale = _mm_set1_ps(255.0f);
+
+        for (int y = y0; y <= y1; y++)
+        {
+            // full screen quad has tex coord v = 0 at the bottom
+            const float* row = source + (this->height - 1 - y) * this->width * 4;
+
+            for (int x = x0; x <= x1; x++)
+            {
+                float& dst = this->depth[y * this->width + x];
+
+                // post shader clip(result.a - 0.001f), surface quad has z 0 so only the first surface passes depth test
+                if (row[x * 4 + 3] < 0.001f || !(0.0f < dst))
+                    continue;
+
+                dst = 0;
+
+                // float to unorm: saturate, scale, round to nearest
+                __m128 c = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(row + x * 4), zero), one);
+                __m128i i = _mm_cvtps_epi32(_mm_mul_ps(c, scale));
+                i = _mm_packs_epi32(i, i);
+                i = _mm_packus_epi16(i, i);
+                int packed = _mm_cvtsi128_si32(i);
+                memcpy(&this->backBuffer[y * this->width + x], &packed, sizeof(int));
+            }
+        }
+    }
+
+    void SoftwareBackend::_Present()
+    {
+#ifdef _WIN32
+        // gdi wants bgra
+        jobSystem->ParallelFor((uint)this->height, 16, [this](uint begin, uint end)
+        {
+            for (uint i = begin * this->width; i < end * this->width; i++)
+            {
+                const Color& c = this->backBuffer[i];
+                this->present[i] = (uint)c.b | ((uint)c.g << 8) | ((uint)c.r << 16) | ((uint)c.a << 24);
+            }
+        });
+
+        BITMAPINFO bmi;
+        ZeroMemory(&bmi, sizeof(bmi));
+        bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        bmi.bmiHeader.biWidth = this->width;
+        bmi.bmiHeader.biHeight = -this->height; // rows from the top
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 32;
+        bmi.bmiHeader.biCompression = BI_RGB;
+
+        HDC dc = GetDC(window->GetHandle());
+        SetDIBitsToDevice(dc, 0, 0, this->width, this->height, 0, 0, 0, this->height,
+            this->present.data(), &bmi, DIB_RGB_COLORS);
+        ReleaseDC(window->GetHandle(), dc);
+#else
+        // nowhere to show it, frame stays in the back buffer for ReadBackBuffer()
+#endif
+    }
+
+    void SoftwareBackend::_Destroy()
+    {
+        d3d.defaultPS->Destroy();
+        d3d.defaultPost->Destroy();
+        d3d.spriteBatchPS->Destroy();
+
+        delete this;
+    }
+
+    RenderBackend* RenderBackend::_Create(RenderBackendType type, const Size& size)
+    {
+#ifdef _WIN32
+        if (type == RenderBackendType::Software)
+            return new SoftwareBackend(size);
+        else
+            return new D3D11Backend(size);
+#else
+        // d3d11 is windows only
+        return new SoftwareBackend(size);
+#endif
+    }
+}
+#pragma endregion
+
+/*@// Window *********************************************************************************************************@*/
+namespace viva
+{
+    // Window where everything is being drawn.
+    class Window
+    {
+    private:
+#ifdef _WIN32
+        RAWINPUTDEVICE Rid; //RAWINPUTDEVICE Rid[1]; // you can have more than one
+        MSG msg;
+#else
+        std::atomic<int> closeReason; // 0 while running
+#endif
+        HWND handle;
+        std::function<void()> worker;   // lib side worker
+        std::function<void()> activity; // client size activity
+#ifdef _WIN32
+        static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam);
+#endif
+    public:
+        // Ctor. Without win32 there is no window, frames only go to the back buffer.
+        Window(const char* title, const Size& size);
+
+        // nullptr without win32.
+        HWND GetHandle() const;
+
+#ifndef _WIN32
+        // Make Run() return after current frame.
+        void _Close(CloseReason reason);
+#endif
+
+        void _Destroy();
+
+        void SetWindowTitle(const char* title);
+
+        // start win32 message pump
+        // gameloop: user's function that runs every frame
+        // intloop: engine function that runs every frame
+        CloseReason Run(const std::function<void()>& gameloop, const std::function<void()>& intloop);
+    };
+}
+
+#pragma region code
+namespace viva
+{
+#ifdef _WIN32
+    LRESULT CALLBACK Window::WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+    {
+        switch (msg)
+        {
+        case WM_SYSKEYDOWN:
         {
             if (wParam == VK_MENU)//ignore left alt stop
             {
             }
-            else
-                return DefWindowProc(hwnd, msg, wParam, lParam); // this makes ALT+F4 work
-            break;
+            else
+                return DefWindowProc(hwnd, msg, wParam, lParam); // this makes ALT+F4 work
+            break;
+        }
+        case WM_CLOSE:
+        {
+            ShowWindow(hwnd, false);
+
+            if (wParam == 0)
+                PostQuitMessage((int)CloseReason::WindowClose);
+            else if (wParam == (int)CloseReason::EngineClose)
+                PostQuitMessage((int)CloseReason::EngineClose);
+
+            break;
+        }
+        case WM_COMMAND:
+            break;
+        case WM_MOUSEWHEEL:
+        {
+            if (mouse != nullptr)
+                mouse->_SetMouseWheel(GET_WHEEL_DELTA_WPARAM(wParam));
+
+            break;
+        }
+        case WM_INPUT:
+        {
+            UINT dwSize = 48; // 48 for 64bit build
+            static BYTE lpb[48];
+
+            GetRawInputData((HRAWINPUT)lParam, RID_INPUT,
+                lpb, &dwSize, sizeof(RAWINPUTHEADER)); // this gets relative coords
+
+            RAWINPUT* raw = (RAWINPUT*)lpb;
+
+            if (raw->header.dwType == RIM_TYPEMOUSE)
+            {
+                int xPosRelative = raw->data.mouse.lLastX;
+                int yPosRelative = raw->data.mouse.lLastY;
+
+                if (mouse != nullptr)
+                    mouse->_SetCursorDeltaRaw(xPosRelative, yPosRelative);
+            }
+            break;
+        }
+        default:
+            return DefWindowProc(hwnd, msg, wParam, lParam);
+        }
+        return 0;
+    }
+
+    Window::Window(const char* title, const Size& size)
+    {
+        const char className[] = "myWindowClass";
+        WNDCLASSEX wc;
+        ZeroMemory(&msg, sizeof(msg));
+        ZeroMemory(&wc, sizeof(wc));
+        wc.cbSize = sizeof(WNDCLASSEX);
+        wc.lpfnWndProc = Window::WndProc;
+        wc.hInstance = GetModuleHandle(0);
+        wc.hIcon = LoadIcon(NULL, IDI_APPLICATION);
+        wc.hbrBackground = (HBRUSH)(COLOR_WINDOW);
+        wc.lpszClassName = className;
+        wc.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
+
+        if (!RegisterClassEx(&wc))
+        {
+            throw viva::Error(__FUNCTION__, "Window Class failed to register");
+        }
+
+        RECT rect = { 0, 0, (int)size.width, (int)size.height };
+
+        // this is to enforce the correct size of window client
+        ::AdjustWindowRectEx(&rect, WS_OVERLAPPEDWINDOW | WS_CLIPSIBLINGS, FALSE, 0);
+
+        this->handle = CreateWindowEx(0, className, title, WS_OVERLAPPEDWINDOW,
+            CW_USEDEFAULT, CW_USEDEFAULT, rect.right - rect.left, rect.bottom - rect.top,
+            NULL, NULL, GetModuleHandle(0), NULL);
+
+        USHORT HID_USAGE_PAGE_GENERIC = 1;
+        USHORT HID_USAGE_GENERIC_MOUSE = 2;
+
+        Rid.usUsagePage = HID_USAGE_PAGE_GENERIC;
+        Rid.usUsage = HID_USAGE_GENERIC_MOUSE;
+        Rid.dwFlags = RIDEV_INPUTSINK;
+        Rid.hwndTarget = handle;
+        ::RegisterRawInputDevices(&Rid, 1, sizeof(RAWINPUTDEVICE));
+
+        if (handle == NULL)
+        {
+            throw Error(__FUNCTION__, "Window Creation Failed!");
+        }
+    }
+
+    HWND Window::GetHandle() const
+    {
+        return this->handle;
+    }
+
+    void Window::_Destroy()
+    {
+        ::DestroyWindow(this->handle);
+        ::UnregisterClass("myWindowClass", GetModuleHandle(0));
+        delete this;
+    }
+
+    void Window::SetWindowTitle(const char* title)
+    {
+        ::SetWindowText(this->handle, title);
+    }
+
+    // start win32 message pump
+    // gameloop: user's function that runs every frame
+    // intloop: engine function that runs every frame
+    CloseReason Window::Run(const std::function<void()>& gameloop, const std::function<void()>& intloop)
+    {
+        ::ShowWindow(handle, SW_SHOW);
+        ::UpdateWindow(handle);
+        this->activity = gameloop;
+        this->worker = intloop;
+
+        while (true)
+        {
+            if (::PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+            {
+                if (msg.message == WM_QUIT)
+                {
+                    CloseReason code = (CloseReason)msg.wParam;
+                    ::ZeroMemory(&msg, sizeof(msg));
+                    return code;
+                }
+                ::TranslateMessage(&msg);
+                ::DispatchMessage(&msg);
+            }
+            else
+            {
+                this->worker();
+                this->activity();
+            }
+        }
+    }
+#else
+    Window::Window(const char* title, const Size& size) : closeReason(0), handle(nullptr)
+    {
+    }
+
+    HWND Window::GetHandle() const
+    {
+        return this->handle;
+    }
+
+    void Window::_Destroy()
+    {
+        delete this;
+    }
+
+    void Window::SetWindowTitle(const char* title)
+    {
+    }
+
+    void Window::_Close(CloseReason reason)
+    {
+        this->closeReason = (int)reason;
+    }
+
+    CloseReason Window::Run(const std::function<void()>& gameloop, const std::function<void()>& intloop)
+    {
+        this->activity = gameloop;
+        this->worker = intloop;
+
+        while (this->closeReason == 0)
+        {
+            this->worker();
+            this->activity();
+        }
+
+        CloseReason code = (CloseReason)this->closeReason.load();
+        this->closeReason = 0;
+        return code;
+    }
+#endif
+}
+#pragma endregion
+
+namespace viva
+{
+    struct VivaParams
+    {
+        const char* title;
+        Size size;
+        Size unit;
+        RenderBackendType backend; // D3D11 if not set
+    };
+
+    // Main viva object. Viva starts and ends here.
+    class Viva
+    {
+    public:
+        // Initialize viva.
+        Viva(VivaParams& params);
+
+        // Destructor.
+        ~Viva();
+    };
+}
+
+#pragma region code
+namespace viva
+{
+    Viva::Viva(VivaParams& params)
+    {
+        if (params.unit.width == 0)
+            params.unit = { 32.0f,32.0f };
+
+        window = new Window(params.title, params.size);
+        creator = new Creator();
+        resourceManager = new ResourceManager();
+        uint hardwareThreads = std::thread::hardware_concurrency();
+        jobSystem = new JobSystem(hardwareThreads > 1 ? hardwareThreads - 1 : 0);
+        textureLoader = new TextureLoader(hardwareThreads > 1 ? hardwareThreads - 1 : 1);
+        transformSystem = new TransformSystem();
+        engine = new Engine(params.size, params.backend);
+        camera = new Camera(params.unit);
+        drawManager = new DrawManager();
+        keyboard = new input::Keyboard();
+        mouse = new input::Mouse();
+        time = new Time();
+        routineManager = new RoutineManager();
+        networkManager = new net::NetworkManager();
+        uiManager = new ui::UIManager();
+    }
+
+    // Destructor.
+    Viva::~Viva()
+    {
+        // in reverse order
+        uiManager->_Destroy();
+        networkManager->_Destroy();
+        routineManager->_Destroy();
+        time->_Destroy();
+        mouse->_Destroy();
+        keyboard->_Destroy();
+        drawManager->_Destroy();
+        camera->_Destroy();
+        engine->_Destroy();
+        transformSystem->_Destroy();
+        textureLoader->_Destroy();
+        jobSystem->_Destroy();
+        resourceManager->_Destroy();
+        creator->_Destroy();
+        window->_Destroy();
+    }
+}
+#pragma endregion
+
+/*@// NetworkError ***********************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        struct NetworkError
+        {
+            std::string message;
+            int code;
+        };
+    }
+}
+
+/*@// NetEvents ****************************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        // What event loop saw on a socket.
+        struct PollEvent
+        {
+            Socket* socket;
+            SOCKET handle;
+            bool read; // readable, accept is ready or peer closed
+            bool write; // writable or connect finished
+            bool error;
+        };
+
+        enum class NetCommandType
+        {
+            // start watching handle
+            Add,
+            // change what is watched on handle
+            Modify,
+            // stop watching and close handle, socket lives on with a new handle
+            Abort,
+            // stop watching and close handle, socket comes back as Released to be deleted
+            Release
+        };
+
+        // Main thread asks event loop to do something.
+        struct NetCommand
+        {
+            NetCommandType type;
+            Socket* socket;
+            SOCKET handle;
+            uint generation;
+            bool read;
+            bool write;
+        };
+
+        enum class NetCompletionType
+        {
+            // server accepted a connection, handle and address are set
+            Accepted,
+            // client finished connect and welcome protocol
+            Connected,
+            // peer closed the connection, handle is closed
+            Closed,
+            // socket failed, code is set, handle is closed
+            Failed,
+            // event loop let go of the socket, it can be deleted
+            Released
+        };
+
+        // Event loop tells main thread that something happened.
+        struct NetCompletion
+        {
+            NetCompletionType type;
+            Socket* socket;
+            SOCKET handle;
+            sockaddr_in address;
+            uint generation;
+            int code;
+        };
+    }
+}
+
+/*@// Framing ****************************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        // Wire protocol version, both sides send it in the welcome message. Bump it when framing changes.
+        const unsigned short ProtocolVersion = 2;
+
+        // Welcome message is "VIVA", version and flags, numbers are little endian.
+        const uint HelloSize = 8;
+
+        // Frame header is varint(size << 2 | flags). First chunk of a chunked message is followed by
+        // varint(message size). Varints are LEB128 so they don't depend on byte order.
+        const uint FrameMore = 1; // more chunks of this message follow
+        const uint FrameContinue = 2; // not the first chunk
+        const uint MaxVarint = 10;
+
+        // NetworkError codes that are not winsock errors.
+        const int ErrorProtocol = -1; // welcome message or frame is malformed
+        const int ErrorVersion = -2; // other side speaks different protocol version
+        const int ErrorTooBig = -3; // message is bigger than max message size
+
+        // Write welcome message.
+        // dst: HelloSize bytes
+        void WriteHello(byte* dst);
+
+        // Check welcome message. Returns 0 or error code.
+        int CheckHello(const byte* src);
+
+        // Write LEB128 varint. Returns bytes written, at most MaxVarint.
+        uint WriteVarint(byte* dst, unsigned long long value);
+
+        // Read LEB128 varint. Returns bytes read, 0 if src doesn't have all of it yet, -1 if it's malformed.
+        // size: bytes available in src
+        int ReadVarint(const byte* src, size_t size, unsigned long long& value);
+    }
+}
+
+#pragma region code
+namespace viva
+{
+    namespace net
+    {
+        void WriteHello(byte* dst)
+        {
+            dst[0] = 'V';
+            dst[1] = 'I';
+            dst[2] = 'V';
+            dst[3] = 'A';
+            dst[4] = (byte)(ProtocolVersion & 0xff);
+            dst[5] = (byte)(ProtocolVersion >> 8);
+            dst[6] = 0; // flags, none yet
+            dst[7] = 0;
+        }
+
+        int CheckHello(const byte* src)
+        {
+            if (::memcmp(src, "VIVA", 4) != 0)
+                return ErrorProtocol;
+
+            unsigned short version = (unsigned short)(src[4] | (src[5] << 8));
+            if (version != ProtocolVersion)
+                return ErrorVersion;
+
+            return 0;
+        }
+
+        uint WriteVarint(byte* dst, unsigned long long value)
+        {
+            uint size = 0;
+
+            while (value >= 0x80)
+            {
+                dst[size++] = (byte)(value | 0x80);
+                value >>= 7;
+            }
+
+            dst[size++] = (byte)value;
+            return size;
+        }
+
+        int ReadVarint(const byte* src, size_t size, unsigned long long& value)
+        {
+            value = 0;
+
+            for (uint i = 0; i < MaxVarint; i++)
+            {
+                if (i == size)
+                    return 0;
+
+                value |= (unsigned long long)(src[i] & 0x7f) << (7 * i);
+
+                if ((src[i] & 0x80) == 0)
+                    return i + 1;
+            }
+
+            return -1;
+        }
+    }
+}
+#pragma endregion
+
+/*@// Base *******************************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        // Sockets are non-blocking and watched by the event loop thread of network manager.
+        // Event loop calls _OnPoll(), main thread gets results in _OnCompletion().
+        class Socket
+        {
+        protected:
+            int index;
+            size_t id;
+            std::queue<NetworkError> errors;
+            std::mutex errorQueueMutex;
+            std::function<void(const NetworkError& error)> onErrorHandler;
+            Routine* activityRoutine;
+            SOCKET handle;
+            sockaddr_in address;
+            uint generation; // main thread, changes every time handle is replaced
+            uint loopGeneration; // event loop, generation of the handle it watches
+            bool watched; // main thread, handle was given to event loop
+            bool destroyed; // main thread, waiting for event loop to let go before delete
+            static bool wsInitialized;
+            static WSAData wsadata;
+        public:
+            Socket();
+
+            virtual ~Socket() {}
+
+            static std::string GetLastWinsockErrorMessage(DWORD errorCode);
+
+            // Winsock message or description of a protocol error.
+            static std::string GetErrorMessage(int code);
+
+            static void _InitWinsock();
+
+            static void _SetNonBlocking(SOCKET s);
+
+            // Messages are coalesced before send(), Nagle would only add latency.
+            static void _SetNoDelay(SOCKET s);
+
+            void _AddError(const NetworkError& error);
+
+            // Pass queued errors to the error handler.
+            void _FlushErrors();
+
+            size_t GetId() const;
+
+            void OnError(const std::function<void(const NetworkError& error)>& handler);
+
+            SOCKET _GetSocket() const;
+
+            sockaddr_in _GetSockAddr() const;
+
+            virtual void _Activity() = 0;
+
+            // Main thread. Called for every socket after all of them had _Activity().
+            virtual void _Flush() {}
+
+            // Event loop thread. Something happened on the handle.
+            virtual void _OnPoll(const PollEvent& e) = 0;
+
+            // Main thread. Event loop has a result for this socket.
+            virtual void _OnCompletion(const NetCompletion& c) = 0;
+
+            virtual void Destroy() = 0;
+
+            int _GetIndex() const;
+
+            void _SetIndex(int index);
+
+            uint _GetGeneration() const;
+
+            uint _GetLoopGeneration() const;
+
+            void _SetLoopGeneration(uint generation);
+
+            bool _IsWatched() const;
+
+            void _SetWatched(bool val);
+
+            bool _IsDestroyed() const;
+
+            void _SetDestroyed();
+        };
+    }
+}
+
+#pragma region code
+namespace viva
+{
+    namespace net
+    {
+        bool Socket::wsInitialized = false;
+        WSAData Socket::wsadata;
+
+        Socket::Socket() : index(-1), id(0), activityRoutine(nullptr), handle(INVALID_SOCKET), generation(0),
+            loopGeneration(0), watched(false), destroyed(false)
+        {
+            ::SecureZeroMemory(&this->address, sizeof(this->address));
+        }
+
+        std::string Socket::GetLastWinsockErrorMessage(DWORD errorCode)
+        {
+#ifdef _WIN32
+            char str[300];
+            SecureZeroMemory(str, sizeof(char) * 300);
+            FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM, 0, errorCode,
+                MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US), str, 300, 0);
+            return std::string(str);
+#else
+            return std::string(::strerror((int)errorCode));
+#endif
+        }
+
+        std::string Socket::GetErrorMessage(int code)
+        {
+            switch (code)
+            {
+            case ErrorProtocol:
+                return "Malformed message";
+            case ErrorVersion:
+                return "Other side uses different protocol version";
+            case ErrorTooBig:
+                return "Message is bigger than max message size";
+            default:
+                return GetLastWinsockErrorMessage(code);
+            }
+        }
+
+        void Socket::_InitWinsock()
+        {
+            if (Socket::wsInitialized)
+                return;
+
+            int res = ::WSAStartup(MAKEWORD(2, 2), &wsadata);
+            if (res != 0)
+            {
+                std::string msg = GetLastWinsockErrorMessage(res);
+                throw viva::Error("WSAStartup", msg.c_str());
+            }
+
+            Socket::wsInitialized = true;
+        }
+
+        void Socket::_SetNonBlocking(SOCKET s)
+        {
+            u_long mode = 1;
+            if (::ioctlsocket(s, FIONBIO, &mode) == SOCKET_ERROR)
+            {
+                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
+                throw viva::Error("ioctlsocket", msg.c_str());
+            }
+        }
+
+        void Socket::_SetNoDelay(SOCKET s)
+        {
+            BOOL one = TRUE;
+            ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+        }
+
+        void Socket::_AddError(const NetworkError& error)
+        {
+            this->errorQueueMutex.lock();
+            this->errors.push(error);
+            this->errorQueueMutex.unlock();
+        }
+
+        void Socket::_FlushErrors()
+        {
+            this->errorQueueMutex.lock();
+            std::queue<NetworkError> errors;
+            errors.swap(this->errors);
+            this->errorQueueMutex.unlock();
+
+            while (errors.size() > 0)
+            {
+                if (this->onErrorHandler)
+                    this->onErrorHandler(errors.front());
+                errors.pop();
+            }
+        }
+
+        size_t Socket::GetId() const
+        {
+            return this->id;
+        }
+
+        void Socket::OnError(const std::function<void(const NetworkError& error)>& handler)
+        {
+            this->onErrorHandler = handler;
+        }
+
+        SOCKET Socket::_GetSocket() const
+        {
+            return this->handle;
+        }
+
+        sockaddr_in Socket::_GetSockAddr() const
+        {
+            return this->address;
+        }
+
+        int Socket::_GetIndex() const
+        {
+            return this->index;
+        }
+
+        void Socket::_SetIndex(int index)
+        {
+            this->index = index;
+        }
+
+        uint Socket::_GetGeneration() const
+        {
+            return this->generation;
+        }
+
+        uint Socket::_GetLoopGeneration() const
+        {
+            return this->loopGeneration;
+        }
+
+        void Socket::_SetLoopGeneration(uint generation)
+        {
+            this->loopGeneration = generation;
+        }
+
+        bool Socket::_IsWatched() const
+        {
+            return this->watched;
+        }
+
+        void Socket::_SetWatched(bool val)
+        {
+            this->watched = val;
+        }
+
+        bool Socket::_IsDestroyed() const
+        {
+            return this->destroyed;
+        }
+
+        void Socket::_SetDestroyed()
+        {
+            this->destroyed = true;
+        }
+    }
+}
+#pragma endregion
+
+/*@// ByteRing *****************************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        // Message that points into the receive buffer of a client.
+        // Valid only inside the callback it was passed to.
+        struct MsgSpan
+        {
+            const byte* data;
+            uint size;
+        };
+
+        // Lock-free byte ring for one producer thread and one consumer thread.
+        // Producer writes straight into the ring (recv() target), consumer reads spans out of it.
+        // Memory is allocated on the first write so idle connections cost nothing.
+        class ByteRing
+        {
+        private:
+            vector<byte> buffer; // capacity bytes of ring and slack for reads that wrap
+            size_t capacity; // power of 2
+            size_t slack;
+            std::atomic<size_t> head; // bytes written so far
+            std::atomic<size_t> tail; // bytes read so far
+        public:
+            // Ctor.
+            // capacity: ring size, rounded up to power of 2
+            // maxRead: biggest span that can be read at once
+            ByteRing(size_t capacity, size_t maxRead);
+
+            // Producer. Get contiguous free space, size is 0 if ring is full.
+            // size: how many bytes can be written to returned pointer
+            byte* GetWriteSpan(size_t& size);
+
+            // Producer. Make written bytes visible to consumer.
+            void CommitWrite(size_t size);
+
+            // Producer. Copy all of src in and commit it, it may wrap around the end.
+            // Returns false and writes nothing if there is not enough room.
+            bool Write(const byte* src, size_t size);
+
+            // Consumer. Number of bytes that can be read.
+            size_t GetReadSize() const;
+
+            size_t GetCapacity() const;
+
+            // Consumer. Get contiguous pointer to bytes that were not read yet. If they wrap around
+            // the end of the ring, the wrapped part is copied after the end.
+            // offset: from the first unread byte
+            // size: must be at most maxRead
+            const byte* Peek(size_t offset, size_t size);
+
+            // Consumer. Give bytes back to producer, pointers from Peek() become invalid.
+            void CommitRead(size_t size);
+
+            // Drop everything. Not thread safe.
+            void Clear();
+
+            // Change capacity and drop everything. Not thread safe.
+            // capacity: ring size, rounded up to power of 2
+            void Resize(size_t capacity);
+        };
+
+        // Lock-free bounded queue for one producer thread and one consumer thread.
+        template <typename T>
+        class SpscQueue
+        {
+        private:
+            vector<T> items;
+            size_t mask;
+            std::atomic<size_t> head; // pushed so far
+            std::atomic<size_t> tail; // popped so far
+        public:
+            // Ctor.
+            // capacity: rounded up to power of 2
+            SpscQueue(size_t capacity) : head(0), tail(0)
+            {
+                size_t size = 1;
+                while (size < capacity)
+                    size *= 2;
+
+                this->items.resize(size);
+                this->mask = size - 1;
+            }
+
+            // Producer. Returns false if queue is full.
+            bool TryPush(const T& item)
+            {
+                size_t head = this->head.load(std::memory_order_relaxed);
+                if (head - this->tail.load(std::memory_order_acquire) == this->items.size())
+                    return false;
+
+                this->items[head & this->mask] = item;
+                this->head.store(head + 1, std::memory_order_release);
+                return true;
+            }
+
+            // Consumer. Returns false if queue is empty.
+            bool TryPop(T& item)
+            {
+                size_t tail = this->tail.load(std::memory_order_relaxed);
+                if (tail == this->head.load(std::memory_order_acquire))
+                    return false;
+
+                item = this->items[tail & this->mask];
+                this->tail.store(tail + 1, std::memory_order_release);
+                return true;
+            }
+        };
+    }
+}
+
+#pragma region code
+namespace viva
+{
+    namespace net
+    {
+        ByteRing::ByteRing(size_t capacity, size_t maxRead) : slack(maxRead), head(0), tail(0)
+        {
+            this->Resize(capacity);
+        }
+
+        byte* ByteRing::GetWriteSpan(size_t& size)
+        {
+            if (this->buffer.size() == 0)
+                this->buffer.resize(this->capacity + this->slack);
+
+            size_t head = this->head.load(std::memory_order_relaxed);
+            size_t used = head - this->tail.load(std::memory_order_acquire);
+            size_t start = head & (this->capacity - 1);
+            size_t free = this->capacity - used;
+            size_t contiguous = this->capacity - start;
+
+            size = free < contiguous ? free : contiguous;
+            return this->buffer.data() + start;
+        }
+
+        void ByteRing::CommitWrite(size_t size)
+        {
+            this->head.store(this->head.load(std::memory_order_relaxed) + size, std::memory_order_release);
+        }
+
+        bool ByteRing::Write(const byte* src, size_t size)
+        {
+            size_t first;
+            byte* dst = this->GetWriteSpan(first);
+            size_t free = this->capacity - (this->head.load(std::memory_order_relaxed) - this->tail.load(std::memory_order_acquire));
+            if (free < size)
+                return false;
+
+            if (first > size)
+                first = size;
+
+            memcpy(dst, src, first);
+            memcpy(this->buffer.data(), src + first, size - first);
+            this->CommitWrite(size);
+            return true;
+        }
+
+        size_t ByteRing::GetReadSize() const
+        {
+            return this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_relaxed);
+        }
+
+        size_t ByteRing::GetCapacity() const
+        {
+            return this->capacity;
+        }
+
+        const byte* ByteRing::Peek(size_t offset, size_t size)
+        {
+            size_t start = (this->tail.load(std::memory_order_relaxed) + offset) & (this->capacity - 1);
+
+            // producer never writes to slack so it can be used to make the span contiguous
+            if (start + size > this->capacity)
+            {
+                if (size > this->slack)
+                    throw Error(__FUNCTION__, "Span is bigger than slack");
+
+                memcpy(this->buffer.data() + this->capacity, this->buffer.data(), start + size - this->capacity);
+            }
+
+            return this->buffer.data() + start;
+        }
+
+        void ByteRing::CommitRead(size_t size)
+        {
+            this->tail.store(this->tail.load(std::memory_order_relaxed) + size, std::memory_order_release);
+        }
+
+        void ByteRing::Clear()
+        {
+            this->head = 0;
+            this->tail = 0;
+        }
+
+        void ByteRing::Resize(size_t capacity)
+        {
+            this->capacity = 1;
+            while (this->capacity < capacity)
+                this->capacity *= 2;
+
+            vector<byte>().swap(this->buffer);
+            this->Clear();
+        }
+    }
+}
+#pragma endregion
+
+/*@// NetPoller ****************************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        // Waits on many non-blocking sockets at once. Everything except Wake() is called
+        // from the event loop thread only.
+        class NetPoller
+        {
+        public:
+            virtual ~NetPoller() {}
+
+            // Start watching handle. Returns false if it can't be watched, WSAGetLastError() says why.
+            // socket: owner, passed back in events
+            // generation: generation of the owner's handle
+            // read: report readable
+            // write: report writable
+            virtual bool Add(SOCKET handle, Socket* socket, uint generation, bool read, bool write) = 0;
+
+            // Change what is watched. Nothing happens unless socket and generation own the handle.
+            virtual void Modify(SOCKET handle, Socket* socket, uint generation, bool read, bool write) = 0;
+
+            // Stop watching handle. Returns false unless socket and generation own it, handle value
+            // could have been closed and reused by another socket.
+            virtual bool Remove(SOCKET handle, Socket* socket, uint generation) = 0;
+
+            // Block until something happens on a handle, Wake() is called or time runs out.
+            // timeoutMs: -1 waits forever
+            // events: cleared and filled
+            virtual void Wait(int timeoutMs, vector<PollEvent>& events) = 0;
+
+            // Any thread. Make Wait() return.
+            virtual void Wake() = 0;
+        };
+
+        // WSAPoll() over all handles. Slot 0 is a loopback udp socket that Wake() sends a byte to.
+        class WinsockPoller : public NetPoller
+        {
+        private:
+            vector<WSAPOLLFD> fds;
+            vector<Socket*> owners; // same index as fds
+            vector<uint> generations; // same index as fds
+            std::unordered_map<SOCKET, size_t> slots; // handle to index in fds
+            SOCKET wakeSocket;
+            sockaddr_in wakeAddress;
+            std::atomic<bool> wakePending;
+
+            static SHORT _Events(bool read, bool write);
+        public:
+            WinsockPoller();
+
+            ~WinsockPoller() override;
+
+            bool Add(SOCKET handle, Socket* socket, uint generation, bool read, bool write) override;
+
+            void Modify(SOCKET handle, Socket* socket, uint generation, bool read, bool write) override;
+
+            bool Remove(SOCKET handle, Socket* socket, uint generation) override;
+
+            void Wait(int timeoutMs, vector<PollEvent>& events) override;
+
+            void Wake() override;
+        };
+
+#ifdef __linux__
+        // epoll, only handles that have something are reported. Wake() writes to an eventfd.
+        class EpollPoller : public NetPoller
+        {
+        private:
+            struct Entry
+            {
+                Socket* socket;
+                SOCKET handle;
+                uint generation;
+            };
+
+            int epoll;
+            int wakeFd;
+            std::unordered_map<SOCKET, Entry> entries; // nodes don't move, epoll points at them
+            vector<epoll_event> ready;
+            std::atomic<bool> wakePending;
+
+            static uint32_t _Events(bool read, bool write);
+        public:
+            EpollPoller();
+
+            ~EpollPoller() override;
+
+            bool Add(SOCKET handle, Socket* socket, uint generation, bool read, bool write) override;
+
+            void Modify(SOCKET handle, Socket* socket, uint generation, bool read, bool write) override;
+
+            bool Remove(SOCKET handle, Socket* socket, uint generation) override;
+
+            void Wait(int timeoutMs, vector<PollEvent>& events) override;
+
+            void Wake() override;
+        };
+#endif
+    }
+}
+
+#pragma region code
+namespace viva
+{
+    namespace net
+    {
+        WinsockPoller::WinsockPoller() : wakePending(false)
+        {
+            Socket::_InitWinsock();
+
+            this->wakeSocket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (this->wakeSocket == INVALID_SOCKET)
+            {
+                std::string msg = Socket::GetLastWinsockErrorMessage(::WSAGetLastError());
+                throw viva::Error("socket", msg.c_str());
+            }
+
+            // bind to any free loopback port and send wake ups there
+            ::SecureZeroMemory(&this->wakeAddress, sizeof(this->wakeAddress));
+            this->wakeAddress.sin_family = AF_INET;
+            this->wakeAddress.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+            this->wakeAddress.sin_port = 0;
+            socklen_t size = sizeof(this->wakeAddress);
+
+            if (::bind(this->wakeSocket, (sockaddr*)&this->wakeAddress, size) == SOCKET_ERROR ||
+                ::getsockname(this->wakeSocket, (sockaddr*)&this->wakeAddress, &size) == SOCKET_ERROR)
+            {
+                std::string msg = Socket::GetLastWinsockErrorMessage(::WSAGetLastError());
+                throw viva::Error("bind", msg.c_str());
+            }
+
+            Socket::_SetNonBlocking(this->wakeSocket);
+
+            WSAPOLLFD fd = { this->wakeSocket, POLLRDNORM, 0 };
+            this->fds.push_back(fd);
+            this->owners.push_back(nullptr);
+            this->generations.push_back(0);
+        }
+
+        WinsockPoller::~WinsockPoller()
+        {
+            ::closesocket(this->wakeSocket);
+        }
+
+        SHORT WinsockPoller::_Events(bool read, bool write)
+        {
+            // POLLHUP and POLLERR are always reported and must not be asked for
+            return (read ? POLLRDNORM : 0) | (write ? POLLWRNORM : 0);
+        }
+
+        bool WinsockPoller::Add(SOCKET handle, Socket* socket, uint generation, bool read, bool write)
+        {
+            WSAPOLLFD fd = { handle, _Events(read, write), 0 };
+            this->slots[handle] = this->fds.size();
+            this->fds.push_back(fd);
+            this->owners.push_back(socket);
+            this->generations.push_back(generation);
+            return true;
+        }
+
+        void WinsockPoller::Modify(SOCKET handle, Socket* socket, uint generation, bool read, bool write)
+        {
+            auto it = this->slots.find(handle);
+            if (it != this->slots.end() && this->owners[it->second] == socket && this->generations[it->second] == generation)
+                this->fds[it->second].events = _Events(read, write);
+        }
+
+        bool WinsockPoller::Remove(SOCKET handle, Socket* socket, uint generation)
+        {
+            auto it = this->slots.find(handle);
+            if (it == this->slots.end() || this->owners[it->second] != socket || this->generations[it->second] != generation)
+                return false;
+
+            // swap with last so other slots stay valid
+            size_t slot = it->second;
+            size_t last = this->fds.size() - 1;
+            this->slots.erase(it);
+
+            if (slot != last)
+            {
+                this->fds[slot] = this->fds[last];
+                this->owners[slot] = this->owners[last];
+                this->generations[slot] = this->generations[last];
+                this->slots[this->fds[slot].fd] = slot;
+            }
+
+            this->fds.pop_back();
+            this->owners.pop_back();
+            this->generations.pop_back();
+            return true;
+        }
+
+        void WinsockPoller::Wait(int timeoutMs, vector<PollEvent>& events)
+        {
+            events.clear();
+
+            int count = ::WSAPoll(this->fds.data(), (ULONG)this->fds.size(), timeoutMs);
+            if (count <= 0)
+                return;
+
+            if (this->fds[0].revents != 0)
+            {
+                // reset before draining so a wake up that comes now is not lost
+                this->wakePending = false;
+                char buf[64];
+                while (::recv(this->wakeSocket, buf, sizeof(buf), 0) > 0);
+            }
+
+            for (size_t i = 1; i < this->fds.size(); i++)
+            {
+                SHORT revents = this->fds[i].revents;
+                if (revents == 0)
+                    continue;
+
+                PollEvent e;
+                e.socket = this->owners[i];
+                e.handle = this->fds[i].fd;
+                e.read = (revents & (POLLRDNORM | POLLHUP)) != 0;
+                e.write = (revents & POLLWRNORM) != 0;
+                e.error = (revents & (POLLERR | POLLNVAL)) != 0;
+                events.push_back(e);
+            }
+        }
+
+        void WinsockPoller::Wake()
+        {
+            if (!this->wakePending.exchange(true))
+                ::sendto(this->wakeSocket, "w", 1, 0, (sockaddr*)&this->wakeAddress, sizeof(this->wakeAddress));
+        }
+
+#ifdef __linux__
+        EpollPoller::EpollPoller() : wakePending(false)
+        {
+            this->epoll = ::epoll_create1(EPOLL_CLOEXEC);
+            if (this->epoll < 0)
+                throw viva::Error("epoll_create1", ::strerror(errno));
+
+            this->wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (this->wakeFd < 0)
+                throw viva::Error("eventfd", ::strerror(errno));
+
+            // null data marks the wake up fd
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = nullptr;
+            ::epoll_ctl(this->epoll, EPOLL_CTL_ADD, this->wakeFd, &ev);
+
+            this->ready.resize(1024);
+        }
+
+        EpollPoller::~EpollPoller()
+        {
+            ::close(this->wakeFd);
+            ::close(this->epoll);
+        }
+
+        uint32_t EpollPoller::_Events(bool read, bool write)
+        {
+            // level triggered like WSAPoll, EPOLLHUP and EPOLLERR are always reported
+            return (read ? EPOLLIN | EPOLLRDHUP : 0) | (write ? EPOLLOUT : 0);
+        }
+
+        bool EpollPoller::Add(SOCKET handle, Socket* socket, uint generation, bool read, bool write)
+        {
+            Entry& entry = this->entries[handle];
+            entry.socket = socket;
+            entry.handle = handle;
+            entry.generation = generation;
+
+            epoll_event ev = {};
+            ev.events = _Events(read, write);
+            ev.data.ptr = &entry;
+            if (::epoll_ctl(this->epoll, EPOLL_CTL_ADD, (int)handle, &ev) < 0)
+            {
+                this->entries.erase(handle);
+                return false;
+            }
+
+            return true;
+        }
+
+        void EpollPoller::Modify(SOCKET handle, Socket* socket, uint generation, bool read, bool write)
+        {
+            auto it = this->entries.find(handle);
+            if (it == this->entries.end() || it->second.socket != socket || it->second.generation != generation)
+                return;
+
+            epoll_event ev = {};
+            ev.events = _Events(read, write);
+            ev.data.ptr = &it->second;
+            ::epoll_ctl(this->epoll, EPOLL_CTL_MOD, (int)handle, &ev);
+        }
+
+        bool EpollPoller::Remove(SOCKET handle, Socket* socket, uint generation)
+        {
+            auto it = this->entries.find(handle);
+            if (it == this->entries.end() || it->second.socket != socket || it->second.generation != generation)
+                return false;
+
+            epoll_event ev = {}; // old kernels want non null event
+            ::epoll_ctl(this->epoll, EPOLL_CTL_DEL, (int)handle, &ev);
+            this->entries.erase(it);
+            return true;
+        }
+
+        void EpollPoller::Wait(int timeoutMs, vector<PollEvent>& events)
+        {
+            events.clear();
+
+            int count = ::epoll_wait(this->epoll, this->ready.data(), (int)this->ready.size(), timeoutMs);
+
+            for (int i = 0; i < count; i++)
+            {
+                const epoll_event& ev = this->ready[i];
+
+                if (ev.data.ptr == nullptr)
+                {
+                    this->wakePending = false;
+                    uint64_t value;
+                    while (::read(this->wakeFd, &value, sizeof(value)) > 0);
+                    continue;
+                }
+
+                Entry* entry = (Entry*)ev.data.ptr;
+                PollEvent e;
+                e.socket = entry->socket;
+                e.handle = entry->handle;
+                e.read = (ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0;
+                e.write = (ev.events & EPOLLOUT) != 0;
+                e.error = (ev.events & EPOLLERR) != 0;
+                events.push_back(e);
+            }
+
+            // everything was ready, there might be more next time
+            if (count == (int)this->ready.size())
+                this->ready.resize(this->ready.size() * 2);
+        }
+
+        void EpollPoller::Wake()
+        {
+            if (!this->wakePending.exchange(true))
+            {
+                uint64_t one = 1;
+                ::write(this->wakeFd, &one, sizeof(one));
+            }
+        }
+#endif
+    }
+}
+#pragma endregion
+
+/*@// Client *****************************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        class Client : public net::Socket
+        {
+        protected:
+            static const uint MaxChunk = 64 * 1024; // bigger messages are sent in chunks
+            static const uint MaxHeader = 2 * MaxVarint; // size and message size of the first chunk
+            static const uint MaxFrame = MaxHeader + MaxChunk;
+            static const uint DefaultMaxMessage = 64 * 1024 * 1024;
+            static const uint MinReceiveRing = 128 * 1024;
+            static const uint DefaultReceiveRing = 256 * 1024;
+            static const uint DefaultRecvSize = 64 * 1024;
+            static const uint RecvPerPoll = 4; // recv() calls per event so one busy socket doesn't starve others
+            static const uint MaxSendBufs = 1024; // buffers per WSASend(), IOV_MAX on posix
+            static const uint DefaultSendLimit = 4 * 1024 * 1024;
+
+            // Queued bytes. Either copied to sendStore or referenced until the end of the frame.
+            struct SendSlice
+            {
+                const byte* data; // referenced by SendRef(), nullptr if bytes are in sendStore
+                size_t offset; // in sendStore
+                uint size;
+            };
+
+            // where connection is, event loop only
+            enum class Link
+            {
+                Connecting,
+                Welcome,
+                Open
+            };
+
+            std::string ip;
+            unsigned short port;
+            std::function<void()> onConnectHandler;
+            std::function<void(const vector<byte>&)> onMsgHandler;
+            std::function<void(const MsgSpan&)> onMsgSpanHandler;
+            std::function<void(const vector<MsgSpan>&)> onMsgBatchHandler;
+            vector<MsgSpan> batch; // reused every frame
+            uint msgBudget; // 0 is no limit
+            double msgTimeBudget; // 0 is no limit
+            bool isConnected;
+            bool isConnecting;
+            Server* server; // owner if this client was accepted by a server
+            RoutineHandle timeOutHandler;
+            ByteRing receiveRing; // event loop writes, main thread reads
+            uint recvSize; // max bytes per recv() call
+            std::atomic<bool> throttled; // event loop stopped reading because ring was full
+            Link link; // event loop only
+            byte hello[HelloSize]; // event loop only
+            uint helloSize; // event loop only
+            vector<byte> assembly; // chunks of a big message are copied here, keeps capacity
+            size_t assembled; // bytes of the message that came so far
+            bool assembling;
+            uint maxMessage; // bigger message closes the connection
+            vector<byte> sendStore; // headers and copied messages, keeps capacity between frames
+            vector<byte> sendSpare; // swapped with sendStore when unsent bytes are compacted
+            vector<SendSlice> sendQueue;
+            vector<WSABUF> sendBufs; // reused by every WSASend()
+            size_t sendQueued; // bytes in sendQueue
+            size_t sendLimit; // Send() fails past that
+            bool coalesce;
+
+            void _Receive(SOCKET handle);
+
+            // Copy bytes to the end of the send queue.
+            void _QueueCopy(const byte* data, uint size);
+
+            // Flush now if coalescing is off or queue is over the limit.
+            void _AfterQueue();
+
+            // Queue can't take more, it's over the limit even after a flush.
+            bool _IsSendFull();
+
+            void _ClearSend();
+
+            // Split message into frames and queue them.
+            // copy: copy payload or reference it until the end of the frame
+            void _QueueMessage(const byte* msg, uint len, bool copy);
+
+            // Connection is gone, handle belongs to event loop or is closed.
+            void _Closed();
+
+            // Main thread. Drop connection because of an error found on the main thread.
+            void _Disconnect(int code);
+
+            // Replace handle with a new one so Connect() can be called again. Old one must be closed
+            // already or belong to event loop.
+            void _ResetHandle();
+        public:
+            Client(const char* _ip, unsigned short _port);
+
+            Client(SOCKET socket, sockaddr_in address, const char* ip, unsigned short port);
+
+            void OnConnect(const std::function<void()>& handler);
+
+            // Message is copied to vector, OnMsgSpan() doesn't copy.
+            void OnMsg(const std::function<void(const vector<byte>&)>& handler);
+
+            // Message points straight into the receive buffer and is valid only inside the handler.
+            void OnMsgSpan(const std::function<void(const MsgSpan&)>& handler);
+
+            // All messages received this frame at once, called after per message handlers.
+            // Spans are valid only inside the handler.
+            void OnMsgBatch(const std::function<void(const vector<MsgSpan>&)>& handler);
+
+            // Limit how much time is spent delivering messages every frame, the rest waits for
+            // the next frame. 0 means no limit. By default everything is delivered.
+            // maxCount: max messages per frame
+            // maxSeconds: max time per frame
+            void SetMsgBudget(uint maxCount, double maxSeconds);
+
+            // Set size of the receive buffer. Call it before Connect().
+            // ringSize: receive buffer size, at least 128KB, allocated when first bytes arrive
+            // recvSize: max bytes read from socket at once
+            void SetReceiveBuffer(uint ringSize, uint recvSize);
+
+            void _Activity() override;
+
+            void _OnPoll(const PollEvent& e) override;
+
+            void _OnCompletion(const NetCompletion& c) override;
+
+            void _ProcessMsg();
+
+            void _SetConnected(bool val);
+
+            void _SetServer(Server* server);
+
+            const char* GetIp() const;
+
+            bool IsConnected() const;
+
+            bool Send(vector<byte>& msg);
+
+            // Queue a copy of the message. All messages queued in a frame go out in one
+            // WSASend() at the end of the network step, or once connected. Messages over 64KB are
+            // sent in chunks. Returns false and doesn't queue it while the queue is over the send
+            // limit, send it again later or drop it.
+            bool Send(byte* msg, uint len);
+
+            // Queue the message without copying it. It must stay valid until the end of the frame.
+            // Returns false like Send().
+            bool SendRef(const byte* msg, uint len);
+
+            // Biggest message that can be sent or received, bigger received message closes the
+            // connection. Default is 64MB.
+            void SetMaxMessageSize(uint bytes);
+
+            // Send what is queued now, the rest stays queued if kernel buffer is full.
+            void _FlushSend();
+
+            void _Flush() override;
+
+            // Queue messages until the end of the frame, on by default. When off every Send()
+            // goes to the socket right away.
+            void SetSendCoalescing(bool val);
+
+            // When this many bytes are queued because kernel buffer is full or the connection isn't
+            // open yet, Send() returns false until there is room. Default is 4MB.
+            void SetSendLimit(uint bytes);
+
+            // Bytes queued and not sent yet.
+            size_t GetSendQueueSize() const;
+
+            void Connect(double timeoutSeconds);
+
+            void Disonnect();
+
+            void Destroy() override;
+        };
+    }
+}
+
+#pragma region code
+namespace viva
+{
+    namespace net
+    {
+        Client::Client(SOCKET socket, sockaddr_in address, const char* ip, unsigned short port)
+            : ip(ip), port(port), msgBudget(0), msgTimeBudget(0), isConnected(false), isConnecting(false), server(nullptr),
+            receiveRing(DefaultReceiveRing, MaxFrame), recvSize(DefaultRecvSize), throttled(false), link(Link::Welcome), helloSize(0),
+            assembled(0), assembling(false), maxMessage(DefaultMaxMessage), sendQueued(0), sendLimit(DefaultSendLimit), coalesce(true)
+        {
+            this->index = -1; // server adds it to network manager when OnConnect is called
+            this->handle = socket;
+            this->id = (size_t)socket;
+            this->address = address;
+            this->timeOutHandler = {}; // connected once the other side says hello
+        }
+
+        Client::Client(const char* ip, unsigned short port)
+            : ip(ip), port(port), msgBudget(0), msgTimeBudget(0), isConnected(false), isConnecting(false), server(nullptr),
+            receiveRing(DefaultReceiveRing, MaxFrame), recvSize(DefaultRecvSize), throttled(false), link(Link::Connecting), helloSize(0),
+            assembled(0), assembling(false), maxMessage(DefaultMaxMessage), sendQueued(0), sendLimit(DefaultSendLimit), coalesce(true)
+        {
+            this->index = -1;
+            this->timeOutHandler = {};
+
+            Socket::_InitWinsock();
+
+            // socket()
+            handle = socket(AF_INET, SOCK_STREAM, NULL);
+            if (handle == INVALID_SOCKET)
+            {
+                std::string msg = GetLastWinsockErrorMessage(WSAGetLastError());
+                throw viva::Error("socket", msg.c_str());
+            }
+            id = (size_t)handle;
+
+            // sockaddr_in
+            SecureZeroMemory(&address, sizeof(address));
+            address.sin_family = AF_INET;
+            inet_pton(AF_INET, ip, &(address.sin_addr));
+            address.sin_port = htons(port);
+        }
+
+        void Client::OnConnect(const std::function<void()>& handler)
+        {
+            this->onConnectHandler = handler;
+        }
+
+        void Client::OnMsg(const std::function<void(const vector<byte>&)>& handler)
+        {
+            this->onMsgHandler = handler;
+        }
+
+        void Client::OnMsgSpan(const std::function<void(const MsgSpan&)>& handler)
+        {
+            this->onMsgSpanHandler = handler;
+        }
+
+        void Client::OnMsgBatch(const std::function<void(const vector<MsgSpan>&)>& handler)
+        {
+            this->onMsgBatchHandler = handler;
+        }
+
+        void Client::SetMsgBudget(uint maxCount, double maxSeconds)
+        {
+            this->msgBudget = maxCount;
+            this->msgTimeBudget = maxSeconds;
+        }
+
+        void Client::SetReceiveBuffer(uint ringSize, uint recvSize)
+        {
+            if (this->watched)
+                throw Error(__FUNCTION__, "Client is already receiving");
+
+            this->receiveRing.Resize(ringSize < MinReceiveRing ? MinReceiveRing : ringSize);
+            this->recvSize = recvSize > 0 ? recvSize : DefaultRecvSize;
+        }
+
+        void Client::_Activity()
+        {
+            this->_ProcessMsg();
+        }
+
+        // Event loop thread.
+        void Client::_OnPoll(const PollEvent& e)
+        {
+            if (this->link == Link::Connecting)
+            {
+                if (!e.write && !e.error && !e.read)
+                    return;
+
+                // connect() finished, see how it went
+                int code = 0;
+                socklen_t size = sizeof(code);
+                ::getsockopt(e.handle, SOL_SOCKET, SO_ERROR, (char*)&code, &size);
+
+                if (code != 0 || !e.write)
+                {
+                    networkManager->_Drop(this, e.handle, NetCompletionType::Failed, code != 0 ? code : WSAECONNREFUSED);
+                    return;
+                }
+
+                // welcome protocol, both sides say hello, send buffer of a new socket always has room
+                byte hello[HelloSize];
+                WriteHello(hello);
+                if (::send(e.handle, (const char*)hello, HelloSize, MSG_NOSIGNAL) != HelloSize)
+                {
+                    networkManager->_Drop(this, e.handle, NetCompletionType::Failed, WSAECONNRESET);
+                    return;
+                }
+
+                this->link = Link::Welcome;
+                networkManager->_Watch(this, e.handle, true, false);
+                return;
+            }
+
+            if (this->link == Link::Welcome)
+            {
+                // welcome protocol
+                int len = ::recv(e.handle, (char*)this->hello + this->helloSize, HelloSize - this->helloSize, 0);
+
+                if (len == SOCKET_ERROR)
+                {
+                    int code = ::WSAGetLastError();
+                    if (code != WSAEWOULDBLOCK)
+                        networkManager->_Drop(this, e.handle, NetCompletionType::Failed, code);
+                    return;
+                }
+
+                if (len == 0)
+                {
+                    networkManager->_Drop(this, e.handle, NetCompletionType::Failed, WSAECONNRESET);
+                    return;
+                }
+
+                this->helloSize += len;
+                if (this->helloSize < HelloSize)
+                    return;
+
+                int code = CheckHello(this->hello);
+                if (code != 0)
+                {
+                    networkManager->_Drop(this, e.handle, NetCompletionType::Failed, code);
+                    return;
+                }
+
+                this->link = Link::Open;
+                NetCompletion c = { NetCompletionType::Connected, this, e.handle, {}, this->loopGeneration, 0 };
+                networkManager->_Complete(c);
+
+                // receive ring is allocated by the first message, an idle connection doesn't need it.
+                // Poll reports the socket again if bytes after the hello are waiting.
+                return;
+            }
+
+            this->_Receive(e.handle);
+        }
+
+        // Event loop thread. Read until socket is empty or ring is full.
+        void Client::_Receive(SOCKET handle)
+        {
+            for (uint i = 0; i < RecvPerPoll; i++)
+            {
+                size_t size;
+                byte* dst = this->receiveRing.GetWriteSpan(size);
+
+                // main thread is behind, stop reading until it catches up, tcp will slow down sender
+                if (size == 0)
+                {
+                    this->throttled = true;
+                    networkManager->_Watch(this, handle, false, false);
+                    return;
+                }
+
+                if (size > this->recvSize)
+                    size = this->recvSize;
+
+                int len = ::recv(handle, (char*)dst, (int)size, 0);
+
+                if (len == SOCKET_ERROR)
+                {
+                    int code = ::WSAGetLastError();
+                    if (code != WSAEWOULDBLOCK)
+                        networkManager->_Drop(this, handle, NetCompletionType::Failed, code);
+                    return;
+                }
+
+                // connection closed
+                if (len == 0)
+                {
+                    networkManager->_Drop(this, handle, NetCompletionType::Closed, 0);
+                    return;
+                }
+
+                this->receiveRing.CommitWrite(len);
+
+                // socket is empty
+                if ((size_t)len < size)
+                    return;
+            }
+        }
+
+        void Client::_OnCompletion(const NetCompletion& c)
+        {
+            // about a handle that was replaced already
+            if (c.generation != this->generation)
+                return;
+
+            if (c.type == NetCompletionType::Connected)
+            {
+                routineManager->RemoveRoutine(this->timeOutHandler);
+                this->isConnecting = false;
+                this->isConnected = true;
+
+                // accepted client said hello, server can announce it now
+                if (this->server != nullptr)
+                    this->server->_OnClientWelcomed(this);
+
+                if (this->onConnectHandler)
+                    this->onConnectHandler();
+                return;
+            }
+
+            if (c.type == NetCompletionType::Failed)
+            {
+                NetworkError err = { GetErrorMessage(c.code), c.code };
+                this->_AddError(err);
+            }
+
+            // event loop closed the handle
+            this->_Closed();
+        }
+
+        void Client::_Closed()
+        {
+            routineManager->RemoveRoutine(this->timeOutHandler);
+            this->_ClearSend();
+            this->assembling = false;
+            this->isConnecting = false;
+            this->isConnected = false;
+            this->watched = false;
+
+            if (this->server != nullptr)
+            {
+                // event loop closed it and accepted client never gets another one
+                this->handle = INVALID_SOCKET;
+                this->server->_OnClientClosed(this);
+            }
+            else
+                this->_ResetHandle();
+        }
+
+        void Client::_Disconnect(int code)
+        {
+            NetCommand abort = { NetCommandType::Abort, this, this->handle, this->generation, false, false };
+            networkManager->_Post(abort);
+
+            NetworkError err = { GetErrorMessage(code), code };
+            this->_AddError(err);
+            this->_Closed();
+        }
+
+        // Deliver complete messages that are in the ring until there are none or budget runs out.
+        // Ring is given back to event loop only after the batch so all spans stay valid.
+        // At most one message wraps around the end of the ring so slack is enough for the batch.
+        // Single frame messages point into the ring. Chunks are copied once, straight to their place
+        // in the assembly buffer which is sized by the first chunk.
+        void Client::_ProcessMsg()
+        {
+            using clock = std::chrono::steady_clock;
+            clock::time_point deadline = clock::now() + std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>(this->msgTimeBudget));
+            size_t available = this->receiveRing.GetReadSize();
+            size_t consumed = 0;
+            uint count = 0;
+            bool assembledInBatch = false;
+
+            this->batch.clear();
+
+            while (available > consumed)
+            {
+                if (this->msgBudget > 0 && count == this->msgBudget)
+                    break;
+
+                // clock is not free, check it every 16 messages
+                if (this->msgTimeBudget > 0 && (count & 15) == 15 && clock::now() > deadline)
+                    break;
+
+                size_t peek = available - consumed < MaxHeader ? available - consumed : MaxHeader;
+                const byte* header = this->receiveRing.Peek(consumed, peek);
+                unsigned long long value, total = 0;
+
+                int headerSize = ReadVarint(header, peek, value);
+                if (headerSize == 0)
+                    break;
+
+                uint flags = (uint)(value & 3);
+                unsigned long long size = value >> 2;
+                bool first = (flags & FrameContinue) == 0;
+                bool chunked = flags != 0;
+
+                if (headerSize > 0 && first && chunked)
+                {
+                    int used = ReadVarint(header + headerSize, peek - headerSize, total);
+                    if (used == 0)
+                        break;
+                    headerSize = used < 0 ? -1 : headerSize + used;
+                }
+
+                if (headerSize < 0 || size > MaxChunk)
+                {
+                    this->_Disconnect(ErrorProtocol);
+                    return;
+                }
+
+                if (available - consumed < headerSize + size)
+                    break;
+
+                // finished big message in the batch still uses the assembly buffer
+                if (first && chunked && assembledInBatch)
+                    break;
+
+                const byte* payload = this->receiveRing.Peek(consumed + headerSize, (size_t)size);
+                consumed += headerSize + (size_t)size;
+
+                MsgSpan span = { payload, (uint)size };
+
+                if (chunked)
+                {
+                    if (first)
+                    {
+                        if (total > this->maxMessage)
+                        {
+                            this->_Disconnect(ErrorTooBig);
+                            return;
+                        }
+
+                        this->assembly.resize((size_t)total);
+                        this->assembled = 0;
+                        this->assembling = true;
+                    }
+
+                    if (!this->assembling || this->assembled + size > this->assembly.size())
+                    {
+                        this->_Disconnect(ErrorProtocol);
+                        return;
+                    }
+
+                    memcpy(this->assembly.data() + this->assembled, payload, (size_t)size);
+                    this->assembled += (size_t)size;
+
+                    if (flags & FrameMore)
+                        continue;
+
+                    if (this->assembled != this->assembly.size())
+                    {
+                        this->_Disconnect(ErrorProtocol);
+                        return;
+                    }
+
+                    this->assembling = false;
+                    assembledInBatch = true;
+                    span = { this->assembly.data(), (uint)this->assembly.size() };
+                }
+
+                if (this->onMsgSpanHandler)
+                    this->onMsgSpanHandler(span);
+
+                if (this->onMsgHandler)
+                    this->onMsgHandler(vector<byte>(span.data, span.data + span.size));
+
+                if (this->onMsgBatchHandler)
+                    this->batch.push_back(span);
+
+                count++;
+            }
+
+            if (this->batch.size() > 0)
+                this->onMsgBatchHandler(this->batch);
+
+            this->receiveRing.CommitRead(consumed);
+
+            // event loop stopped reading when ring was full, there is room now
+            if (this->throttled && this->receiveRing.GetReadSize() < this->receiveRing.GetCapacity())
+            {
+                this->throttled = false;
+                NetCommand cmd = { NetCommandType::Modify, this, this->handle, this->generation, true, false };
+                networkManager->_Post(cmd);
+            }
+        }
+
+        void Client::_SetConnected(bool val)
+        {
+            this->isConnected = val;
+        }
+
+        void Client::_SetServer(Server* server)
+        {
+            this->server = server;
+        }
+
+        const char* Client::GetIp() const
+        {
+            return this->ip.c_str();
+        }
+
+        bool Client::IsConnected() const
+        {
+            return this->isConnected;
+        }
+
+        bool Client::Send(vector<byte>& msg)
+        {
+            return this->Send(msg.data(), (uint)msg.size());
+        }
+
+        void Client::_ResetHandle()
+        {
+            this->handle = ::socket(AF_INET, SOCK_STREAM, NULL);
+            this->id = (size_t)this->handle;
+            this->generation++;
+            this->watched = false;
+            this->isConnecting = false;
+        }
+
+        void Client::Connect(double timeoutSeconds)
+        {
+            if (this->isConnected || this->isConnecting)
+                throw Error(__FUNCTION__, "Client is already running");
+
+            this->receiveRing.Clear();
+            this->throttled = false;
+            this->link = Link::Connecting;
+            this->helloSize = 0;
+
+            Socket::_SetNonBlocking(this->handle);
+            Socket::_SetNoDelay(this->handle);
+
+            // non-blocking connect() returns right away, event loop sees when it is done
+            if (::connect(this->handle, (sockaddr*)&this->address, sizeof(sockaddr_in)) == SOCKET_ERROR)
+            {
+                int code = ::WSAGetLastError();
+                if (code != WSAEWOULDBLOCK && code != WSAEINPROGRESS) // winsock says would block, posix in progress
+                {
+                    NetworkError err = { GetLastWinsockErrorMessage(code), code };
+                    this->_AddError(err);
+                    ::closesocket(this->handle);
+                    this->_ResetHandle();
+                    return;
+                }
+            }
+
+            this->isConnecting = true;
+            this->watched = true;
+            NetCommand cmd = { NetCommandType::Add, this, this->handle, this->generation, false, true };
+            networkManager->_Post(cmd);
+
+            Routine* timeOutRoutine = routineManager->AddRoutine([this]()
+            {
+                if (this->isConnecting)
+                {
+                    // event loop closes the handle, stale completions are dropped by generation
+                    NetCommand abort = { NetCommandType::Abort, this, this->handle, this->generation, false, false };
+                    networkManager->_Post(abort);
+                    this->_ResetHandle();
+
+                    ::WSASetLastError(WSAETIMEDOUT);
+                    std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
+                    NetworkError err = { msg, WSAETIMEDOUT };
+                    this->_AddError(err);
+                }
+
+                return 0;
+            }, 0, timeoutSeconds, 0, 0);
+            this->timeOutHandler = routineManager->GetHandle(timeOutRoutine);
+        }
+
+        bool Client::Send(byte* msg, uint len)
+        {
+            if (this->_IsSendFull())
+                return false;
+
+            this->_QueueMessage(msg, len, true);
+            this->_AfterQueue();
+            return true;
+        }
+
+        bool Client::SendRef(const byte* msg, uint len)
+        {
+            if (this->_IsSendFull())
+                return false;
+
+            this->_QueueMessage(msg, len, false);
+            this->_AfterQueue();
+            return true;
+        }
+
+        void Client::SetMaxMessageSize(uint bytes)
+        {
+            this->maxMessage = bytes;
+        }
+
+        void Client::_QueueMessage(const byte* msg, uint len, bool copy)
+        {
+            if (len > this->maxMessage)
+                throw Error(__FUNCTION__, "Message is bigger than max message size");
+
+            uint offset = 0;
+
+            // empty message is one empty frame
+            do
+            {
+                uint size = len - offset < MaxChunk ? len - offset : MaxChunk;
+                uint flags = 0;
+                if (len > MaxChunk)
+                    flags = (offset > 0 ? FrameContinue : 0) | (offset + size < len ? FrameMore : 0);
+
+                byte header[MaxHeader];
+                uint headerSize = WriteVarint(header, ((unsigned long long)size << 2) | flags);
+                if (flags == FrameMore)
+                    headerSize += WriteVarint(header + headerSize, len);
+
+                this->_QueueCopy(header, headerSize);
+
+                if (copy)
+                {
+                    this->_QueueCopy(msg + offset, size);
+                }
+                else if (size > 0)
+                {
+                    SendSlice slice = { msg + offset, 0, size };
+                    this->sendQueue.push_back(slice);
+                    this->sendQueued += size;
+                }
+
+                offset += size;
+            } while (offset < len);
+        }
+
+        void Client::_QueueCopy(const byte* data, uint size)
+        {
+            size_t offset = this->sendStore.size();
+            this->sendStore.insert(this->sendStore.end(), data, data + size);
+            this->sendQueued += size;
+
+            // bytes right after the last slice make it longer, fewer buffers for WSASend()
+            if (this->sendQueue.size() > 0)
+            {
+                SendSlice& last = this->sendQueue.back();
+                if (last.data == nullptr && last.offset + last.size == offset)
+                {
+                    last.size += size;
+                    return;
+                }
+            }
+
+            SendSlice slice = { nullptr, offset, size };
+            this->sendQueue.push_back(slice);
+        }
+
+        void Client::_AfterQueue()
+        {
+            if (!this->coalesce || this->sendQueued >= this->sendLimit)
+                this->_FlushSend();
+        }
+
+        bool Client::_IsSendFull()
+        {
+            if (this->sendQueued < this->sendLimit)
+                return false;
+
+            // kernel may have room since the last flush, caller decides what to do if it doesn't
+            this->_FlushSend();
+            return this->sendQueued >= this->sendLimit;
+        }
+
+        void Client::_ClearSend()
+        {
+            this->sendQueue.clear();
+            this->sendStore.clear();
+            this->sendQueued = 0;
+        }
+
+        // Gather queued slices into WSASend() calls, header and payload are separate buffers and
+        // nothing is copied. Stops when kernel buffer is full, unsent bytes are copied to sendStore
+        // because referenced messages are valid only until the end of the frame.
+        void Client::_FlushSend()
+        {
+            size_t first = 0; // first slice not sent completely
+            size_t skip = 0; // bytes of the first slice that were sent
+
+            // hello goes first, the rest waits in sendStore until the other side answered
+            bool open = this->isConnected;
+            if (!open && this->sendQueue.size() == 1 && this->sendQueue[0].data == nullptr)
+                return;
+
+            while (open && first < this->sendQueue.size())
+            {
+                size_t batch = 0;
+                this->sendBufs.clear();
+
+                for (size_t i = first; i < this->sendQueue.size() && this->sendBufs.size() < MaxSendBufs; i++)
+                {
+                    const SendSlice& slice = this->sendQueue[i];
+                    const byte* data = slice.data != nullptr ? slice.data : this->sendStore.data() + slice.offset;
+                    size_t offset = i == first ? skip : 0;
+
+                    WSABUF buf;
+                    buf.buf = (char*)data + offset;
+                    buf.len = (ULONG)(slice.size - offset);
+                    this->sendBufs.push_back(buf);
+                    batch += buf.len;
+                }
+
+                DWORD sent = 0;
+                if (::WSASend(this->handle, this->sendBufs.data(), (DWORD)this->sendBufs.size(), &sent, 0, NULL, NULL) == SOCKET_ERROR)
+                {
+                    int code = ::WSAGetLastError();
+
+                    // kernel buffer is full, try again next frame
+                    if (code == WSAEWOULDBLOCK)
+                        break;
+
+                    NetworkError err = { GetLastWinsockErrorMessage(code), code };
+                    this->_AddError(err);
+                    this->_ClearSend();
+                    return;
+                }
+
+                this->sendQueued -= sent;
+
+                size_t left = sent;
+                while (left > 0)
+                {
+                    size_t rest = this->sendQueue[first].size - skip;
+                    if (left < rest)
+                    {
+                        skip += left;
+                        break;
+                    }
+
+                    left -= rest;
+                    skip = 0;
+                    first++;
+                }
+
+                // kernel took only part of it, it's full
+                if (sent < batch)
+                    break;
+            }
+
+            if (first == this->sendQueue.size())
+            {
+                this->sendQueue.clear();
+                this->sendStore.clear();
+                return;
+            }
+
+            this->sendSpare.clear();
+            for (size_t i = first; i < this->sendQueue.size(); i++)
+            {
+                const SendSlice& slice = this->sendQueue[i];
+                const byte* data = slice.data != nullptr ? slice.data : this->sendStore.data() + slice.offset;
+                size_t offset = i == first ? skip : 0;
+                this->sendSpare.insert(this->sendSpare.end(), data + offset, data + slice.size);
+            }
+
+            this->sendStore.swap(this->sendSpare);
+            this->sendQueue.clear();
+            SendSlice slice = { nullptr, 0, (uint)this->sendStore.size() };
+            this->sendQueue.push_back(slice);
+        }
+
+        void Client::_Flush()
+        {
+            if (this->sendQueue.size() > 0)
+                this->_FlushSend();
+        }
+
+        void Client::SetSendCoalescing(bool val)
+        {
+            this->coalesce = val;
+        }
+
+        void Client::SetSendLimit(uint bytes)
+        {
+            this->sendLimit = bytes > MaxFrame ? bytes : MaxFrame;
+        }
+
+        size_t Client::GetSendQueueSize() const
+        {
+            return this->sendQueued;
+        }
+
+        void Client::Disonnect()
+        {
+            // TODO
+            throw Error(__FUNCTION__, "Not implemented");
+        }
+
+        void Client::Destroy()
+        {
+            networkManager->_Remove(this);
+
+            if (this->server != nullptr)
+                this->server->_RemoveClient(this);
+
+            // routine captures this, stale handle is fine
+            routineManager->RemoveRoutine(this->timeOutHandler);
+
+            // whatever kernel takes right now
+            if (this->isConnected)
+                this->_Flush();
+
+            // event loop closes the socket and gives it back to be deleted
+            networkManager->_Release(this);
+        }
+    }
+}
+#pragma endregion
+
+/*@// Server *****************************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        class Server : public net::Socket
+        {
+        protected:
+            static const uint AcceptPerPoll = 64; // accept() calls per event
+            static constexpr double HelloTimeout = 10; // seconds accepted client has to say hello
+
+            struct Welcoming
+            {
+                Client* client;
+                std::chrono::steady_clock::time_point deadline;
+            };
+
+            unsigned short port;
+            std::function<void(Client* c)> onConnectHandler;
+            std::function<void(Client* c)> onDisconnectHandler;
+            std::deque<Welcoming> welcoming; // accepted clients wait here for hello of the other side, oldest first
+            std::deque<Client*> clients; // clients that said hello wait here until OnConnect
+            vector<Client*> ackedClients; // main thread grabs clients from queue, calls onconnect callback and moves from queue to vector
+            uint acceptBudget; // 0 is no limit
+            bool isRunning;
+
+        public:
+            Server(unsigned short port);
+
+            void OnConnect(const std::function<void(Client* c)>& handler);
+
+            void OnDisconnect(const std::function<void(Client* c)>& handler);
+
+            const vector<Client*>& GetClients() const;
+
+            // Limit how many new clients are handed to OnConnect every frame, the rest waits for
+            // the next frame. 0 means no limit which is default.
+            // maxCount: max clients per frame
+            void SetAcceptBudget(uint maxCount);
+
+            void _RemoveClient(Client* client);
+
+            void _OnClientClosed(Client* client);
+
+            // Accepted client said a valid hello, it waits for OnConnect now.
+            void _OnClientWelcomed(Client* client);
+
+            void _Activity() override;
+
+            void _OnPoll(const PollEvent& e) override;
+
+            void _OnCompletion(const NetCompletion& c) override;
+
+            void Start(int backlog);
+
+            void Stop();
+
+            void Destroy() override;
+        };
+    }
+}
+
+#pragma region code
+namespace viva
+{
+    namespace net
+    {
+        Server::Server(unsigned short port)
+            : port(port), acceptBudget(0), isRunning(false)
+        {
+            this->index = -1;
+
+            Socket::_InitWinsock();
+
+            // socket()
+            ::SecureZeroMemory(&address, sizeof(address));
+            this->handle = ::socket(AF_INET, SOCK_STREAM, NULL);
+            if (this->handle == INVALID_SOCKET)
+            {
+                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
+                throw viva::Error("socket", msg.c_str());
+            }
+            this->id = (size_t)this->handle;
+
+            // sockaddr
+            address.sin_port = ::htons(port);
+            address.sin_addr.s_addr = ::htonl(INADDR_ANY);
+            address.sin_family = AF_INET;
+            sockaddr* paddress = (sockaddr*)&address;
+
+#ifndef _WIN32
+            // bind while connections of the previous run are in TIME_WAIT,
+            // on windows this would let another socket take the port
+            int one = 1;
+            ::setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+#endif
+
+            // bind()
+            if (::bind((SOCKET)handle, paddress, (int)sizeof(sockaddr)) == SOCKET_ERROR)
+            {
+                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
+                throw viva::Error("bind", msg.c_str());
+            }
+        }
+
+        void Server::OnConnect(const std::function<void(Client* c)>& handler)
+        {
+            this->onConnectHandler = handler;
+        }
+
+        void Server::OnDisconnect(const std::function<void(Client* c)>& handler)
+        {
+            this->onDisconnectHandler = handler;
+        }
+
+        const vector<Client*>& Server::GetClients() const
+        {
+            return this->ackedClients;
+        }
+
+        void Server::SetAcceptBudget(uint maxCount)
+        {
+            this->acceptBudget = maxCount;
+        }
+
+        void Server::_RemoveClient(Client* client)
+        {
+            auto it = std::find(this->ackedClients.begin(), this->ackedClients.end(), client);
+            if (it != this->ackedClients.end())
+            {
+                this->ackedClients.erase(it);
+                return;
+            }
+
+            auto queued = std::find(this->clients.begin(), this->clients.end(), client);
+            if (queued != this->clients.end())
+            {
+                this->clients.erase(queued);
+                return;
+            }
+
+            for (auto it = this->welcoming.begin(); it != this->welcoming.end(); ++it)
+            {
+                if (it->client == client)
+                {
+                    this->welcoming.erase(it);
+                    return;
+                }
+            }
+        }
+
+        void Server::_OnClientClosed(Client* client)
+        {
+            // never announced, bad hello or closed while waiting, nobody else knows about it
+            if (client->_GetIndex() < 0)
+            {
+                client->Destroy();
+                return;
+            }
+
+            if (this->onDisconnectHandler)
+                this->onDisconnectHandler(client);
+        }
+
+        void Server::_OnClientWelcomed(Client* client)
+        {
+            for (auto it = this->welcoming.begin(); it != this->welcoming.end(); ++it)
+            {
+                if (it->client == client)
+                {
+                    this->welcoming.erase(it);
+                    this->clients.push_back(client);
+                    return;
+                }
+            }
+        }
+
+        void Server::_Activity()
+        {
+            // other side never said hello, Destroy() takes it out of the queue
+            auto now = std::chrono::steady_clock::now();
+            while (this->welcoming.size() > 0 && this->welcoming.front().deadline <= now)
+                this->welcoming.front().client->Destroy();
+
+            // clients that said hello are queued already, hand some of them to OnConnect
+            size_t count = this->clients.size();
+            if (this->acceptBudget > 0 && count > this->acceptBudget)
+                count = this->acceptBudget;
+            size_t first = this->ackedClients.size();
+            for (size_t i = 0; i < count; i++)
+            {
+                Client* client = this->clients.front();
+                this->clients.pop_front();
+                this->ackedClients.push_back(client);
+                networkManager->_Add(client);
+            }
+
+            if (this->onConnectHandler)
+            {
+                for (size_t i = first; i < first + count; i++)
+                    this->onConnectHandler(this->ackedClients[i]);
+            }
+        }
+
+        // Event loop thread.
+        void Server::_OnPoll(const PollEvent& e)
+        {
+            for (uint i = 0; i < AcceptPerPoll; i++)
+            {
+                socklen_t size = sizeof(sockaddr_in);
+                sockaddr_in address;
+                SOCKET acceptedSocket = ::accept(e.handle, (sockaddr*)(&address), &size);
+
+                if (acceptedSocket == INVALID_SOCKET)
+                {
+                    int code = ::WSAGetLastError();
+
+                    // peer gave up before it was accepted, next one
+                    if (code == WSAECONNRESET)
+                        continue;
+
+                    if (code != WSAEWOULDBLOCK)
+                    {
+                        NetCompletion c = { NetCompletionType::Failed, this, e.handle, {}, this->loopGeneration, code };
+                        networkManager->_Complete(c);
+                    }
+                    return;
+                }
+
+                Socket::_SetNonBlocking(acceptedSocket);
+                Socket::_SetNoDelay(acceptedSocket);
+
+                // welcome protocol, send buffer of a new socket always has room for it
+                byte hello[HelloSize];
+                WriteHello(hello);
+                if (::send(acceptedSocket, (const char*)hello, HelloSize, MSG_NOSIGNAL) != HelloSize)
+                {
+                    ::closesocket(acceptedSocket);
+                    continue;
+                }
+
+                NetCompletion c = { NetCompletionType::Accepted, this, acceptedSocket, address, this->loopGeneration, 0 };
+                networkManager->_Complete(c);
+            }
+        }
+
+        void Server::_OnCompletion(const NetCompletion& c)
+        {
+            if (c.type == NetCompletionType::Accepted)
+            {
+                // receive right away, OnConnect comes after hello and when accept budget allows
+                Client* client = new Client(c.handle, c.address, "", 0);
+                client->_SetServer(this);
+                client->_SetWatched(true);
+                NetCommand cmd = { NetCommandType::Add, client, c.handle, client->_GetGeneration(), true, false };
+                networkManager->_Post(cmd);
+
+                auto timeout = std::chrono::duration<double>(HelloTimeout);
+                Welcoming w = { client, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout) };
+                this->welcoming.push_back(w);
+            }
+            else if (c.type == NetCompletionType::Failed)
+            {
+                NetworkError err = { GetErrorMessage(c.code), c.code };
+                this->_AddError(err);
+            }
+        }
+
+        void Server::Start(int backlog)
+        {
+            if (this->isRunning)
+                throw viva::Error(__FUNCTION__, "Server already running");
+
+            // listen()
+            if (::listen(handle, backlog) == SOCKET_ERROR)
+            {
+                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
+                throw viva::Error("listen", msg.c_str());
+            }
+
+            Socket::_SetNonBlocking(this->handle);
+            this->isRunning = true;
+            this->watched = true;
+
+            NetCommand cmd = { NetCommandType::Add, this, this->handle, this->generation, true, false };
+            networkManager->_Post(cmd);
+        }
+
+        void Server::Stop()
+        {
+            // TODO
+            throw Error(__FUNCTION__, "Not implemented");
+        }
+
+        void Server::Destroy()
+        {
+            networkManager->_Remove(this);
+
+            // Destroy() removes client from the vector
+            while (this->ackedClients.size() > 0)
+                this->ackedClients.back()->Destroy();
+
+            while (this->clients.size() > 0)
+                this->clients.back()->Destroy();
+
+            while (this->welcoming.size() > 0)
+                this->welcoming.back().client->Destroy();
+
+            // event loop closes the socket and gives it back to be deleted
+            networkManager->_Release(this);
+        }
+    }
+}
+#pragma endregion
+
+/*@// UdpPeer ******************************************************************************************************@*/
+namespace viva
+{
+    namespace net
+    {
+        // Datagrams stay under common MTU with ip and udp headers.
+        const uint UdpMaxPacket = 1200;
+
+        // Biggest message that fits in one packet, big data goes over tcp.
+        const uint UdpMaxMessage = 1024;
+
+        // How a udp message gets to the other side.
+        enum class Delivery : byte
+        {
+            // might be lost, duplicates are dropped
+            Unreliable,
+            // might be lost, never older than what was delivered already
+            Sequenced,
+            // resent until acked, delivered in order
+            Reliable
+        };
+
+        // One remote address of a udp socket. Messages queued with Send() are coalesced into
+        // packets at the end of the frame. Every packet carries acks for the last 33 packets
+        // from the other side, reliable messages are resent until a packet that had them is acked.
+        //
+        // Packet: 'V', flags, u16 sequence, u16 ack, u32 ack bits, then messages, all little endian.
+        // Message: byte delivery, u16 channel sequence if not unreliable, varint size, payload.
+        class UdpPeer
+        {
+        private:
+            static const uint PacketHeader = 10;
+            static const byte PacketHasAck = 1; // ack and ack bits are valid
+            static const uint SentHistory = 1024; // packets remembered for acks
+            static const uint ReliableWindow = 1024; // reliable messages in flight
+            static constexpr double MinResend = 0.02; // seconds
+
+            struct SentPacket
+            {
+                unsigned short seq;
+                bool used;
+                bool acked;
+                double time;
+                vector<unsigned short> reliable; // reliable messages in the packet, keeps capacity
+            };
+
+            // encoded message waiting for an ack
+            struct ReliableMsg
+            {
+                unsigned short seq;
+                bool acked;
+                bool sent;
+                double lastSent;
+                vector<byte> record;
+            };
+
+            SOCKET handle; // of the udp socket, shared by all its peers
+            sockaddr_in address;
+            std::function<void(const MsgSpan&, Delivery)> onMsgHandler;
+
+            // sending
+            unsigned short nextPacket;
+            unsigned short nextSequenced;
+            unsigned short nextReliable;
+            vector<byte> outStore; // encoded unreliable and sequenced messages of this frame
+            vector<uint> outSizes;
+            std::deque<ReliableMsg> reliableOut; // ordered by seq, front is the oldest not acked
+            vector<SentPacket> sent; // ring by packet sequence
+            vector<byte> packet; // packet being built
+            uint packetMessages;
+            bool ackPending; // received something that was not acked yet
+
+            // receiving
+            bool anyReceived;
+            unsigned short remotePacket; // newest packet from the other side
+            uint receivedBits; // bit i is packet remotePacket - 1 - i
+            bool anySequenced;
+            unsigned short lastSequenced;
+            unsigned short expectedReliable;
+            std::map<unsigned short, vector<byte>> earlyReliable; // came before the ones in front of them
+
+            // stats
+            double rtt; // smoothed, seconds
+            double rttVar;
+            uint packetsSent;
+            uint packetsReceived;
+            uint resent;
+
+            static bool _SeqGreater(unsigned short a, unsigned short b);
+
+            void _StartPacket();
+
+            void _SendPacket(double now);
+
+            // Append encoded message to the packet, send the packet first if it's full.
+            void _Pack(const byte* record, uint size, double now);
+
+            void _OnAck(unsigned short seq, double now);
+
+            void _Deliver(const byte* data, uint size, Delivery delivery);
+        public:
+            UdpPeer(SOCKET handle, const sockaddr_in& address);
+
+            // Queue message, it goes out with other messages at the end of the frame.
+            // len: at most UdpMaxMessage
+            void Send(const byte* msg, uint len, Delivery delivery);
+
+            // Message points into the receive buffer and is valid only inside the handler.
+            void OnMsg(const std::function<void(const MsgSpan&, Delivery)>& handler);
+
+            // Smoothed round trip time in seconds, 0 before the first ack.
+            double GetRtt() const;
+
+            uint GetPacketsSent() const;
+
+            uint GetPacketsReceived() const;
+
+            // Reliable messages sent again because they were not acked in time.
+            uint GetResent() const;
+
+            const sockaddr_in& _GetAddress() const;
+
+            void _OnPacket(const byte* data, uint size, double now);
+
+            // Send queued messages and resends that are due.
+            void _Flush(double now);
+        };
+    }
+}
+
+#pragma region code
+namespace viva
+{
+    namespace net
+    {
+        UdpPeer::UdpPeer(SOCKET handle, const sockaddr_in& address)
+            : handle(handle), address(address), nextPacket(0), nextSequenced(0), nextReliable(0), packetMessages(0),
+            ackPending(false), anyReceived(false), remotePacket(0), receivedBits(0), anySequenced(false), lastSequenced(0),
+            expectedReliable(0), rtt(0), rttVar(0), packetsSent(0), packetsReceived(0), resent(0)
+        {
+            this->sent.resize(SentHistory);
+            for (uint i = 0; i < SentHistory; i++)
+                this->sent[i].used = false;
+        }
+
+        bool UdpPeer::_SeqGreater(unsigned short a, unsigned short b)
+        {
+            // works across wrap around as long as they are less than 32768 apart
+            return (short)(a - b) > 0;
+        }
+
+        void UdpPeer::Send(const byte* msg, uint len, Delivery delivery)
+        {
+            if (len > UdpMaxMessage)
+                throw Error(__FUNCTION__, "Message doesn't fit in a packet");
+
+            byte header[3 + MaxVarint];
+            uint headerSize = 1;
+            header[0] = (byte)delivery;
+
+            unsigned short seq = 0;
+            if (delivery == Delivery::Sequenced)
+                seq = this->nextSequenced++;
+            else if (delivery == Delivery::Reliable)
+                seq = this->nextReliable++;
+
+            if (delivery != Delivery::Unreliable)
+            {
+                header[1] = (byte)(seq & 0xff);
+                header[2] = (byte)(seq >> 8);
+                headerSize = 3;
+            }
+
+            headerSize += WriteVarint(header + headerSize, len);
+
+            if (delivery == Delivery::Reliable)
+            {
+                this->reliableOut.emplace_back();
+                ReliableMsg& r = this->reliableOut.back();
+                r.seq = seq;
+                r.acked = false;
+                r.sent = false;
+                r.lastSent = 0;
+                r.record.assign(header, header + headerSize);
+                r.record.insert(r.record.end(), msg, msg + len);
+                return;
+            }
+
+            this->outStore.insert(this->outStore.end(), header, header + headerSize);
+            this->outStore.insert(this->outStore.end(), msg, msg + len);
+            this->outSizes.push_back(headerSize + len);
+        }
+
+        void UdpPeer::OnMsg(const std::function<void(const MsgSpan&, Delivery)>& handler)
+        {
+            this->onMsgHandler = handler;
+        }
+
+        double UdpPeer::GetRtt() const
+        {
+            return this->rtt;
+        }
+
+        uint UdpPeer::GetPacketsSent() const
+        {
+            return this->packetsSent;
+        }
+
+        uint UdpPeer::GetPacketsReceived() const
+        {
+            return this->packetsReceived;
         }
-        case WM_CLOSE:
+
+        uint UdpPeer::GetResent() const
         {
-            ShowWindow(hwnd, false);
+            return this->resent;
+        }
 
-            if (wParam == 0)
-                PostQuitMessage((int)CloseReason::WindowClose);
-            else if (wParam == (int)CloseReason::EngineClose)
-                PostQuitMessage((int)CloseReason::EngineClose);
+        const sockaddr_in& UdpPeer::_GetAddress() const
+        {
+            return this->address;
+        }
 
-            break;
+        void UdpPeer::_StartPacket()
+        {
+            unsigned short seq = this->nextPacket;
+            unsigned short ack = this->remotePacket;
+            uint bits = this->receivedBits;
+
+            this->packet.resize(PacketHeader);
+            byte* p = this->packet.data();
+            p[0] = 'V';
+            p[1] = this->anyReceived ? PacketHasAck : 0;
+            p[2] = (byte)(seq & 0xff);
+            p[3] = (byte)(seq >> 8);
+            p[4] = (byte)(ack & 0xff);
+            p[5] = (byte)(ack >> 8);
+            p[6] = (byte)(bits & 0xff);
+            p[7] = (byte)((bits >> 8) & 0xff);
+            p[8] = (byte)((bits >> 16) & 0xff);
+            p[9] = (byte)(bits >> 24);
+            this->packetMessages = 0;
+
+            SentPacket& record = this->sent[seq % SentHistory];
+            record.seq = seq;
+            record.used = false;
+            record.acked = false;
+            record.reliable.clear();
         }
-        case WM_COMMAND:
-            break;
-        case WM_MOUSEWHEEL:
+
+        void UdpPeer::_SendPacket(double now)
         {
-            if (mouse != nullptr)
-                mouse->_SetMouseWheel(GET_WHEEL_DELTA_WPARAM(wParam));
+            SentPacket& record = this->sent[this->nextPacket % SentHistory];
+            record.used = true;
+            record.time = now;
 
-            break;
+            // udp never blocks for long, full kernel buffer is packet loss and reliable ones are resent
+            ::sendto(this->handle, (const char*)this->packet.data(), (int)this->packet.size(), 0,
+                (const sockaddr*)&this->address, sizeof(this->address));
+
+            this->nextPacket++;
+            this->packetsSent++;
+            this->ackPending = false;
+            this->_StartPacket();
         }
-        case WM_INPUT:
+
+        void UdpPeer::_Pack(const byte* record, uint size, double now)
         {
-            UINT dwSize = 48; // 48 for 64bit build
-            static BYTE lpb[48];
+            if (this->packet.size() + size > UdpMaxPacket)
+                this->_SendPacket(now);
 
-            GetRawInputData((HRAWINPUT)lParam, RID_INPUT,
-                lpb, &dwSize, sizeof(RAWINPUTHEADER)); // this gets relative coords
+            this->packet.insert(this->packet.end(), record, record + size);
+            this->packetMessages++;
+        }
 
-            RAWINPUT* raw = (RAWINPUT*)lpb;
+        void UdpPeer::_Flush(double now)
+        {
+            this->_StartPacket();
 
-            if (raw->header.dwType == RIM_TYPEMOUSE)
+            // resend timeout like tcp, srtt + 4 * rttvar, before first ack assume 100ms
+            double resend = this->rtt > 0 ? this->rtt + 4 * this->rttVar : 0.1;
+            if (resend < MinResend)
+                resend = MinResend;
+
+            size_t window = this->reliableOut.size() < ReliableWindow ? this->reliableOut.size() : ReliableWindow;
+            for (size_t i = 0; i < window; i++)
             {
-                int xPosRelative = raw->data.mouse.lLastX;
-                int yPosRelative = raw->data.mouse.lLastY;
+                ReliableMsg& r = this->reliableOut[i];
+                if (r.acked || (r.sent && now - r.lastSent < resend))
+                    continue;
 
-                if (mouse != nullptr)
-                    mouse->_SetCursorDeltaRaw(xPosRelative, yPosRelative);
+                if (r.sent)
+                    this->resent++;
+
+                this->_Pack(r.record.data(), (uint)r.record.size(), now);
+                this->sent[this->nextPacket % SentHistory].reliable.push_back(r.seq);
+                r.sent = true;
+                r.lastSent = now;
             }
-            break;
-        }
-        default:
-            return DefWindowProc(hwnd, msg, wParam, lParam);
-        }
-        return 0;
-    }
 
-    Window::Window(const char* title, const Size& size)
-    {
-        const char className[] = "myWindowClass";
-        WNDCLASSEX wc;
-        ZeroMemory(&msg, sizeof(msg));
-        ZeroMemory(&wc, sizeof(wc));
-        wc.cbSize = sizeof(WNDCLASSEX);
-        wc.lpfnWndProc = Window::WndProc;
-        wc.hInstance = GetModuleHandle(0);
-        wc.hIcon = LoadIcon(NULL, IDI_APPLICATION);
-        wc.hbrBackground = (HBRUSH)(COLOR_WINDOW);
-        wc.lpszClassName = className;
-        wc.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
+            size_t offset = 0;
+            for (size_t i = 0; i < this->outSizes.size(); i++)
+            {
+                this->_Pack(this->outStore.data() + offset, this->outSizes[i], now);
+                offset += this->outSizes[i];
+            }
 
-        if (!RegisterClassEx(&wc))
-        {
-            throw viva::Error(__FUNCTION__, "Window Class failed to register");
+            this->outStore.clear();
+            this->outSizes.clear();
+
+            // nothing to say but the other side waits for acks
+            if (this->packetMessages > 0 || this->ackPending)
+                this->_SendPacket(now);
         }
 
-        RECT rect = { 0, 0, (int)size.width, (int)size.height };
+        void UdpPeer::_OnAck(unsigned short seq, double now)
+        {
+            SentPacket& record = this->sent[seq % SentHistory];
+            if (!record.used || record.acked || record.seq != seq)
+                return;
 
-        // this is to enforce the correct size of window client
-        ::AdjustWindowRectEx(&rect, WS_OVERLAPPEDWINDOW | WS_CLIPSIBLINGS, FALSE, 0);
+            record.acked = true;
 
-        this->handle = CreateWindowEx(0, className, title, WS_OVERLAPPEDWINDOW,
-            CW_USEDEFAULT, CW_USEDEFAULT, rect.right - rect.left, rect.bottom - rect.top,
-            NULL, NULL, GetModuleHandle(0), NULL);
+            double sample = now - record.time;
+            if (this->rtt == 0)
+            {
+                this->rtt = sample;
+                this->rttVar = sample / 2;
+            }
+            else
+            {
+                double diff = sample > this->rtt ? sample - this->rtt : this->rtt - sample;
+                this->rttVar += 0.25 * (diff - this->rttVar);
+                this->rtt += 0.125 * (sample - this->rtt);
+            }
 
-        USHORT HID_USAGE_PAGE_GENERIC = 1;
-        USHORT HID_USAGE_GENERIC_MOUSE = 2;
+            if (this->reliableOut.empty())
+                return;
 
-        Rid.usUsagePage = HID_USAGE_PAGE_GENERIC;
-        Rid.usUsage = HID_USAGE_GENERIC_MOUSE;
-        Rid.dwFlags = RIDEV_INPUTSINK;
-        Rid.hwndTarget = handle;
-        ::RegisterRawInputDevices(&Rid, 1, sizeof(RAWINPUTDEVICE));
+            // reliable messages are in seq order so position is the distance from the front
+            unsigned short front = this->reliableOut.front().seq;
+            for (unsigned short r : record.reliable)
+            {
+                unsigned short index = r - front;
+                if (index < this->reliableOut.size())
+                    this->reliableOut[index].acked = true;
+            }
 
-        if (handle == NULL)
+            while (!this->reliableOut.empty() && this->reliableOut.front().acked)
+                this->reliableOut.pop_front();
+        }
+
+        void UdpPeer::_Deliver(const byte* data, uint size, Delivery delivery)
         {
-            throw Error(__FUNCTION__, "Window Creation Failed!");
+            MsgSpan span = { data, size };
+            if (this->onMsgHandler)
+                this->onMsgHandler(span, delivery);
         }
-    }
 
-    HWND Window::GetHandle() const
-    {
-        return this->handle;
-    }
+        void UdpPeer::_OnPacket(const byte* data, uint size, double now)
+        {
+            if (size < PacketHeader || data[0] != 'V')
+                return;
 
-    void Window::_Destroy()
-    {
-        ::DestroyWindow(this->handle);
-        ::UnregisterClass("myWindowClass", GetModuleHandle(0));
-        delete this;
-    }
+            unsigned short seq = (unsigned short)(data[2] | (data[3] << 8));
+            unsigned short ack = (unsigned short)(data[4] | (data[5] << 8));
+            uint bits = data[6] | (data[7] << 8) | (data[8] << 16) | ((uint)data[9] << 24);
 
-    void Window::SetWindowTitle(const char* title)
-    {
-        ::SetWindowText(this->handle, title);
-    }
+            // remember what came, duplicates are dropped
+            if (!this->anyReceived || _SeqGreater(seq, this->remotePacket))
+            {
+                unsigned short shift = this->anyReceived ? (unsigned short)(seq - this->remotePacket) : 0;
+                if (shift > 32)
+                    this->receivedBits = 0;
+                else if (shift == 32)
+                    this->receivedBits = 1u << 31;
+                else if (shift > 0)
+                    this->receivedBits = (this->receivedBits << shift) | (1u << (shift - 1));
+                this->remotePacket = seq;
+                this->anyReceived = true;
+            }
+            else
+            {
+                unsigned short distance = this->remotePacket - seq;
+                if (distance == 0 || distance > 32 || (this->receivedBits & (1u << (distance - 1))))
+                    return;
+                this->receivedBits |= 1u << (distance - 1);
+            }
 
-    // start win32 message pump
-    // gameloop: user's function that runs every frame
-    // intloop: engine function that runs every frame
-    CloseReason Window::Run(const std::function<void()>& gameloop, const std::function<void()>& intloop)
-    {
-        ::ShowWindow(handle, SW_SHOW);
-        ::UpdateWindow(handle);
-        this->activity = gameloop;
-        this->worker = intloop;
+            this->packetsReceived++;
+            this->ackPending = true;
 
-        while (true)
-        {
-            if (::PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+            if (data[1] & PacketHasAck)
             {
-                if (msg.message == WM_QUIT)
+                this->_OnAck(ack, now);
+                for (uint i = 0; i < 32; i++)
                 {
-                    CloseReason code = (CloseReason)msg.wParam;
-                    ::ZeroMemory(&msg, sizeof(msg));
-                    return code;
+                    if (bits & (1u << i))
+                        this->_OnAck((unsigned short)(ack - 1 - i), now);
                 }
-                ::TranslateMessage(&msg);
-                ::DispatchMessage(&msg);
             }
-            else
+
+            uint offset = PacketHeader;
+            while (offset < size)
             {
-                this->worker();
-                this->activity();
-            }
-        }
-    }
-}
-#pragma endregion
+                Delivery delivery = (Delivery)data[offset];
+                uint headerSize = delivery == Delivery::Unreliable ? 1 : 3;
+                if (delivery > Delivery::Reliable || offset + headerSize > size)
+                    return;
 
-namespace viva
-{
-    struct VivaParams
-    {
-        const char* title;
-        Size size;
-        Size unit;
-    };
+                unsigned short msgSeq = 0;
+                if (headerSize == 3)
+                    msgSeq = (unsigned short)(data[offset + 1] | (data[offset + 2] << 8));
 
-    // Main viva object. Viva starts and ends here.
-    class Viva
-    {
-    public:
-        // Initialize viva.
-        Viva(VivaParams& params);
+                unsigned long long varint;
+                int used = ReadVarint(data + offset + headerSize, size - offset - headerSize, varint);
+                // compare with what is left, a huge varint must not wrap the sum around
+                if (used <= 0 || varint > UdpMaxMessage || varint > (unsigned long long)(size - offset - headerSize - used))
+                    return;
 
-        // Destructor.
-        ~Viva();
-    };
-}
+                uint len = (uint)varint;
+                const byte* payload = data + offset + headerSize + used;
+                offset += headerSize + used + len;
 
-#pragma region code
-namespace viva
-{
-    Viva::Viva(VivaParams& params)
-    {
-        if (params.unit.width == 0)
-            params.unit = { 32.0f,32.0f };
+                if (delivery == Delivery::Unreliable)
+                {
+                    this->_Deliver(payload, len, delivery);
+                }
+                else if (delivery == Delivery::Sequenced)
+                {
+                    // older than what was delivered already
+                    if (this->anySequenced && !_SeqGreater(msgSeq, this->lastSequenced))
+                        continue;
 
-        window = new Window(params.title, params.size);
-        creator = new Creator();
-        engine = new Engine(params.size);
-        camera = new Camera(params.unit);
-        drawManager = new DrawManager();
-        keyboard = new input::Keyboard();
-        mouse = new input::Mouse();
-        time = new Time();
-        routineManager = new RoutineManager();
-        networkManager = new net::NetworkManager();
-        uiManager = new ui::UIManager();
-    }
+                    this->anySequenced = true;
+                    this->lastSequenced = msgSeq;
+                    this->_Deliver(payload, len, delivery);
+                }
+                else
+                {
+                    // delivered already or too far ahead
+                    unsigned short ahead = msgSeq - this->expectedReliable;
+                    if (ahead >= ReliableWindow)
+                        continue;
 
-    // Destructor.
-    Viva::~Viva()
-    {
-        // in reverse order
-        uiManager->_Destroy();
-        networkManager->_Destroy();
-        routineManager->_Destroy();
-        time->_Destroy();
-        mouse->_Destroy();
-        keyboard->_Destroy();
-        drawManager->_Destroy();
-        camera->_Destroy();
-        engine->_Destroy();
-        creator->_Destroy();
-        window->_Destroy();
+                    if (ahead > 0)
+                    {
+                        if (this->earlyReliable.find(msgSeq) == this->earlyReliable.end())
+                            this->earlyReliable[msgSeq].assign(payload, payload + len);
+                        continue;
+                    }
+
+                    this->_Deliver(payload, len, delivery);
+                    this->expectedReliable++;
+
+                    // the ones that were waiting for it
+                    auto it = this->earlyReliable.find(this->expectedReliable);
+                    while (it != this->earlyReliable.end())
+                    {
+                        this->_Deliver(it->second.data(), (uint)it->second.size(), delivery);
+                        this->earlyReliable.erase(it);
+                        this->expectedReliable++;
+                        it = this->earlyReliable.find(this->expectedReliable);
+                    }
+                }
+            }
+        }
     }
 }
 #pragma endregion
 
-/*@// NetworkError ***********************************************************************************************@*/
+/*@// UdpSocket ****************************************************************************************************@*/
 namespace viva
 {
     namespace net
     {
-        struct NetworkError
+        // Udp socket bound to a port, talks to any number of peers. Event loop receives datagrams
+        // into a ring, main thread routes them to peers by address.
+        class UdpSocket : public net::Socket
         {
-            std::string message;
-            int code;
+        protected:
+            static const uint MaxDatagram = 2048;
+            static const uint RecordHeader = 2 + sizeof(sockaddr_in); // size and sender
+            static const uint ReceiveRing = 1024 * 1024;
+            static const uint RecvPerPoll = 64;
+
+            // simulated late packet
+            struct DelayedPacket
+            {
+                double time;
+                sockaddr_in from;
+                vector<byte> data;
+            };
+
+            unsigned short port;
+            ByteRing receiveRing; // event loop writes records, main thread reads
+            std::unordered_map<unsigned long long, UdpPeer*> peerMap; // address and port to peer
+            vector<UdpPeer*> peers;
+            std::function<void(UdpPeer*)> onPeerHandler;
+            std::atomic<uint> dropped; // ring was full
+            // loss and latency simulator
+            float simLoss;
+            double simLatency;
+            double simJitter;
+            std::mt19937 simRandom;
+            vector<DelayedPacket> delayed;
+
+            static unsigned long long _Key(const sockaddr_in& address);
+
+            static double _Now();
+
+            void _Route(const sockaddr_in& from, const byte* data, uint size, double now);
+        public:
+            // Ctor.
+            // port: 0 picks any free port
+            UdpSocket(unsigned short port);
+
+            // Start talking to address. There is no handshake, peer is ready right away.
+            UdpPeer* Connect(const char* ip, unsigned short port);
+
+            // Packet came from an address that has no peer yet.
+            void OnPeer(const std::function<void(UdpPeer*)>& handler);
+
+            void RemovePeer(UdpPeer* peer);
+
+            const vector<UdpPeer*>& GetPeers() const;
+
+            // Port the socket is bound to.
+            unsigned short GetPort() const;
+
+            // Datagrams dropped because main thread was behind.
+            uint GetDropped() const;
+
+            // Simulate bad network on received packets, for testing over loopback.
+            // loss: 0 to 1, chance a packet is dropped
+            // latency: seconds added to every packet
+            // jitter: random seconds added on top, reorders packets
+            void SetSimulation(float loss, double latency, double jitter);
+
+            void _Activity() override;
+
+            void _Flush() override;
+
+            void _OnPoll(const PollEvent& e) override;
+
+            void _OnCompletion(const NetCompletion& c) override;
+
+            void Destroy() override;
         };
     }
 }
 
-/*@// Base *******************************************************************************************************@*/
+#pragma region code
 namespace viva
 {
     namespace net
     {
-        class Socket
+        UdpSocket::UdpSocket(unsigned short port)
+            : receiveRing(ReceiveRing, RecordHeader + MaxDatagram), dropped(0), simLoss(0), simLatency(0), simJitter(0)
         {
-        protected:
-            int index;
-            size_t id;
-            std::queue<NetworkError> errors;
-            std::mutex errorQueueMutex;
-            std::function<void(const NetworkError& error)> onErrorHandler;
-            Routine* activityRoutine;
-            SOCKET handle;
-            sockaddr_in address;
-            static bool wsInitialized;
-            static WSAData wsadata;
-            static std::string GetLastWinsockErrorMessage(DWORD errorCode);
-        public:
-            void _AddError(const NetworkError& error);
+            Socket::_InitWinsock();
+
+            // socket() and bind(), no listen or connect, any address can send to it
+
+            this->handle = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (this->handle == INVALID_SOCKET)
+            {
+                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
+                throw viva::Error("socket", msg.c_str());
+            }
+            this->id = (size_t)this->handle;
 
-            size_t GetId() const;
+            this->address.sin_family = AF_INET;
+            this->address.sin_addr.s_addr = ::htonl(INADDR_ANY);
+            this->address.sin_port = ::htons(port);
+            socklen_t size = sizeof(this->address);
 
-            void OnError(const std::function<void(const NetworkError& error)>& handler);
+            if (::bind(this->handle, (sockaddr*)&this->address, size) == SOCKET_ERROR ||
+                ::getsockname(this->handle, (sockaddr*)&this->address, &size) == SOCKET_ERROR)
+            {
+                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
+                throw viva::Error("bind", msg.c_str());
+            }
+            this->port = ::ntohs(this->address.sin_port);
 
-            SOCKET _GetSocket() const;
+            Socket::_SetNonBlocking(this->handle);
+            this->watched = true;
+            NetCommand cmd = { NetCommandType::Add, this, this->handle, this->generation, true, false };
+            networkManager->_Post(cmd);
+        }
 
-            sockaddr_in _GetSockAddr() const;
+        unsigned long long UdpSocket::_Key(const sockaddr_in& address)
+        {
+            return ((unsigned long long)address.sin_addr.s_addr << 16) | address.sin_port;
+        }
 
-            virtual void _Activity() = 0;
+        double UdpSocket::_Now()
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
 
-            virtual void Destroy() = 0;
+        UdpPeer* UdpSocket::Connect(const char* ip, unsigned short port)
+        {
+            sockaddr_in address;
+            ::SecureZeroMemory(&address, sizeof(address));
+            address.sin_family = AF_INET;
+            ::inet_pton(AF_INET, ip, &address.sin_addr);
+            address.sin_port = ::htons(port);
 
-            int _GetIndex() const;
+            auto it = this->peerMap.find(_Key(address));
+            if (it != this->peerMap.end())
+                return it->second;
 
-            void _SetIndex(int index);
-        };
-    }
-}
+            UdpPeer* peer = new UdpPeer(this->handle, address);
+            this->peerMap[_Key(address)] = peer;
+            this->peers.push_back(peer);
+            return peer;
+        }
 
-#pragma region code
-namespace viva
-{
-    namespace net
-    {
-        bool Socket::wsInitialized = false;
-        WSAData Socket::wsadata;
+        void UdpSocket::OnPeer(const std::function<void(UdpPeer*)>& handler)
+        {
+            this->onPeerHandler = handler;
+        }
 
-        std::string Socket::GetLastWinsockErrorMessage(DWORD errorCode)
+        void UdpSocket::RemovePeer(UdpPeer* peer)
         {
-            char str[300];
-            SecureZeroMemory(str, sizeof(char) * 300);
-            FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM, 0, errorCode,
-                MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US), str, 300, 0);
-            return std::string(str);
+            this->peerMap.erase(_Key(peer->_GetAddress()));
+            this->peers.erase(std::find(this->peers.begin(), this->peers.end(), peer));
+            delete peer;
         }
 
-        void Socket::_AddError(const NetworkError& error)
+        const vector<UdpPeer*>& UdpSocket::GetPeers() const
         {
-            this->errorQueueMutex.lock();
-            this->errors.push(error);
-            this->errorQueueMutex.unlock();
+            return this->peers;
         }
 
-        size_t Socket::GetId() const
+        unsigned short UdpSocket::GetPort() const
         {
-            return this->id;
+            return this->port;
         }
 
-        void Socket::OnError(const std::function<void(const NetworkError& error)>& handler)
+        uint UdpSocket::GetDropped() const
         {
-            this->onErrorHandler = handler;
+            return this->dropped;
         }
 
-        SOCKET Socket::_GetSocket() const
+        void UdpSocket::SetSimulation(float loss, double latency, double jitter)
         {
-            return this->handle;
+            this->simLoss = loss;
+            this->simLatency = latency;
+            this->simJitter = jitter;
         }
 
-        sockaddr_in Socket::_GetSockAddr() const
+        // Event loop thread.
+        void UdpSocket::_OnPoll(const PollEvent& e)
         {
-            return this->address;
+            byte record[RecordHeader + MaxDatagram];
+
+            for (uint i = 0; i < RecvPerPoll; i++)
+            {
+                sockaddr_in from;
+                socklen_t fromSize = sizeof(from);
+                int len = ::recvfrom(e.handle, (char*)record + RecordHeader, MaxDatagram, 0, (sockaddr*)&from, &fromSize);
+
+                if (len == SOCKET_ERROR)
+                {
+                    int code = ::WSAGetLastError();
+
+                    // too big or icmp port unreachable from an earlier send, udp doesn't care
+                    if (code == WSAEMSGSIZE || code == WSAECONNRESET)
+                        continue;
+                    return;
+                }
+
+                record[0] = (byte)(len & 0xff);
+                record[1] = (byte)(len >> 8);
+                memcpy(record + 2, &from, sizeof(from));
+
+                // main thread is behind, it's udp so drop it
+                if (!this->receiveRing.Write(record, RecordHeader + len))
+                    this->dropped++;
+            }
         }
 
-        int Socket::_GetIndex() const
+        void UdpSocket::_OnCompletion(const NetCompletion& c)
         {
-            return this->index;
+            // nothing to complete, datagrams go through the ring
         }
 
-        void Socket::_SetIndex(int index)
+        void UdpSocket::_Route(const sockaddr_in& from, const byte* data, uint size, double now)
         {
-            this->index = index;
+            UdpPeer* peer;
+            auto it = this->peerMap.find(_Key(from));
+
+            if (it != this->peerMap.end())
+            {
+                peer = it->second;
+            }
+            else
+            {
+                // strangers are ignored unless someone wants them
+                if (!this->onPeerHandler)
+                    return;
+
+                peer = new UdpPeer(this->handle, from);
+                this->peerMap[_Key(from)] = peer;
+                this->peers.push_back(peer);
+                this->onPeerHandler(peer);
+            }
+
+            peer->_OnPacket(data, size, now);
+        }
+
+        void UdpSocket::_Activity()
+        {
+            double now = _Now();
+            size_t available = this->receiveRing.GetReadSize();
+            size_t consumed = 0;
+            std::uniform_real_distribution<double> chance(0, 1);
+
+            while (available - consumed >= RecordHeader)
+            {
+                const byte* header = this->receiveRing.Peek(consumed, RecordHeader);
+                uint size = header[0] | (header[1] << 8);
+                sockaddr_in from;
+                memcpy(&from, header + 2, sizeof(from));
+
+                const byte* data = this->receiveRing.Peek(consumed + RecordHeader, size);
+                consumed += RecordHeader + size;
+
+                if (this->simLoss > 0 && chance(this->simRandom) < this->simLoss)
+                    continue;
+
+                if (this->simLatency > 0 || this->simJitter > 0)
+                {
+                    DelayedPacket p;
+                    p.time = now + this->simLatency + this->simJitter * chance(this->simRandom);
+                    p.from = from;
+                    p.data.assign(data, data + size);
+                    this->delayed.push_back(std::move(p));
+                    continue;
+                }
+
+                this->_Route(from, data, size, now);
+            }
+
+            this->receiveRing.CommitRead(consumed);
+
+            // simulated packets that are due, jitter reorders them
+            for (size_t i = 0; i < this->delayed.size();)
+            {
+                if (this->delayed[i].time > now)
+                {
+                    i++;
+                    continue;
+                }
+
+                DelayedPacket p = std::move(this->delayed[i]);
+                this->delayed[i] = std::move(this->delayed.back());
+                this->delayed.pop_back();
+                this->_Route(p.from, p.data.data(), (uint)p.data.size(), now);
+            }
+        }
+
+        void UdpSocket::_Flush()
+        {
+            double now = _Now();
+            for (size_t i = 0; i < this->peers.size(); i++)
+                this->peers[i]->_Flush(now);
+        }
+
+        void UdpSocket::Destroy()
+        {
+            networkManager->_Remove(this);
+
+            for (UdpPeer* peer : this->peers)
+                delete peer;
+            this->peers.clear();
+            this->peerMap.clear();
+
+            // event loop closes the socket and gives it back to be deleted
+            networkManager->_Release(this);
         }
     }
 }
 #pragma endregion
 
-        /*@// Client *****************************************************************************************************@*/
+/*@// Replication **************************************************************************************************@*/
 namespace viva
 {
     namespace net
     {
-        class Client : public net::Socket
+        // Quantized state of one replicated entity, what goes on the wire.
+        struct ReplicaState
         {
-        protected:
-            std::string ip;
-            unsigned short port;
-            std::function<void()> onConnectHandler;
-            std::function<void(const vector<byte>&)> onMsgHandler;
-            bool isConnected;
-            bool returnReceive;
-            Routine* timeOutHandler;
-            std::future<int> timeOut;
-            std::future<bool> receiveThread;
-            std::mutex msgQueueMutex;
-            std::vector<byte> msg;
+            bool alive;
+            int x, y; // position in position steps
+            unsigned short rotation; // full turn is 65536
+            int scaleX, scaleY; // in scale steps
+            uint color; // rgba
+        };
+
+        // Writes values of any bit width, least significant bit first.
+        class BitWriter
+        {
+        private:
+            vector<byte>& out;
+            unsigned long long bits; // not written to out yet
+            uint count;
         public:
-            Client(const char* _ip, unsigned short _port);
+            // out: bits are appended to it
+            BitWriter(vector<byte>& out);
 
-            Client(SOCKET socket, sockaddr_in address, const char* ip, unsigned short port);
+            // bits: 1 to 32
+            void Write(uint value, uint bits);
 
-            void OnConnect(const std::function<void()>& handler);
+            // Zigzag signed value prefixed with 2 bit width class, small deltas take 6 bits.
+            void WriteSigned(int value);
 
-            void OnMsg(const std::function<void(const vector<byte>&)>& handler);
+            void WriteUnsigned(uint value);
 
-            void _Activity() override;
+            // Write what is left, padded to byte.
+            void Finish();
+        };
 
-            void _PushMsgBytes(byte* arr, int len);
+        class BitReader
+        {
+        private:
+            const byte* data;
+            size_t size;
+            size_t position; // in bits
+        public:
+            BitReader(const byte* data, size_t size);
 
-            void _ProcessMsg();
+            // Returns 0 past the end, check IsOverrun() when done.
+            uint Read(uint bits);
 
-            void _SetConnected(bool val);
+            int ReadSigned();
 
-            const char* GetIp() const;
+            uint ReadUnsigned();
 
-            void Send(vector<byte>& msg);
+            bool IsOverrun() const;
+        };
 
-            void Send(byte* msg, unsigned short len);
+        // Replicates transforms and colors of registered entities to all clients of a server.
+        // Every client gets only what changed since the last snapshot it acked. Clients that acked
+        // the same snapshot share one encoded message.
+        //
+        // Snapshot: 'R' 'S', varint tick, varint baseline tick (0 is none), varint changed entities,
+        // then bits. Entity: id gap, alive bit, 4 changed bits, deltas of changed fields.
+        // Ack: 'R' 'A', varint tick (0 asks for a full snapshot).
+        class Replicator
+        {
+        private:
+            struct Entity
+            {
+                Transform* transform;
+                Drawable* drawable; // color, can be null
+            };
 
-            void Connect(double timeoutSeconds);
+            struct Snapshot
+            {
+                uint tick; // 0 if slot is unused
+                vector<ReplicaState> states; // by entity id
+            };
 
-            void Disonnect();
+            // encoded once, sent to every client with that baseline
+            struct Group
+            {
+                uint baseline;
+                vector<byte> msg;
+            };
 
-            void Destroy() override;
+            Server* server;
+            vector<Entity> entities; // by id, transform is null if id is free
+            vector<uint> freeIds;
+            vector<Snapshot> history; // ring by tick
+            std::unordered_map<Client*, uint> acked; // last acked tick of connected clients, 0 is none
+            std::unordered_map<Client*, uint> ackedScratch;
+            vector<Group> groups;
+            vector<ReplicaState> empty; // baseline of a full snapshot
+            uint tick;
+            float positionStep;
+            float scaleStep;
+            // stats of the last Replicate()
+            size_t lastBytes;
+            uint lastGroups;
+            double lastEncodeSeconds;
+
+            ReplicaState _Capture(const Entity& e) const;
+
+            const vector<ReplicaState>& _Baseline(uint tick);
+        public:
+            // Ctor.
+            // server: snapshots go to its clients
+            // history: how many snapshots are kept as baselines, clients that acked nothing newer get everything
+            Replicator(Server* server, uint history = 32);
+
+            // Start replicating transform and color of drawable. Returns entity id that
+            // ReplicaReader::Bind() uses on the other side.
+            // drawable: can be null, color is not replicated then
+            uint Register(Transform* transform, Drawable* drawable);
+
+            // Stop replicating, clients see the entity as not alive.
+            void Unregister(uint id);
+
+            // Values are rounded to these steps, reader must use the same ones.
+            // Defaults are 1/256 for position and 1/1024 for scale.
+            void SetQuantization(float positionStep, float scaleStep);
+
+            // Take a snapshot and send deltas to every client of the server.
+            void Replicate();
+
+            // Pass every message from server side clients here. Returns true if it was an ack
+            // and was consumed.
+            bool Acknowledge(Client* client, const MsgSpan& msg);
+
+            // Forget the client, call it from Server::OnDisconnect() so a new client that gets
+            // the same address doesn't inherit its baseline.
+            void RemoveClient(Client* client);
+
+            uint GetTick() const;
+
+            // Bytes sent to all clients by the last Replicate().
+            size_t GetLastBytes() const;
+
+            // Messages encoded by the last Replicate(), one per distinct baseline.
+            uint GetLastGroups() const;
+
+            // Time spent capturing and encoding in the last Replicate().
+            double GetLastEncodeSeconds() const;
+
+            void Destroy();
+        };
+
+        // Receives snapshots of a Replicator, applies them to bound objects and acks them.
+        class ReplicaReader
+        {
+        private:
+            static const uint DefaultMaxEntities = 64 * 1024;
+
+            struct Binding
+            {
+                Transform* transform;
+                Drawable* drawable;
+            };
 
-            static bool ReceiveThread(Client* client);
+            struct Snapshot
+            {
+                uint tick;
+                vector<ReplicaState> states;
+            };
+
+            Client* client;
+            vector<Snapshot> history; // ring by tick, baselines the server might use
+            vector<ReplicaState> empty;
+            vector<Binding> bindings; // by entity id
+            uint tick; // last applied
+            float positionStep;
+            float scaleStep;
+            uint maxEntities; // ids come from the wire, states grow up to that
+        public:
+            // Ctor.
+            // client: acks go back through it
+            // history: same as the replicator
+            ReplicaReader(Client* client, uint history = 32);
+
+            // Apply entity to these objects every snapshot.
+            // drawable: can be null
+            void Bind(uint id, Transform* transform, Drawable* drawable);
+
+            void Unbind(uint id);
+
+            // Same as the replicator.
+            void SetQuantization(float positionStep, float scaleStep);
+
+            // Snapshot with an entity id at or over this is malformed and dropped. Default is 65536.
+            void SetMaxEntities(uint count);
 
-            static int ConnectThread(Client* client);
+            // Pass every message from the client here. Returns true if it was a snapshot
+            // and was consumed.
+            bool Read(const MsgSpan& msg);
 
-            bool GetReturnReceive() const;
+            // Entity is alive in the last snapshot.
+            bool IsAlive(uint id) const;
+
+            // Last applied snapshot, 0 if none.
+            uint GetTick() const;
+
+            void Destroy();
         };
     }
 }
@@ -4778,449 +14149,530 @@ namespace viva
 {
     namespace net
     {
-        Client::Client(SOCKET socket, sockaddr_in address, const char* ip, unsigned short port)
-            : ip(ip), port(port), isConnected(false), returnReceive(false)
+        BitWriter::BitWriter(vector<byte>& out) : out(out), bits(0), count(0)
         {
-            this->handle = socket;
-            this->address = address;
-            this->isConnected = true;
         }
 
-        Client::Client(const char* ip, unsigned short port)
-            : ip(ip), port(port), isConnected(false), returnReceive(false)
+        void BitWriter::Write(uint value, uint bits)
         {
-            // WSAStartup
-            if (!Socket::wsInitialized)
-            {
-                int res = ::WSAStartup(MAKEWORD(2, 2), &wsadata);
-                if (res != 0)
-                {
-                    std::string msg = GetLastWinsockErrorMessage(res);
-                    throw viva::Error("WSAStartup", msg.c_str());
-                }
+            if (bits < 32)
+                value &= (1u << bits) - 1;
 
-                Socket::wsInitialized = true;
-            }
+            this->bits |= (unsigned long long)value << this->count;
+            this->count += bits;
 
-            // socket()
-            handle = socket(AF_INET, SOCK_STREAM, NULL);
-            if (handle == INVALID_SOCKET)
+            while (this->count >= 8)
             {
-                std::string msg = GetLastWinsockErrorMessage(WSAGetLastError());
-                throw viva::Error("socket", msg.c_str());
+                this->out.push_back((byte)this->bits);
+                this->bits >>= 8;
+                this->count -= 8;
             }
-            id = (size_t)handle;
-
-            // sockaddr_in
-            SecureZeroMemory(&address, sizeof(address));
-            address.sin_family = AF_INET;
-            inet_pton(AF_INET, ip, &(address.sin_addr));
-            address.sin_port = htons(port);
         }
 
-        void Client::OnConnect(const std::function<void()>& handler)
+        void BitWriter::WriteUnsigned(uint value)
         {
-            this->onConnectHandler = handler;
+            // width class: 4, 8, 16 or 32 bits
+            if (value < (1u << 4))
+            {
+                this->Write(0, 2);
+                this->Write(value, 4);
+            }
+            else if (value < (1u << 8))
+            {
+                this->Write(1, 2);
+                this->Write(value, 8);
+            }
+            else if (value < (1u << 16))
+            {
+                this->Write(2, 2);
+                this->Write(value, 16);
+            }
+            else
+            {
+                this->Write(3, 2);
+                this->Write(value, 32);
+            }
         }
 
-        void Client::OnMsg(const std::function<void(const vector<byte>&)>& handler)
+        void BitWriter::WriteSigned(int value)
         {
-            this->onMsgHandler = handler;
+            this->WriteUnsigned(((uint)value << 1) ^ (uint)(value >> 31));
         }
 
-        void Client::_Activity()
+        void BitWriter::Finish()
         {
-            this->_ProcessMsg();
+            if (this->count > 0)
+                this->out.push_back((byte)this->bits);
+
+            this->bits = 0;
+            this->count = 0;
         }
 
-        void Client::_PushMsgBytes(byte* arr, int len)
+        BitReader::BitReader(const byte* data, size_t size) : data(data), size(size), position(0)
         {
-            this->msgQueueMutex.lock();
-            size_t size = this->msg.size();
-            this->msg.resize(msg.size() + len);
-            memcpy(this->msg.data() + size, arr, len);
-            this->msgQueueMutex.unlock();
         }
 
-        void Client::_ProcessMsg()
+        uint BitReader::Read(uint bits)
         {
-            if (this->msg.size() > 0)
-            {
-                this->msgQueueMutex.lock();
-                unsigned short size;
-                memcpy(&size, this->msg.data(), sizeof(unsigned short)); // TODO endianess problem
+            uint value = 0;
 
-                if (this->msg.size() < size + 2)
-                {
-                    this->msgQueueMutex.unlock();
-                    return;
-                }
-
-                vector<byte> completeMsg(this->msg.begin() + 2, this->msg.begin() + 2 + size);
-                this->msg.erase(this->msg.begin(), this->msg.begin() + 2 + size);
-                this->msgQueueMutex.unlock();
+            for (uint i = 0; i < bits; i++, this->position++)
+            {
+                size_t index = this->position >> 3;
+                if (index >= this->size)
+                    continue;
 
-                if (this->onMsgHandler)
-                    this->onMsgHandler(completeMsg);
+                value |= (uint)((this->data[index] >> (this->position & 7)) & 1) << i;
             }
+
+            return value;
         }
 
-        void Client::_SetConnected(bool val)
+        uint BitReader::ReadUnsigned()
         {
-            this->isConnected = val;
+            static const uint widths[] = { 4, 8, 16, 32 };
+            return this->Read(widths[this->Read(2)]);
         }
 
-        const char* Client::GetIp() const
+        int BitReader::ReadSigned()
         {
-            return this->ip.c_str();
+            uint value = this->ReadUnsigned();
+            return (int)(value >> 1) ^ -(int)(value & 1);
         }
 
-        void Client::Send(vector<byte>& msg)
+        bool BitReader::IsOverrun() const
         {
-            this->Send(msg.data(), (unsigned short)msg.size());
+            return this->position > this->size * 8;
         }
 
-        int Client::ConnectThread(Client* client)
+        static int _QuantizeStep(float value, float step)
         {
-            char buf[5] = { 0,0,0,0,0 };
-
-            if (::connect(client->_GetSocket(), (sockaddr*)&(client->_GetSockAddr()), sizeof(sockaddr_in)) == SOCKET_ERROR)
-                return WSAGetLastError();
-
-            // welcome protocol
-            int received = 0;
-            while (received < 5)
-                received += ::recv(client->_GetSocket(), (char*)buf, 5 - received, 0);
-
-            if (::memcmp(buf, "Hello", 5) != 0)
-                return 10060; // error 10060 is timed out
-
-            client->_SetConnected(true);
-
-            return 0;
+            return (int)::floorf(value / step + 0.5f);
         }
 
-        bool Client::ReceiveThread(Client* client)
+        // Changed fields of one entity, baseline to state.
+        static void _EncodeEntity(BitWriter& w, const ReplicaState& base, const ReplicaState& s)
         {
-            byte tempBuffer[256];
+            w.Write(s.alive ? 1 : 0, 1);
+            if (!s.alive)
+                return;
 
-            while (!client->GetReturnReceive())
+            bool position = s.x != base.x || s.y != base.y;
+            bool rotation = s.rotation != base.rotation;
+            bool scale = s.scaleX != base.scaleX || s.scaleY != base.scaleY;
+            bool color = s.color != base.color;
+            w.Write((position ? 1 : 0) | (rotation ? 2 : 0) | (scale ? 4 : 0) | (color ? 8 : 0), 4);
+
+            if (position)
             {
-                int len = ::recv(client->_GetSocket(), (char*)tempBuffer, 256, NULL);
+                w.WriteSigned(s.x - base.x);
+                w.WriteSigned(s.y - base.y);
+            }
 
-                if (len == SOCKET_ERROR)
-                {
-                    auto code = ::WSAGetLastError();
-                    std::string msg = GetLastWinsockErrorMessage(code);
-                    NetworkError err = { msg, code };
-                    client->_AddError(err);
-                }
-                /*else if (len == 0)
-                {
-                    break;
-                }*/
+            // shortest way around
+            if (rotation)
+                w.WriteSigned((short)(s.rotation - base.rotation));
 
-                client->_PushMsgBytes(tempBuffer, len);
+            if (scale)
+            {
+                w.WriteSigned(s.scaleX - base.scaleX);
+                w.WriteSigned(s.scaleY - base.scaleY);
             }
 
-            return false;
+            if (color)
+                w.Write(s.color, 32);
         }
 
-        void Client::Connect(double timeoutSeconds)
+        static void _DecodeEntity(BitReader& r, ReplicaState& s)
         {
-            if (isConnected)
-                throw Error(__FUNCTION__, "Client is already running");
-
-            this->msg.clear();
+            // dead entity is zeroed like on the other side
+            bool alive = r.Read(1) != 0;
+            if (!alive)
+            {
+                s = ReplicaState();
+                return;
+            }
+            s.alive = true;
 
-            this->timeOut = std::async(Client::ConnectThread, this);
+            uint changed = r.Read(4);
 
-            // TODO implement this without timeout ?
-            this->timeOutHandler = routineManager->AddRoutine([&]()
+            if (changed & 1)
             {
-                auto state = this->timeOut.wait_for(std::chrono::milliseconds(0));
+                s.x += r.ReadSigned();
+                s.y += r.ReadSigned();
+            }
 
-                if (state != std::future_status::ready)
-                {
-                    ::closesocket(handle);
-                    handle = ::socket(AF_INET, SOCK_STREAM, NULL);
-                    id = (long long)handle;
-                    ::WSASetLastError(10060);
-                    std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
-                    NetworkError err = { msg, 10060 };
-                    this->_AddError(err);
-                }
-                else if (timeOut.get() != 0)
-                {
-                    ::closesocket(handle);
-                    handle = ::socket(AF_INET, SOCK_STREAM, NULL);
-                    id = (long long)handle;
-                    ::WSASetLastError(10060);
-                    std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
-                    NetworkError err = { msg, 10060 };
-                    this->_AddError(err);
-                }
-                else
-                {
-                    this->onConnectHandler();
-                    this->receiveThread = std::async(Client::ReceiveThread, this);
-                }
+            if (changed & 2)
+                s.rotation = (unsigned short)(s.rotation + r.ReadSigned());
 
-                return 0;
-            }, 0, timeoutSeconds, 0, 0);
+            if (changed & 4)
+            {
+                s.scaleX += r.ReadSigned();
+                s.scaleY += r.ReadSigned();
+            }
+
+            if (changed & 8)
+                s.color = r.Read(32);
         }
 
-        bool Client::GetReturnReceive() const
+        static bool _SameState(const ReplicaState& a, const ReplicaState& b)
         {
-            return this->returnReceive;
+            if (a.alive != b.alive)
+                return false;
+
+            // dead entities have nothing else worth sending
+            return !a.alive || (a.x == b.x && a.y == b.y && a.rotation == b.rotation &&
+                a.scaleX == b.scaleX && a.scaleY == b.scaleY && a.color == b.color);
         }
 
-        void Client::Send(byte* msg, unsigned short len)
+        Replicator::Replicator(Server* server, uint history)
+            : server(server), tick(0), positionStep(1.0f / 256), scaleStep(1.0f / 1024), lastBytes(0), lastGroups(0),
+            lastEncodeSeconds(0)
         {
-            vector<byte> buf;
-            buf.resize(2 + len);
-            ::memcpy(buf.data(), &len, 2);
-            ::memcpy(buf.data() + 2, msg, len);
-            int sent = 0;
-
-            while (sent < buf.size())
-            {
-                int temp = ::send(handle, (char*)buf.data() + sent, (int)buf.size() - sent, 0);
+            this->history.resize(history);
+            for (uint i = 0; i < history; i++)
+                this->history[i].tick = 0;
+        }
 
-                if (temp == SOCKET_ERROR)
-                {
-                    std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
-                    throw viva::Error("Send", msg.c_str());
-                }
+        uint Replicator::Register(Transform* transform, Drawable* drawable)
+        {
+            uint id;
 
-                sent += temp;
+            if (this->freeIds.size() > 0)
+            {
+                id = this->freeIds.back();
+                this->freeIds.pop_back();
+            }
+            else
+            {
+                id = (uint)this->entities.size();
+                this->entities.emplace_back();
             }
+
+            this->entities[id].transform = transform;
+            this->entities[id].drawable = drawable;
+            return id;
         }
 
-        void Client::Disonnect()
+        void Replicator::Unregister(uint id)
         {
-            // TODO
-            throw Error(__FUNCTION__, "Not implemented");
+            this->entities[id].transform = nullptr;
+            this->entities[id].drawable = nullptr;
+            this->freeIds.push_back(id);
         }
 
-        void Client::Destroy()
+        void Replicator::SetQuantization(float positionStep, float scaleStep)
         {
-            networkManager->_Remove(this);
-
-            // TODO
-            throw Error(__FUNCTION__, "Not implemented");
-            // other things to do:
-            // stop threads
-            // close sockets
-
-            delete this;
+            this->positionStep = positionStep;
+            this->scaleStep = scaleStep;
         }
-    }
-}
-#pragma endregion
 
-/*@// Server *****************************************************************************************************@*/
-namespace viva
-{
-    namespace net
-    {
-        class Server : public net::Socket
+        ReplicaState Replicator::_Capture(const Entity& e) const
         {
-        protected:
-            unsigned short port;
-            std::function<void(Client* c)> onConnectHandler;
-            std::function<void(Client* c)> onDisconnectHandler;
-            std::mutex errorQueueMutex;
-            std::mutex clientQueueMutex;
-            std::queue<Client*> clients; // first clients are coming to queue
-            vector<Client*> ackedClients; // main thread grabs clients from queue, calls onconnect callback and moves from queue to vector
-            bool isRunning;
-            bool returnAccept;
-            std::future<bool> acceptThread;
+            ReplicaState s = {};
+            if (e.transform == nullptr)
+                return s;
 
-        public:
-            Server(unsigned short port);
+            const Vector& position = e.transform->GetPos();
+            const Vector& scale = e.transform->GetScale();
+            float turns = e.transform->GetRot() / (2 * math::PI);
 
-            void OnConnect(const std::function<void(Client* c)>& handler);
+            s.alive = true;
+            s.x = _QuantizeStep(position.x, this->positionStep);
+            s.y = _QuantizeStep(position.y, this->positionStep);
+            s.rotation = (unsigned short)(int)::floorf((turns - ::floorf(turns)) * 65536 + 0.5f);
+            s.scaleX = _QuantizeStep(scale.x, this->scaleStep);
+            s.scaleY = _QuantizeStep(scale.y, this->scaleStep);
 
-            void OnDisconnect(const std::function<void(Client* c)>& handler);
+            if (e.drawable != nullptr)
+            {
+                const Color& c = e.drawable->GetColor();
+                s.color = c.r | (c.g << 8) | (c.b << 16) | ((uint)c.a << 24);
+            }
 
-            const vector<Client*>& GetClients() const;
+            return s;
+        }
 
-            void _AddClient(Client* client);
+        const vector<ReplicaState>& Replicator::_Baseline(uint tick)
+        {
+            // older than history is as good as nothing
+            const Snapshot& s = this->history[tick % this->history.size()];
+            if (tick == 0 || s.tick != tick)
+                return this->empty;
 
-            void _Activity() override;
+            return s.states;
+        }
 
-            bool GetReturnAccept() const;
+        void Replicator::Replicate()
+        {
+            auto start = std::chrono::steady_clock::now();
 
-            void Start(int backlog);
+            this->tick++;
+            Snapshot& current = this->history[this->tick % this->history.size()];
+            current.tick = this->tick;
+            current.states.resize(this->entities.size());
+            for (size_t i = 0; i < this->entities.size(); i++)
+                current.states[i] = this->_Capture(this->entities[i]);
 
-            void Stop();
+            // entities past the end of a baseline were never alive there
+            if (this->empty.size() < this->entities.size())
+                this->empty.resize(this->entities.size(), ReplicaState());
 
-            void Destroy() override;
+            // new clients start with nothing acked, gone ones are forgotten
+            const vector<Client*>& connected = this->server->GetClients();
+            this->ackedScratch.clear();
+            for (size_t i = 0; i < connected.size(); i++)
+            {
+                auto it = this->acked.find(connected[i]);
+                this->ackedScratch[connected[i]] = it == this->acked.end() ? 0 : it->second;
+            }
+            this->acked.swap(this->ackedScratch);
 
-            static bool AcceptThread(Server* server);
-        };
-    }
-}
+            for (size_t i = 0; i < this->groups.size(); i++)
+                this->groups[i].msg.clear();
+            uint groupCount = 0;
+            this->lastBytes = 0;
 
-#pragma region code
-namespace viva
-{
-    namespace net
-    {
-        Server::Server(unsigned short port)
-            : port(port), isRunning(false), returnAccept(false)
-        {
-            // WSAStartup
-            if (!Socket::wsInitialized)
+            for (size_t c = 0; c < connected.size(); c++)
             {
-                int res = ::WSAStartup(MAKEWORD(2, 2), &wsadata);
-                if (res != 0)
+                uint acked = this->acked[connected[c]];
+                const vector<ReplicaState>& base = this->_Baseline(acked);
+                uint baseline = &base == &this->empty ? 0 : acked;
+
+                Group* group = nullptr;
+                for (uint g = 0; g < groupCount; g++)
                 {
-                    std::string msg = GetLastWinsockErrorMessage(res);
-                    throw viva::Error("WSAStartup", msg.c_str());
+                    if (this->groups[g].baseline == baseline)
+                        group = &this->groups[g];
                 }
 
-                Socket::wsInitialized = true;
-            }
+                if (group == nullptr)
+                {
+                    if (groupCount == this->groups.size())
+                        this->groups.emplace_back();
+                    group = &this->groups[groupCount++];
+                    group->baseline = baseline;
+
+                    vector<byte>& msg = group->msg;
+                    msg.push_back('R');
+                    msg.push_back('S');
+                    byte header[3 * MaxVarint];
+                    uint headerSize = WriteVarint(header, this->tick);
+                    headerSize += WriteVarint(header + headerSize, baseline);
+
+                    // baseline is shorter if entities were registered after it
+                    auto before = [&base, this](size_t i) -> const ReplicaState&
+                    {
+                        return i < base.size() ? base[i] : this->empty[i];
+                    };
+
+                    uint changed = 0;
+                    for (size_t i = 0; i < current.states.size(); i++)
+                        changed += _SameState(before(i), current.states[i]) ? 0 : 1;
+                    headerSize += WriteVarint(header + headerSize, changed);
+                    msg.insert(msg.end(), header, header + headerSize);
+
+                    BitWriter w(msg);
+                    uint last = 0;
+                    for (uint i = 0; i < (uint)current.states.size(); i++)
+                    {
+                        if (_SameState(before(i), current.states[i]))
+                            continue;
 
-            // socket()
-            ::SecureZeroMemory(&address, sizeof(address));
-            this->handle = ::socket(AF_INET, SOCK_STREAM, NULL);
-            if (this->handle == INVALID_SOCKET)
-            {
-                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
-                throw viva::Error("socket", msg.c_str());
+                        w.WriteUnsigned(i - last);
+                        last = i;
+                        _EncodeEntity(w, before(i), current.states[i]);
+                    }
+                    w.Finish();
+                }
+
+                connected[c]->Send(group->msg.data(), (uint)group->msg.size());
+                this->lastBytes += group->msg.size();
             }
 
-            // sockaddr
-            address.sin_port = ::htons(port);
-            address.sin_addr.s_addr = ::htonl(INADDR_ANY);
-            address.sin_family = AF_INET;
-            sockaddr* paddress = (sockaddr*)&address;
+            this->lastGroups = groupCount;
+            this->lastEncodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
 
-            // bind()
-            if (::bind((SOCKET)handle, paddress, (int)sizeof(sockaddr)) == SOCKET_ERROR)
-            {
-                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
-                throw viva::Error("bind", msg.c_str());
-            }
+        bool Replicator::Acknowledge(Client* client, const MsgSpan& msg)
+        {
+            if (msg.size < 3 || msg.data[0] != 'R' || msg.data[1] != 'A')
+                return false;
+
+            unsigned long long tick;
+            if (ReadVarint(msg.data + 2, msg.size - 2, tick) <= 0)
+                return true;
+
+            // tcp keeps acks in order, the last one is the newest
+            auto it = this->acked.find(client);
+            if (it != this->acked.end())
+                it->second = (uint)tick;
+            return true;
         }
 
-        void Server::OnConnect(const std::function<void(Client* c)>& handler)
+        void Replicator::RemoveClient(Client* client)
         {
-            this->onConnectHandler = handler;
+            this->acked.erase(client);
         }
 
-        void Server::OnDisconnect(const std::function<void(Client* c)>& handler)
+        uint Replicator::GetTick() const
         {
-            this->onDisconnectHandler = handler;
+            return this->tick;
         }
 
-        const vector<Client*>& Server::GetClients() const
+        size_t Replicator::GetLastBytes() const
         {
-            return this->ackedClients;
+            return this->lastBytes;
         }
 
-        void Server::_AddClient(Client* client)
+        uint Replicator::GetLastGroups() const
         {
-            this->clientQueueMutex.lock();
-            this->clients.push(client);
-            this->clientQueueMutex.unlock();
+            return this->lastGroups;
         }
 
-        void Server::_Activity()
+        double Replicator::GetLastEncodeSeconds() const
         {
-            if (this->clients.size() > 0)
-            {
-                this->clientQueueMutex.lock();
-                Client* client = this->clients.front();
-                this->clients.pop();
-                this->clientQueueMutex.unlock();
+            return this->lastEncodeSeconds;
+        }
 
-                this->ackedClients.push_back(client);
-                this->onConnectHandler(client);
-            }
+        void Replicator::Destroy()
+        {
+            delete this;
         }
 
-        bool Server::GetReturnAccept() const
+        ReplicaReader::ReplicaReader(Client* client, uint history)
+            : client(client), tick(0), positionStep(1.0f / 256), scaleStep(1.0f / 1024), maxEntities(DefaultMaxEntities)
         {
-            return this->returnAccept;
+            this->history.resize(history);
+            for (uint i = 0; i < history; i++)
+                this->history[i].tick = 0;
         }
 
-        bool Server::AcceptThread(Server* server)
+        void ReplicaReader::Bind(uint id, Transform* transform, Drawable* drawable)
         {
-            int size = sizeof(sockaddr_in);
-            sockaddr_in address;
-            SOCKET acceptedSocket;
-            char hello[] = "Hello";
+            if (id >= this->bindings.size())
+                this->bindings.resize(id + 1, { nullptr, nullptr });
+
+            this->bindings[id].transform = transform;
+            this->bindings[id].drawable = drawable;
+        }
+
+        void ReplicaReader::Unbind(uint id)
+        {
+            if (id < this->bindings.size())
+                this->bindings[id] = { nullptr, nullptr };
+        }
+
+        void ReplicaReader::SetQuantization(float positionStep, float scaleStep)
+        {
+            this->positionStep = positionStep;
+            this->scaleStep = scaleStep;
+        }
 
-            while (!server->GetReturnAccept())
+        void ReplicaReader::SetMaxEntities(uint count)
+        {
+            this->maxEntities = count;
+        }
+
+        bool ReplicaReader::Read(const MsgSpan& msg)
+        {
+            if (msg.size < 2 || msg.data[0] != 'R' || msg.data[1] != 'S')
+                return false;
+
+            const byte* data = msg.data + 2;
+            size_t size = msg.size - 2;
+            unsigned long long tick, baseline, changed;
+            int used;
+
+            if ((used = ReadVarint(data, size, tick)) <= 0)
+                return true;
+            data += used;
+            size -= used;
+            if ((used = ReadVarint(data, size, baseline)) <= 0)
+                return true;
+            data += used;
+            size -= used;
+            if ((used = ReadVarint(data, size, changed)) <= 0)
+                return true;
+            data += used;
+            size -= used;
+
+            byte ack[2 + MaxVarint] = { 'R', 'A' };
+
+            // baseline is gone, ask for everything
+            const Snapshot& base = this->history[baseline % this->history.size()];
+            if (baseline != 0 && base.tick != baseline)
             {
-                acceptedSocket = ::accept(server->_GetSocket(), (sockaddr*)(&address), &size);
+                uint ackSize = 2 + WriteVarint(ack + 2, 0);
+                this->client->Send(ack, ackSize);
+                return true;
+            }
 
-                if (acceptedSocket == INVALID_SOCKET)
+            Snapshot& current = this->history[tick % this->history.size()];
+            const vector<ReplicaState>& from = baseline == 0 ? this->empty : base.states;
+            if (&current != &base)
+                current.states = from;
+            current.tick = (uint)tick;
+
+            BitReader r(data, size);
+            unsigned long long id = 0;
+            bool malformed = false;
+            for (unsigned long long i = 0; i < changed && !r.IsOverrun(); i++)
+            {
+                id += r.ReadUnsigned();
+                if (id >= this->maxEntities)
                 {
-                    auto code = ::WSAGetLastError();
-                    std::string msg = GetLastWinsockErrorMessage(code);
-                    NetworkError err = { msg, code };
-                    server->_AddError(err);
+                    malformed = true;
+                    break;
                 }
-                else
-                {
-                    int sent = 0;
-                    while (sent < 5)
-                    {
-                        int temp = ::send(acceptedSocket, (const char*)hello + sent, 5 - sent, 0);
-
-                        if (temp == SOCKET_ERROR)
-                            return false;
 
-                        sent += temp;
-                    }
+                if (id >= current.states.size())
+                    current.states.resize(id + 1, ReplicaState());
 
-                    Client* client = new Client(acceptedSocket, address, "", 0);
-                    server->_AddClient(client);
-                }
+                _DecodeEntity(r, current.states[id]);
             }
 
-            return false;
-        }
+            if (malformed || r.IsOverrun())
+            {
+                current.tick = 0;
+                return true;
+            }
 
-        void Server::Start(int backlog)
-        {
-            if (this->isRunning)
-                throw viva::Error(__FUNCTION__, "Server already running");
+            this->tick = (uint)tick;
+            uint ackSize = 2 + WriteVarint(ack + 2, tick);
+            this->client->Send(ack, ackSize);
 
-            // listen()
-            if (::listen(handle, backlog) == SOCKET_ERROR)
+            for (size_t i = 0; i < this->bindings.size() && i < current.states.size(); i++)
             {
-                std::string msg = GetLastWinsockErrorMessage(::WSAGetLastError());
-                throw viva::Error("listen", msg.c_str());
-            }
+                const Binding& b = this->bindings[i];
+                const ReplicaState& s = current.states[i];
+                if (b.transform == nullptr || !s.alive)
+                    continue;
 
-            this->isRunning = true;
+                b.transform->Pos().xy(s.x * this->positionStep, s.y * this->positionStep);
+                b.transform->Rot() = s.rotation * (2 * math::PI) / 65536;
+                b.transform->Scale().xy(s.scaleX * this->scaleStep, s.scaleY * this->scaleStep);
 
-            this->acceptThread = std::async(Server::AcceptThread, this);
+                if (b.drawable != nullptr)
+                    b.drawable->SetColor((byte)s.color, (byte)(s.color >> 8), (byte)(s.color >> 16), (byte)(s.color >> 24));
+            }
+
+            return true;
         }
 
-        void Server::Stop()
+        bool ReplicaReader::IsAlive(uint id) const
         {
-            // TODO
-            throw Error(__FUNCTION__, "Not implemented");
+            const Snapshot& s = this->history[this->tick % this->history.size()];
+            return this->tick != 0 && s.tick == this->tick && id < s.states.size() && s.states[id].alive;
         }
 
-        void Server::Destroy()
+        uint ReplicaReader::GetTick() const
         {
-            networkManager->_Remove(this);
-
-            // TODO
-            throw Error(__FUNCTION__, "Not implemented");
-            // other things to do:
-            // stop threads
-            // close sockets
+            return this->tick;
+        }
 
+        void ReplicaReader::Destroy()
+        {
             delete this;
         }
     }
@@ -5232,11 +14684,31 @@ namespace viva
 {
     namespace net
     {
+        // Owns the event loop thread. Loop waits on all sockets with the poller, does the
+        // non-blocking work and hands results to the main thread through a lock-free queue.
+        // Main thread sends commands to the loop through another one.
         class NetworkManager
         {
         private:
-            vector<Socket*> sockets;
+            static const uint QueueSize = 64 * 1024;
+
+            vector<Socket*> sockets; // main thread, sockets that get _Activity()
+            NetPoller* poller;
+            SpscQueue<NetCommand> commands; // main thread to event loop
+            SpscQueue<NetCompletion> completions; // event loop to main thread
+            std::deque<NetCompletion> overflow; // event loop only, completions that didn't fit, loop never blocks
+            vector<PollEvent> events; // event loop only
+            std::atomic<bool> stop;
+            std::thread loop;
+
+            void _Loop();
+
+            void _RunCommand(const NetCommand& cmd);
+
+            void _Dispatch(const NetCompletion& c);
         public:
+            NetworkManager();
+
             void _Activity();
 
             void _Clear();
@@ -5246,6 +14718,21 @@ namespace viva
             void _Add(Socket* s);
 
             void _Remove(Socket* s);
+
+            // Main thread. Queue a command for the event loop and wake it up.
+            void _Post(const NetCommand& cmd);
+
+            // Main thread. Event loop closes the socket, it is deleted when it comes back.
+            void _Release(Socket* s);
+
+            // Event loop. Hand a result to the main thread.
+            void _Complete(const NetCompletion& c);
+
+            // Event loop. Change what is watched on a handle.
+            void _Watch(Socket* s, SOCKET handle, bool read, bool write);
+
+            // Event loop. Stop watching and close a handle, tell main thread why.
+            void _Drop(Socket* s, SOCKET handle, NetCompletionType type, int code);
         };
     }
 }
@@ -5255,6 +14742,16 @@ namespace viva
 {
     namespace net
     {
+        NetworkManager::NetworkManager() : commands(QueueSize), completions(QueueSize), stop(false)
+        {
+#ifdef __linux__
+            this->poller = new EpollPoller();
+#else
+            this->poller = new WinsockPoller();
+#endif
+            this->loop = std::thread(&NetworkManager::_Loop, this);
+        }
+
         void NetworkManager::_Add(Socket* b)
         {
             b->_SetIndex(this->sockets.size());
@@ -5263,26 +14760,188 @@ namespace viva
 
         void NetworkManager::_Remove(Socket* b)
         {
-            this->sockets.erase(this->sockets.begin() + b->_GetIndex());
+            int index = b->_GetIndex();
+            if (index < 0)
+                return;
+
+            // swap with last so other indices stay valid
+            this->sockets[index] = this->sockets.back();
+            this->sockets[index]->_SetIndex(index);
+            this->sockets.pop_back();
+            b->_SetIndex(-1);
+        }
+
+        void NetworkManager::_Post(const NetCommand& cmd)
+        {
+            // loop always drains commands, it can't be waiting on us
+            while (!this->commands.TryPush(cmd))
+            {
+                this->poller->Wake();
+                std::this_thread::yield();
+            }
+
+            this->poller->Wake();
+        }
+
+        void NetworkManager::_Release(Socket* s)
+        {
+            s->_SetDestroyed();
+
+            // handle that loop never got is closed here
+            SOCKET handle = s->_GetSocket();
+            if (!s->_IsWatched())
+            {
+                if (handle != INVALID_SOCKET)
+                    ::closesocket(handle);
+                handle = INVALID_SOCKET;
+            }
+
+            NetCommand cmd = { NetCommandType::Release, s, handle, s->_GetGeneration(), false, false };
+            this->_Post(cmd);
+        }
+
+        void NetworkManager::_Complete(const NetCompletion& c)
+        {
+            if (!this->overflow.empty() || !this->completions.TryPush(c))
+                this->overflow.push_back(c);
+        }
+
+        void NetworkManager::_Watch(Socket* s, SOCKET handle, bool read, bool write)
+        {
+            this->poller->Modify(handle, s, s->_GetLoopGeneration(), read, write);
+        }
+
+        void NetworkManager::_Drop(Socket* s, SOCKET handle, NetCompletionType type, int code)
+        {
+            // only close what is still watched, main thread might have aborted it already
+            if (this->poller->Remove(handle, s, s->_GetLoopGeneration()))
+                ::closesocket(handle);
+
+            NetCompletion c = { type, s, handle, {}, s->_GetLoopGeneration(), code };
+            this->_Complete(c);
+        }
+
+        void NetworkManager::_RunCommand(const NetCommand& cmd)
+        {
+            switch (cmd.type)
+            {
+            case NetCommandType::Add:
+                cmd.socket->_SetLoopGeneration(cmd.generation);
+                if (!this->poller->Add(cmd.handle, cmd.socket, cmd.generation, cmd.read, cmd.write))
+                {
+                    // loop can't throw, socket hears about it like about any other failure
+                    int code = ::WSAGetLastError();
+                    ::closesocket(cmd.handle);
+                    NetCompletion c = { NetCompletionType::Failed, cmd.socket, cmd.handle, {}, cmd.generation, code };
+                    this->_Complete(c);
+                }
+                break;
+            // handle value may have been closed and reused by another socket by now,
+            // poller only touches it if socket and generation still own it
+            case NetCommandType::Modify:
+                this->poller->Modify(cmd.handle, cmd.socket, cmd.generation, cmd.read, cmd.write);
+                break;
+            case NetCommandType::Abort:
+                if (this->poller->Remove(cmd.handle, cmd.socket, cmd.generation))
+                    ::closesocket(cmd.handle);
+                break;
+            case NetCommandType::Release:
+            {
+                if (cmd.handle != INVALID_SOCKET && this->poller->Remove(cmd.handle, cmd.socket, cmd.generation))
+                    ::closesocket(cmd.handle);
+                NetCompletion c = { NetCompletionType::Released, cmd.socket, cmd.handle, {}, cmd.generation, 0 };
+                this->_Complete(c);
+                break;
+            }
+            }
+        }
+
+        void NetworkManager::_Loop()
+        {
+            while (true)
+            {
+                NetCommand cmd;
+                while (this->commands.TryPop(cmd))
+                    this->_RunCommand(cmd);
+
+                if (this->stop)
+                {
+                    // commands posted before stop are visible now
+                    while (this->commands.TryPop(cmd))
+                        this->_RunCommand(cmd);
+                    return;
+                }
+
+                while (!this->overflow.empty() && this->completions.TryPush(this->overflow.front()))
+                    this->overflow.pop_front();
+
+                // main thread is behind, come back soon to push the rest
+                this->poller->Wait(this->overflow.empty() ? 100 : 1, this->events);
+
+                for (size_t i = 0; i < this->events.size(); i++)
+                    this->events[i].socket->_OnPoll(this->events[i]);
+            }
+        }
+
+        void NetworkManager::_Dispatch(const NetCompletion& c)
+        {
+            if (c.type == NetCompletionType::Released)
+            {
+                delete c.socket;
+                return;
+            }
+
+            // socket is waiting to be deleted, nobody takes the connection
+            if (c.socket->_IsDestroyed())
+            {
+                if (c.type == NetCompletionType::Accepted)
+                    ::closesocket(c.handle);
+                return;
+            }
+
+            c.socket->_OnCompletion(c);
         }
 
         void NetworkManager::_Activity()
         {
+            NetCompletion c;
+            while (this->completions.TryPop(c))
+                this->_Dispatch(c);
+
             for (int i = 0; i < this->sockets.size(); i++)
+            {
+                this->sockets[i]->_FlushErrors();
                 this->sockets[i]->_Activity();
+            }
+
+            // messages queued this frame, also by handlers above
+            for (int i = 0; i < this->sockets.size(); i++)
+                this->sockets[i]->_Flush();
         }
 
         void NetworkManager::_Clear()
         {
-            for (int i = 0; i < this->sockets.size(); i++)
-                this->sockets[i]->Destroy();
-
-            this->sockets.clear();
+            // Destroy() removes socket from the vector
+            while (this->sockets.size() > 0)
+                this->sockets.back()->Destroy();
         }
 
         void NetworkManager::_Destroy()
         {
             this->_Clear();
+
+            this->stop = true;
+            this->poller->Wake();
+            this->loop.join();
+
+            // loop ran every command before it returned, delete what came back
+            NetCompletion c;
+            while (this->completions.TryPop(c))
+                this->_Dispatch(c);
+            for (size_t i = 0; i < this->overflow.size(); i++)
+                this->_Dispatch(this->overflow[i]);
+
+            delete this->poller;
             delete this;
         }
     }
@@ -5376,10 +15035,12 @@ namespace viva
             curState(this->buffer1),
             prevState(this->buffer2)
         {
+#ifdef _WIN32
             POINT p;
             ::GetCursorPos(&p);
             this->lastCursorPos.x = (float)p.x;
             this->lastCursorPos.y = (float)p.y;
+#endif
             memset(this->curState, 0, STATE_SIZE);
             memset(this->prevState, 0, STATE_SIZE);
         }
@@ -5423,7 +15084,9 @@ namespace viva
 
         void Mouse::ShowCursor(bool visible)
         {
+#ifdef _WIN32
             ::ShowCursor(visible);
+#endif
         }
 
         bool Mouse::IsCursorVisible() const
@@ -5448,6 +15111,12 @@ namespace viva
 
         void Mouse::_Activity()
         {
+            // swap states
+            auto temp = this->prevState;
+            this->prevState = this->curState;
+            this->curState = temp;
+
+#ifdef _WIN32
             // get cursor pos and delta from os
             POINT p;
             ::GetCursorPos(&p);
@@ -5456,15 +15125,14 @@ namespace viva
             this->lastCursorPos.x = (float)p.x;
             this->lastCursorPos.y = (float)p.y;
 
-            // swap states
-            auto temp = this->prevState;
-            this->prevState = this->curState;
-            this->curState = temp;
-
             // update current
             this->curState[VK_LBUTTON] = (::GetAsyncKeyState(VK_LBUTTON) & 0x8000) && true;
             this->curState[VK_RBUTTON] = (::GetAsyncKeyState(VK_RBUTTON) & 0x8000) && true;
             this->curState[VK_MBUTTON] = (::GetAsyncKeyState(VK_MBUTTON) & 0x8000) && true;
+#else
+            // no input device, buttons stay up
+            memset(this->curState, 0, STATE_SIZE);
+#endif
         }
 
         void Mouse::ResetKey(MouseKey key)
@@ -5562,7 +15230,9 @@ namespace viva
         void Keyboard::_Activity()
         {
             this->getChar = 0;
+#ifdef _WIN32
             this->capslockActive = ::GetKeyState((int)KeyboardKey::CapsLock) & 1;
+#endif
 
             // swap states
             auto temp = this->prevState;
@@ -5572,7 +15242,12 @@ namespace viva
             // get button states
             for (int i = 0; i < Keyboard::STATE_SIZE; i++)
             {
+#ifdef _WIN32
                 this->curState[i] = (::GetAsyncKeyState(i) & 0x8000) && true;
+#else
+                // no input device, keys stay up
+                this->curState[i] = false;
+#endif
 
                 if (this->IsKeyPressed((KeyboardKey)i) && this->chars[i] != 0)
                     this->getChar = i;
@@ -6003,6 +15678,10 @@ namespace viva
     input::Keyboard* keyboard;
     RoutineManager* routineManager;
     Time* time;
+    TransformSystem* transformSystem;
+    JobSystem* jobSystem;
+    TextureLoader* textureLoader;
+    RenderBackend* renderBackend;
     net::NetworkManager* networkManager;
     ui::UIManager* uiManager;
     D3D11 d3d;